@@ -0,0 +1,67 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+/**
+ * Walker/Vose alias table: O(n) build, O(1) sampling of a discrete
+ * distribution proportional to the given weights.
+ */
+class alias_table {
+public:
+    __host__ __device__ alias_table() : prob(nullptr), alias(nullptr), pdf(nullptr), n(0) {}
+    __host__ __device__ alias_table(const float* weights, int count);
+    __host__ __device__ ~alias_table() {
+        delete[] prob;
+        delete[] alias;
+        delete[] pdf;
+    }
+
+    __host__ __device__ int sample(float u, float& pmf) const {
+        float scaled = u * n;
+        int i = int(scaled) < n - 1 ? int(scaled) : n - 1;
+        int chosen = (scaled - i < prob[i]) ? i : alias[i];
+        pmf = pdf[chosen];
+        return chosen;
+    }
+    __host__ __device__ float pmf(int i) const { return pdf[i]; }
+
+    float* prob;
+    int* alias;
+    float* pdf;
+    int n;
+};
+
+__host__ __device__ alias_table::alias_table(const float* weights, int count) : n(count) {
+    prob = new float[n];
+    alias = new int[n];
+    pdf = new float[n];
+
+    float total = 0.f;
+    for (int i = 0; i < n; ++i) total += weights[i];
+
+    int* small = new int[n];
+    int* large = new int[n];
+    int num_small = 0, num_large = 0;
+    for (int i = 0; i < n; ++i) {
+        pdf[i] = total > 0.f ? weights[i] / total : 1.f / n;
+        prob[i] = pdf[i] * n;
+        alias[i] = i;
+        if (prob[i] < 1.f) small[num_small++] = i;
+        else large[num_large++] = i;
+    }
+    while (num_small > 0 && num_large > 0) {
+        int s = small[--num_small];
+        int l = large[--num_large];
+        alias[s] = l;
+        prob[l] = (prob[l] + prob[s]) - 1.f;
+        if (prob[l] < 1.f) small[num_small++] = l;
+        else large[num_large++] = l;
+    }
+    // Leftovers only differ from 1 by rounding.
+    while (num_large > 0) prob[large[--num_large]] = 1.f;
+    while (num_small > 0) prob[small[--num_small]] = 1.f;
+
+    delete[] small;
+    delete[] large;
+}
+
+#endif
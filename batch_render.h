@@ -0,0 +1,270 @@
+#ifndef BATCH_RENDER_H
+#define BATCH_RENDER_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "image_io.h"
+
+// Blocks per streaming multiprocessor in one batch launch. Launches are cut
+// across view boundaries, so views finish, and are written, while later
+// views are still tracing.
+#define BATCH_BLOCKS_PER_SM 16
+
+// Launches' worth of pixels, or largest views, the framebuffer ring holds;
+// whichever is more.
+#define BATCH_RING_SIZE 2
+
+struct view_spec {
+    vec3 lookfrom;
+    vec3 lookat;
+    int nx, ny;
+    std::string output;
+};
+
+// Reads one view per line: FX FY FZ AX AY AZ OUTPUT [WIDTH HEIGHT]. Views
+// without a size use nx x ny. Blank lines and lines starting with # are
+// skipped.
+inline std::vector<view_spec> read_views(const std::string& path, int nx, int ny) {
+    std::vector<view_spec> views;
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "can't read views from " << path << "\n";
+        exit(1);
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+        std::istringstream fields(line);
+        view_spec v;
+        float f[6];
+        if (!(fields >> f[0] >> f[1] >> f[2] >> f[3] >> f[4] >> f[5] >> v.output)) {
+            std::cerr << path << ":" << line_number << ": expected FX FY FZ AX AY AZ OUTPUT [WIDTH HEIGHT]\n";
+            exit(1);
+        }
+        v.lookfrom = vec3(f[0], f[1], f[2]);
+        v.lookat = vec3(f[3], f[4], f[5]);
+        if (!(fields >> v.nx >> v.ny) || v.nx <= 0 || v.ny <= 0) {
+            v.nx = nx;
+            v.ny = ny;
+        }
+        views.push_back(v);
+    }
+    return views;
+}
+
+// A view as the device sees it; its pixels start at fb_offset in the
+// framebuffer ring.
+struct batch_view {
+    camera cam;
+    int nx, ny;
+    size_t fb_offset;
+};
+
+// One block of work: a packed tile of one view.
+struct batch_tile {
+    int view;
+    int tile;
+};
+
+/**
+ * Renders the tiles work[first ...] of any mix of views. Samples are
+ * seeded by their pixel's index in its view, so a view comes out the same
+ * as a standalone render of it.
+ */
+template <unsigned F, int DEPTH>
+__global__ void render_batch(vec3* fb, const batch_view* views, const batch_tile* work, int first, int ns, int order,
+    hittable** world, light_bvh** lights, int max_depth) {
+    batch_tile item = work[first + blockIdx.x];
+    const batch_view& view = views[item.view];
+    int i, j;
+    if (!tile_pixel_coords(order, item.tile, view.nx, view.ny, i, j)) return;
+    int pixel_index = j * view.nx + i;
+    fb[view.fb_offset + pixel_index] = render_pixel<F, DEPTH>(i, j, view.nx, view.ny, 0, ns, view.cam, world, lights, max_depth);
+}
+
+struct batch_launcher {
+    int first, count;
+    vec3* fb;
+    const batch_view* views;
+    const batch_tile* work;
+    int ns, order;
+    hittable** world;
+    light_bvh** lights;
+    cudaStream_t stream;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        render_batch<F, DEPTH> << <count, TILE_SIZE * TILE_SIZE, 0, stream >> > (fb, views, work, first, ns, order, world, lights, max_depth);
+    }
+};
+
+// A queued launch: the event recorded after it and the views whose copies
+// back it was followed by.
+struct batch_launch {
+    cudaEvent_t done;
+    std::vector<int> finished;
+};
+
+// Waits for the oldest launch in pending, writes the views it finished from
+// host_fb, and returns how many of them were written.
+inline int write_finished(std::deque<batch_launch>& pending, const std::vector<view_spec>& specs, const std::vector<batch_view>& views,
+    const vec3* host_fb, std::chrono::steady_clock::time_point start) {
+    batch_launch& launch = pending.front();
+    checkCudaErrors(cudaEventSynchronize(launch.done));
+    int written = 0;
+    for (int k : launch.finished) {
+        const batch_view& v = views[k];
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (write_ppm(specs[k].output, host_fb + v.fb_offset, v.nx, v.ny)) {
+            std::cerr << "view " << k << " written to " << specs[k].output << " at " << ms << " ms\n";
+            ++written;
+        }
+        else {
+            std::cerr << "can't write " << specs[k].output << "\n";
+        }
+    }
+    checkCudaErrors(cudaEventDestroy(launch.done));
+    pending.pop_front();
+    return written;
+}
+
+/**
+ * Renders every view of a scene that is already built, with base's lens,
+ * field of view and shutter. The tiles of all views go through one queue in
+ * view order, launched in chunks sized to fill the device, and each image
+ * is copied back and written as soon as the chunk holding its last tile is
+ * done. Views take turns in a ring of device and pinned host framebuffer
+ * that holds BATCH_RING_SIZE launches or largest views, so memory doesn't
+ * grow with the number of views: a launch stops short of a view whose
+ * pixels overlap a view it is still tracing, and a view is only copied
+ * back once every view it overlaps has been written. Returns the number of
+ * images written.
+ */
+int render_views(const std::vector<view_spec>& specs, const camera& base, unsigned features, int max_depth, int ns, int order,
+    hittable** world, light_bvh** lights) {
+    int num_views = int(specs.size());
+    std::vector<batch_view> views(num_views);
+    std::vector<batch_tile> work;
+    std::vector<int> last_tile(num_views);
+    std::map<std::pair<int, int>, std::vector<int>> orders;
+    size_t total_pixels = 0;
+    size_t largest = 0;
+    for (int k = 0; k < num_views; ++k) {
+        const view_spec& s = specs[k];
+        views[k].cam = base.moved(s.lookfrom, s.lookat, float(s.nx) / float(s.ny));
+        views[k].nx = s.nx;
+        views[k].ny = s.ny;
+        total_pixels += size_t(s.nx) * s.ny;
+        largest = std::max(largest, size_t(s.nx) * s.ny);
+        std::vector<int>& tiles = orders[std::make_pair(s.nx, s.ny)];
+        if (tiles.empty()) tiles = make_tile_order(order, s.nx, s.ny);
+        for (int t : tiles) work.push_back({ k, t });
+        last_tile[k] = int(work.size()) - 1;
+    }
+
+    int device, sms;
+    checkCudaErrors(cudaGetDevice(&device));
+    checkCudaErrors(cudaDeviceGetAttribute(&sms, cudaDevAttrMultiProcessorCount, device));
+    int chunk = sms * BATCH_BLOCKS_PER_SM;
+
+    // Views are laid out one after another in the ring, wrapping to its
+    // start when the next doesn't fit before the end. reuse[k] is the last
+    // earlier view whose pixels view k overwrites, or -1.
+    size_t ring_pixels = std::min(total_pixels, BATCH_RING_SIZE * std::max(largest, size_t(chunk) * TILE_SIZE * TILE_SIZE));
+    std::vector<int> reuse(num_views, -1);
+    size_t head = 0;
+    for (int k = 0; k < num_views; ++k) {
+        size_t pixels = size_t(views[k].nx) * views[k].ny;
+        if (head + pixels > ring_pixels) head = 0;
+        views[k].fb_offset = head;
+        head += pixels;
+        for (int j = k - 1; j >= 0; --j) {
+            size_t j_end = views[j].fb_offset + size_t(views[j].nx) * views[j].ny;
+            if (views[j].fb_offset < head && views[k].fb_offset < j_end) {
+                reuse[k] = j;
+                break;
+            }
+        }
+    }
+
+    vec3* fb;
+    vec3* host_fb;
+    batch_view* d_views;
+    batch_tile* d_work;
+    cudaStream_t stream;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&fb, ring_pixels * sizeof(vec3)));
+    checkCudaErrors(cudaMallocHost((void**)&host_fb, ring_pixels * sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void**)&d_views, num_views * sizeof(batch_view)));
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&d_work, work.size() * sizeof(batch_tile)));
+    checkCudaErrors(cudaMemcpy(d_views, views.data(), num_views * sizeof(batch_view), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(d_work, work.data(), work.size() * sizeof(batch_tile), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+
+    // Each launch is followed by the copies of the views it completes and
+    // an event; the host writes views as the events fire while the device
+    // carries on, and waits only to free ring space for a copy.
+    auto start = std::chrono::steady_clock::now();
+    std::deque<batch_launch> pending;
+    batch_launcher launcher = { 0, 0, fb, d_views, d_work, ns, order, world, lights, stream };
+    int next_view = 0;
+    int next_write = 0;
+    int written = 0;
+    while (launcher.first < int(work.size())) {
+        int end = std::min(launcher.first + chunk, int(work.size()));
+        // Every view before the one this launch starts in has had its copy
+        // queued; a view overwriting that one or a later one waits for the
+        // next launch.
+        int first_view = work[launcher.first].view;
+        for (int t = launcher.first + 1; t < end; ++t) {
+            if (work[t].view != work[t - 1].view && reuse[work[t].view] >= first_view) {
+                end = t;
+                break;
+            }
+        }
+        launcher.count = end - launcher.first;
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        batch_launch launch;
+        while (next_view < num_views && last_tile[next_view] < end) {
+            while (next_write <= reuse[next_view]) {
+                next_write += int(pending.front().finished.size());
+                written += write_finished(pending, specs, views, host_fb, start);
+            }
+            const batch_view& v = views[next_view];
+            checkCudaErrors(cudaMemcpyAsync(host_fb + v.fb_offset, fb + v.fb_offset, size_t(v.nx) * v.ny * sizeof(vec3),
+                cudaMemcpyDeviceToHost, stream));
+            launch.finished.push_back(next_view++);
+        }
+        checkCudaErrors(cudaEventCreate(&launch.done));
+        checkCudaErrors(cudaEventRecord(launch.done, stream));
+        pending.push_back(launch);
+        launcher.first = end;
+    }
+    while (!pending.empty()) written += write_finished(pending, specs, views, host_fb, start);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << num_views << " views in " << seconds << " seconds, "
+        << double(total_pixels) * ns / seconds * 1e-6 << " Msamples/s.\n";
+
+    checkCudaErrors(cudaStreamDestroy(stream));
+    checkCudaErrors(tracked_free(fb));
+    checkCudaErrors(cudaFreeHost(host_fb));
+    checkCudaErrors(cudaFree(d_views));
+    checkCudaErrors(tracked_free(d_work));
+    return written;
+}
+
+#endif
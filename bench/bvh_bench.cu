@@ -0,0 +1,95 @@
+// Closest hit traversal of the binary BVH against its 4 and 8 wide
+// collapses with 8 bit child bounds.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o bvh_bench bench/bvh_bench.cu
+//
+// Usage: bvh_bench [scene] [width] [height] [runs]
+//
+// Every layout traces the same camera rays and one diffuse bounce from
+// each hit, so there are coherent and incoherent rays. The BVH heap
+// includes the scene's light BVH, which is the same in every layout.
+// Every layout's hit distances are compared with the binary ones.
+
+#define RT_STATS
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <float.h>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "multi_device.h"
+
+// Writes the distance to the camera ray's hit and to the bounce's, or -1.
+__global__ void trace_rays(int max_x, int max_y, camera** cam, hittable** world, float* t) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if (i >= max_x || j >= max_y) return;
+    int pixel_index = j * max_x + i;
+    curandState state;
+    curand_init(1984, pixel_index, 0, &state);
+    ray r = (*cam)->get_ray(float(i + curand_uniform(&state)) / max_x, float(j + curand_uniform(&state)) / max_y, &state);
+    hit_record rec;
+    t[2 * pixel_index] = t[2 * pixel_index + 1] = -1.f;
+    if (!(*world)->hit(r, 0.001f, FLT_MAX, rec)) return;
+    t[2 * pixel_index] = rec.t;
+    ray bounce(rec.p, rec.normal + random_in_unit_sphere(&state), r.time());
+    if ((*world)->hit(bounce, 0.001f, FLT_MAX, rec)) t[2 * pixel_index + 1] = rec.t;
+}
+
+int main(int argc, char** argv) {
+    std::string scene = argc > 1 ? argv[1] : "random";
+    int nx = argc > 2 ? atoi(argv[2]) : 1200;
+    int ny = argc > 3 ? atoi(argv[3]) : 800;
+    int runs = argc > 4 ? atoi(argv[4]) : 10;
+    size_t num_pixels = size_t(nx) * ny;
+    dim3 blocks(nx / 8 + 1, ny / 8 + 1);
+    dim3 threads(8, 8);
+
+    float* t;
+    checkCudaErrors(cudaMallocManaged((void**)&t, 2 * num_pixels * sizeof(float)));
+    std::vector<float> binary;
+    std::cout << scene << " " << nx << "x" << ny << ", " << 2 * num_pixels << " rays, " << runs << " runs\n";
+    std::cout << "layout   bvh heap KB        ms   Mrays/s  nodes/ray  speedup  hits\n";
+    double base_ms = 0.0;
+    const int widths[] = { 2, 4, 8 };
+    for (int width : widths) {
+        scene_replica built(scene, nx, ny, width);
+        unsigned long long heap = device_memory_usage().current[MEM_BVH];
+
+        trace_rays << <blocks, threads >> > (nx, ny, built.d_camera, built.d_world, t);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        render_stats stats = {};
+        checkCudaErrors(cudaMemcpyToSymbol(d_stats, &stats, sizeof(render_stats)));
+        auto start = std::chrono::steady_clock::now();
+        for (int k = 0; k < runs; ++k) trace_rays << <blocks, threads >> > (nx, ny, built.d_camera, built.d_world, t);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+        checkCudaErrors(cudaMemcpyFromSymbol(&stats, d_stats, sizeof(render_stats)));
+
+        size_t rays = 0, differ = 0;
+        for (size_t k = 0; k < 2 * num_pixels; ++k) {
+            if (k % 2 == 0 || t[k - 1] >= 0.f) rays++;
+            if (width != 2 && fabsf(t[k] - binary[k]) > 1e-4f * fmaxf(1.f, fabsf(binary[k]))) differ++;
+        }
+        if (width == 2) {
+            binary.assign(t, t + 2 * num_pixels);
+            base_ms = ms;
+        }
+        std::cout << std::setw(6) << (width == 2 ? std::string("binary") : "wide" + std::to_string(width)) << std::fixed
+            << std::setprecision(1) << std::setw(14) << heap / 1024.0 << std::setw(10) << ms << std::setw(10) << rays / ms * 1e-3
+            << std::setw(11) << double(stats.node_visits) / (double(rays) * runs) << std::setprecision(2) << std::setw(9) << base_ms / ms
+            << "  " << (differ == 0 ? std::string("same") : std::to_string(differ) + " differ") << std::defaultfloat << "\n";
+    }
+    checkCudaErrors(cudaFree(t));
+    return 0;
+}
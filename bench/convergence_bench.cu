@@ -0,0 +1,395 @@
+// Convergence harness: error against a stored high-spp reference as a
+// function of samples and wall time, for the standard scenes.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o convergence_bench bench/convergence_bench.cu
+//
+// Each scene is rendered progressively through launch_render(), the same
+// kernels main() uses, in passes whose linear results are summed. After the
+// pass that completes 1, 2, 4 ... spp, and after the first pass past each
+// time budget, the running mean is compared with the reference using RMSE,
+// relMSE and a FLIP-style perceptual error (image_metrics.h). Only the
+// passes are timed, not the scoring.
+//
+// References are read from DIR/<scene>_<width>x<height>.pfm and rendered
+// there first if missing; keep them from a trusted build so later runs
+// measure against the same image. Results go to a CSV file and an SVG
+// chart of each metric against wall time. With --baseline, the run is
+// compared with an earlier CSV at equal time, and the exit status is 1 if
+// any scene got worse by more than --tolerance.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "render.h"
+#include "image_io.h"
+#include "image_metrics.h"
+
+struct bench_options {
+    std::vector<std::string> scenes = { "random", "simple_light", "cornell" };
+    int nx = 400;
+    int ny = 400;
+    int max_spp = 256;
+    std::vector<double> budgets_ms = { 100, 250, 500, 1000, 2000, 4000 };
+    int reference_spp = 8192;
+    std::string references = "references";
+    std::string csv = "convergence.csv";
+    std::string svg = "convergence.svg";
+    std::string baseline;
+    double tolerance = 0.05;
+};
+
+struct checkpoint {
+    std::string scene;
+    int spp;
+    double ms;
+    image_error error;
+};
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::istringstream in(s);
+    for (std::string part; std::getline(in, part, sep);) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+bench_options parse_bench_options(int argc, char** argv) {
+    bench_options opt;
+    for (int a = 1; a < argc; ++a) {
+        const char* arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (!strcmp(arg, "--scenes") && has_value) opt.scenes = split(argv[++a], ',');
+        else if (!strcmp(arg, "--width") && has_value) opt.nx = atoi(argv[++a]);
+        else if (!strcmp(arg, "--height") && has_value) opt.ny = atoi(argv[++a]);
+        else if (!strcmp(arg, "--max-spp") && has_value) opt.max_spp = atoi(argv[++a]);
+        else if (!strcmp(arg, "--budgets-ms") && has_value) {
+            opt.budgets_ms.clear();
+            for (const std::string& b : split(argv[++a], ',')) opt.budgets_ms.push_back(atof(b.c_str()));
+            std::sort(opt.budgets_ms.begin(), opt.budgets_ms.end());
+        }
+        else if (!strcmp(arg, "--reference-spp") && has_value) opt.reference_spp = atoi(argv[++a]);
+        else if (!strcmp(arg, "--references") && has_value) opt.references = argv[++a];
+        else if (!strcmp(arg, "--csv") && has_value) opt.csv = argv[++a];
+        else if (!strcmp(arg, "--svg") && has_value) opt.svg = argv[++a];
+        else if (!strcmp(arg, "--baseline") && has_value) opt.baseline = argv[++a];
+        else if (!strcmp(arg, "--tolerance") && has_value) opt.tolerance = atof(argv[++a]);
+        else {
+            std::cerr << "usage: " << argv[0] << " [options]\n"
+                << "  --scenes A,B,C       scenes to measure (random,simple_light,cornell)\n"
+                << "  --width N            image width (400)\n"
+                << "  --height N           image height (400)\n"
+                << "  --max-spp N          last sample count checkpoint (256)\n"
+                << "  --budgets-ms A,B,C   time checkpoints (100,250,500,1000,2000,4000)\n"
+                << "  --reference-spp N    samples per pixel for missing references (8192)\n"
+                << "  --references DIR     where references are kept (references)\n"
+                << "  --csv FILE           results table (convergence.csv)\n"
+                << "  --svg FILE           error against time chart (convergence.svg)\n"
+                << "  --baseline FILE      earlier results to compare with at equal time\n"
+                << "  --tolerance T        allowed error increase over the baseline (0.05)\n";
+            exit(1);
+        }
+    }
+    return opt;
+}
+
+/**
+ * A built scene and the buffers for rendering it progressively. Each pass
+ * starts its sample numbers where the last one ended, and samples are
+ * seeded from their pixel and number, so every pass draws new samples.
+ */
+class progressive_scene {
+public:
+    progressive_scene(const std::string& name, int w, int h) : scene(name), nx(w), ny(h), num_pixels(w * h) {
+        list_size = scene_list_size(scene);
+        checkCudaErrors(cudaMalloc((void**)&fb, num_pixels * sizeof(vec3)));
+        checkCudaErrors(cudaMalloc((void**)&accum, num_pixels * sizeof(vec3)));
+        checkCudaErrors(cudaMalloc((void**)&rand_state, sizeof(curandState)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_list, list_size * sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_world, sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_lights, sizeof(light_bvh*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_camera, sizeof(camera*)));
+        render_init << <1, 1 >> > (1, 1, rand_state);
+        checkCudaErrors(cudaGetLastError());
+        if (!create_scene(scene, d_list, d_world, d_lights, d_camera, nx, ny, rand_state, features)) exit(1);
+        std::vector<int> tile_order = make_tile_order(ORDER_ROW_MAJOR, nx, ny);
+        num_tiles = int(tile_order.size());
+        checkCudaErrors(cudaMalloc((void**)&tiles, num_tiles * sizeof(int)));
+        checkCudaErrors(cudaMemcpy(tiles, tile_order.data(), num_tiles * sizeof(int), cudaMemcpyHostToDevice));
+        reset();
+    }
+    ~progressive_scene() {
+        free_world << <1, 1 >> > (d_list, list_size, d_world, d_lights, d_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaFree(d_list));
+        checkCudaErrors(cudaFree(d_world));
+        checkCudaErrors(cudaFree(d_lights));
+        checkCudaErrors(cudaFree(d_camera));
+        checkCudaErrors(cudaFree(tiles));
+        checkCudaErrors(cudaFree(rand_state));
+        checkCudaErrors(cudaFree(accum));
+        checkCudaErrors(cudaFree(fb));
+    }
+
+    void reset() {
+        checkCudaErrors(cudaMemset(accum, 0, num_pixels * sizeof(vec3)));
+        spp = 0;
+    }
+
+    // Renders ns more samples per pixel and waits for them.
+    void pass(int ns) {
+        launch_render(features, MAX_DEPTH, num_tiles, fb, nx, ny, ns, ORDER_ROW_MAJOR, tiles, d_camera, d_world, d_lights, spp);
+        accumulate_pass << <(num_pixels + 255) / 256, 256 >> > (accum, fb, num_pixels, ns);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        spp += ns;
+    }
+
+    // The linear mean so far.
+    std::vector<vec3> mean() const {
+        std::vector<vec3> image(num_pixels);
+        checkCudaErrors(cudaMemcpy(image.data(), accum, num_pixels * sizeof(vec3), cudaMemcpyDeviceToHost));
+        for (vec3& p : image) p /= float(spp);
+        return image;
+    }
+
+    // Pass sizes that land on every power of two while keeping launches to
+    // about eight per doubling.
+    static int next_pass(int spp) {
+        int ns = 1;
+        while (ns * 16 <= spp) ns *= 2;
+        return ns;
+    }
+
+    std::string scene;
+    int nx, ny, num_pixels;
+    int spp = 0;
+
+private:
+    int list_size;
+    unsigned features;
+    vec3* fb;
+    vec3* accum;
+    curandState* rand_state;  // for building the scene
+    int* tiles;
+    int num_tiles;
+    hittable** d_list;
+    hittable** d_world;
+    light_bvh** d_lights;
+    camera** d_camera;
+};
+
+std::vector<vec3> load_reference(const bench_options& opt, const std::string& scene) {
+    std::ostringstream path;
+    path << opt.references << "/" << scene << "_" << opt.nx << "x" << opt.ny << ".pfm";
+    std::vector<vec3> reference;
+    int rx, ry;
+    if (read_pfm(path.str(), reference, rx, ry) && rx == opt.nx && ry == opt.ny) return reference;
+
+    std::cerr << scene << ": rendering a " << opt.reference_spp << " spp reference to " << path.str() << "\n";
+    // Under another seed: with the measured run's, the reference would hold
+    // the very samples each checkpoint is scored on, and early checkpoints
+    // would look closer to it than they are.
+    unsigned long long seed = render_seed;
+    set_render_seed(~seed);
+    progressive_scene s(scene, opt.nx, opt.ny);
+    while (s.spp < opt.reference_spp) s.pass(std::min(progressive_scene::next_pass(s.spp), opt.reference_spp - s.spp));
+    reference = s.mean();
+    set_render_seed(seed);
+    if (!write_pfm(path.str(), reference.data(), opt.nx, opt.ny)) {
+        std::cerr << "can't write " << path.str() << "; is " << opt.references << " a directory?\n";
+    }
+    return reference;
+}
+
+std::vector<checkpoint> measure_scene(const bench_options& opt, const std::string& scene) {
+    std::vector<vec3> reference = load_reference(opt, scene);
+    progressive_scene s(scene, opt.nx, opt.ny);
+    std::vector<checkpoint> results;
+    double ms = 0.0;
+    int next_spp = 1;
+    size_t next_budget = 0;
+    while (s.spp < opt.max_spp || next_budget < opt.budgets_ms.size()) {
+        auto start = std::chrono::steady_clock::now();
+        s.pass(progressive_scene::next_pass(s.spp));
+        ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        bool at_spp = s.spp >= next_spp && s.spp <= opt.max_spp;
+        bool at_budget = next_budget < opt.budgets_ms.size() && ms >= opt.budgets_ms[next_budget];
+        while (next_spp <= s.spp) next_spp *= 2;
+        while (next_budget < opt.budgets_ms.size() && ms >= opt.budgets_ms[next_budget]) ++next_budget;
+        if (!at_spp && !at_budget) continue;
+        checkpoint c = { scene, s.spp, ms, measure_error(s.mean(), reference, opt.nx, opt.ny) };
+        std::cerr << std::setw(14) << scene << std::setw(7) << c.spp << " spp " << std::setw(10) << std::fixed
+            << std::setprecision(1) << c.ms << " ms  rmse " << std::setprecision(5) << c.error.rmse
+            << "  relmse " << c.error.relmse << "  flip " << c.error.flip << std::defaultfloat << "\n";
+        results.push_back(c);
+    }
+    return results;
+}
+
+void write_csv(const std::string& path, const std::vector<checkpoint>& results) {
+    std::ofstream out(path);
+    out << "scene,spp,ms,rmse,relmse,flip\n";
+    out << std::setprecision(8);
+    for (const checkpoint& c : results) {
+        out << c.scene << "," << c.spp << "," << c.ms << "," << c.error.rmse << "," << c.error.relmse << "," << c.error.flip << "\n";
+    }
+}
+
+std::vector<checkpoint> read_csv(const std::string& path) {
+    std::vector<checkpoint> results;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::vector<std::string> f = split(line, ',');
+        if (f.size() < 6) continue;
+        results.push_back({ f[0], atoi(f[1].c_str()), atof(f[2].c_str()),
+            { atof(f[3].c_str()), atof(f[4].c_str()), atof(f[5].c_str()) } });
+    }
+    return results;
+}
+
+double metric(const image_error& e, int m) {
+    return m == 0 ? e.rmse : m == 1 ? e.relmse : e.flip;
+}
+
+// One log-log panel per metric, one line per scene.
+void write_svg(const std::string& path, const std::vector<checkpoint>& results, const std::vector<std::string>& scenes) {
+    static const char* names[3] = { "RMSE", "relMSE", "FLIP" };
+    static const char* colors[6] = { "#1f77b4", "#d62728", "#2ca02c", "#9467bd", "#ff7f0e", "#8c564b" };
+    const double w = 360, h = 280, left = 60, top = 30, pw = 280, ph = 200;
+    std::ofstream out(path);
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << 3 * w << "\" height=\"" << h + 20 * scenes.size() << "\" "
+        << "font-family=\"sans-serif\" font-size=\"11\">\n<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n";
+    for (int m = 0; m < 3; ++m) {
+        double t0 = 1e30, t1 = 0, e0 = 1e30, e1 = 0;
+        for (const checkpoint& c : results) {
+            double e = metric(c.error, m);
+            if (c.ms <= 0 || e <= 0) continue;
+            t0 = std::min(t0, c.ms);
+            t1 = std::max(t1, c.ms);
+            e0 = std::min(e0, e);
+            e1 = std::max(e1, e);
+        }
+        if (t1 <= 0) continue;
+        t0 = std::pow(10, std::floor(std::log10(t0)));
+        t1 = std::pow(10, std::ceil(std::log10(t1)));
+        e0 = std::pow(10, std::floor(std::log10(e0)));
+        e1 = std::pow(10, std::ceil(std::log10(e1)));
+        if (t1 <= t0) t1 = 10 * t0;
+        if (e1 <= e0) e1 = 10 * e0;
+        double ox = m * w + left;
+        auto px = [&](double t) { return ox + pw * std::log10(t / t0) / std::log10(t1 / t0); };
+        auto py = [&](double e) { return top + ph - ph * std::log10(e / e0) / std::log10(e1 / e0); };
+        out << "<text x=\"" << ox + pw / 2 << "\" y=\"18\" text-anchor=\"middle\" font-weight=\"bold\">" << names[m] << "</text>\n";
+        out << "<rect x=\"" << ox << "\" y=\"" << top << "\" width=\"" << pw << "\" height=\"" << ph << "\" fill=\"none\" stroke=\"black\"/>\n";
+        for (double t = t0; t <= t1 * 1.001; t *= 10) {
+            out << "<line x1=\"" << px(t) << "\" y1=\"" << top << "\" x2=\"" << px(t) << "\" y2=\"" << top + ph << "\" stroke=\"#ddd\"/>\n"
+                << "<text x=\"" << px(t) << "\" y=\"" << top + ph + 14 << "\" text-anchor=\"middle\">" << t << "</text>\n";
+        }
+        for (double e = e0; e <= e1 * 1.001; e *= 10) {
+            out << "<line x1=\"" << ox << "\" y1=\"" << py(e) << "\" x2=\"" << ox + pw << "\" y2=\"" << py(e) << "\" stroke=\"#ddd\"/>\n"
+                << "<text x=\"" << ox - 4 << "\" y=\"" << py(e) + 4 << "\" text-anchor=\"end\">" << e << "</text>\n";
+        }
+        out << "<text x=\"" << ox + pw / 2 << "\" y=\"" << top + ph + 30 << "\" text-anchor=\"middle\">wall time (ms)</text>\n";
+        for (size_t s = 0; s < scenes.size(); ++s) {
+            out << "<polyline fill=\"none\" stroke=\"" << colors[s % 6] << "\" stroke-width=\"1.5\" points=\"";
+            for (const checkpoint& c : results) {
+                if (c.scene == scenes[s] && c.ms > 0 && metric(c.error, m) > 0) out << px(c.ms) << "," << py(metric(c.error, m)) << " ";
+            }
+            out << "\"/>\n";
+        }
+    }
+    for (size_t s = 0; s < scenes.size(); ++s) {
+        double y = h + 10 + 20 * s;
+        out << "<line x1=\"" << left << "\" y1=\"" << y << "\" x2=\"" << left + 20 << "\" y2=\"" << y << "\" stroke=\"" << colors[s % 6]
+            << "\" stroke-width=\"2\"/><text x=\"" << left + 26 << "\" y=\"" << y + 4 << "\">" << scenes[s] << "</text>\n";
+    }
+    out << "</svg>\n";
+}
+
+// Baseline relMSE at time ms, interpolated log-log; 0 outside its range.
+double baseline_at(const std::vector<checkpoint>& baseline, const std::string& scene, double ms) {
+    const checkpoint* before = nullptr;
+    for (const checkpoint& c : baseline) {
+        if (c.scene != scene) continue;
+        if (c.ms <= ms) {
+            before = &c;
+            continue;
+        }
+        if (before == nullptr || before->error.relmse <= 0 || c.error.relmse <= 0) return 0.0;
+        double f = std::log(ms / before->ms) / std::log(c.ms / before->ms);
+        return std::exp(std::log(before->error.relmse) + f * (std::log(c.error.relmse) - std::log(before->error.relmse)));
+    }
+    return before != nullptr && before->ms == ms ? before->error.relmse : 0.0;
+}
+
+// Geometric mean over each scene's checkpoints of relMSE over the
+// baseline's at the same time. Returns false if a scene is worse by more
+// than the tolerance.
+bool compare_baseline(const std::vector<checkpoint>& results, const std::vector<checkpoint>& baseline,
+    const std::vector<std::string>& scenes, double tolerance) {
+    bool accepted = true;
+    for (const std::string& scene : scenes) {
+        double log_sum = 0.0;
+        int n = 0;
+        for (const checkpoint& c : results) {
+            if (c.scene != scene || c.error.relmse <= 0) continue;
+            double b = baseline_at(baseline, scene, c.ms);
+            if (b <= 0) continue;
+            log_sum += std::log(c.error.relmse / b);
+            ++n;
+        }
+        if (n == 0) {
+            std::cerr << scene << ": no baseline data at these times\n";
+            continue;
+        }
+        double ratio = std::exp(log_sum / n);
+        bool worse = ratio > 1.0 + tolerance;
+        std::cerr << scene << ": relMSE " << ratio << "x the baseline at equal time over " << n << " checkpoints"
+            << (worse ? ", WORSE" : ratio < 1.0 - tolerance ? ", better" : ", same") << "\n";
+        accepted = accepted && !worse;
+    }
+    return accepted;
+}
+
+int main(int argc, char** argv) {
+    bench_options opt = parse_bench_options(argc, argv);
+    std::vector<checkpoint> results;
+    for (const std::string& scene : opt.scenes) {
+        std::vector<checkpoint> r = measure_scene(opt, scene);
+        results.insert(results.end(), r.begin(), r.end());
+    }
+    write_csv(opt.csv, results);
+    write_svg(opt.svg, results, opt.scenes);
+    std::cerr << "results in " << opt.csv << ", chart in " << opt.svg << "\n";
+
+    int status = 0;
+    if (!opt.baseline.empty()) {
+        std::vector<checkpoint> baseline = read_csv(opt.baseline);
+        if (baseline.empty()) {
+            std::cerr << "can't read a baseline from " << opt.baseline << "\n";
+            status = 1;
+        }
+        else if (!compare_baseline(results, baseline, opt.scenes, opt.tolerance)) {
+            status = 1;
+        }
+    }
+    cudaDeviceReset();
+    return status;
+}
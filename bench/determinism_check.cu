@@ -0,0 +1,178 @@
+// Checks that a render is bit-identical however its work is scheduled.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o determinism_check bench/determinism_check.cu
+//
+// Usage: determinism_check [scene] [width] [height] [spp]
+//
+// The scene is rendered once in one launch of row-major tiles, then again
+// with every other pixel order, with the tiles reversed and launched one
+// at a time across two streams, shuffled into launches of a few tiles, and
+// through the tiled renderer's kernel with its own thread layout. Every
+// image must equal the first bit for bit. A scene with dielectrics also
+// renders its light traced caustics twice, which must agree too, and a
+// different seed must change the image. Exits with 1 if any check fails.
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "render.h"
+#include "tiled_render.h"
+#include "light_tracing.h"
+
+struct check_scene {
+    std::string name;
+    int nx, ny, ns;
+    int list_size;
+    unsigned features;
+    hittable** d_list;
+    hittable** d_world;
+    light_bvh** d_lights;
+    camera** d_camera;
+    curandState* rand_state;
+    vec3* fb;
+    int* tiles;
+};
+
+// The image as it is now, bit for bit.
+std::vector<vec3> read_image(const check_scene& s) {
+    std::vector<vec3> image(size_t(s.nx) * s.ny);
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(cudaMemcpy(image.data(), s.fb, image.size() * sizeof(vec3), cudaMemcpyDeviceToHost));
+    return image;
+}
+
+// Renders the tiles of order, in chunks of chunk tiles, launches alternating
+// between the streams given.
+std::vector<vec3> render_tiles(check_scene& s, int order, const std::vector<int>& tiles, int chunk, cudaStream_t* streams, int num_streams) {
+    checkCudaErrors(cudaMemset(s.fb, 0, size_t(s.nx) * s.ny * sizeof(vec3)));
+    checkCudaErrors(cudaMemcpy(s.tiles, tiles.data(), tiles.size() * sizeof(int), cudaMemcpyHostToDevice));
+    int launch = 0;
+    for (size_t first = 0; first < tiles.size(); first += chunk, ++launch) {
+        int count = int(std::min(tiles.size() - first, size_t(chunk)));
+        render_launcher launcher = { count, s.fb, s.nx, s.ny, s.ns, order, s.tiles + first, s.d_camera, s.d_world, s.d_lights, 0,
+            streams[launch % num_streams] };
+        dispatch_variant(s.features, MAX_DEPTH, launcher);
+        checkCudaErrors(cudaGetLastError());
+    }
+    return read_image(s);
+}
+
+// Renders through render_tile_chunk(), chunk tiles a launch, and puts the
+// tiles back where render() would have written them.
+std::vector<vec3> render_tile_chunks(check_scene& s, const std::vector<int>& tiles, int chunk) {
+    std::vector<vec3> image(size_t(s.nx) * s.ny);
+    vec3* out;
+    checkCudaErrors(cudaMalloc((void**)&out, size_t(chunk) * TILE_SIZE * TILE_SIZE * sizeof(vec3)));
+    std::vector<vec3> host(size_t(chunk) * TILE_SIZE * TILE_SIZE);
+    checkCudaErrors(cudaMemcpy(s.tiles, tiles.data(), tiles.size() * sizeof(int), cudaMemcpyHostToDevice));
+    for (size_t first = 0; first < tiles.size(); first += chunk) {
+        int count = int(std::min(tiles.size() - first, size_t(chunk)));
+        tile_chunk_launcher launcher = { count, out, s.nx, s.ny, s.ns, ORDER_MORTON, s.tiles + first, s.d_camera, s.d_world, s.d_lights, 0 };
+        dispatch_variant(s.features, MAX_DEPTH, launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaMemcpy(host.data(), out, size_t(count) * TILE_SIZE * TILE_SIZE * sizeof(vec3), cudaMemcpyDeviceToHost));
+        for (int k = 0; k < count; ++k) {
+            int tile = tiles[first + k];
+            for (int y = 0; y < TILE_SIZE; ++y) {
+                for (int x = 0; x < TILE_SIZE; ++x) {
+                    int i = (tile & 0xffff) * TILE_SIZE + x;
+                    int row = (tile >> 16) * TILE_SIZE + y;
+                    if (i >= s.nx || row >= s.ny) continue;
+                    image[size_t(s.ny - 1 - row) * s.nx + i] = host[(size_t(k) * TILE_SIZE + y) * TILE_SIZE + x];
+                }
+            }
+        }
+    }
+    checkCudaErrors(cudaFree(out));
+    return image;
+}
+
+std::vector<vec3> light_traced_image(check_scene& s, int order) {
+    std::vector<int> tiles = make_tile_order(order, s.nx, s.ny);
+    checkCudaErrors(cudaMemcpy(s.tiles, tiles.data(), tiles.size() * sizeof(int), cudaMemcpyHostToDevice));
+    render_light_traced(s.fb, s.nx, s.ny, s.ns, 4.f, s.features, MAX_DEPTH, order, s.tiles, int(tiles.size()), s.d_camera, s.d_world,
+        s.d_lights, s.d_list, s.list_size);
+    return read_image(s);
+}
+
+// Reports whether image matches reference bit for bit.
+bool check(const char* what, const std::vector<vec3>& image, const std::vector<vec3>& reference) {
+    size_t differ = 0;
+    for (size_t p = 0; p < image.size(); ++p) {
+        if (memcmp(&image[p], &reference[p], sizeof(vec3)) != 0) differ++;
+    }
+    std::cout << what << ": " << (differ == 0 ? std::string("identical") : std::to_string(differ) + " pixels differ") << "\n";
+    return differ == 0;
+}
+
+int main(int argc, char** argv) {
+    check_scene s;
+    s.name = argc > 1 ? argv[1] : "many_lights";
+    s.nx = argc > 2 ? atoi(argv[2]) : 200;
+    s.ny = argc > 3 ? atoi(argv[3]) : 120;
+    s.ns = argc > 4 ? atoi(argv[4]) : 8;
+    s.list_size = scene_list_size(s.name);
+    size_t num_pixels = size_t(s.nx) * s.ny;
+    checkCudaErrors(cudaMalloc((void**)&s.rand_state, sizeof(curandState)));
+    checkCudaErrors(cudaMallocManaged((void**)&s.d_list, s.list_size * sizeof(hittable*)));
+    checkCudaErrors(cudaMallocManaged((void**)&s.d_world, sizeof(hittable*)));
+    checkCudaErrors(cudaMallocManaged((void**)&s.d_lights, sizeof(light_bvh*)));
+    checkCudaErrors(cudaMallocManaged((void**)&s.d_camera, sizeof(camera*)));
+    checkCudaErrors(cudaMalloc((void**)&s.fb, num_pixels * sizeof(vec3)));
+    std::vector<int> row_major = make_tile_order(ORDER_ROW_MAJOR, s.nx, s.ny);
+    checkCudaErrors(cudaMalloc((void**)&s.tiles, row_major.size() * sizeof(int)));
+    render_init << <1, 1 >> > (1, 1, s.rand_state);
+    checkCudaErrors(cudaGetLastError());
+    if (!create_scene(s.name, s.d_list, s.d_world, s.d_lights, s.d_camera, s.nx, s.ny, s.rand_state, s.features)) return 1;
+    cudaStream_t streams[2];
+    checkCudaErrors(cudaStreamCreateWithFlags(&streams[0], cudaStreamNonBlocking));
+    checkCudaErrors(cudaStreamCreateWithFlags(&streams[1], cudaStreamNonBlocking));
+    std::cout << s.name << " " << s.nx << "x" << s.ny << ", " << s.ns << " spp\n";
+
+    std::vector<vec3> reference = render_tiles(s, ORDER_ROW_MAJOR, row_major, int(row_major.size()), streams, 1);
+    bool ok = true;
+    ok = check("morton order", render_tiles(s, ORDER_MORTON, make_tile_order(ORDER_MORTON, s.nx, s.ny), int(row_major.size()), streams, 1),
+        reference) && ok;
+    ok = check("hilbert order", render_tiles(s, ORDER_HILBERT, make_tile_order(ORDER_HILBERT, s.nx, s.ny), int(row_major.size()), streams, 1),
+        reference) && ok;
+    std::vector<int> reversed(row_major.rbegin(), row_major.rend());
+    ok = check("reversed, a tile a launch on two streams", render_tiles(s, ORDER_HILBERT, reversed, 1, streams, 2), reference) && ok;
+    std::vector<int> shuffled = row_major;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(7));
+    ok = check("shuffled, 7 tiles a launch", render_tiles(s, ORDER_MORTON, shuffled, 7, streams, 2), reference) && ok;
+    ok = check("tiled renderer, 3 tiles a launch", render_tile_chunks(s, shuffled, 3), reference) && ok;
+
+    if (s.features & FEATURE_DIELECTRIC) {
+        std::vector<vec3> light_traced = light_traced_image(s, ORDER_ROW_MAJOR);
+        ok = check("light traced caustics, hilbert order", light_traced_image(s, ORDER_HILBERT), light_traced) && ok;
+    }
+
+    set_render_seed(render_seed + 1);
+    bool reseeded = !check("another seed (must differ)", render_tiles(s, ORDER_ROW_MAJOR, row_major, int(row_major.size()), streams, 1),
+        reference);
+    ok = reseeded && ok;
+
+    free_world << <1, 1 >> > (s.d_list, s.list_size, s.d_world, s.d_lights, s.d_camera);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(cudaStreamDestroy(streams[0]));
+    checkCudaErrors(cudaStreamDestroy(streams[1]));
+    checkCudaErrors(cudaFree(s.tiles));
+    checkCudaErrors(cudaFree(s.fb));
+    checkCudaErrors(cudaFree(s.d_list));
+    checkCudaErrors(cudaFree(s.d_world));
+    checkCudaErrors(cudaFree(s.d_lights));
+    checkCudaErrors(cudaFree(s.d_camera));
+    checkCudaErrors(cudaFree(s.rand_state));
+    std::cout << (ok ? "deterministic\n" : "NOT deterministic\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+// Scaling of render_multi_device() from one GPU to all of them, with each
+// device's host thread pinned to its NUMA node and without.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o device_scaling_bench bench/device_scaling_bench.cu
+//
+// Usage: device_scaling_bench [scene] [width] [height] [spp]
+//
+// The scene is built once on device 0; the other devices build their
+// replicas inside each timed run, as they do in main(). Every run's image
+// is compared with the one-device image, which it must match exactly.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "render.h"
+#include "multi_device.h"
+
+int main(int argc, char** argv) {
+    std::string scene = argc > 1 ? argv[1] : "cornell";
+    int nx = argc > 2 ? atoi(argv[2]) : 800;
+    int ny = argc > 3 ? atoi(argv[3]) : 800;
+    int ns = argc > 4 ? atoi(argv[4]) : 64;
+    int max_depth = MAX_DEPTH;
+
+    int count;
+    checkCudaErrors(cudaGetDeviceCount(&count));
+    checkCudaErrors(cudaSetDevice(0));
+    std::vector<int> tile_order = make_tile_order(ORDER_HILBERT, nx, ny);
+    size_t num_pixels = size_t(nx) * ny;
+    scene_replica built(scene, nx, ny);
+    checkCudaErrors(cudaDeviceSynchronize());
+
+    std::vector<vec3> single(num_pixels), image(num_pixels);
+    std::cout << scene << " " << nx << "x" << ny << ", " << ns << " spp, " << count << " devices\n";
+    std::cout << "devices  pinned        ms   Msamples/s  speedup  efficiency  image\n";
+    double base_ms = 0.0;
+    for (int n = 1; n <= count; ++n) {
+        for (int pin = 1; pin >= 0; --pin) {
+            if (n == 1 && !pin) continue;
+            auto start = std::chrono::steady_clock::now();
+            std::vector<device_render_stats> stats = render_multi_device(n == 1 ? single.data() : image.data(), nx, ny, ns,
+                built.features, max_depth, ORDER_HILBERT, tile_order, scene, built.d_camera, built.d_world, built.d_lights, n, pin != 0);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (n == 1) base_ms = ms;
+            bool same = n == 1 || memcmp(single.data(), image.data(), num_pixels * sizeof(vec3)) == 0;
+            std::cout << std::setw(7) << n << std::setw(8) << (pin ? "yes" : "no") << std::fixed << std::setprecision(1)
+                << std::setw(10) << ms << std::setw(13) << double(num_pixels) * ns / ms * 1e-3
+                << std::setprecision(2) << std::setw(9) << base_ms / ms << std::setw(12) << base_ms / ms / n
+                << (same ? "  same" : "  DIFFERS") << std::defaultfloat << "\n";
+            if (n == count && pin) print_device_stats(std::cout, stats);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Time to first pixel with an eagerly built BVH against a lazy one.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o lazy_bvh_bench bench/lazy_bvh_bench.cu
+//
+// Usage: lazy_bvh_bench [spheres] [width] [height]
+//
+// Both layouts build over the same random field of spheres. The first
+// pixels are a TILE_SIZE square in the middle of the frame, traced right
+// after the build; then the whole frame is traced twice, the first time
+// while the lazy BVH is still splitting. Rays are a camera ray and one
+// diffuse bounce from its hit, and their hit distances are compared with
+// the eager ones.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <float.h>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "tile_order.h"
+
+__global__ void sphere_field(hittable** list, int n, camera** cam, float aspect) {
+    curandState state;
+    curand_init(1984, 0, 0, &state);
+    float extent = 2.f * cbrtf(float(n));
+    for (int i = 0; i < n; ++i) {
+        vec3 center = extent * (vec3(curand_uniform(&state), curand_uniform(&state), curand_uniform(&state)) - vec3(0.5f, 0.5f, 0.5f));
+        list[i] = new sphere(center, 0.4f, new lambertian(vec3(curand_uniform(&state), curand_uniform(&state), curand_uniform(&state))));
+    }
+    *cam = new camera(vec3(0, 0, 1.5f * extent), vec3(0, 0, 0), vec3(0, 1, 0), 40.f, aspect, 0.f, 1.f, 0.f, 1.f);
+}
+
+__global__ void build_world(hittable** list, int n, hittable** world) {
+    curandState state;
+    curand_init(1984, 1, 0, &state);
+    *world = build_bvh(list, n, &state);
+}
+
+__global__ void free_field(hittable** list, int n, hittable** world, camera** cam) {
+    delete *world;
+    for (int i = 0; i < n; ++i) delete list[i];
+    delete *cam;
+}
+
+// Writes the distance to the camera ray's hit and to the bounce's, or -1,
+// for the pixels of the w x h window at (x0, y0).
+__global__ void trace_window(int x0, int y0, int w, int h, int max_x, int max_y, camera** cam, hittable** world, float* t) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if (i >= w || j >= h) return;
+    i += x0;
+    j += y0;
+    int pixel_index = j * max_x + i;
+    curandState state;
+    curand_init(1984, pixel_index, 0, &state);
+    ray r = (*cam)->get_ray(float(i + curand_uniform(&state)) / max_x, float(j + curand_uniform(&state)) / max_y, &state);
+    hit_record rec;
+    t[2 * pixel_index] = t[2 * pixel_index + 1] = -1.f;
+    if (!(*world)->hit(r, 0.001f, FLT_MAX, rec)) return;
+    t[2 * pixel_index] = rec.t;
+    ray bounce(rec.p, rec.normal + random_in_unit_sphere(&state), r.time());
+    if ((*world)->hit(bounce, 0.001f, FLT_MAX, rec)) t[2 * pixel_index + 1] = rec.t;
+}
+
+double trace_ms(int x0, int y0, int w, int h, int nx, int ny, camera** cam, hittable** world, float* t) {
+    auto start = std::chrono::steady_clock::now();
+    trace_window << <dim3(w / 8 + 1, h / 8 + 1), dim3(8, 8) >> > (x0, y0, w, h, nx, ny, cam, world, t);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    int nx = argc > 2 ? atoi(argv[2]) : 1200;
+    int ny = argc > 3 ? atoi(argv[3]) : 800;
+    size_t num_pixels = size_t(nx) * ny;
+    checkCudaErrors(cudaDeviceSetLimit(cudaLimitMallocHeapSize, size_t(n) * 1024 + (64 << 20)));
+
+    hittable** d_list;
+    checkCudaErrors(cudaMalloc((void**)&d_list, n * sizeof(hittable*)));
+    hittable** d_world;
+    checkCudaErrors(cudaMalloc((void**)&d_world, sizeof(hittable*)));
+    camera** d_camera;
+    checkCudaErrors(cudaMalloc((void**)&d_camera, sizeof(camera*)));
+    float* t;
+    checkCudaErrors(cudaMallocManaged((void**)&t, 2 * num_pixels * sizeof(float)));
+
+    std::vector<float> eager;
+    std::cout << n << " spheres, " << nx << "x" << ny << ", first " << TILE_SIZE << "x" << TILE_SIZE << " pixels in the middle\n";
+    std::cout << "layout  build ms  first tile ms  first pixels ms  frame ms  next frame ms  bvh heap KB  hits\n";
+    for (int lazy = 0; lazy < 2; ++lazy) {
+        sphere_field << <1, 1 >> > (d_list, n, d_camera, float(nx) / float(ny));
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        bool flag = lazy != 0;
+        checkCudaErrors(cudaMemcpyToSymbol(d_lazy_bvh, &flag, sizeof(bool)));
+
+        auto start = std::chrono::steady_clock::now();
+        build_world << <1, 1 >> > (d_list, n, d_world);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        double build = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double tile = trace_ms((nx - TILE_SIZE) / 2, (ny - TILE_SIZE) / 2, TILE_SIZE, TILE_SIZE, nx, ny, d_camera, d_world, t);
+        double frame = trace_ms(0, 0, nx, ny, nx, ny, d_camera, d_world, t);
+        double next = trace_ms(0, 0, nx, ny, nx, ny, d_camera, d_world, t);
+        unsigned long long heap = device_memory_usage().current[MEM_BVH];
+
+        size_t differ = 0;
+        if (lazy) {
+            for (size_t k = 0; k < 2 * num_pixels; ++k) {
+                if (fabsf(t[k] - eager[k]) > 1e-4f * fmaxf(1.f, fabsf(eager[k]))) differ++;
+            }
+        }
+        else eager.assign(t, t + 2 * num_pixels);
+        std::cout << std::setw(6) << (lazy ? "lazy" : "eager") << std::fixed << std::setprecision(1) << std::setw(10) << build
+            << std::setw(15) << tile << std::setw(17) << build + tile << std::setw(10) << frame << std::setw(15) << next
+            << std::setw(13) << heap / 1024.0 << "  " << (lazy ? differ == 0 ? std::string("same") : std::to_string(differ) + " differ" : std::string("-"))
+            << std::defaultfloat << "\n";
+
+        free_field << <1, 1 >> > (d_list, n, d_world, d_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    checkCudaErrors(cudaFree(t));
+    checkCudaErrors(cudaFree(d_camera));
+    checkCudaErrors(cudaFree(d_world));
+    checkCudaErrors(cudaFree(d_list));
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Checks that a grid medium's majorants bound its density everywhere.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -o majorant_check bench/majorant_check.cu
+//
+// Usage: majorant_check [points]
+//
+// Grids of several sizes, most of them not multiples of MAJORANT_CELL, are
+// filled with sparse random spikes of density. Random points in each grid's
+// box are looked up in the majorant cell march() would put them in, and the
+// trilinear density there must not exceed that cell's majorant; where it
+// does, delta tracking is biased and ratio tracking's 1 - sigma / majorant
+// factors go negative. Exits with 1 if any point is above its majorant.
+
+#include <iostream>
+#include <cstdlib>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "medium.h"
+#include "box.h"
+
+struct grid_size {
+    int nx, ny, nz;
+};
+
+const grid_size sizes[] = { { 8, 8, 8 }, { 9, 9, 9 }, { 13, 5, 30 }, { 17, 17, 17 }, { 31, 2, 9 } };
+const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+__global__ void build_grid(grid_medium** grid, int nx, int ny, int nz, int seed) {
+    curandState state;
+    curand_init(seed, 0, 0, &state);
+    float* density = device_new_array<float>(MEM_GEOMETRY, nx * ny * nz);
+    for (int v = 0; v < nx * ny * nz; ++v) density[v] = curand_uniform(&state) < 0.05f ? curand_uniform(&state) * 10.f : 0.f;
+    *grid = new grid_medium(new box(vec3(-1, -2, 0), vec3(3, 1, 5), nullptr), density, nx, ny, nz, 0.5f, vec3(1, 1, 1));
+}
+
+__global__ void free_grid(grid_medium** grid) {
+    delete *grid;
+}
+
+// Counts the points whose density is above the majorant of the cell they
+// are in, and records the largest density to majorant ratio seen.
+__global__ void check_points(grid_medium** grid, int points, int seed, int* above, float* worst) {
+    const grid_medium& g = **grid;
+    curandState state;
+    curand_init(seed, 1, 0, &state);
+    vec3 lo = g.bounds.min(), extent = g.bounds.max() - g.bounds.min();
+    int res[3] = { g.mx, g.my, g.mz };
+    for (int k = 0; k < points; ++k) {
+        vec3 p = lo + vec3(curand_uniform(&state) * extent.x(), curand_uniform(&state) * extent.y(), curand_uniform(&state) * extent.z());
+        int cell[3];
+        for (int a = 0; a < 3; ++a) {
+            float cell_size = extent[a] / res[a];
+            cell[a] = min(max(int((p[a] - lo[a]) / cell_size), 0), res[a] - 1);
+        }
+        float sigma = g.density_at(p) * g.scale;
+        float majorant = g.majorant[(cell[2] * g.my + cell[1]) * g.mx + cell[0]];
+        if (sigma > majorant * (1.f + 1e-5f)) {
+            (*above)++;
+            *worst = fmaxf(*worst, sigma / fmaxf(majorant, 1e-20f));
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int points = argc > 1 ? atoi(argv[1]) : 200000;
+    grid_medium** grid;
+    int* above;
+    float* worst;
+    checkCudaErrors(cudaMallocManaged((void**)&grid, sizeof(grid_medium*)));
+    checkCudaErrors(cudaMallocManaged((void**)&above, sizeof(int)));
+    checkCudaErrors(cudaMallocManaged((void**)&worst, sizeof(float)));
+    bool ok = true;
+    for (int k = 0; k < num_sizes; ++k) {
+        const grid_size& s = sizes[k];
+        *above = 0;
+        *worst = 0.f;
+        build_grid << <1, 1 >> > (grid, s.nx, s.ny, s.nz, 1984 + k);
+        checkCudaErrors(cudaGetLastError());
+        check_points << <1, 1 >> > (grid, points, 1984 + k, above, worst);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        std::cout << s.nx << "x" << s.ny << "x" << s.nz << ": ";
+        if (*above == 0) std::cout << "bounded\n";
+        else std::cout << *above << " of " << points << " points above their majorant, up to " << *worst << "x\n";
+        ok = *above == 0 && ok;
+        free_grid << <1, 1 >> > (grid);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    checkCudaErrors(cudaFree(worst));
+    checkCudaErrors(cudaFree(above));
+    checkCudaErrors(cudaFree(grid));
+    std::cout << (ok ? "majorants bound the density\n" : "majorants DON'T bound the density\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+// Microbenchmark for the vec3 math layer: dot, cross, normalize and
+// onb::build_from_w on the host backend chosen by simd.h and on the device.
+//
+// Build (from the repository root):
+//   nvcc -O3 -I. -Xcompiler -mavx -o vec3_bench bench/vec3_bench.cu
+//   nvcc -O3 -I. -DVEC3_FORCE_SCALAR -o vec3_bench_scalar bench/vec3_bench.cu
+//
+// Every host row is also timed against a 12-byte, 1/sqrt reference that
+// matches the layout vec3 had before the aligned backend was introduced.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <curand_kernel.h>
+
+#include "vec3.h"
+#include "onb.h"
+
+#define checkCudaErrors(val) check_cuda( (val), #val, __FILE__, __LINE__ )
+
+void check_cuda(cudaError_t result, char const* const func, const char* const file, int const line) {
+    if (result) {
+        std::cerr << "CUDA error = " << static_cast<unsigned int>(result) << " at " <<
+            file << ":" << line << " '" << func << "' \n";
+        cudaDeviceReset();
+        exit(99);
+    }
+}
+
+struct ref_vec3 {
+    float e[3];
+};
+
+inline float ref_dot(const ref_vec3& a, const ref_vec3& b) {
+    return a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2];
+}
+
+inline ref_vec3 ref_cross(const ref_vec3& a, const ref_vec3& b) {
+    return { { a.e[1] * b.e[2] - a.e[2] * b.e[1],
+               a.e[2] * b.e[0] - a.e[0] * b.e[2],
+               a.e[0] * b.e[1] - a.e[1] * b.e[0] } };
+}
+
+inline ref_vec3 ref_unit(const ref_vec3& a) {
+    float l = sqrtf(ref_dot(a, a));
+    return { { a.e[0] / l, a.e[1] / l, a.e[2] / l } };
+}
+
+// The branchy basis construction onb.h used before.
+inline void ref_onb(const ref_vec3& n, ref_vec3 axis[3]) {
+    axis[2] = ref_unit(n);
+    ref_vec3 a = (fabs(axis[2].e[0]) > 0.9f) ? ref_vec3{ { 0, 1, 0 } } : ref_vec3{ { 1, 0, 0 } };
+    axis[1] = ref_unit(ref_cross(axis[2], a));
+    axis[0] = ref_cross(axis[2], axis[1]);
+}
+
+template <typename F>
+double time_ns_per_op(int n, int reps, F f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        f();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / (double(n) * reps);
+}
+
+__global__ void dot_kernel(const vec3* a, const vec3* b, float* out, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < n) out[i] = dot(a[i], b[i]);
+}
+
+__global__ void cross_kernel(const vec3* a, const vec3* b, vec3* out, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < n) out[i] = cross(a[i], b[i]);
+}
+
+__global__ void normalize_kernel(const vec3* a, vec3* out, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < n) out[i] = unit_vector(a[i]);
+}
+
+__global__ void onb_kernel(const vec3* a, vec3* out, int n) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < n) {
+        onb uvw;
+        uvw.build_from_w(a[i]);
+        out[i] = uvw.u() + uvw.v();
+    }
+}
+
+template <typename K>
+float time_kernel_ns_per_op(int n, int reps, K launch) {
+    cudaEvent_t start, stop;
+    checkCudaErrors(cudaEventCreate(&start));
+    checkCudaErrors(cudaEventCreate(&stop));
+    launch();
+    checkCudaErrors(cudaEventRecord(start));
+    for (int r = 0; r < reps; ++r) {
+        launch();
+    }
+    checkCudaErrors(cudaEventRecord(stop));
+    checkCudaErrors(cudaEventSynchronize(stop));
+    checkCudaErrors(cudaGetLastError());
+    float ms = 0.f;
+    checkCudaErrors(cudaEventElapsedTime(&ms, start, stop));
+    checkCudaErrors(cudaEventDestroy(start));
+    checkCudaErrors(cudaEventDestroy(stop));
+    return ms * 1e6f / (float(n) * reps);
+}
+
+void report(const char* name, double simd_ns, double ref_ns, float device_ns) {
+    std::cerr << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(3)
+        << std::setw(12) << simd_ns << std::setw(12) << ref_ns
+        << std::setw(10) << ref_ns / simd_ns << "x"
+        << std::setw(12) << device_ns << "\n";
+}
+
+int main() {
+    const int n = 1 << 20;
+    const int reps = 20;
+
+    std::mt19937 gen(1984);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+
+    std::vector<vec3> a(n), b(n), out(n);
+    std::vector<ref_vec3> ra(n), rb(n), rout(n);
+    for (int i = 0; i < n; ++i) {
+        a[i] = vec3(dist(gen), dist(gen), dist(gen));
+        b[i] = vec3(dist(gen), dist(gen), dist(gen));
+        ra[i] = { { a[i].x(), a[i].y(), a[i].z() } };
+        rb[i] = { { b[i].x(), b[i].y(), b[i].z() } };
+    }
+
+    volatile float sink = 0.f;
+    float acc = 0.f;
+
+    double dot_simd = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) acc += dot(a[i], b[i]);
+    });
+    double dot_ref = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) acc += ref_dot(ra[i], rb[i]);
+    });
+    double cross_simd = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) out[i] = cross(a[i], b[i]);
+    });
+    double cross_ref = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) rout[i] = ref_cross(ra[i], rb[i]);
+    });
+    double unit_simd = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) out[i] = unit_vector(a[i]);
+    });
+    double unit_ref = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) rout[i] = ref_unit(ra[i]);
+    });
+    double onb_simd = time_ns_per_op(n, reps, [&] {
+        for (int i = 0; i < n; ++i) {
+            onb uvw;
+            uvw.build_from_w(a[i]);
+            out[i] = uvw.u() + uvw.v();
+        }
+    });
+    double onb_ref = time_ns_per_op(n, reps, [&] {
+        ref_vec3 axis[3];
+        for (int i = 0; i < n; ++i) {
+            ref_onb(ra[i], axis);
+            rout[i] = axis[0];
+        }
+    });
+    sink = acc + out[n / 2].x() + rout[n / 2].e[0];
+
+    vec3* d_a;
+    vec3* d_b;
+    vec3* d_out;
+    float* d_dot;
+    checkCudaErrors(cudaMalloc((void**)&d_a, n * sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void**)&d_b, n * sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void**)&d_out, n * sizeof(vec3)));
+    checkCudaErrors(cudaMalloc((void**)&d_dot, n * sizeof(float)));
+    checkCudaErrors(cudaMemcpy(d_a, a.data(), n * sizeof(vec3), cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMemcpy(d_b, b.data(), n * sizeof(vec3), cudaMemcpyHostToDevice));
+
+    int threads = 256;
+    int blocks = (n + threads - 1) / threads;
+    float dot_dev = time_kernel_ns_per_op(n, reps, [&] { dot_kernel << <blocks, threads >> > (d_a, d_b, d_dot, n); });
+    float cross_dev = time_kernel_ns_per_op(n, reps, [&] { cross_kernel << <blocks, threads >> > (d_a, d_b, d_out, n); });
+    float unit_dev = time_kernel_ns_per_op(n, reps, [&] { normalize_kernel << <blocks, threads >> > (d_a, d_out, n); });
+    float onb_dev = time_kernel_ns_per_op(n, reps, [&] { onb_kernel << <blocks, threads >> > (d_a, d_out, n); });
+
+    std::cerr << "vec3 backend: " << VEC3_BACKEND_NAME << ", sizeof(vec3) = " << sizeof(vec3)
+        << ", " << n << " elements x " << reps << " reps\n";
+    std::cerr << std::left << std::setw(12) << "op" << std::right << std::setw(12) << "host ns"
+        << std::setw(12) << "ref ns" << std::setw(11) << "speedup" << std::setw(12) << "device ns" << "\n";
+    report("dot", dot_simd, dot_ref, dot_dev);
+    report("cross", cross_simd, cross_ref, cross_dev);
+    report("normalize", unit_simd, unit_ref, unit_dev);
+    report("onb", onb_simd, onb_ref, onb_dev);
+
+    checkCudaErrors(cudaFree(d_a));
+    checkCudaErrors(cudaFree(d_b));
+    checkCudaErrors(cudaFree(d_out));
+    checkCudaErrors(cudaFree(d_dot));
+    cudaDeviceReset();
+    return sink == 12345.f ? 1 : 0;
+}
@@ -1,44 +1,174 @@
 #ifndef BOX_H
 #define BOX_H
 
-#include "rect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 #include "material.h"
 
-class box : public hittable{
+/**
+ * Axis-aligned box, intersected with a single slab test. The face hit is
+ * the slab that set the entry (or, from inside, the exit) distance, and the
+ * normal points along that axis against the ray, as the rectangles' do.
+ */
+class box : public hittable {
 public:
-	__device__ box() {}
-	__device__ box(const vec3& p0, const vec3& p1, material* ptr);
-	__device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
-	__device__ virtual bool bounding_box(float t0, float t1, aabb& box) const {
-		box = aabb(box_min, box_max);
-		return true;
-	}
-
-	vec3 box_min;
-	vec3 box_max;
-	hittable* sides;
+    __device__ box() {}
+    __device__ box(const vec3& p0, const vec3& p1, material* ptr) : box_min(p0), box_max(p1), mat_ptr(ptr) {}
+    __device__ virtual ~box() {
+        delete mat_ptr;
+    }
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override {
+        box = aabb(box_min, box_max);
+        return true;
+    }
+    __device__ virtual double pdf_value(const vec3& origin, const vec3& v) const override;
+    __device__ virtual vec3 random(const vec3& origin, curandState* state) const override;
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override;
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override;
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
+
+    // Whether the face on side (0 low, 1 high) of axis faces origin; every
+    // face does from inside.
+    __device__ bool face_visible(int axis, int side, const vec3& origin) const {
+        bool inside = true;
+        for (int a = 0; a < 3; ++a) {
+            inside = inside && origin[a] >= box_min[a] && origin[a] <= box_max[a];
+        }
+        return inside || (side == 0 ? origin[axis] < box_min[axis] : origin[axis] > box_max[axis]);
+    }
+    __device__ float face_area(int axis) const {
+        vec3 extent = box_max - box_min;
+        return extent[(axis + 1) % 3] * extent[(axis + 2) % 3];
+    }
+    // Area of the faces origin can see, which light sampling spreads its
+    // points over.
+    __device__ float visible_area(const vec3& origin) const {
+        float area = 0.f;
+        for (int f = 0; f < 6; ++f) {
+            if (face_visible(f / 2, f % 2, origin)) area += face_area(f / 2);
+        }
+        return area;
+    }
+
+    vec3 box_min;
+    vec3 box_max;
+    material* mat_ptr;
 };
 
-__device__ box::box(const vec3& p0, const vec3& p1, material* ptr) {
-	box_min = p0;
-	box_max = p1;
-
-	hittable** list = new hittable * [6];
-	list[0] = new rectangle_xy(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-	list[1] = new rectangle_xy(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr);
-	list[2] = new rectangle_xz(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-	list[3] = new rectangle_xz(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr);
-	list[4] = new rectangle_yz(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr);
-	list[5] = new rectangle_yz(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-	sides = new hittable_list(list, 6);
+__device__ bool box::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    float t_near = -FLT_MAX, t_far = FLT_MAX;
+    int near_axis = 0, far_axis = 0;
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (box_min[a] - r.origin()[a]) / r.direction()[a];
+        float t1 = (box_max[a] - r.origin()[a]) / r.direction()[a];
+        if (r.direction()[a] < 0.f) {
+            float tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        if (t0 > t_near) {
+            t_near = t0;
+            near_axis = a;
+        }
+        if (t1 < t_far) {
+            t_far = t1;
+            far_axis = a;
+        }
+    }
+    if (t_near > t_far) return false;
+
+    int axis;
+    if (t_near >= t_min && t_near <= t_max) {
+        rec.t = t_near;
+        axis = near_axis;
+    }
+    else if (t_far >= t_min && t_far <= t_max) {
+        rec.t = t_far;
+        axis = far_axis;
+    }
+    else {
+        return false;
+    }
+    rec.mat_ptr = mat_ptr;
+    rec.obj = this;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = 1.f;
+    rec.normal = r.direction()[axis] < 0.f ? outward_normal : -outward_normal;
+    return true;
+}
+
+__device__ double box::pdf_value(const vec3& origin, const vec3& v) const {
+    hit_record rec;
+    if (!this->hit(ray(origin, v), 0.001, FLT_MAX, rec))
+        return 0;
+
+    auto distance_squared = rec.t * rec.t * v.squared_length();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+    return distance_squared / (cosine * visible_area(origin));
+}
+
+// A point spread uniformly over the faces origin can see. Those map one to
+// one onto the directions that hit the box, so pdf_value() is the first
+// hit's area density converted to solid angle.
+__device__ vec3 box::random(const vec3& origin, curandState* state) const {
+    float u = curand_uniform(state) * visible_area(origin);
+    int face = -1;
+    for (int f = 0; f < 6; ++f) {
+        if (!face_visible(f / 2, f % 2, origin)) continue;
+        face = f;
+        u -= face_area(f / 2);
+        if (u <= 0.f) break;
+    }
+    int a = face / 2, b = (a + 1) % 3, c = (a + 2) % 3;
+    vec3 random_point;
+    random_point[a] = face % 2 ? box_max[a] : box_min[a];
+    random_point[b] = box_min[b] + curand_uniform(state) * (box_max[b] - box_min[b]);
+    random_point[c] = box_min[c] + curand_uniform(state) * (box_max[c] - box_min[c]);
+    return random_point - origin;
+}
+
+// A point spread uniformly over all six faces, with the face's outward
+// normal.
+__device__ bool box::sample_surface(curandState* state, hit_record& rec, float& pdf) const {
+    float total = 2.f * (face_area(0) + face_area(1) + face_area(2));
+    float u = curand_uniform(state) * total;
+    int face = 5;
+    for (int f = 0; f < 5; ++f) {
+        u -= face_area(f / 2);
+        if (u <= 0.f) {
+            face = f;
+            break;
+        }
+    }
+    int a = face / 2, b = (a + 1) % 3, c = (a + 2) % 3;
+    rec.p[a] = face % 2 ? box_max[a] : box_min[a];
+    rec.p[b] = box_min[b] + curand_uniform(state) * (box_max[b] - box_min[b]);
+    rec.p[c] = box_min[c] + curand_uniform(state) * (box_max[c] - box_min[c]);
+    rec.normal = vec3(0, 0, 0);
+    rec.normal[a] = face % 2 ? 1.f : -1.f;
+    rec.t = 0.f;
+    rec.mat_ptr = mat_ptr;
+    rec.obj = this;
+    pdf = 1.f / total;
+    return true;
 }
 
-__device__ bool box::hit(const ray& r,
-	float t_min,
-	float t_max,
-	hit_record& rec) const {
-	return sides->hit(r, t_min, t_max, rec);
+__device__ bool box::emitter_bounds(light_bounds& lb) const {
+    float power = luminance(mat_ptr->emitted(0, 0, box_min)) * 2.f * (face_area(0) + face_area(1) + face_area(2));
+    if (power <= 0.f)
+        return false;
+    bounding_box(0, 0, lb.box);
+    lb.axis = vec3(0, 0, 1);
+    lb.cos_theta_o = -1.f;
+    lb.cos_theta_e = 0.f;
+    lb.power = power;
+    lb.two_sided = false;
+    return true;
 }
 
-#endif
\ No newline at end of file
+#endif
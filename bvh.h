@@ -5,6 +5,7 @@
 #include <curand_kernel.h>
 
 #include "hittable.h"
+#include "stats.h"
 
 
 struct box_compare {
@@ -34,12 +35,7 @@ struct box_compare {
             val2 = box_right.min().z();
         }
 
-        if (val1 - val2 < 0.0) {
-            return false;
-        }
-        else {
-            return true;
-        }
+        return val1 < val2;
     }
     // mode: 1, x; 2, y; 3, z
     int mode;
@@ -48,12 +44,21 @@ struct box_compare {
 
 class bvhNode : public hittable {
 public:
-    __device__ bvhNode() {}
+    DEVICE_MEMORY_CATEGORY(MEM_BVH)
+
+    __device__ bvhNode() : owns_children(false) {}
     __device__ bvhNode(hittable** l,
         int n,
         float time0,
         float time1,
         curandState* state);
+    // Leaves belong to the scene; only inner nodes are freed here.
+    __device__ virtual ~bvhNode() {
+        if (owns_children) {
+            delete left;
+            delete right;
+        }
+    }
 
     __device__ virtual bool hit(const ray& r,
         float t_min,
@@ -64,9 +69,18 @@ public:
         float t1,
         aabb& b) const;
 
+    __device__ virtual unsigned features() const {
+        return left->features() | right->features();
+    }
+
+    __device__ virtual const bvhNode* as_bvh_node() const {
+        return this;
+    }
+
     hittable* left;
     hittable* right;
     aabb box;
+    bool owns_children;
 };
 
 
@@ -86,6 +100,7 @@ __device__ bvhNode::bvhNode(hittable** l,
         thrust::sort(l, l + n, box_compare(3));
     }
 
+    owns_children = n > 2;
     if (n == 1) {
         left = right = l[0];
     }
@@ -96,6 +111,8 @@ __device__ bvhNode::bvhNode(hittable** l,
     else {
         left = new bvhNode(l, n / 2, time0, time1, state);
         right = new bvhNode(l + n / 2, n - n / 2, time0, time1, state);
+        // Out of device heap; create_scene() reports it.
+        if (left == nullptr || right == nullptr) return;
     }
 
     aabb box_left, box_right;
@@ -120,6 +137,7 @@ __device__ bool bvhNode::hit(const ray& r,
     float t_min,
     float t_max,
     hit_record& rec) const {
+    STATS_ADD(node_visits, 1);
     if (box.hit(r, t_min, t_max)) {
         hit_record left_rec, right_rec;
         bool hit_left = left->hit(r, t_min, t_max, left_rec);
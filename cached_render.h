@@ -0,0 +1,174 @@
+#ifndef CACHED_RENDER_H
+#define CACHED_RENDER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "radiance_cache.h"
+#include "image_io.h"
+#include "image_metrics.h"
+#include "memory_budget.h"
+
+// Cells per axis across the longest side of the scene bounds.
+#define RADIANCE_CACHE_RESOLUTION 128
+// Hash table slots, a power of two; 24 bytes each.
+#define RADIANCE_CACHE_SLOTS (1 << 20)
+// Continue probability of the unbiased mode.
+#define RADIANCE_CACHE_CONTINUE 0.5f
+
+// The table's buffers on the device, sized for the scene's bounds.
+struct device_radiance_cache {
+    radiance_cache view;
+
+    device_radiance_cache(const aabb& bounds) {
+        vec3 extent = bounds.max() - bounds.min();
+        float longest = fmaxf(extent.x(), fmaxf(extent.y(), extent.z()));
+        view.cell = fmaxf(longest, 1e-3f) / RADIANCE_CACHE_RESOLUTION;
+        view.inv_cell = 1.f / view.cell;
+        view.origin = bounds.min();
+        view.mask = RADIANCE_CACHE_SLOTS - 1;
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.keys, RADIANCE_CACHE_SLOTS * sizeof(unsigned long long)));
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.radiance, 3 * RADIANCE_CACHE_SLOTS * sizeof(float)));
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.samples, RADIANCE_CACHE_SLOTS * sizeof(unsigned)));
+        checkCudaErrors(cudaMemset(view.keys, 0, RADIANCE_CACHE_SLOTS * sizeof(unsigned long long)));
+        checkCudaErrors(cudaMemset(view.radiance, 0, 3 * RADIANCE_CACHE_SLOTS * sizeof(float)));
+        checkCudaErrors(cudaMemset(view.samples, 0, RADIANCE_CACHE_SLOTS * sizeof(unsigned)));
+    }
+    ~device_radiance_cache() {
+        checkCudaErrors(tracked_free(view.keys));
+        checkCudaErrors(tracked_free(view.radiance));
+        checkCudaErrors(tracked_free(view.samples));
+    }
+
+    int cells() const {
+        std::vector<unsigned long long> keys(RADIANCE_CACHE_SLOTS);
+        checkCudaErrors(cudaMemcpy(keys.data(), view.keys, keys.size() * sizeof(unsigned long long), cudaMemcpyDeviceToHost));
+        int used = 0;
+        for (unsigned long long k : keys) used += k != 0ull;
+        return used;
+    }
+};
+
+/**
+ * render() with a radiance cache: every sample fills it, and with use set
+ * paths end on it as cache_path describes. Pixels are seeded as in
+ * render(), so with use off the image is render()'s. Path vertices traced
+ * are counted into vertices either way.
+ */
+template <unsigned F, int DEPTH>
+__global__ void cached_trace(vec3* fb, int max_x, int max_y, int ns, int order, const int* tiles, camera** cam,
+    hittable** world, light_bvh** lights, radiance_cache cache, bool use, float continue_probability, unsigned long long* vertices, int max_depth) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    cache_path path;
+    path.cache = &cache;
+    path.continue_probability = continue_probability;
+    vec3 col(0, 0, 0);
+    unsigned long long depth = 0;
+    for (int s = 0; s < ns; s++) {
+        curandState local_rand_state;
+        sample_state(pixel_index, s, &local_rand_state);
+        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+        path_state ps;
+        path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+        cache_path_begin(path);
+        while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state, nullptr, use ? &path : nullptr)) {}
+        depth += ps.depth;
+        if (use) cache_train(path, ps.radiance);
+        col += ps.radiance;
+    }
+    atomicAdd(vertices, depth);
+    col /= float(ns);
+    fb[pixel_index] = vec3(sqrtf(fmaxf(col[0], 0.f)), sqrtf(fmaxf(col[1], 0.f)), sqrtf(fmaxf(col[2], 0.f)));
+}
+
+struct cached_launcher {
+    int num_tiles;
+    vec3* fb;
+    int max_x, max_y, ns, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    radiance_cache cache;
+    bool use;
+    float continue_probability;
+    unsigned long long* vertices;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        cached_trace<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (fb, max_x, max_y, ns, order, tiles, cam, world, lights,
+            cache, use, continue_probability, vertices, max_depth);
+    }
+};
+
+/**
+ * Renders ns samples per pixel into fb with the radiance cache in mode, then
+ * the same samples without it, and reports both times, the path vertices
+ * each traced, and how far the cached image is from the plain one (and from
+ * reference, if it names an image of the same size).
+ */
+void render_radiance_cached(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order, const int* tiles, int num_tiles,
+    camera** cam, hittable** world, light_bvh** lights, int mode, const std::string& reference) {
+    int num_pixels = nx * ny;
+    aabb* bounds;
+    checkCudaErrors(cudaMallocManaged((void**)&bounds, sizeof(aabb)));
+    world_bounds << <1, 1 >> > (world, bounds);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    device_radiance_cache cached(*bounds);
+    checkCudaErrors(cudaFree(bounds));
+    unsigned long long* vertices;
+    checkCudaErrors(cudaMallocManaged((void**)&vertices, 2 * sizeof(unsigned long long)));
+    vertices[0] = vertices[1] = 0;
+
+    float q = mode == CACHE_UNBIASED ? RADIANCE_CACHE_CONTINUE : 0.f;
+    cached_launcher launcher = { num_tiles, fb, nx, ny, ns, order, tiles, cam, world, lights, cached.view, true, q, &vertices[0] };
+    auto start = std::chrono::steady_clock::now();
+    dispatch_variant(features, max_depth, launcher);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    double cached_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<vec3> cached_image = linear_image(fb, num_pixels);
+
+    vec3* plain_fb;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&plain_fb, num_pixels * sizeof(vec3), true));
+    launcher.fb = plain_fb;
+    launcher.use = false;
+    launcher.vertices = &vertices[1];
+    start = std::chrono::steady_clock::now();
+    dispatch_variant(features, max_depth, launcher);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    double plain_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<vec3> plain_image = linear_image(plain_fb, num_pixels);
+    checkCudaErrors(tracked_free(plain_fb));
+
+    double samples = double(num_pixels) * ns;
+    std::cerr << "radiance cache (" << (mode == CACHE_UNBIASED ? "unbiased" : "biased") << "): " << cached_seconds << " seconds, "
+        << vertices[0] / samples << " vertices per path, " << cached.cells() << " cells.\n";
+    std::cerr << "without the cache: " << plain_seconds << " seconds, " << vertices[1] / samples << " vertices per path; "
+        << plain_seconds / cached_seconds << "x speedup.\n";
+    checkCudaErrors(cudaFree(vertices));
+    std::cerr << "relMSE of the cached image against the uncached one: " << image_relmse(cached_image, plain_image) << "\n";
+
+    std::vector<vec3> reference_image;
+    int rx, ry;
+    if (reference.empty()) return;
+    if (!read_ppm(reference, reference_image, rx, ry) || rx != nx || ry != ny) {
+        std::cerr << "can't compare against " << reference << ": not a " << nx << "x" << ny << " image\n";
+        return;
+    }
+    for (vec3& p : reference_image) p = p * p;
+    std::cerr << "relMSE against " << reference << ": cached " << image_relmse(cached_image, reference_image)
+        << ", uncached " << image_relmse(plain_image, reference_image) << "\n";
+}
+
+#endif
@@ -3,20 +3,25 @@
 
 #include <curand_kernel.h>
 #include "ray.h"
+#include "render_features.h"
 
 #define M_PI 3.1415926535197932
 
 __device__ vec3 random_in_unit_disk(curandState* local_rand_state) {
-    vec3 p;
-    do {
-        p = 2.0f * vec3(curand_uniform(local_rand_state), curand_uniform(local_rand_state), 0) - vec3(1, 1, 0);
-    } while (dot(p, p) >= 1.0f);
-    return p;
+    float r = sqrtf(curand_uniform(local_rand_state));
+    float phi = 2.0f * float(M_PI) * curand_uniform(local_rand_state);
+    return vec3(r * cosf(phi), r * sinf(phi), 0);
 }
 
 class camera {
 public:
-    __device__ camera(vec3 lookfrom, vec3 lookat, vec3 vup, float vfov, float aspect, float aperture, float focus_dist, float t0, float t1) { // vfov is top to bottom in degrees
+    __host__ __device__ camera() {}
+    __host__ __device__ camera(vec3 lookfrom, vec3 lookat, vec3 vup, float vfov, float aspect, float aperture, float focus_dist, float t0, float t1) { // vfov is top to bottom in degrees
+        this->lookat = lookat;
+        this->vup = vup;
+        this->vfov = vfov;
+        this->aspect = aspect;
+        this->focus_dist = focus_dist;
         lens_radius = aperture / 2.0f;
         float theta = vfov * ((float)M_PI) / 180.0f;
         float half_height = tan(theta / 2.0f);
@@ -31,12 +36,67 @@ public:
         time0 = t0;
         time1 = t1;
     }
-    __device__ ray get_ray(float s, float t, curandState* local_rand_state) {
-        vec3 rd = lens_radius * random_in_unit_disk(local_rand_state);
-        vec3 offset = u * rd.x() + v * rd.y();
-        float rand_t = time0 + curand_uniform(local_rand_state) * (time1 - time0);
+    // Without FEATURE_DEPTH_OF_FIELD / FEATURE_MOTION_BLUR in F the lens and
+    // shutter aren't sampled: rays leave the pinhole at time0.
+    template <unsigned F = FEATURE_ALL>
+    __device__ ray get_ray(float s, float t, curandState* local_rand_state) const {
+        vec3 offset(0, 0, 0);
+        if (F & FEATURE_DEPTH_OF_FIELD) {
+            vec3 rd = lens_radius * random_in_unit_disk(local_rand_state);
+            offset = u * rd.x() + v * rd.y();
+        }
+        float rand_t = time0;
+        if (F & FEATURE_MOTION_BLUR) {
+            rand_t += curand_uniform(local_rand_state) * (time1 - time0);
+        }
         return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, rand_t);
     }
+    // Image coordinates (s, t) of the pinhole projection of p. False if p is
+    // behind the camera.
+    __host__ __device__ bool project(const vec3& p, float& s, float& t) const {
+        vec3 d = p - origin;
+        float depth = -dot(d, w);
+        if (depth <= 0.f) return false;
+        vec3 q = d * (focus_dist / depth) - (lower_left_corner - origin);
+        s = dot(q, horizontal) / horizontal.squared_length();
+        t = dot(q, vertical) / vertical.squared_length();
+        return true;
+    }
+    // Connects p to a point on the lens, for light tracing. s and t are the
+    // image coordinates the lens point sees p at, and importance the pixel
+    // response per unit of radiance leaving p towards lens, per unit area
+    // at p without p's own cosine: focus_dist^2 / (A cos^3 theta r^2), where
+    // A is the area of the image at focus_dist. Splatted into a pixel, that
+    // times nx * ny matches what get_ray() samples average there. False if
+    // p is behind the lens.
+    template <unsigned F = FEATURE_ALL>
+    __device__ bool connect(const vec3& p, curandState* local_rand_state, vec3& lens, float& s, float& t, float& importance) const {
+        lens = origin;
+        if (F & FEATURE_DEPTH_OF_FIELD) {
+            vec3 rd = lens_radius * random_in_unit_disk(local_rand_state);
+            lens += u * rd.x() + v * rd.y();
+        }
+        vec3 d = p - lens;
+        float depth = -dot(d, w);
+        if (depth <= 0.f) return false;
+        vec3 q = lens + d * (focus_dist / depth) - lower_left_corner;
+        s = dot(q, horizontal) / horizontal.squared_length();
+        t = dot(q, vertical) / vertical.squared_length();
+        float r2 = d.squared_length();
+        float cos_theta = depth / sqrtf(r2);
+        importance = focus_dist * focus_dist / (horizontal.length() * vertical.length() * cos_theta * cos_theta * cos_theta * r2);
+        return true;
+    }
+    // Same lens, field of view and shutter from a new viewpoint.
+    __host__ __device__ camera moved(const vec3& lookfrom, const vec3& new_lookat) const {
+        return camera(lookfrom, new_lookat, vup, vfov, aspect, 2.0f * lens_radius, focus_dist, time0, time1);
+    }
+    __host__ __device__ camera moved(const vec3& lookfrom, const vec3& new_lookat, float new_aspect) const {
+        return camera(lookfrom, new_lookat, vup, vfov, new_aspect, 2.0f * lens_radius, focus_dist, time0, time1);
+    }
+    __device__ unsigned features() const {
+        return (lens_radius > 0.f ? FEATURE_DEPTH_OF_FIELD : 0u) | (time1 > time0 ? FEATURE_MOTION_BLUR : 0u);
+    }
 
     vec3 origin;
     vec3 lower_left_corner;
@@ -45,6 +105,8 @@ public:
     vec3 u, v, w;
     float lens_radius;
     float time0, time1;
+    vec3 lookat, vup;
+    float vfov, aspect, focus_dist;
 };
 
 
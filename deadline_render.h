@@ -0,0 +1,89 @@
+#ifndef DEADLINE_RENDER_H
+#define DEADLINE_RENDER_H
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "memory_budget.h"
+#include "trace.h"
+
+// Passes the time left is split into, so the cost estimate is corrected a
+// few times before the last one.
+#define DEADLINE_PASSES_LEFT 4
+// A pass is only started if it fits at this multiple of the measured cost.
+#define DEADLINE_MARGIN 1.1
+// Time kept back for writing the image and tearing down, per pixel.
+#define DEADLINE_OUTPUT_NS_PER_PIXEL 1000
+// Most samples per pixel in one pass.
+#define DEADLINE_MAX_PASS_SPP 4096
+
+struct deadline_result {
+    int spp;
+    int passes;
+    double warmup_seconds;
+    double seconds;
+    // Seconds left before the deadline when the image was resolved;
+    // negative if even the warm-up pass overran it.
+    double slack;
+};
+
+/**
+ * Renders as many samples per pixel as fit before deadline, and leaves fb
+ * complete with every pixel averaged over the same number of samples. A
+ * 1 spp warm-up pass over the whole frame measures what a sample costs.
+ * Each later pass adds k samples to every tile, with k sized so the time
+ * left still spans about DEADLINE_PASSES_LEFT passes at the cost measured
+ * over the passes so far (the warm-up only until there are others, as it
+ * includes first launch overheads). Rendering stops once one more sample
+ * per pixel would not finish in time at DEADLINE_MARGIN times that cost.
+ * Each pass numbers its samples on from the last, so it draws new ones.
+ */
+deadline_result render_to_deadline(vec3* fb, int nx, int ny, std::chrono::steady_clock::time_point deadline, unsigned features, int max_depth,
+    int order, const int* tiles, int num_tiles, camera** cam, hittable** world, light_bvh** lights) {
+    typedef std::chrono::steady_clock clock;
+    int num_pixels = nx * ny;
+    vec3* accum;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&accum, num_pixels * sizeof(vec3)));
+    checkCudaErrors(cudaMemset(accum, 0, num_pixels * sizeof(vec3)));
+    deadline_result result = { 0, 0, 0.0, 0.0, 0.0 };
+    clock::time_point start = clock::now();
+    clock::time_point stop = deadline - std::chrono::nanoseconds((long long)DEADLINE_OUTPUT_NS_PER_PIXEL * num_pixels);
+
+    double measured_seconds = 0.0;
+    int measured_spp = 0;
+    for (int ns = 1; ns > 0;) {
+        TRACE_SCOPE("pass");
+        clock::time_point pass_start = clock::now();
+        launch_render(features, max_depth, num_tiles, fb, nx, ny, ns, order, tiles, cam, world, lights, result.spp);
+        accumulate_pass << <(num_pixels + 255) / 256, 256 >> > (accum, fb, num_pixels, ns);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        double pass_seconds = std::chrono::duration<double>(clock::now() - pass_start).count();
+        if (result.passes++ == 0) result.warmup_seconds = pass_seconds;
+        else {
+            measured_seconds += pass_seconds;
+            measured_spp += ns;
+        }
+        result.spp += ns;
+
+        double cost = measured_spp > 0 ? measured_seconds / measured_spp : result.warmup_seconds;
+        double left = std::chrono::duration<double>(stop - clock::now()).count();
+        double fits = left / (cost * DEADLINE_MARGIN);
+        ns = fits < 1.0 ? 0 : fits < DEADLINE_PASSES_LEFT ? 1 : int(std::min(fits / DEADLINE_PASSES_LEFT, double(DEADLINE_MAX_PASS_SPP)));
+    }
+
+    resolve_passes << <(num_pixels + 255) / 256, 256 >> > (fb, accum, num_pixels, result.spp);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(tracked_free(accum));
+    clock::time_point end = clock::now();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.slack = std::chrono::duration<double>(deadline - end).count();
+    return result;
+}
+
+#endif
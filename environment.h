@@ -0,0 +1,137 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "vec3.h"
+#include "alias_table.h"
+#include "image_io.h"
+#include "memory_budget.h"
+
+/**
+ * HDR environment around the scene, an equirectangular image: a direction's
+ * azimuth around +y picks the column and its angle from +y the row, top row
+ * straight up. Radiance is constant over a texel, so sampling picks a texel
+ * from an alias table over luminance * sin(theta), the texel's share of the
+ * incoming light, and then a point uniformly inside it; the density is then
+ * exactly proportional to what the texel contributes. texels is bottom row
+ * first, as read_pfm() returns it. A null texels means no environment.
+ */
+struct environment_map {
+    int width;
+    int height;
+    float scale;
+    const vec3* texels;
+    const float* prob;
+    const int* alias;
+    const float* pmf;
+};
+
+__host__ __device__ inline environment_map no_environment() {
+    environment_map e;
+    e.width = e.height = 0;
+    e.scale = 0.f;
+    e.texels = nullptr;
+    e.prob = e.pmf = nullptr;
+    e.alias = nullptr;
+    return e;
+}
+
+// Index of the texel seen along unit direction d.
+__device__ inline int environment_texel(const environment_map& e, const vec3& d) {
+    float phi = atan2f(d.z(), d.x());
+    if (phi < 0.f) phi += 2.f * float(M_PI);
+    float theta = acosf(fmaxf(-1.f, fminf(1.f, d.y())));
+    int i = max(0, min(int(phi * (0.5f / float(M_PI)) * e.width), e.width - 1));
+    int j = max(0, min(int(theta * (1.f / float(M_PI)) * e.height), e.height - 1));
+    return (e.height - 1 - j) * e.width + i;
+}
+
+__device__ vec3 environment_radiance(const environment_map& e, const vec3& direction) {
+    return e.scale * e.texels[environment_texel(e, unit_vector(direction))];
+}
+
+// Solid angle density of environment_sample() returning direction.
+__device__ float environment_pdf(const environment_map& e, const vec3& direction) {
+    vec3 d = unit_vector(direction);
+    float sin_theta = sqrtf(fmaxf(0.f, 1.f - d.y() * d.y()));
+    if (sin_theta <= 0.f) return 0.f;
+    return e.pmf[environment_texel(e, d)] * float(e.width) * float(e.height) / (2.f * float(M_PI) * float(M_PI) * sin_theta);
+}
+
+// A unit direction towards the environment and its solid angle density.
+// Texels hold millions of entries, so the alias table gets a uniform of its
+// own for the column and one for the coin flip.
+__device__ vec3 environment_sample(const environment_map& e, curandState* state, float& pdf) {
+    int n = e.width * e.height;
+    int k = min(int(curand_uniform(state) * n), n - 1);
+    if (curand_uniform(state) >= e.prob[k]) k = e.alias[k];
+    int row = e.height - 1 - k / e.width;
+    float phi = (k % e.width + curand_uniform(state)) / e.width * 2.f * float(M_PI);
+    float theta = (row + curand_uniform(state)) / e.height * float(M_PI);
+    float sin_theta = sinf(theta);
+    pdf = sin_theta > 0.f ? e.pmf[k] * float(n) / (2.f * float(M_PI) * float(M_PI) * sin_theta) : 0.f;
+    return vec3(sin_theta * cosf(phi), cosf(theta), sin_theta * sinf(phi));
+}
+
+/**
+ * An environment_map in device memory, read from a PFM file with its
+ * sampling tables built on the host.
+ */
+class device_environment {
+public:
+    // view stays no_environment() if path can't be read.
+    device_environment(const std::string& path, float scale) : view(no_environment()) {
+        std::vector<vec3> image;
+        int nx, ny;
+        if (!read_pfm(path, image, nx, ny)) return;
+
+        std::vector<float> weights(image.size());
+        for (int row = 0; row < ny; ++row) {
+            float sin_theta = sinf((ny - 1 - row + 0.5f) / ny * float(M_PI));
+            for (int i = 0; i < nx; ++i) {
+                size_t k = size_t(row) * nx + i;
+                weights[k] = fmaxf(luminance(image[k]), 0.f) * sin_theta;
+            }
+        }
+        alias_table table(weights.data(), int(weights.size()));
+
+        size_t n = image.size();
+        vec3* texels;
+        float* prob;
+        int* alias;
+        float* pmf;
+        checkCudaErrors(tracked_malloc(MEM_TEXTURES, (void**)&texels, n * sizeof(vec3)));
+        checkCudaErrors(tracked_malloc(MEM_TEXTURES, (void**)&prob, n * sizeof(float)));
+        checkCudaErrors(tracked_malloc(MEM_TEXTURES, (void**)&alias, n * sizeof(int)));
+        checkCudaErrors(tracked_malloc(MEM_TEXTURES, (void**)&pmf, n * sizeof(float)));
+        checkCudaErrors(cudaMemcpy(texels, image.data(), n * sizeof(vec3), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpy(prob, table.prob, n * sizeof(float), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpy(alias, table.alias, n * sizeof(int), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpy(pmf, table.pdf, n * sizeof(float), cudaMemcpyHostToDevice));
+        view.width = nx;
+        view.height = ny;
+        view.scale = scale;
+        view.texels = texels;
+        view.prob = prob;
+        view.alias = alias;
+        view.pmf = pmf;
+    }
+    ~device_environment() {
+        if (view.texels == nullptr) return;
+        checkCudaErrors(tracked_free((void*)view.texels));
+        checkCudaErrors(tracked_free((void*)view.prob));
+        checkCudaErrors(tracked_free((void*)view.alias));
+        checkCudaErrors(tracked_free((void*)view.pmf));
+    }
+
+    bool loaded() const { return view.texels != nullptr; }
+
+    environment_map view;
+};
+
+#endif
@@ -0,0 +1,328 @@
+#ifndef GEOMETRY_STORE_H
+#define GEOMETRY_STORE_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "material.h"
+
+/**
+ * Geometry file for scenes that don't fit in memory. Layout:
+ *
+ *   geom_header | paged_material[] | page_entry[] | top-level flat_node[] | pages
+ *
+ * Each page is one bottom-level subtree: its flat BVH nodes followed by its
+ * spheres, padded to page_size so pages can be mapped into fixed device
+ * slots. The top-level BVH has one leaf per page. Only the sections before
+ * the pages are read at load time; page_cache pulls pages in on demand.
+ */
+#define GEOM_MAGIC 0x4d4f4547u
+#define GEOM_VERSION 1
+#define GEOM_ALIGN 4096
+
+struct geom_header {
+    unsigned magic;
+    int version;
+    int page_count;
+    int page_size;
+    int material_count;
+    int top_node_count;
+    unsigned long long pages_offset;
+};
+
+// Interior nodes (count == 0) have their left child at index + 1 and their
+// right child at offset. Leaves cover items [offset, offset + count).
+struct flat_node {
+    float bmin[3];
+    int offset;
+    float bmax[3];
+    int count;
+};
+
+struct page_entry {
+    float bmin[3];
+    int node_count;
+    float bmax[3];
+    int prim_count;
+};
+
+struct paged_sphere {
+    float center[3];
+    float radius;
+    int material;
+};
+
+// type is a material_type; param is the metal fuzz or dielectric index.
+struct paged_material {
+    int type;
+    float albedo[3];
+    float param;
+};
+
+struct flat_box {
+    float lo[3];
+    float hi[3];
+};
+
+inline flat_box sphere_box(const paged_sphere& s) {
+    flat_box b;
+    for (int a = 0; a < 3; ++a) {
+        b.lo[a] = s.center[a] - s.radius;
+        b.hi[a] = s.center[a] + s.radius;
+    }
+    return b;
+}
+
+inline void grow_box(flat_box& b, const flat_box& o) {
+    for (int a = 0; a < 3; ++a) {
+        b.lo[a] = std::min(b.lo[a], o.lo[a]);
+        b.hi[a] = std::max(b.hi[a], o.hi[a]);
+    }
+}
+
+inline flat_box empty_box() {
+    flat_box b;
+    for (int a = 0; a < 3; ++a) {
+        b.lo[a] = FLT_MAX;
+        b.hi[a] = -FLT_MAX;
+    }
+    return b;
+}
+
+// Median split on the widest centroid axis. order[first, first + n) is
+// permuted so every leaf covers a contiguous range of it.
+inline int build_flat_bvh(const std::vector<flat_box>& boxes, std::vector<int>& order, int first, int n, int max_leaf, std::vector<flat_node>& nodes) {
+    int index = int(nodes.size());
+    nodes.push_back(flat_node());
+    flat_box bounds = empty_box();
+    flat_box centroids = empty_box();
+    for (int i = first; i < first + n; ++i) {
+        const flat_box& b = boxes[order[i]];
+        grow_box(bounds, b);
+        flat_box c;
+        for (int a = 0; a < 3; ++a) c.lo[a] = c.hi[a] = 0.5f * (b.lo[a] + b.hi[a]);
+        grow_box(centroids, c);
+    }
+
+    flat_node node;
+    for (int a = 0; a < 3; ++a) {
+        node.bmin[a] = bounds.lo[a];
+        node.bmax[a] = bounds.hi[a];
+    }
+    if (n <= max_leaf) {
+        node.offset = first;
+        node.count = n;
+        nodes[index] = node;
+        return index;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+        if (centroids.hi[a] - centroids.lo[a] > centroids.hi[axis] - centroids.lo[axis]) axis = a;
+    }
+    int half = n / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + n,
+        [&](int l, int r) { return boxes[l].lo[axis] + boxes[l].hi[axis] < boxes[r].lo[axis] + boxes[r].hi[axis]; });
+    build_flat_bvh(boxes, order, first, half, max_leaf, nodes);
+    node.offset = build_flat_bvh(boxes, order, first + half, n - half, max_leaf, nodes);
+    node.count = 0;
+    nodes[index] = node;
+    return index;
+}
+
+/**
+ * Writes a field of count spheres on a jittered grid, prims_per_page per
+ * page. Used to produce test scenes of any size for the paged renderer.
+ */
+inline void write_sphere_field(const std::string& path, long long count, int prims_per_page, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uni(0.f, 1.f);
+
+    std::vector<paged_material> materials;
+    for (int i = 0; i < 6; ++i) {
+        materials.push_back({ MATERIAL_LAMBERTIAN, { uni(rng) * uni(rng), uni(rng) * uni(rng), uni(rng) * uni(rng) }, 0.f });
+    }
+    materials.push_back({ MATERIAL_METAL, { 0.7f, 0.6f, 0.5f }, 0.1f });
+    materials.push_back({ MATERIAL_DIELECTRIC, { 1.f, 1.f, 1.f }, 1.5f });
+
+    long long side = (long long)ceil(sqrt(double(count)));
+    std::vector<paged_sphere> spheres(count);
+    std::vector<flat_box> boxes(count);
+    for (long long i = 0; i < count; ++i) {
+        paged_sphere& s = spheres[i];
+        s.radius = 0.15f + 0.2f * uni(rng);
+        s.center[0] = float(i % side - side / 2) + 0.5f * uni(rng);
+        s.center[1] = s.radius;
+        s.center[2] = float(i / side - side / 2) + 0.5f * uni(rng);
+        float choose_mat = uni(rng);
+        s.material = choose_mat < 0.85f ? int(uni(rng) * 5.99f) : choose_mat < 0.97f ? 6 : 7;
+        boxes[i] = sphere_box(s);
+    }
+
+    // The top-level BVH's leaves are the pages.
+    std::vector<int> order(count);
+    for (long long i = 0; i < count; ++i) order[i] = int(i);
+    std::vector<flat_node> top;
+    build_flat_bvh(boxes, order, 0, int(count), prims_per_page, top);
+
+    std::vector<page_entry> pages;
+    std::vector<std::vector<char>> blobs;
+    size_t largest = 0;
+    for (flat_node& leaf : top) {
+        if (leaf.count == 0) continue;
+        std::vector<int> local(leaf.count);
+        for (int i = 0; i < leaf.count; ++i) local[i] = order[leaf.offset + i];
+        std::vector<int> local_order(leaf.count);
+        std::vector<flat_box> local_boxes(leaf.count);
+        for (int i = 0; i < leaf.count; ++i) {
+            local_order[i] = i;
+            local_boxes[i] = boxes[local[i]];
+        }
+        std::vector<flat_node> nodes;
+        build_flat_bvh(local_boxes, local_order, 0, leaf.count, 4, nodes);
+
+        page_entry entry;
+        for (int a = 0; a < 3; ++a) {
+            entry.bmin[a] = leaf.bmin[a];
+            entry.bmax[a] = leaf.bmax[a];
+        }
+        entry.node_count = int(nodes.size());
+        entry.prim_count = leaf.count;
+        std::vector<char> blob(nodes.size() * sizeof(flat_node) + leaf.count * sizeof(paged_sphere));
+        memcpy(blob.data(), nodes.data(), nodes.size() * sizeof(flat_node));
+        paged_sphere* prims = (paged_sphere*)(blob.data() + nodes.size() * sizeof(flat_node));
+        for (int i = 0; i < leaf.count; ++i) prims[i] = spheres[local[local_order[i]]];
+        largest = std::max(largest, blob.size());
+
+        leaf.offset = int(pages.size());
+        leaf.count = 1;
+        pages.push_back(entry);
+        blobs.push_back(std::move(blob));
+    }
+
+    geom_header header;
+    header.magic = GEOM_MAGIC;
+    header.version = GEOM_VERSION;
+    header.page_count = int(pages.size());
+    header.page_size = int((largest + GEOM_ALIGN - 1) / GEOM_ALIGN * GEOM_ALIGN);
+    header.material_count = int(materials.size());
+    header.top_node_count = int(top.size());
+    size_t table_bytes = sizeof(geom_header) + materials.size() * sizeof(paged_material)
+        + pages.size() * sizeof(page_entry) + top.size() * sizeof(flat_node);
+    header.pages_offset = (table_bytes + GEOM_ALIGN - 1) / GEOM_ALIGN * GEOM_ALIGN;
+
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)materials.data(), materials.size() * sizeof(paged_material));
+    out.write((const char*)pages.data(), pages.size() * sizeof(page_entry));
+    out.write((const char*)top.data(), top.size() * sizeof(flat_node));
+    std::vector<char> pad(header.pages_offset - table_bytes, 0);
+    out.write(pad.data(), pad.size());
+    for (const std::vector<char>& blob : blobs) {
+        out.write(blob.data(), blob.size());
+        pad.assign(header.page_size - blob.size(), 0);
+        out.write(pad.data(), pad.size());
+    }
+    if (!out) {
+        std::cerr << "failed to write " << path << "\n";
+        exit(1);
+    }
+    std::cerr << "wrote " << count << " spheres in " << header.page_count << " pages of "
+        << header.page_size / 1024 << " KB to " << path << "\n";
+}
+
+/**
+ * Read-only mapping of a geometry file. Pages are only touched when
+ * page_cache copies them to the device, so the OS pages the file in and
+ * out as needed.
+ */
+class geometry_store {
+public:
+    geometry_store(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) fail(path);
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        file_size = size_t(size.QuadPart);
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) fail(path);
+        base = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (base == NULL) fail(path);
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) fail(path);
+        struct stat st;
+        fstat(fd, &st);
+        file_size = size_t(st.st_size);
+        void* p = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) fail(path);
+        base = (const char*)p;
+#endif
+        if (file_size < sizeof(geom_header) || header().magic != GEOM_MAGIC || header().version != GEOM_VERSION) {
+            std::cerr << path << " is not a geometry file\n";
+            exit(1);
+        }
+    }
+    ~geometry_store() {
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap((void*)base, file_size);
+        close(fd);
+#endif
+    }
+
+    const geom_header& header() const { return *(const geom_header*)base; }
+    const paged_material* materials() const {
+        return (const paged_material*)(base + sizeof(geom_header));
+    }
+    const page_entry* pages() const {
+        return (const page_entry*)(materials() + header().material_count);
+    }
+    const flat_node* top_nodes() const {
+        return (const flat_node*)(pages() + header().page_count);
+    }
+    const char* page(int i) const {
+        return base + header().pages_offset + size_t(i) * header().page_size;
+    }
+
+    size_t file_size;
+
+private:
+    void fail(const std::string& path) {
+        std::cerr << "can't map " << path << "\n";
+        exit(1);
+    }
+
+    const char* base;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef GUIDE_TREE_H
+#define GUIDE_TREE_H
+
+#include <curand_kernel.h>
+
+#include "vec3.h"
+
+// Diffuse vertices per path kept for training the guide.
+#define GUIDE_MAX_VERTICES 16
+
+/**
+ * Device side of the path guiding SD tree (Müller et al., "Practical Path
+ * Guiding for Efficient Light-Transport Simulation", 2017): a binary tree
+ * over the scene bounds whose leaves each hold a quadtree over directions.
+ * Directions map to the unit square by cylindrical coordinates, which
+ * preserve area, so a quadtree cell's share of the energy over its share of
+ * the area is the density there.
+ *
+ * Spatial inner nodes halve their box along axis; their children are
+ * child and child + 1. A leaf (axis < 0) keeps the index of its quadtree's
+ * root node in child.
+ */
+struct guide_spatial_node {
+    int axis;
+    int child;
+};
+
+// energy[q] is the radiance recorded in quadrant q, children included.
+// child[q] is 0 when quadrant q isn't subdivided.
+struct guide_quad_node {
+    float energy[4];
+    int child[4];
+};
+
+struct guide_tree {
+    vec3 lo, hi;
+    const guide_spatial_node* spatial;
+    guide_quad_node* quads;
+    // Records that landed in each spatial leaf, indexed like spatial.
+    unsigned* samples;
+};
+
+__device__ inline void guide_square(const vec3& d, float& x, float& y) {
+    vec3 u = unit_vector(d);
+    x = fminf(fmaxf(0.5f * (u.z() + 1.f), 0.f), 0.99999f);
+    float phi = atan2f(u.y(), u.x());
+    if (phi < 0.f) phi += 2.f * float(M_PI);
+    y = fminf(phi / (2.f * float(M_PI)), 0.99999f);
+}
+
+__device__ inline vec3 guide_direction(float x, float y) {
+    float cos_theta = 2.f * x - 1.f;
+    float sin_theta = sqrtf(fmaxf(0.f, 1.f - cos_theta * cos_theta));
+    float phi = 2.f * float(M_PI) * y;
+    return vec3(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+}
+
+// Quadrant of (x, y), which is then rescaled into that quadrant.
+__device__ inline int guide_quadrant(float& x, float& y) {
+    int q = 0;
+    x *= 2.f;
+    y *= 2.f;
+    if (x >= 1.f) { q |= 1; x -= 1.f; }
+    if (y >= 1.f) { q |= 2; y -= 1.f; }
+    return q;
+}
+
+__device__ inline float guide_node_energy(const guide_quad_node& n) {
+    return n.energy[0] + n.energy[1] + n.energy[2] + n.energy[3];
+}
+
+// Spatial leaf containing p.
+__device__ int guide_leaf(const guide_tree& t, const vec3& p) {
+    vec3 lo = t.lo, hi = t.hi;
+    int node = 0;
+    while (t.spatial[node].axis >= 0) {
+        int a = t.spatial[node].axis;
+        float mid = 0.5f * (lo[a] + hi[a]);
+        if (p[a] < mid) {
+            hi[a] = mid;
+            node = t.spatial[node].child;
+        }
+        else {
+            lo[a] = mid;
+            node = t.spatial[node].child + 1;
+        }
+    }
+    return node;
+}
+
+// Solid angle density of direction d under the quadtree at root.
+__device__ float guide_pdf(const guide_tree& t, int root, const vec3& d) {
+    float x, y;
+    guide_square(d, x, y);
+    const guide_quad_node* n = &t.quads[root];
+    float p = 1.f;
+    for (;;) {
+        float sum = guide_node_energy(*n);
+        if (sum <= 0.f) return 0.f;
+        int q = guide_quadrant(x, y);
+        p *= 4.f * n->energy[q] / sum;
+        if (p <= 0.f || n->child[q] == 0) break;
+        n = &t.quads[n->child[q]];
+    }
+    return p / (4.f * float(M_PI));
+}
+
+// Picks a direction in proportion to the quadtree at root, which must hold
+// some energy, and returns its density.
+__device__ float guide_sample(const guide_tree& t, int root, curandState* state, vec3& d) {
+    const guide_quad_node* n = &t.quads[root];
+    float ox = 0.f, oy = 0.f, size = 1.f, p = 1.f;
+    for (;;) {
+        float sum = guide_node_energy(*n);
+        float u = curand_uniform(state) * sum;
+        int q = 0;
+        while (q < 3 && (u >= n->energy[q] || n->energy[q] <= 0.f)) {
+            u -= n->energy[q];
+            ++q;
+        }
+        p *= 4.f * n->energy[q] / sum;
+        size *= 0.5f;
+        ox += (q & 1) ? size : 0.f;
+        oy += (q & 2) ? size : 0.f;
+        if (n->child[q] == 0) break;
+        n = &t.quads[n->child[q]];
+    }
+    d = guide_direction(ox + curand_uniform(state) * size, oy + curand_uniform(state) * size);
+    return p / (4.f * float(M_PI));
+}
+
+// Adds value to every level of the quadtree cell d falls in, at p.
+__device__ void guide_record(const guide_tree& t, const vec3& p, const vec3& d, float value) {
+    int leaf = guide_leaf(t, p);
+    atomicAdd(&t.samples[leaf], 1u);
+    float x, y;
+    guide_square(d, x, y);
+    guide_quad_node* n = &t.quads[t.spatial[leaf].child];
+    for (;;) {
+        int q = guide_quadrant(x, y);
+        atomicAdd(&n->energy[q], value);
+        if (n->child[q] == 0) break;
+        n = &t.quads[n->child[q]];
+    }
+}
+
+/**
+ * A diffuse vertex of the current path: where it was, the direction it
+ * sampled with density pdf, and the radiance and throughput the path had
+ * just after it. Whatever the path collects later, divided by that
+ * throughput, estimates the radiance arriving along dir.
+ */
+struct guide_vertex {
+    vec3 p;
+    vec3 dir;
+    vec3 radiance;
+    vec3 throughput;
+    float pdf;
+};
+
+// Per-thread guiding state passed to path_bounce().
+struct guide_path {
+    // Distribution learned so far, or null before there is one.
+    const guide_tree* sampling;
+    // Distribution being trained, or null when not training.
+    const guide_tree* building;
+    // Probability of sampling the guide rather than the BSDF.
+    float fraction;
+    int count;
+    guide_vertex vertex[GUIDE_MAX_VERTICES];
+};
+
+// Quadtree root at p, or -1 where there's nothing to guide with.
+__device__ int guide_lookup(const guide_path& g, const vec3& p) {
+    if (g.sampling == nullptr) return -1;
+    int root = g.sampling->spatial[guide_leaf(*g.sampling, p)].child;
+    return guide_node_energy(g.sampling->quads[root]) > 0.f ? root : -1;
+}
+
+__device__ float guide_mix_pdf(const guide_path& g, int root, float bsdf_pdf, const vec3& d) {
+    return g.fraction * guide_pdf(*g.sampling, root, d) + (1.f - g.fraction) * bsdf_pdf;
+}
+
+// Splats what the finished path found behind each of its vertices into the
+// tree being built, weighted by the inverse of the density it was sampled
+// with.
+__device__ void guide_train(const guide_path& g, const vec3& radiance) {
+    for (int k = 0; k < g.count; ++k) {
+        const guide_vertex& v = g.vertex[k];
+        vec3 behind = radiance - v.radiance;
+        float value = 0.f;
+        for (int c = 0; c < 3; ++c) {
+            if (v.throughput[c] > 0.f) value += behind[c] / v.throughput[c];
+        }
+        value /= 3.f * v.pdf;
+        if (value > 0.f && isfinite(value)) guide_record(*g.building, v.p, v.dir, value);
+    }
+}
+
+#endif
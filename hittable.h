@@ -3,7 +3,10 @@
 
 #include "ray.h"
 #include "aabb.h"
+#include "memory_budget.h"
 class material;
+class hittable;
+class bvhNode;
 
 struct hit_record
 {
@@ -13,10 +16,29 @@ struct hit_record
     //float u;
     //float v;
     material* mat_ptr;
+    const hittable* obj;
+};
+
+/**
+ * Spatial, directional and power bounds of an emitter (or a cluster of
+ * emitters), used by light_bvh to estimate a light's contribution at a
+ * shading point. Normals lie within acos(cos_theta_o) of axis and emit up to
+ * acos(cos_theta_e) beyond that.
+ */
+struct light_bounds {
+    aabb box;
+    vec3 axis;
+    float cos_theta_o;
+    float cos_theta_e;
+    float power;
+    bool two_sided;
 };
 
 class hittable {
 public:
+    DEVICE_MEMORY_CATEGORY(MEM_GEOMETRY)
+
+    __device__ virtual ~hittable() {}
     __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
     __device__ virtual double pdf_value(const vec3& o, const vec3& v) const {
@@ -26,16 +48,58 @@ public:
     __device__ virtual vec3 random(const vec3& o, curandState* state) const {
         return vec3(1, 0, 0);
     }
+
+    // Emitters return their bounds so light_bvh can importance sample them.
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const {
+        return false;
+    }
+
+    // A point spread uniformly over an emitter's surface, for tracing light
+    // out of it: rec gets the point, the normal of the side it leaves from,
+    // the material and the object, pdf the area density. Two sided emitters
+    // pick the side at random, which halves pdf.
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const {
+        return false;
+    }
+
+    // Groups pick one of their members; a single emitter picks itself.
+    __device__ virtual const hittable* sample_emitter(float u, float& pmf) const {
+        pmf = 1.f;
+        return this;
+    }
+
+    // Feature flags (render_features.h) render() needs to draw this object.
+    __device__ virtual unsigned features() const {
+        return 0;
+    }
+    __device__ virtual void set_light_id(int id) {
+        light_id = id;
+    }
+    // Binary BVH nodes return themselves, for collapse_bvh() (wide_bvh.h).
+    __device__ virtual const bvhNode* as_bvh_node() const {
+        return nullptr;
+    }
+
+    // Leaf index in the scene's light_bvh, and the probability of picking
+    // this primitive once that leaf is chosen. -1 for non-emitters.
+    int light_id = -1;
+    float light_pmf = 1.f;
 };
 
 class rotate_y : public hittable {
 public:
     __device__ rotate_y(hittable* p, float angle);
+    __device__ virtual ~rotate_y() {
+        delete ptr;
+    }
     __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override {
         box = bbox;
         return hasbox;
     }
+    __device__ virtual unsigned features() const override {
+        return ptr->features();
+    }
     hittable* ptr;
     float sin_theta;
     float cos_theta;
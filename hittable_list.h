@@ -9,6 +9,11 @@ public:
     __device__ hittable_list(hittable** l, int n) { list = l; list_size = n; }
     __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const;
+    __device__ virtual unsigned features() const {
+        unsigned f = 0;
+        for (int i = 0; i < list_size; i++) f |= list[i]->features();
+        return f;
+    }
     hittable** list;
     int list_size;
 };
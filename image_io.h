@@ -0,0 +1,200 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "vec3.h"
+
+// fb is gamma corrected, bottom row first. Each of comments becomes a
+// "# " line of the header.
+inline bool write_ppm(const std::string& path, const vec3* fb, int nx, int ny, const std::vector<std::string>& comments = {}) {
+    std::ofstream image(path);
+    image << "P3\n";
+    for (const std::string& c : comments) image << "# " << c << "\n";
+    image << nx << " " << ny << "\n255\n";
+    for (int j = ny - 1; j >= 0; j--) {
+        for (int i = 0; i < nx; i++) {
+            size_t pixel_index = j * nx + i;
+            int ir = int(255.99 * fb[pixel_index].r());
+            int ig = int(255.99 * fb[pixel_index].g());
+            int ib = int(255.99 * fb[pixel_index].b());
+            image << ir << " " << ig << " " << ib << "\n";
+        }
+    }
+    return bool(image);
+}
+
+// Linear float RGB (PFM), bottom row first like fb, so references keep
+// their full range.
+inline bool write_pfm(const std::string& path, const vec3* fb, int nx, int ny) {
+    std::ofstream image(path, std::ios::binary);
+    image << "PF\n" << nx << " " << ny << "\n-1.0\n";
+    for (size_t p = 0; p < size_t(nx) * ny; p++) {
+        float rgb[3] = { fb[p].r(), fb[p].g(), fb[p].b() };
+        image.write((const char*)rgb, sizeof(rgb));
+    }
+    return bool(image);
+}
+
+// Reads a little-endian PFM as written by write_pfm().
+inline bool read_pfm(const std::string& path, std::vector<vec3>& fb, int& nx, int& ny) {
+    std::ifstream image(path, std::ios::binary);
+    std::string magic;
+    float scale;
+    if (!(image >> magic >> nx >> ny >> scale) || magic != "PF" || nx <= 0 || ny <= 0 || scale >= 0.f) return false;
+    image.get();
+    fb.resize(size_t(nx) * ny);
+    for (size_t p = 0; p < fb.size(); p++) {
+        float rgb[3];
+        if (!image.read((char*)rgb, sizeof(rgb))) return false;
+        fb[p] = vec3(rgb[0], rgb[1], rgb[2]);
+    }
+    return true;
+}
+
+// Skips whitespace and "#" comment lines in a PPM header.
+inline std::istream& skip_ppm_comments(std::istream& in) {
+    while (in >> std::ws && in.peek() == '#') in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    return in;
+}
+
+// Reads a P3 image as written by write_ppm(), scaled to [0, 1].
+inline bool read_ppm(const std::string& path, std::vector<vec3>& fb, int& nx, int& ny) {
+    std::ifstream image(path);
+    std::string magic;
+    int max_value;
+    if (!(image >> magic >> skip_ppm_comments >> nx >> ny >> max_value) || magic != "P3" || nx <= 0 || ny <= 0 || max_value <= 0) return false;
+    fb.resize(size_t(nx) * ny);
+    for (int j = ny - 1; j >= 0; j--) {
+        for (int i = 0; i < nx; i++) {
+            int r, g, b;
+            if (!(image >> r >> g >> b)) return false;
+            fb[size_t(j) * nx + i] = vec3(r, g, b) / float(max_value);
+        }
+    }
+    return true;
+}
+
+/**
+ * Streams an 8 bit RGB image into a tiled TIFF a tile at a time, in any
+ * order: each tile is appended as it arrives and the directory mapping
+ * tile numbers to file offsets is written by close(), so only the offset
+ * table is held in memory. Tile (0, 0) is the top left one. Files that
+ * would reach 4 GB are written as BigTIFF, which has 64 bit offsets.
+ * TIFF wants tile_size to be a multiple of 16.
+ */
+class tiff_tile_writer {
+public:
+    tiff_tile_writer(const std::string& path, int nx, int ny, int tile_size)
+        : file(path, std::ios::binary), nx(nx), ny(ny), tile_size(tile_size), across((nx + tile_size - 1) / tile_size),
+        offsets(size_t(across) * ((ny + tile_size - 1) / tile_size), 0), bytes(size_t(tile_size) * tile_size * 3) {
+        big = uint64_t(offsets.size()) * (bytes + 8) + 4096 > 0xffffffffull;
+        put(2, 0x4949);
+        if (big) {
+            put(2, 43);
+            put(2, 8);
+            put(2, 0);
+        }
+        else put(2, 42);
+        // The directory offset, filled in by close().
+        put(big ? 8 : 4, 0);
+    }
+    ~tiff_tile_writer() { close(); }
+
+    // tile is tile_size x tile_size gamma corrected pixels, top row first;
+    // the parts past the image's right and bottom edges are ignored.
+    bool write_tile(int tx, int ty, const vec3* tile) {
+        std::vector<unsigned char> rgb(bytes, 0);
+        int w = std::min(tile_size, nx - tx * tile_size);
+        int h = std::min(tile_size, ny - ty * tile_size);
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const vec3& c = tile[y * tile_size + x];
+                for (int k = 0; k < 3; ++k) rgb[(y * tile_size + x) * 3 + k] = (unsigned char)std::max(0, std::min(255, int(255.99 * c[k])));
+            }
+        }
+        offsets[size_t(ty) * across + tx] = uint64_t(file.tellp());
+        file.write((const char*)rgb.data(), rgb.size());
+        return bool(file);
+    }
+
+    // Writes the directory after the tiles and its offset into the header.
+    bool close() {
+        if (!file.is_open()) return false;
+        struct field {
+            uint16_t tag, type;
+            std::vector<uint64_t> values;
+        };
+        uint16_t offset_type = big ? 16 : 4;
+        const field fields[] = {
+            { 256, 4, { uint64_t(nx) } },           // ImageWidth
+            { 257, 4, { uint64_t(ny) } },           // ImageLength
+            { 258, 3, { 8, 8, 8 } },                // BitsPerSample
+            { 259, 3, { 1 } },                      // Compression: none
+            { 262, 3, { 2 } },                      // PhotometricInterpretation: RGB
+            { 277, 3, { 3 } },                      // SamplesPerPixel
+            { 284, 3, { 1 } },                      // PlanarConfiguration: interleaved
+            { 322, 4, { uint64_t(tile_size) } },    // TileWidth
+            { 323, 4, { uint64_t(tile_size) } },    // TileLength
+            { 324, offset_type, offsets },          // TileOffsets
+            { 325, offset_type, std::vector<uint64_t>(offsets.size(), bytes) },   // TileByteCounts
+        };
+        const int count = sizeof(fields) / sizeof(fields[0]);
+        int word = big ? 8 : 4;
+        if (file.tellp() & 1) file.put(0);
+        uint64_t directory = uint64_t(file.tellp());
+
+        // Values that don't fit in an entry follow the directory.
+        uint64_t data = directory + (big ? 8 + 20 * count + 8 : 2 + 12 * count + 4);
+        put(big ? 8 : 2, count);
+        for (const field& f : fields) {
+            int size = f.type == 3 ? 2 : f.type == 4 ? 4 : 8;
+            uint64_t total = uint64_t(size) * f.values.size();
+            put(2, f.tag);
+            put(2, f.type);
+            put(word, f.values.size());
+            if (total <= uint64_t(word)) {
+                for (uint64_t v : f.values) put(size, v);
+                put(int(word - total), 0);
+            }
+            else {
+                put(word, data);
+                data += (total + 1) & ~1ull;
+            }
+        }
+        put(word, 0);
+        for (const field& f : fields) {
+            int size = f.type == 3 ? 2 : f.type == 4 ? 4 : 8;
+            uint64_t total = uint64_t(size) * f.values.size();
+            if (total <= uint64_t(word)) continue;
+            for (uint64_t v : f.values) put(size, v);
+            if (total & 1) file.put(0);
+        }
+        file.seekp(big ? 8 : 4);
+        put(word, directory);
+        bool ok = bool(file);
+        file.close();
+        return ok;
+    }
+
+    bool is_open() const { return file.is_open() && bool(file); }
+
+private:
+    // Little endian, as the header's "II" says.
+    void put(int size, uint64_t v) {
+        for (int b = 0; b < size; ++b) file.put(char((v >> (8 * b)) & 0xff));
+    }
+
+    std::ofstream file;
+    int nx, ny, tile_size, across;
+    std::vector<uint64_t> offsets;
+    size_t bytes;
+    bool big;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef IMAGE_METRICS_H
+#define IMAGE_METRICS_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "vec3.h"
+
+// Error of a linear image against a linear reference of the same size.
+struct image_error {
+    double rmse;
+    double relmse;
+    double flip;
+};
+
+// A gamma corrected frame buffer the host can read, as linear radiance.
+inline std::vector<vec3> linear_image(const vec3* fb, int num_pixels) {
+    std::vector<vec3> image(fb, fb + num_pixels);
+    for (vec3& p : image) p = p * p;
+    return image;
+}
+
+inline double image_rmse(const std::vector<vec3>& image, const std::vector<vec3>& reference) {
+    double sum = 0.0;
+    for (size_t p = 0; p < image.size(); ++p) {
+        for (int c = 0; c < 3; ++c) {
+            double d = double(image[p][c]) - reference[p][c];
+            sum += d * d;
+        }
+    }
+    return std::sqrt(sum / (3.0 * image.size()));
+}
+
+// Squared error relative to the reference's own brightness, so dark and
+// bright regions count alike; epsilon keeps black pixels finite.
+inline double image_relmse(const std::vector<vec3>& image, const std::vector<vec3>& reference, double epsilon = 0.01) {
+    double sum = 0.0;
+    for (size_t p = 0; p < image.size(); ++p) {
+        for (int c = 0; c < 3; ++c) {
+            double r = reference[p][c];
+            double d = double(image[p][c]) - r;
+            sum += d * d / (r * r + epsilon);
+        }
+    }
+    return sum / (3.0 * image.size());
+}
+
+// Displayed as main() writes it (gamma 2, clamped), then CIELAB.
+inline vec3 display_lab(const vec3& linear) {
+    float rgb[3];
+    for (int c = 0; c < 3; ++c) {
+        float shown = fminf(sqrtf(fmaxf(linear[c], 0.f)), 1.f);
+        rgb[c] = shown <= 0.04045f ? shown / 12.92f : powf((shown + 0.055f) / 1.055f, 2.4f);
+    }
+    float x = (0.4124f * rgb[0] + 0.3576f * rgb[1] + 0.1805f * rgb[2]) / 0.9505f;
+    float y = 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+    float z = (0.0193f * rgb[0] + 0.1192f * rgb[1] + 0.9505f * rgb[2]) / 1.089f;
+    auto f = [](float t) { return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.f / 116.f; };
+    float fx = f(x), fy = f(y), fz = f(z);
+    return vec3(116.f * fy - 16.f, 500.f * (fx - fy), 200.f * (fy - fz));
+}
+
+// 3x3 binomial blur, edges clamped.
+inline std::vector<vec3> blur3(const std::vector<vec3>& in, int nx, int ny) {
+    static const float w[3] = { 0.25f, 0.5f, 0.25f };
+    std::vector<vec3> out(in.size());
+    for (int j = 0; j < ny; ++j) {
+        for (int i = 0; i < nx; ++i) {
+            vec3 sum(0, 0, 0);
+            for (int dj = -1; dj <= 1; ++dj) {
+                for (int di = -1; di <= 1; ++di) {
+                    int x = std::min(std::max(i + di, 0), nx - 1);
+                    int y = std::min(std::max(j + dj, 0), ny - 1);
+                    sum += w[di + 1] * w[dj + 1] * in[size_t(y) * nx + x];
+                }
+            }
+            out[size_t(j) * nx + i] = sum;
+        }
+    }
+    return out;
+}
+
+/**
+ * A simplified take on FLIP (Andersson et al., "FLIP: A Difference
+ * Evaluator for Alternating Images", 2020), not the reference
+ * implementation: both images are displayed, converted to CIELAB and
+ * blurred slightly as the eye would at normal viewing distance. The color
+ * error is the HyAB distance, and the feature error the difference in
+ * lightness gradients, which raises the color error where edges appear or
+ * vanish. Per-pixel errors lie in [0, 1]; this returns their mean.
+ */
+inline double image_flip(const std::vector<vec3>& image, const std::vector<vec3>& reference, int nx, int ny) {
+    std::vector<vec3> a(image.size()), b(reference.size());
+    for (size_t p = 0; p < image.size(); ++p) {
+        a[p] = display_lab(image[p]);
+        b[p] = display_lab(reference[p]);
+    }
+    a = blur3(a, nx, ny);
+    b = blur3(b, nx, ny);
+    auto gradient = [nx, ny](const std::vector<vec3>& lab, int i, int j) {
+        auto at = [&](int x, int y) {
+            return lab[size_t(std::min(std::max(y, 0), ny - 1)) * nx + std::min(std::max(x, 0), nx - 1)][0] / 100.f;
+        };
+        float gx = at(i + 1, j - 1) + 2.f * at(i + 1, j) + at(i + 1, j + 1) - at(i - 1, j - 1) - 2.f * at(i - 1, j) - at(i - 1, j + 1);
+        float gy = at(i - 1, j + 1) + 2.f * at(i, j + 1) + at(i + 1, j + 1) - at(i - 1, j - 1) - 2.f * at(i, j - 1) - at(i + 1, j - 1);
+        return sqrtf(gx * gx + gy * gy) / 4.f;
+    };
+    double sum = 0.0;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = 0; i < nx; ++i) {
+            size_t p = size_t(j) * nx + i;
+            float dl = fabsf(a[p][0] - b[p][0]);
+            float dab = sqrtf((a[p][1] - b[p][1]) * (a[p][1] - b[p][1]) + (a[p][2] - b[p][2]) * (a[p][2] - b[p][2]));
+            // HyAB distance; 80 or more counts as completely different.
+            float color = fminf(1.f, powf((dl + dab) / 80.f, 0.7f));
+            float feature = fminf(1.f, fabsf(gradient(a, i, j) - gradient(b, i, j)));
+            sum += powf(color, 1.f - feature);
+        }
+    }
+    return sum / (double(nx) * ny);
+}
+
+inline image_error measure_error(const std::vector<vec3>& image, const std::vector<vec3>& reference, int nx, int ny) {
+    return { image_rmse(image, reference), image_relmse(image, reference), image_flip(image, reference, nx, ny) };
+}
+
+#endif
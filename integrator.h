@@ -0,0 +1,397 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <curand_kernel.h>
+
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "light.h"
+#include "medium.h"
+#include "guide_tree.h"
+#include "radiance_cache.h"
+#include "reservoir.h"
+#include "stats.h"
+
+#define MAX_DEPTH 50
+
+// Medium boundaries a ray may pass through between two vertices before it
+// is treated as blocked.
+#define MEDIUM_MAX_CROSSINGS 8
+
+// Kernels are instantiated for these path depths; a requested depth is
+// rounded up to the next one, and paths stop at the requested depth itself
+// (path_state::max_depth).
+__host__ __device__ inline int depth_bucket(int depth) {
+    return depth <= 8 ? 8 : depth <= 16 ? 16 : MAX_DEPTH;
+}
+
+__device__ float power_heuristic(float pdf_a, float pdf_b) {
+    return (pdf_a * pdf_a) / (pdf_a * pdf_a + pdf_b * pdf_b);
+}
+
+/**
+ * Everything a path carries from one vertex to the next, so the same bounce
+ * can run inside the per-pixel loop of color() or one wavefront at a time.
+ */
+struct path_state {
+    ray r;
+    vec3 attenuation;
+    vec3 radiance;
+    // Vertex r left from; prev_pdf is 0 for camera and specular rays.
+    vec3 prev_p;
+    vec3 prev_n;
+    float prev_pdf;
+    // Medium the ray is travelling through, if any. Paths start outside
+    // every medium.
+    const medium* current_medium;
+    int depth;
+    // Requested path depth; the DEPTH a kernel is instantiated for only
+    // bounds it from above.
+    int max_depth;
+    int pixel;
+    bool alive;
+    // Set when the path ran into geometry that isn't resident (see
+    // paged_geometry); its radiance is incomplete and must be discarded.
+    bool faulted;
+    // Whether the first hit was diffuse and every vertex since a dielectric.
+    // With skip_caustics set, light reached that way past at least one
+    // dielectric is left out; light tracing adds it (light_tracing.h).
+    bool caustic;
+    bool skip_caustics;
+    // Set once the first vertex's direct light is left to a reservoir
+    // (restir_render.h); the next vertex then leaves out the light it sees.
+    bool direct_resampled;
+};
+
+__device__ void path_begin(path_state& ps, const ray& r, int pixel, int max_depth = MAX_DEPTH) {
+    ps.r = r;
+    ps.attenuation = vec3(1.f, 1.f, 1.f);
+    ps.radiance = vec3(0.f, 0.f, 0.f);
+    ps.prev_pdf = 0.f;
+    ps.current_medium = nullptr;
+    ps.depth = 0;
+    ps.max_depth = max_depth;
+    ps.pixel = pixel;
+    ps.alive = true;
+    ps.faulted = false;
+    ps.caustic = false;
+    ps.skip_caustics = false;
+    ps.direct_resampled = false;
+}
+
+__device__ bool caustic_skipped(const path_state& ps) {
+    return ps.skip_caustics && ps.caustic && ps.depth > 2;
+}
+
+__device__ bool direct_skipped(const path_state& ps) {
+    return ps.direct_resampled && ps.depth == 2;
+}
+
+// Material calls dispatched on the type tag, so the built in materials are
+// called directly and can be inlined, and dielectric code is only present in
+// kernels built with FEATURE_DIELECTRIC.
+template <unsigned F>
+__device__ bool material_scatter(const material* m, const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* state, float& pdf) {
+    switch (m->type) {
+    case MATERIAL_LAMBERTIAN:
+        return static_cast<const lambertian*>(m)->lambertian::scatter(r_in, rec, attenuation, scattered, state, pdf);
+    case MATERIAL_METAL:
+        return static_cast<const metal*>(m)->metal::scatter(r_in, rec, attenuation, scattered, state, pdf);
+    case MATERIAL_DIELECTRIC:
+        if (F & FEATURE_DIELECTRIC)
+            return static_cast<const dielectric*>(m)->dielectric::scatter(r_in, rec, attenuation, scattered, state, pdf);
+        return false;
+    case MATERIAL_DIFFUSE_LIGHT:
+        return false;
+    default:
+        return m->scatter(r_in, rec, attenuation, scattered, state, pdf);
+    }
+}
+
+__device__ float material_scattering_pdf(const material* m, const ray& r_in, const hit_record& rec, const ray& scattered) {
+    switch (m->type) {
+    case MATERIAL_LAMBERTIAN:
+        return static_cast<const lambertian*>(m)->lambertian::scattering_pdf(r_in, rec, scattered);
+    case MATERIAL_OTHER:
+        return m->scattering_pdf(r_in, rec, scattered);
+    default:
+        return 0.f;
+    }
+}
+
+__device__ vec3 material_emitted(const material* m, const vec3& p) {
+    switch (m->type) {
+    case MATERIAL_DIFFUSE_LIGHT:
+        return static_cast<const diffuse_light*>(m)->emit;
+    case MATERIAL_OTHER:
+        return m->emitted(0., 0., p);
+    default:
+        return vec3(0.f, 0.f, 0.f);
+    }
+}
+
+__device__ bool material_is_specular(const material* m) {
+    switch (m->type) {
+    case MATERIAL_METAL:
+    case MATERIAL_DIELECTRIC:
+        return true;
+    case MATERIAL_OTHER:
+        return m->is_specular();
+    default:
+        return false;
+    }
+}
+
+__device__ bool is_medium_boundary(const hit_record& rec) {
+    return rec.mat_ptr != nullptr && rec.mat_ptr->type == MATERIAL_MEDIUM;
+}
+
+// Casts a shadow ray from inside m (or from outside every medium if m is
+// null) through any medium boundaries in its way, and returns the first
+// surface it hits in rec with the transmittance of the media in between.
+// Returns false if nothing was hit or no light gets through.
+template <unsigned F>
+__device__ bool trace_shadow(ray r, const medium* m, hittable** world, curandState* state, hit_record& rec, float& transmittance) {
+    transmittance = 1.f;
+    for (int crossing = 0;; ++crossing) {
+        STATS_ADD(rays, 1);
+        bool hit = (*world)->hit(r, 0.001f, FLT_MAX, rec);
+        if (!(F & FEATURE_MEDIA)) return hit;
+        bool boundary = hit && is_medium_boundary(rec);
+        const medium* inside = boundary && !medium_entering(rec, r) ? static_cast<const medium*>(rec.obj) : m;
+        if (inside != nullptr) {
+            transmittance *= inside->transmittance(r, hit ? rec.t : FLT_MAX, state);
+            if (transmittance <= 0.f) return false;
+        }
+        if (!boundary || crossing == MEDIUM_MAX_CROSSINGS) return hit;
+        m = medium_entering(rec, r) ? static_cast<const medium*>(rec.obj) : nullptr;
+        r = ray(rec.p, r.direction(), r.time());
+    }
+}
+
+// Whether a shadow ray traced by trace_shadow() reached the light it was
+// sampled towards: the emitter itself, or for the environment, nothing.
+__device__ bool light_arrives(const hittable* light, bool to_environment, bool visible, const hit_record& rec, float transmittance) {
+    if (to_environment) return !visible && transmittance > 0.f;
+    return visible && rec.obj == light;
+}
+
+__device__ vec3 light_emitted(const light_bvh& lights, bool to_environment, const hit_record& rec, const vec3& direction) {
+    if (to_environment) return environment_radiance(lights.environment, direction);
+    return material_emitted(rec.mat_ptr, rec.p);
+}
+
+// A real collision at p inside the path's medium: next event estimation
+// with the phase function in place of the BSDF, then a new direction from
+// the phase function. Media vertices have no normal, so prev_n is zero.
+template <unsigned F>
+__device__ bool medium_scatter(path_state& ps, const vec3& p, hittable** world, light_bvh** lights, curandState* state) {
+    const medium* m = ps.current_medium;
+    vec3 to_light;
+    float light_pdf;
+    bool to_environment;
+    const hittable* light = (*lights)->sample(p, vec3(0.f, 0.f, 0.f), state, to_light, light_pdf, to_environment);
+    if (light != nullptr || to_environment) {
+        ray shadow(p, to_light, ps.r.time());
+        hit_record light_rec;
+        float transmittance;
+        bool visible = trace_shadow<F>(shadow, m, world, state, light_rec, transmittance);
+        if (visible && light_rec.mat_ptr == nullptr) {
+            ps.faulted = true;
+            ps.alive = false;
+            return false;
+        }
+        if (light_arrives(light, to_environment, visible, light_rec, transmittance)) {
+            float phase_pdf = m->phase(ps.r.direction(), to_light);
+            float weight = power_heuristic(light_pdf, phase_pdf);
+            ps.radiance += ps.attenuation * m->albedo * light_emitted(**lights, to_environment, light_rec, to_light)
+                * (transmittance * phase_pdf * weight / light_pdf);
+        }
+    }
+
+    vec3 wi;
+    float pdf = m->sample_phase(ps.r.direction(), state, wi);
+    ps.attenuation *= m->albedo;
+    ps.caustic = false;
+    ps.prev_p = p;
+    ps.prev_n = vec3(0.f, 0.f, 0.f);
+    ps.prev_pdf = pdf;
+    ps.r = ray(p, wi, ps.r.time());
+    return true;
+}
+
+// Next event estimation through the light BVH at every diffuse vertex, MIS
+// combined with the material's own sampling using the power heuristic.
+// Paths that leave the scene pick up the environment map, if there is one,
+// weighted against its sampling the same way.
+// Inside media, distances are sampled by delta tracking and medium
+// boundaries are crossed without counting a bounce. With a guide, diffuse
+// vertices sample its learned distribution or the BSDF, one-sample MIS with
+// the mixture density, and are recorded for training (path_guiding.h).
+// With a radiance cache, diffuse vertices fill it and, after the first, may
+// end the path on it (radiance_cache.h).
+// With a restir_vertex, a first vertex that is diffuse is recorded there
+// and skips next event estimation; its direct light is resampled from
+// reservoirs instead (restir_render.h).
+// Returns false once the path has terminated.
+template <unsigned F = FEATURE_ALL, int DEPTH = MAX_DEPTH>
+__device__ bool path_bounce(path_state& ps, hittable** world, light_bvh** lights, curandState* state, guide_path* guide = nullptr,
+    cache_path* cache = nullptr, restir_vertex* resample = nullptr) {
+    if (!ps.alive || ps.depth >= DEPTH || ps.depth >= ps.max_depth) {
+        ps.alive = false;
+        return false;
+    }
+    ps.depth++;
+
+    hit_record rec;
+    bool hit;
+    for (int crossing = 0;; ++crossing) {
+        STATS_ADD(rays, 1);
+        hit = (*world)->hit(ps.r, 0.001f, FLT_MAX, rec);
+        if (!(F & FEATURE_MEDIA)) break;
+        bool boundary = hit && is_medium_boundary(rec);
+        if (boundary && !medium_entering(rec, ps.r)) ps.current_medium = static_cast<const medium*>(rec.obj);
+        float t;
+        if (ps.current_medium != nullptr && ps.current_medium->sample_collision(ps.r, hit ? rec.t : FLT_MAX, state, t)) {
+            return medium_scatter<F>(ps, ps.r.at(t), world, lights, state);
+        }
+        if (!boundary || crossing == MEDIUM_MAX_CROSSINGS) break;
+        ps.current_medium = medium_entering(rec, ps.r) ? static_cast<const medium*>(rec.obj) : nullptr;
+        ps.r = ray(rec.p, ps.r.direction(), ps.r.time());
+    }
+    if (!hit) {
+        const light_bvh& l = **lights;
+        if (l.environment.texels != nullptr && !caustic_skipped(ps) && !direct_skipped(ps)) {
+            vec3 background = environment_radiance(l.environment, ps.r.direction());
+            if (ps.prev_pdf > 0.f) background *= power_heuristic(ps.prev_pdf, l.environment_pdf_value(ps.r.direction()));
+            ps.radiance += ps.attenuation * background;
+        }
+        ps.alive = false;
+        return false;
+    }
+    if (rec.mat_ptr == nullptr) {
+        ps.faulted = true;
+        ps.alive = false;
+        return false;
+    }
+    vec3 emitted = material_emitted(rec.mat_ptr, rec.p);
+    if (ps.prev_pdf > 0.f) {
+        float light_pdf = (*lights)->pdf_value(ps.prev_p, ps.prev_n, rec.obj, ps.r.direction());
+        emitted *= power_heuristic(ps.prev_pdf, light_pdf);
+    }
+    if (!caustic_skipped(ps) && !direct_skipped(ps)) ps.radiance += ps.attenuation * emitted;
+
+    ray scattered;
+    vec3 attenuation;
+    float pdf;
+    if (!material_scatter<F>(rec.mat_ptr, ps.r, rec, attenuation, scattered, state, pdf)) {
+        ps.alive = false;
+        return false;
+    }
+    if (material_is_specular(rec.mat_ptr)) {
+        ps.caustic = ps.caustic && rec.mat_ptr->type == MATERIAL_DIELECTRIC;
+        ps.attenuation *= attenuation;
+        ps.r = scattered;
+        ps.prev_pdf = 0.f;
+        return true;
+    }
+    ps.caustic = ps.depth == 1;
+
+    if (cache != nullptr) {
+        const radiance_cache& c = *cache->cache;
+        int slot = radiance_cache_slot(c, rec.p, rec.normal);
+        if (cache->count < RADIANCE_CACHE_MAX_VERTICES) {
+            cache_vertex& v = cache->vertex[cache->count++];
+            v.slot = slot;
+            v.radiance = ps.radiance;
+            v.throughput = ps.attenuation;
+        }
+        vec3 cached;
+        if (cache->diffuse_vertices++ > 0 && rec.t * ps.r.direction().length() >= RADIANCE_CACHE_MIN_DISTANCE * c.cell
+            && radiance_cache_lookup(c, slot, cached)) {
+            ps.radiance += ps.attenuation * cached;
+            float q = cache->continue_probability;
+            if (q <= 0.f || curand_uniform(state) >= q) {
+                ps.alive = false;
+                return false;
+            }
+            ps.attenuation /= q;
+            ps.radiance -= ps.attenuation * cached;
+        }
+    }
+
+    int guide_root = guide != nullptr ? guide_lookup(*guide, rec.p) : -1;
+    vec3 to_light;
+    float light_pdf;
+    bool to_environment;
+    const hittable* light = nullptr;
+    if (resample != nullptr && ps.depth == 1) {
+        resample->rec = rec;
+        resample->r_in = ps.r;
+        resample->throughput = ps.attenuation * attenuation;
+        ps.direct_resampled = true;
+        to_environment = false;
+    }
+    else light = (*lights)->sample(rec.p, rec.normal, state, to_light, light_pdf, to_environment);
+    if (light != nullptr || to_environment) {
+        ray shadow(rec.p, to_light, ps.r.time());
+        hit_record light_rec;
+        float transmittance;
+        bool visible = trace_shadow<F>(shadow, ps.current_medium, world, state, light_rec, transmittance);
+        if (visible && light_rec.mat_ptr == nullptr) {
+            ps.faulted = true;
+            ps.alive = false;
+            return false;
+        }
+        if (light_arrives(light, to_environment, visible, light_rec, transmittance)) {
+            float scattering_pdf = material_scattering_pdf(rec.mat_ptr, ps.r, rec, shadow);
+            float bsdf_pdf = guide_root >= 0 ? guide_mix_pdf(*guide, guide_root, scattering_pdf, to_light) : scattering_pdf;
+            float weight = power_heuristic(light_pdf, bsdf_pdf);
+            ps.radiance += ps.attenuation * attenuation * light_emitted(**lights, to_environment, light_rec, to_light)
+                * (transmittance * scattering_pdf * weight / light_pdf);
+        }
+    }
+
+    if (guide_root >= 0) {
+        if (curand_uniform(state) < guide->fraction) {
+            vec3 d;
+            guide_sample(*guide->sampling, guide_root, state, d);
+            scattered = ray(rec.p, d, ps.r.time());
+            pdf = material_scattering_pdf(rec.mat_ptr, ps.r, rec, scattered);
+        }
+        pdf = guide_mix_pdf(*guide, guide_root, pdf, scattered.direction());
+    }
+    if (pdf <= 0.f) {
+        ps.alive = false;
+        return false;
+    }
+    ps.attenuation *= attenuation * material_scattering_pdf(rec.mat_ptr, ps.r, rec, scattered) / pdf;
+    if (guide != nullptr && guide->building != nullptr && guide->count < GUIDE_MAX_VERTICES) {
+        guide_vertex& v = guide->vertex[guide->count++];
+        v.p = rec.p;
+        v.dir = scattered.direction();
+        v.radiance = ps.radiance;
+        v.throughput = ps.attenuation;
+        v.pdf = pdf;
+    }
+    ps.prev_p = rec.p;
+    ps.prev_n = rec.normal;
+    ps.prev_pdf = pdf;
+    ps.r = scattered;
+    return true;
+}
+
+template <unsigned F = FEATURE_ALL, int DEPTH = MAX_DEPTH>
+__device__ vec3 color(const ray& r,
+    hittable** world,
+    light_bvh** lights,
+    curandState* state,
+    int max_depth = MAX_DEPTH) {
+    path_state ps;
+    path_begin(ps, r, 0, max_depth);
+    while (path_bounce<F, DEPTH>(ps, world, lights, state)) {}
+    return ps.radiance;
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "stats.h"
+
+// Levels of a lazy BVH split while the scene is built; everything below
+// is split by the first ray that reaches it.
+#define LAZY_BVH_EAGER_LEVELS 4
+
+/**
+ * A lazy node's two children, published together once they exist. range
+ * is the reordered copy of the node's primitives the children point into,
+ * or null for nodes split before rendering, which reorder their own range.
+ */
+struct lazy_split {
+    DEVICE_MEMORY_CATEGORY(MEM_BVH)
+
+    hittable* left;
+    hittable* right;
+    bool owns_children;
+    hittable** range;
+    int n;
+};
+
+// Reorders l so l[k] is where sorting by box_compare(axis) would put it,
+// with nothing after it that sorts before it and nothing before it that
+// sorts after it: a median split without the cost of a sort.
+__device__ void select_nth(hittable** l, int n, int k, int axis) {
+    box_compare less(axis);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        hittable* pivot = l[(lo + hi) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (less(l[i], pivot)) i++;
+            while (less(pivot, l[j])) j--;
+            if (i <= j) {
+                hittable* swapped = l[i];
+                l[i++] = l[j];
+                l[j--] = swapped;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+}
+
+__device__ aabb range_box(hittable* const* l, int n) {
+    aabb b;
+    l[0]->bounding_box(0.f, 1.f, b);
+    for (int i = 1; i < n; ++i) {
+        aabb next;
+        l[i]->bounding_box(0.f, 1.f, next);
+        b = surrounding_box(b, next);
+    }
+    return b;
+}
+
+/**
+ * Binary BVH node that keeps its primitives as an unsorted range until a
+ * ray first gets inside its box, and is only then split at the median
+ * along the box's longest axis. The first thread there claims the split
+ * with an atomic, builds both children and publishes them with one
+ * pointer store after a fence, so each node is split once. A thread that
+ * finds the split claimed but not yet published tests the range itself
+ * instead of waiting, as the thread building it may be in the same warp;
+ * that is also why a published split reorders a copy of the range rather
+ * than the range such a thread may still be reading.
+ */
+class lazy_bvh_node : public hittable {
+public:
+    DEVICE_MEMORY_CATEGORY(MEM_BVH)
+
+    __device__ lazy_bvh_node(hittable** l, int n, const aabb& b, int eager_levels, bool owns_range = false);
+    __device__ virtual ~lazy_bvh_node();
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& b) const override {
+        b = box;
+        return true;
+    }
+    __device__ virtual unsigned features() const override {
+        unsigned mask = 0;
+        for (int i = 0; i < count; ++i) mask |= prims[i]->features();
+        return mask;
+    }
+
+    hittable** prims;
+    int count;
+    aabb box;
+    bool owns_range;
+    mutable int claimed;
+    mutable lazy_split* split;
+
+private:
+    __device__ lazy_split* build_split(hittable** l, int eager_levels) const;
+    __device__ bool hit_range(const ray& r, float t_min, float t_max, hit_record& rec) const;
+};
+
+__device__ lazy_bvh_node::lazy_bvh_node(hittable** l, int n, const aabb& b, int eager_levels, bool owns_range)
+    : prims(l), count(n), box(b), owns_range(owns_range), claimed(0), split(nullptr) {
+    if (eager_levels > 0) {
+        claimed = 1;
+        split = build_split(prims, eager_levels - 1);
+    }
+}
+
+__device__ lazy_bvh_node::~lazy_bvh_node() {
+    if (split != nullptr) {
+        if (split->owns_children) {
+            delete split->left;
+            delete split->right;
+        }
+        if (split->range != nullptr) device_delete_array(MEM_BVH, split->range, split->n);
+        delete split;
+    }
+    if (owns_range) device_delete_array(MEM_BVH, prims, count);
+}
+
+// Splits l, prims or a copy of them, into two halves. Null when the device
+// heap can't hold the split.
+__device__ lazy_split* lazy_bvh_node::build_split(hittable** l, int eager_levels) const {
+    vec3 extent = box.max() - box.min();
+    int axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 1 : extent.y() >= extent.z() ? 2 : 3;
+    select_nth(l, count, count / 2, axis);
+
+    lazy_split* s = new lazy_split;
+    if (s == nullptr) return nullptr;
+    s->range = l == prims ? nullptr : l;
+    s->n = count;
+    s->owns_children = count > 2;
+    if (count == 1) {
+        s->left = s->right = l[0];
+    }
+    else if (count == 2) {
+        s->left = l[0];
+        s->right = l[1];
+    }
+    else {
+        int half = count / 2;
+        s->left = new lazy_bvh_node(l, half, range_box(l, half), eager_levels);
+        s->right = new lazy_bvh_node(l + half, count - half, range_box(l + half, count - half), eager_levels);
+        if (s->left == nullptr || s->right == nullptr) {
+            delete s->left;
+            delete s->right;
+            delete s;
+            return nullptr;
+        }
+    }
+    return s;
+}
+
+__device__ bool lazy_bvh_node::hit_range(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    for (int i = 0; i < count; ++i) {
+        hit_record prim_rec;
+        if (prims[i]->hit(r, t_min, t_max, prim_rec)) {
+            hit_anything = true;
+            t_max = prim_rec.t;
+            rec = prim_rec;
+        }
+    }
+    return hit_anything;
+}
+
+__device__ bool lazy_bvh_node::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    STATS_ADD(node_visits, 1);
+    if (!box.hit(r, t_min, t_max)) return false;
+
+    // Volatile, so a split published after this line was cached is seen.
+    // Ranges of two or fewer are never worth splitting.
+    const lazy_split* s = *(lazy_split* volatile*)&split;
+    if (s == nullptr && count > 2 && atomicCAS(&claimed, 0, 1) == 0) {
+        hittable** copy = device_new_array<hittable*>(MEM_BVH, count);
+        // Out of device heap: the node stays a flat range.
+        if (copy == nullptr) return hit_range(r, t_min, t_max, rec);
+        for (int i = 0; i < count; ++i) copy[i] = prims[i];
+        lazy_split* built = build_split(copy, 0);
+        if (built == nullptr) {
+            device_delete_array(MEM_BVH, copy, count);
+            return hit_range(r, t_min, t_max, rec);
+        }
+        __threadfence();
+        atomicExch((unsigned long long*)&split, (unsigned long long)built);
+        s = built;
+    }
+    if (s == nullptr) return hit_range(r, t_min, t_max, rec);
+
+    hit_record left_rec, right_rec;
+    bool hit_left = s->left->hit(r, t_min, t_max, left_rec);
+    bool hit_right = s->right->hit(r, t_min, hit_left ? left_rec.t : t_max, right_rec);
+    if (hit_right) {
+        rec = right_rec;
+        return true;
+    }
+    if (hit_left) {
+        rec = left_rec;
+        return true;
+    }
+    return false;
+}
+
+// A lazy BVH over a copy of l, split LAZY_BVH_EAGER_LEVELS deep; l keeps
+// its order.
+__device__ hittable* make_lazy_bvh(hittable** l, int n) {
+    hittable** range = device_new_array<hittable*>(MEM_BVH, n);
+    if (range == nullptr) return nullptr;
+    for (int i = 0; i < n; ++i) range[i] = l[i];
+    return new lazy_bvh_node(range, n, range_box(range, n), LAZY_BVH_EAGER_LEVELS, true);
+}
+
+#endif
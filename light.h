@@ -0,0 +1,410 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <thrust/sort.h>
+#include <curand_kernel.h>
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "alias_table.h"
+#include "environment.h"
+#include "trace.h"
+
+// Smallest cone containing both cones (PBRT-v4 DirectionCone::Union).
+__device__ void cone_union(const vec3& wa, float cos_a, const vec3& wb, float cos_b, vec3& w, float& cos_theta) {
+    float theta_a = acosf(fmaxf(-1.f, fminf(1.f, cos_a)));
+    float theta_b = acosf(fmaxf(-1.f, fminf(1.f, cos_b)));
+    float theta_d = acosf(fmaxf(-1.f, fminf(1.f, dot(wa, wb))));
+    if (fminf(theta_d + theta_b, float(M_PI)) <= theta_a) {
+        w = wa;
+        cos_theta = cos_a;
+        return;
+    }
+    if (fminf(theta_d + theta_a, float(M_PI)) <= theta_b) {
+        w = wb;
+        cos_theta = cos_b;
+        return;
+    }
+
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    vec3 wr = cross(wa, wb);
+    if (theta_o >= float(M_PI) || wr.squared_length() == 0.f) {
+        w = wa;
+        cos_theta = -1.f;
+        return;
+    }
+    // Rotate wa towards wb by theta_o - theta_a around wr.
+    float theta_r = theta_o - theta_a;
+    w = cosf(theta_r) * wa + sinf(theta_r) * cross(unit_vector(wr), wa);
+    cos_theta = cosf(theta_o);
+}
+
+__device__ light_bounds bounds_union(const light_bounds& a, const light_bounds& b) {
+    if (a.power <= 0.f) return b;
+    if (b.power <= 0.f) return a;
+    light_bounds u;
+    u.box = surrounding_box(a.box, b.box);
+    cone_union(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, u.axis, u.cos_theta_o);
+    u.cos_theta_e = fminf(a.cos_theta_e, b.cos_theta_e);
+    u.power = a.power + b.power;
+    u.two_sided = a.two_sided || b.two_sided;
+    return u;
+}
+
+/**
+ * Conservative estimate of the light reaching p (with normal n, or a zero
+ * normal for media) from the emitters in lb, after Conty Estevez & Kulla,
+ * "Importance Sampling of Many Lights with Adaptive Tree Splitting".
+ */
+__device__ float importance(const light_bounds& lb, const vec3& p, const vec3& n) {
+    if (lb.power <= 0.f) return 0.f;
+
+    vec3 pc = 0.5f * (lb.box.min() + lb.box.max());
+    vec3 diag = lb.box.max() - lb.box.min();
+    vec3 wi = p - pc;
+    float d2 = dot(wi, wi);
+    float r2 = 0.25f * dot(diag, diag);
+
+    // Angle subtended by the bounds' sphere; everything if p is inside it.
+    float cos_theta_b = d2 <= r2 ? -1.f : sqrtf(1.f - r2 / d2);
+    float theta_b = acosf(cos_theta_b);
+    float cos_theta_w = 1.f;
+    if (d2 > 0.f) {
+        wi = unit_vector(wi);
+        cos_theta_w = dot(lb.axis, wi);
+        if (lb.two_sided) cos_theta_w = fabsf(cos_theta_w);
+    }
+    d2 = fmaxf(d2, r2);
+
+    float theta_w = acosf(fmaxf(-1.f, fminf(1.f, cos_theta_w)));
+    float theta_o = acosf(lb.cos_theta_o);
+    float theta_e = acosf(lb.cos_theta_e);
+    float theta_p = fmaxf(0.f, theta_w - theta_o - theta_b);
+    if (theta_p >= theta_e) return 0.f;
+
+    float imp = lb.power * cosf(theta_p) / d2;
+    if (n.squared_length() > 0.f && d2 > 0.f) {
+        float theta_i = acosf(fminf(1.f, fabsf(dot(wi, n))));
+        imp *= cosf(fmaxf(0.f, theta_i - theta_b));
+    }
+    return fmaxf(imp, 0.f);
+}
+
+/**
+ * A set of emitters (an LED wall, the faces of lit signage) that acts as a
+ * single light: the light BVH sees one leaf, and a member is then picked in
+ * O(1) from an alias table over the members' power.
+ */
+class emitter_group : public hittable {
+public:
+    // Takes ownership of the members and of l, which must come from
+    // device_new_array(MEM_GEOMETRY, n).
+    __device__ emitter_group(hittable** l, int n);
+    __device__ virtual ~emitter_group() {
+        delete accel;
+        delete table;
+        for (int i = 0; i < members.list_size; ++i) delete members.list[i];
+        device_delete_array(MEM_GEOMETRY, members.list, members.list_size);
+    }
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override {
+        return accel->hit(r, t_min, t_max, rec);
+    }
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override {
+        return accel->bounding_box(t0, t1, box);
+    }
+    __device__ virtual unsigned features() const override {
+        return accel->features();
+    }
+    __device__ virtual double pdf_value(const vec3& o, const vec3& v) const override {
+        double sum = 0.0;
+        for (int i = 0; i < members.list_size; ++i) {
+            sum += table->pmf(i) * members.list[i]->pdf_value(o, v);
+        }
+        return sum;
+    }
+    __device__ virtual vec3 random(const vec3& o, curandState* state) const override {
+        float pmf;
+        return sample_emitter(curand_uniform(state), pmf)->random(o, state);
+    }
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override {
+        lb = bounds;
+        return bounds.power > 0.f;
+    }
+    __device__ virtual const hittable* sample_emitter(float u, float& pmf) const override {
+        return members.list[table->sample(u, pmf)];
+    }
+    __device__ virtual void set_light_id(int id) override {
+        light_id = id;
+        for (int i = 0; i < members.list_size; ++i) {
+            members.list[i]->light_id = id;
+        }
+    }
+
+    hittable_list members;
+    hittable* accel;
+    alias_table* table;
+    light_bounds bounds;
+};
+
+__device__ emitter_group::emitter_group(hittable** l, int n) : members(l, n) {
+    float* power = new float[n];
+    bounds.power = 0.f;
+    for (int i = 0; i < n; ++i) {
+        light_bounds lb;
+        power[i] = l[i]->emitter_bounds(lb) ? lb.power : 0.f;
+        if (power[i] > 0.f) bounds = bounds_union(bounds, lb);
+    }
+    table = new alias_table(power, n);
+    for (int i = 0; i < n; ++i) {
+        l[i]->light_pmf = table->pmf(i);
+    }
+    delete[] power;
+
+    // bvhNode reorders its input, so give it a copy of the member list.
+    hittable** sorted = new hittable * [n];
+    for (int i = 0; i < n; ++i) sorted[i] = l[i];
+    curandState state;
+    curand_init(1984, 0, 0, &state);
+    accel = new bvhNode(sorted, n, 0.f, 1.f, &state);
+    delete[] sorted;
+}
+
+struct light_bvh_node {
+    light_bounds bounds;
+    int second_child;   // -1 for leaves; the first child always follows its parent
+    int light;          // index into light_bvh::lights for leaves
+};
+
+struct centroid_compare {
+    __device__ centroid_compare(const light_bounds* b, int a) : bounds(b), axis(a) {}
+    __device__ bool operator()(int a, int b) const {
+        float ca = bounds[a].box.min()[axis] + bounds[a].box.max()[axis];
+        float cb = bounds[b].box.min()[axis] + bounds[b].box.max()[axis];
+        return ca < cb;
+    }
+    const light_bounds* bounds;
+    int axis;
+};
+
+/**
+ * Light hierarchy over every emitter in a scene. Sampling walks from the root
+ * choosing a child in proportion to its importance at the shading point, so
+ * a light is picked in O(log n). Each light remembers the branches taken to
+ * reach it so its probability can be recomputed for MIS in O(log n) too.
+ * A scene lit by an environment map samples it with probability
+ * environment_select instead: half the time when it has emitters as well,
+ * since their power and the environment's can't be compared.
+ */
+class light_bvh {
+public:
+    DEVICE_MEMORY_CATEGORY(MEM_BVH)
+
+    __device__ light_bvh(hittable** l, int n);
+    __device__ ~light_bvh() {
+        device_delete_array(MEM_BVH, lights, num_lights);
+        device_delete_array(MEM_BVH, nodes, num_nodes);
+        device_delete_array(MEM_BVH, trails, num_lights);
+    }
+
+    __device__ void set_environment(const environment_map& e) {
+        environment = e;
+        environment_select = e.texels == nullptr ? 0.f : num_lights > 0 ? 0.5f : 1.f;
+    }
+
+    // Picks an emitting primitive and a direction towards it; pdf is the
+    // solid angle density of that direction including the selection pmf.
+    // Returns null with to_environment set if the environment was picked.
+    __device__ const hittable* sample(const vec3& p, const vec3& n, curandState* state, vec3& direction, float& pdf, bool& to_environment) const;
+    // Solid angle density of sampling direction v from p towards obj.
+    __device__ float pdf_value(const vec3& p, const vec3& n, const hittable* obj, const vec3& v) const;
+    // Solid angle density of sampling direction v towards the environment.
+    __device__ float environment_pdf_value(const vec3& v) const {
+        return environment_select > 0.f ? environment_select * environment_pdf(environment, v) : 0.f;
+    }
+    __device__ float pmf(const vec3& p, const vec3& n, int light) const;
+    // Picks an emitting primitive in proportion to power alone, for starting
+    // light paths; pmf includes the chance of not picking the environment.
+    __device__ const hittable* sample_power(float u, float& pmf) const;
+
+    hittable** lights;
+    int num_lights;
+    light_bvh_node* nodes;
+    int num_nodes;
+    unsigned* trails;
+    environment_map environment;
+    float environment_select;
+
+private:
+    __device__ int build(int* order, const light_bounds* bounds, int begin, int end, unsigned trail, int depth);
+};
+
+__device__ light_bvh::light_bvh(hittable** l, int n) : lights(nullptr), num_lights(0), nodes(nullptr), num_nodes(0), trails(nullptr),
+    environment(no_environment()), environment_select(0.f) {
+    TRACE_DEVICE_SCOPE(TRACE_LIGHT_BVH_BUILD);
+    light_bounds* bounds = new light_bounds[n > 0 ? n : 1];
+    hittable** found = new hittable * [n > 0 ? n : 1];
+    for (int i = 0; i < n; ++i) {
+        if (l[i]->emitter_bounds(bounds[num_lights])) {
+            found[num_lights++] = l[i];
+        }
+    }
+    if (num_lights > 0) {
+        lights = device_new_array<hittable*>(MEM_BVH, num_lights);
+        nodes = device_new_array<light_bvh_node>(MEM_BVH, 2 * num_lights - 1);
+        trails = device_new_array<unsigned>(MEM_BVH, num_lights);
+        if (lights == nullptr || nodes == nullptr || trails == nullptr) {
+            // Out of device heap: left without lights; create_scene()
+            // reports it.
+            device_delete_array(MEM_BVH, lights, num_lights);
+            device_delete_array(MEM_BVH, nodes, 2 * num_lights - 1);
+            device_delete_array(MEM_BVH, trails, num_lights);
+            lights = nullptr;
+            nodes = nullptr;
+            trails = nullptr;
+            num_lights = 0;
+        }
+        else {
+            for (int i = 0; i < num_lights; ++i) lights[i] = found[i];
+            int* order = new int[num_lights];
+            for (int i = 0; i < num_lights; ++i) order[i] = i;
+            build(order, bounds, 0, num_lights, 0u, 0);
+            delete[] order;
+        }
+    }
+    delete[] found;
+    delete[] bounds;
+}
+
+__device__ int light_bvh::build(int* order, const light_bounds* bounds, int begin, int end, unsigned trail, int depth) {
+    int index = num_nodes++;
+    if (end - begin == 1) {
+        int light = order[begin];
+        nodes[index].bounds = bounds[light];
+        nodes[index].second_child = -1;
+        nodes[index].light = light;
+        trails[light] = trail;
+        lights[light]->set_light_id(light);
+        return index;
+    }
+
+    // Median split along the widest centroid extent keeps the depth at
+    // ceil(log2 n), so a trail always fits in 32 bits.
+    vec3 cmin = bounds[order[begin]].box.min() + bounds[order[begin]].box.max();
+    vec3 cmax = cmin;
+    for (int i = begin + 1; i < end; ++i) {
+        vec3 c = bounds[order[i]].box.min() + bounds[order[i]].box.max();
+        for (int a = 0; a < 3; ++a) {
+            cmin[a] = fminf(cmin[a], c[a]);
+            cmax[a] = fmaxf(cmax[a], c[a]);
+        }
+    }
+    vec3 extent = cmax - cmin;
+    int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+    thrust::sort(order + begin, order + end, centroid_compare(bounds, axis));
+
+    int mid = (begin + end) / 2;
+    int first = build(order, bounds, begin, mid, trail, depth + 1);
+    int second = build(order, bounds, mid, end, trail | (1u << depth), depth + 1);
+    nodes[index].bounds = bounds_union(nodes[first].bounds, nodes[second].bounds);
+    nodes[index].second_child = second;
+    nodes[index].light = -1;
+    return index;
+}
+
+__device__ const hittable* light_bvh::sample(const vec3& p, const vec3& n, curandState* state, vec3& direction, float& pdf, bool& to_environment) const {
+    to_environment = environment_select >= 1.f || (environment_select > 0.f && curand_uniform(state) < environment_select);
+    if (to_environment) {
+        direction = environment_sample(environment, state, pdf);
+        pdf *= environment_select;
+        return nullptr;
+    }
+    pdf = 0.f;
+    if (num_lights == 0 || importance(nodes[0].bounds, p, n) <= 0.f) return nullptr;
+
+    float u = curand_uniform(state);
+    float select = 1.f;
+    int index = 0;
+    while (nodes[index].second_child >= 0) {
+        float i0 = importance(nodes[index + 1].bounds, p, n);
+        float i1 = importance(nodes[nodes[index].second_child].bounds, p, n);
+        if (i0 + i1 <= 0.f) return nullptr;
+        float p0 = i0 / (i0 + i1);
+        if (u < p0) {
+            index = index + 1;
+            u = fminf(u / p0, 0.99999994f);
+            select *= p0;
+        }
+        else {
+            index = nodes[index].second_child;
+            u = fminf((u - p0) / (1.f - p0), 0.99999994f);
+            select *= 1.f - p0;
+        }
+    }
+
+    float member_pmf;
+    const hittable* obj = lights[nodes[index].light]->sample_emitter(u, member_pmf);
+    direction = obj->random(p, state);
+    pdf = (1.f - environment_select) * select * member_pmf * float(obj->pdf_value(p, direction));
+    return pdf > 0.f ? obj : nullptr;
+}
+
+__device__ float light_bvh::pmf(const vec3& p, const vec3& n, int light) const {
+    // sample() never picks a light when the root has no importance, which
+    // with a single light the walk below wouldn't see.
+    if (light < 0 || light >= num_lights || importance(nodes[0].bounds, p, n) <= 0.f) return 0.f;
+    unsigned trail = trails[light];
+    float select = 1.f;
+    int index = 0;
+    while (nodes[index].second_child >= 0) {
+        float i0 = importance(nodes[index + 1].bounds, p, n);
+        float i1 = importance(nodes[nodes[index].second_child].bounds, p, n);
+        if (i0 + i1 <= 0.f) return 0.f;
+        if (trail & 1u) {
+            select *= i1 / (i0 + i1);
+            index = nodes[index].second_child;
+        }
+        else {
+            select *= i0 / (i0 + i1);
+            index = index + 1;
+        }
+        trail >>= 1;
+    }
+    return select;
+}
+
+__device__ const hittable* light_bvh::sample_power(float u, float& pmf) const {
+    pmf = 0.f;
+    if (num_lights == 0) return nullptr;
+    float select = 1.f;
+    int index = 0;
+    while (nodes[index].second_child >= 0) {
+        float p0 = nodes[index + 1].bounds.power / nodes[index].bounds.power;
+        if (u < p0) {
+            index = index + 1;
+            u = fminf(u / p0, 0.99999994f);
+            select *= p0;
+        }
+        else {
+            index = nodes[index].second_child;
+            u = fminf((u - p0) / (1.f - p0), 0.99999994f);
+            select *= 1.f - p0;
+        }
+    }
+    float member_pmf;
+    const hittable* obj = lights[nodes[index].light]->sample_emitter(u, member_pmf);
+    pmf = (1.f - environment_select) * select * member_pmf;
+    return obj;
+}
+
+__device__ float light_bvh::pdf_value(const vec3& p, const vec3& n, const hittable* obj, const vec3& v) const {
+    if (obj == nullptr || obj->light_id < 0) return 0.f;
+    return (1.f - environment_select) * pmf(p, n, obj->light_id) * obj->light_pmf * float(obj->pdf_value(p, v));
+}
+
+__global__ void set_environment(light_bvh** lights, environment_map e) {
+    (*lights)->set_environment(e);
+}
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef LIGHT_TRACING_H
+#define LIGHT_TRACING_H
+
+#include <iostream>
+#include <chrono>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "memory_budget.h"
+
+// Light paths each thread traces, one after the other.
+#define LIGHT_PATHS_PER_THREAD 16
+#define LIGHT_TRACE_THREADS 256
+// Splats are summed as integers in units of 1 / SPLAT_UNITS: integer
+// atomic adds give the same sum in any order, float ones don't.
+#define SPLAT_UNITS 16777216.f
+
+/**
+ * Dielectric caustics are split off the camera paths: light that reaches a
+ * diffuse first hit through one or more dielectric vertices and nothing else
+ * is left out of them (path_state::skip_caustics) and traced from the light
+ * instead. Light paths leave an emitter, or come in from the environment,
+ * follow dielectrics only and connect their first other surface to the
+ * lens. Each path type is counted by exactly one of the two, so the sum of
+ * their images is unbiased, and the caustics come from the side that can
+ * find them. Splats from all threads go straight into one fixed point
+ * framebuffer with atomic adds, which never block, and are added to the
+ * camera image at the end.
+ */
+
+// Bounds of the objects with a dielectric in them. found stays false if the
+// scene has none.
+__global__ void dielectric_bounds(hittable** list, int n, aabb* bounds, bool* found) {
+    *found = false;
+    for (int k = 0; k < n; ++k) {
+        aabb box;
+        if (!(list[k]->features() & FEATURE_DIELECTRIC) || !list[k]->bounding_box(0.f, 1.f, box)) continue;
+        *bounds = *found ? surrounding_box(*bounds, box) : box;
+        *found = true;
+    }
+}
+
+// Starts a light path: a ray leaving an emitter or coming in from the
+// environment, and its weight. Environment light only makes a caustic if it
+// hits a dielectric first, so it enters through a disk that faces it and
+// covers the dielectrics' bounding sphere (center, radius); a ray that
+// something behind the disk would have shadowed is dropped.
+template <unsigned F>
+__device__ bool emit_light_path(hittable** world, const light_bvh& lights, const vec3& center, float radius, float time, curandState* state,
+    ray& r, vec3& beta) {
+    bool from_environment = lights.environment_select >= 1.f
+        || (lights.environment_select > 0.f && curand_uniform(state) < lights.environment_select);
+    if (from_environment) {
+        float pdf;
+        vec3 d = environment_sample(lights.environment, state, pdf);
+        if (pdf <= 0.f) return false;
+        onb uvw;
+        uvw.build_from_w(d);
+        vec3 disk = random_in_unit_disk(state);
+        vec3 origin = center + radius * (d + disk.x() * uvw.u() + disk.y() * uvw.v());
+        hit_record rec;
+        if ((*world)->hit(ray(origin, d, time), 0.001f, FLT_MAX, rec)) return false;
+        r = ray(origin, -d, time);
+        beta = environment_radiance(lights.environment, d) * (float(M_PI) * radius * radius / (pdf * lights.environment_select));
+        return true;
+    }
+
+    float pmf;
+    const hittable* light = lights.sample_power(curand_uniform(state), pmf);
+    hit_record rec;
+    float area_pdf;
+    if (light == nullptr || pmf <= 0.f || !light->sample_surface(state, rec, area_pdf)) return false;
+    onb uvw;
+    uvw.build_from_w(rec.normal);
+    r = ray(rec.p, uvw.local(random_cosine_direction(state)), time);
+    // Cosine sampled directions cancel the emitter's cosine but for pi.
+    beta = material_emitted(rec.mat_ptr, rec.p) * (float(M_PI) / (pmf * area_pdf));
+    return true;
+}
+
+// Connects the diffuse vertex rec, reached along r with weight beta, to the
+// lens and adds what the camera sees of it to its pixel in splat, three
+// fixed point channels a pixel.
+template <unsigned F>
+__device__ void splat_caustic(unsigned long long* splat, int max_x, int max_y, float scale, const camera& cam, hittable** world, const ray& r,
+    const hit_record& rec, const vec3& beta, curandState* state) {
+    vec3 lens;
+    float s, t, importance;
+    if (!cam.connect<F>(rec.p, state, lens, s, t, importance) || s < 0.f || s >= 1.f || t < 0.f || t >= 1.f) return;
+    vec3 attenuation;
+    ray scattered;
+    float pdf;
+    if (!material_scatter<F>(rec.mat_ptr, r, rec, attenuation, scattered, state, pdf)) return;
+    float distance = (lens - rec.p).length();
+    ray to_lens(rec.p, (lens - rec.p) / distance, r.time());
+    float cosine_bsdf = material_scattering_pdf(rec.mat_ptr, r, rec, to_lens);
+    if (cosine_bsdf <= 0.f) return;
+    hit_record blocker;
+    if ((*world)->hit(to_lens, 0.001f, distance * 0.9999f, blocker)) return;
+
+    int i = min(int(s * max_x), max_x - 1);
+    int j = min(int(t * max_y), max_y - 1);
+    vec3 value = beta * attenuation * (cosine_bsdf * importance * scale);
+    unsigned long long* pixel = splat + 3 * ((unsigned long long)j * max_x + i);
+    for (int k = 0; k < 3; ++k) atomicAdd(&pixel[k], (unsigned long long)(fminf(value[k] * SPLAT_UNITS, 1e19f) + 0.5f));
+}
+
+/**
+ * Traces paths light paths, LIGHT_PATHS_PER_THREAD a thread, and splats
+ * their caustics, times scale, into splat as linear radiance. Only paths
+ * with at most min(max_depth, DEPTH) - 2 dielectric vertices count, as
+ * camera paths reach no further.
+ */
+template <unsigned F, int DEPTH>
+__global__ void light_trace(unsigned long long* splat, int max_x, int max_y, unsigned long long paths, float scale, camera** cam, hittable** world,
+    light_bvh** lights, vec3 center, float radius, int max_depth) {
+    int max_refractions = min(max_depth, DEPTH) - 2;
+    unsigned long long thread = threadIdx.x + (unsigned long long)blockIdx.x * blockDim.x;
+    unsigned long long first = thread * LIGHT_PATHS_PER_THREAD;
+    if (first >= paths) return;
+    const camera& c = **cam;
+    unsigned long long last = first + LIGHT_PATHS_PER_THREAD < paths ? first + LIGHT_PATHS_PER_THREAD : paths;
+    for (unsigned long long k = first; k < last; ++k) {
+        // Seeded as pixels past every real one, so light paths don't
+        // correlate with camera paths.
+        curandState state;
+        sample_state((unsigned long long)max_x * max_y + k, 0, &state);
+        float time = c.time0;
+        if (F & FEATURE_MOTION_BLUR) time += curand_uniform(&state) * (c.time1 - c.time0);
+        ray r;
+        vec3 beta;
+        if (!emit_light_path<F>(world, **lights, center, radius, time, &state, r, beta)) continue;
+
+        hit_record rec;
+        bool hit;
+        int refractions = 0;
+        while ((hit = (*world)->hit(r, 0.001f, FLT_MAX, rec)) && rec.mat_ptr != nullptr && rec.mat_ptr->type == MATERIAL_DIELECTRIC
+            && refractions <= max_refractions) {
+            vec3 attenuation;
+            ray scattered;
+            float pdf;
+            if (!material_scatter<F>(rec.mat_ptr, r, rec, attenuation, scattered, &state, pdf)) break;
+            beta *= attenuation;
+            r = scattered;
+            refractions++;
+        }
+        if (!hit || refractions == 0 || refractions > max_refractions || rec.mat_ptr == nullptr || material_is_specular(rec.mat_ptr)) continue;
+        splat_caustic<F>(splat, max_x, max_y, scale, c, world, r, rec, beta, &state);
+    }
+}
+
+// render() without the caustics light tracing adds, as linear radiance.
+template <unsigned F, int DEPTH>
+__global__ void render_without_caustics(vec3* fb, int max_x, int max_y, int ns, int order, const int* tiles, camera** cam, hittable** world,
+    light_bvh** lights, int max_depth) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    vec3 col(0, 0, 0);
+    for (int s = 0; s < ns; s++) {
+        curandState local_rand_state;
+        sample_state(pixel_index, s, &local_rand_state);
+        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+        path_state ps;
+        path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+        ps.skip_caustics = true;
+        while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state)) {}
+        col += ps.radiance;
+    }
+    fb[pixel_index] = col / float(ns);
+}
+
+// fb, linear, plus the splatted caustics, gamma corrected.
+__global__ void add_light_image(vec3* fb, const unsigned long long* splat, int num_pixels) {
+    int p = threadIdx.x + blockIdx.x * blockDim.x;
+    if (p >= num_pixels) return;
+    vec3 col = fb[p] + vec3(float(splat[3 * p]), float(splat[3 * p + 1]), float(splat[3 * p + 2])) / SPLAT_UNITS;
+    fb[p] = vec3(sqrtf(fmaxf(col[0], 0.f)), sqrtf(fmaxf(col[1], 0.f)), sqrtf(fmaxf(col[2], 0.f)));
+}
+
+struct caustic_free_launcher {
+    int num_tiles;
+    vec3* fb;
+    int max_x, max_y, ns, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        render_without_caustics<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (fb, max_x, max_y, ns, order, tiles, cam, world, lights,
+            max_depth);
+    }
+};
+
+struct light_trace_launcher {
+    unsigned long long* splat;
+    int max_x, max_y;
+    unsigned long long paths;
+    float scale;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    vec3 center;
+    float radius;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        unsigned long long threads = (paths + LIGHT_PATHS_PER_THREAD - 1) / LIGHT_PATHS_PER_THREAD;
+        int blocks = int((threads + LIGHT_TRACE_THREADS - 1) / LIGHT_TRACE_THREADS);
+        light_trace<F, DEPTH> << <blocks, LIGHT_TRACE_THREADS >> > (splat, max_x, max_y, paths, scale, cam, world, lights, center, radius,
+            max_depth);
+    }
+};
+
+/**
+ * Renders ns camera samples per pixel without dielectric caustics, then
+ * light_paths light paths per pixel for them, and writes the sum to fb.
+ * list holds the scene's n objects, for finding its dielectrics.
+ */
+void render_light_traced(vec3* fb, int nx, int ny, int ns, float light_paths, unsigned features, int max_depth, int order, const int* tiles,
+    int num_tiles, camera** cam, hittable** world, light_bvh** lights, hittable** list, int n) {
+    int num_pixels = nx * ny;
+    aabb* bounds;
+    bool* found;
+    checkCudaErrors(cudaMallocManaged((void**)&bounds, sizeof(aabb)));
+    checkCudaErrors(cudaMallocManaged((void**)&found, sizeof(bool)));
+    dielectric_bounds << <1, 1 >> > (list, n, bounds, found);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    vec3 center = 0.5f * (bounds->min() + bounds->max());
+    float radius = *found ? 0.5f * (bounds->max() - bounds->min()).length() : 0.f;
+    bool any = *found;
+    checkCudaErrors(cudaFree(bounds));
+    checkCudaErrors(cudaFree(found));
+
+    auto start = std::chrono::steady_clock::now();
+    caustic_free_launcher camera_paths = { num_tiles, fb, nx, ny, ns, order, tiles, cam, world, lights };
+    dispatch_variant(features, max_depth, camera_paths);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    double camera_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned long long* splat;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&splat, 3 * num_pixels * sizeof(unsigned long long)));
+    checkCudaErrors(cudaMemset(splat, 0, 3 * num_pixels * sizeof(unsigned long long)));
+    unsigned long long paths = any ? (unsigned long long)(double(light_paths) * num_pixels) : 0ull;
+    start = std::chrono::steady_clock::now();
+    if (paths > 0) {
+        light_trace_launcher light_paths_launcher = { splat, nx, ny, paths, float(double(num_pixels) / double(paths)), cam, world, lights,
+            center, radius };
+        dispatch_variant(features, max_depth, light_paths_launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    double light_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    add_light_image << <(num_pixels + 255) / 256, 256 >> > (fb, splat, num_pixels);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    checkCudaErrors(tracked_free(splat));
+    if (!any) std::cerr << "light tracing: the scene has no dielectrics, so no caustics to trace.\n";
+    std::cerr << "camera paths: " << camera_seconds << " seconds; light tracing: " << paths << " paths in " << light_seconds << " seconds.\n";
+}
+
+#endif
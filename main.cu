@@ -1,191 +1,114 @@
 #include <iostream>
 #include <time.h>
+#include <chrono>
 #include <fstream>
+#include <string>
+#include <vector>
 #include <curand_kernel.h>
 
-#include "ray.h"
-#include "vec3.h"
-#include "hittable.h"
-#include "hittable_list.h"
-#include "sphere.h"
-#include "camera.h"
-#include "material.h"
-#include "rect.h"
+#include "helper_cuda.h"
+#include "options.h"
+#include "scenes.h"
+#include "render.h"
+#include "wavefront.h"
+#include "paged_render.h"
+#include "preview.h"
+#include "shm_framebuffer.h"
+#include "image_io.h"
+#include "render_daemon.h"
+#include "batch_render.h"
+#include "path_guiding.h"
+#include "multi_device.h"
+#include "cached_render.h"
+#include "restir_render.h"
+#include "deadline_render.h"
+#include "light_tracing.h"
+#include "tiled_render.h"
+#include "memory_budget.h"
+#include "stats.h"
+#include "trace.h"
 
-// limited version of checkCudaErrors from helper_cuda.h in CUDA examples
-#define checkCudaErrors(val) check_cuda( (val), #val, __FILE__, __LINE__ )
-
-__device__ vec3 color(const ray& r,
-    hittable** world,
-    curandState* state) {
-    ray cur_ray = r;
-    vec3 cur_attenuation = vec3(1.f, 1.f, 1.f);
-
-    for (int i = 0; i < 50; ++i) {
-        hit_record rec;
-        if (!((*world)->hit(cur_ray, 0.001f, FLT_MAX, rec))) {
-            return vec3(0.f, 0.f, 0.f);
-        }
-        ray scattered;
-        vec3 attenuation;
-        vec3 emitted = rec.mat_ptr->emitted(0., 0., rec.p);
-        float pdf;
-        if (rec.mat_ptr->scatter(cur_ray, rec, attenuation, scattered, state, pdf)) {
-            auto on_light = vec3(213 + curand_uniform(state) * (343 - 213), 554, 227 + curand_uniform(state) * (332 - 227));
-            auto to_light = on_light - rec.p;
-            auto distance_squared = dot(to_light, to_light);
-            to_light = unit_vector(to_light);
-
-            if (dot(to_light, rec.normal) < 0)
-                return emitted;
-
-            double light_area = (343 - 213) * (332 - 227);
-            auto light_cosine = fabs(to_light.y());
-            if (light_cosine < 0.000001)
-                return emitted;
-
-            pdf = distance_squared / (light_cosine * light_area);
-            scattered = ray(rec.p, to_light, r.time());
-            cur_attenuation *= (attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scattered) / pdf);
-            cur_ray = scattered;
-        }
-        else {
-            cur_attenuation = emitted * cur_attenuation;
-            return cur_attenuation;
-        }
-    }
-    return vec3(0.f, 0.f, 0.f);
+// Writes the timeline asked for with --trace, if this build records one.
+void write_trace(const std::string& path) {
+    if (path.empty()) return;
+    if (trace_write(path)) std::cerr << "trace written to " << path << "\n";
+    else std::cerr << "no trace written: build with RT_TRACE defined to record one\n";
 }
 
-void check_cuda(cudaError_t result, char const* const func, const char* const file, int const line) {
-    if (result) {
-        std::cerr << "CUDA error = " << static_cast<unsigned int>(result) << " at " <<
-            file << ":" << line << " '" << func << "' \n";
-        // Make sure we call CUDA Device Reset before exiting
-        cudaDeviceReset();
-        exit(99);
+int main(int argc, char** argv) {
+    std::chrono::steady_clock::time_point job_start = std::chrono::steady_clock::now();
+    render_options opt = parse_options(argc, argv);
+    TRACE_THREAD_NAME("main");
+    set_memory_budget(size_t(opt.mem_budget_mb) << 20, opt.mem_policy);
+    if (!opt.submit.empty()) {
+        std::ostringstream job;
+        job << "render scene=" << opt.scene << " width=" << opt.nx << " height=" << opt.ny << " spp=" << opt.ns
+            << " max_depth=" << opt.max_depth << " priority=" << opt.priority << " output=" << opt.output;
+        return submit_job(opt.submit, job.str());
     }
-}
-
-__global__ void render_init(int max_x, int max_y, curandState* rand_state) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
-    if ((i >= max_x) || (j >= max_y)) return;
-    int pixel_index = j * max_x + i;
-    //Each thread gets same seed, a different sequence number, no offset
-    curand_init(1984, pixel_index, 0, &rand_state[pixel_index]);
-}
-
-__global__ void render(vec3* fb, int max_x, int max_y, int ns, camera** cam, hittable** world, curandState* rand_state) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
-    if ((i >= max_x) || (j >= max_y)) return;
-    int pixel_index = j * max_x + i;
-    curandState local_rand_state = rand_state[pixel_index];
-    vec3 col(0, 0, 0);
-    for (int s = 0; s < ns; s++) {
-        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
-        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
-        ray r = (*cam)->get_ray(u, v, &local_rand_state);
-        col += color(r, world, &local_rand_state);
-    }
-    rand_state[pixel_index] = local_rand_state;
-    col /= float(ns);
-    col[0] = sqrt(col[0]);
-    col[1] = sqrt(col[1]);
-    col[2] = sqrt(col[2]);
-    fb[pixel_index] = col;
-}
-
-#define RND (curand_uniform(&local_rand_state))
-
-__global__ void create_world(hittable** d_list, hittable** d_world, camera** d_camera, int nx, int ny, curandState* rand_state) {
-    if (threadIdx.x == 0 && blockIdx.x == 0) {
-        curandState local_rand_state = *rand_state;
-        d_list[0] = new sphere(vec3(0, -1000.0, -1), 1000,
-            new lambertian(vec3(0.5, 0.5, 0.5)));
-        int i = 1;
-        for (int a = -11; a < 11; a++) {
-            for (int b = -11; b < 11; b++) {
-                float choose_mat = RND;
-                vec3 center(a + RND, 0.2, b + RND);
-                if (choose_mat < 0.8f) {
-                    auto center2 = center + vec3(0, RND * RND, 0);
-                    d_list[i++] = new moving_sphere(center, center2, 0.f, 1.f, 0.2,
-                        new lambertian(vec3(RND * RND, RND * RND, RND * RND)));
-                }
-                else if (choose_mat < 0.95f) {
-                    d_list[i++] = new sphere(center, 0.2,
-                        new metal(vec3(0.5f * (1.0f + RND), 0.5f * (1.0f + RND), 0.5f * (1.0f + RND)), 0.5f * RND));
-                }
-                else {
-                    d_list[i++] = new sphere(center, 0.2, new dielectric(1.5));
-                }
-            }
-        }
-        d_list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-        d_list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)));
-        d_list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
-        *rand_state = local_rand_state;
-        *d_world = new hittable_list(d_list, 22 * 22 + 1 + 3);
-
-        vec3 lookfrom(13, 2, 3);
-        vec3 lookat(0, 0, 0);
-        float dist_to_focus = 10.0; (lookfrom - lookat).length();
-        float aperture = 0.1;
-        *d_camera = new camera(lookfrom,
-            lookat,
-            vec3(0, 1, 0),
-            30.0,
-            float(nx) / float(ny),
-            aperture,
-            dist_to_focus,
-            0.f,
-            1.f);
+    if (!opt.views.empty() && opt.scene == "paged") {
+        std::cerr << "--views can't render the paged scene\n";
+        return 1;
     }
-}
-
-__global__ void free_world(hittable** d_list, hittable** d_world, camera** d_cam) {
-    for (int i = 0; i < 8; ++i) {
-        delete* (d_list + i);
+    if (opt.guide && opt.scene == "paged") {
+        std::cerr << "--guide can't render the paged scene\n";
+        return 1;
     }
-    delete *(d_world);
-    delete* (d_cam);
-}
-
-__global__ void simple_light(hittable** d_list, hittable** d_world, camera** d_cam, int nx, int ny) {
-
-    d_list[0] = new rectangle_xz(-10, 10, -10, 10, 0, new lambertian(vec3(0.5, 0.5, 0.5)));
-    d_list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(vec3(0.4, 0.2, 0.1)));
-    d_list[2] = new rectangle_xy(3, 5, 1, 3, -2, new diffuse_light(vec3(4, 4, 4)));
-    d_list[3] = new sphere(vec3(0, 7, 0), 2, new diffuse_light(vec3(4, 4, 4)));
-    *d_world = new hittable_list(d_list, 4);
-    *d_cam = new camera(vec3(26, 3, 6), vec3(0, 2, 0), vec3(0, 1, 0), 30.f, float(nx) / float(ny), 0., 10., 0.f, 0.f);
-}
-
-__global__ void cornell_box(hittable** d_list, hittable** d_world, camera** d_cam, int nx, int ny) {
-
-    d_list[0] = new rectangle_yz(0, 555, 0, 555, 555, new lambertian(vec3(.12, .45, .15)));
-    d_list[1] = new rectangle_yz(0, 555, 0, 555, 0, new lambertian(vec3(.65, .05, .05)));
-    d_list[2] = new rectangle_xz(213, 343, 227, 332, 554, new diffuse_light(vec3(15, 15, 15)));
-    d_list[3] = new rectangle_xz(0, 555, 0, 555, 0, new lambertian(vec3(0.73, 0.73, 0.73)));
-    d_list[4] = new rectangle_xz(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
-    d_list[5] = new rectangle_xy(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
-    hittable* box_1 = new box(vec3(130, 0, 65), vec3(295, 165, 230), new lambertian(vec3(0.73, 0.73, 0.73)));
-    hittable* box_2 = new box(vec3(265, 0, 295), vec3(430, 330, 460), new lambertian(vec3(0.73, 0.73, 0.73)));
-    d_list[6] = box_1;
-    d_list[7] = box_2;
-    *d_world = new hittable_list(d_list, 8);
-    *d_cam = new camera(vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40.f, float(nx) / float(ny), 0.f, 10.f, 0.f, 0.f);
-
-}
+    if (opt.radiance_cache != CACHE_OFF && opt.scene == "paged") {
+        std::cerr << "--radiance-cache can't render the paged scene\n";
+        return 1;
+    }
+    if (opt.restir && opt.scene == "paged") {
+        std::cerr << "--restir can't render the paged scene\n";
+        return 1;
+    }
+    if (opt.devices != 1 && opt.scene == "paged") {
+        std::cerr << "--devices can't render the paged scene\n";
+        return 1;
+    }
+    if (opt.time_budget > 0.f && opt.scene == "paged") {
+        std::cerr << "--time-budget can't render the paged scene\n";
+        return 1;
+    }
+    if (opt.devices != 1 && !opt.environment.empty()) {
+        std::cerr << "--devices can't render with --env\n";
+        return 1;
+    }
+    if (opt.light_paths > 0.f && (opt.scene == "paged" || opt.devices != 1)) {
+        std::cerr << "--light-paths can't render the paged scene or with --devices\n";
+        return 1;
+    }
+    if (opt.devices != 1 && opt.bvh_width != 2) {
+        std::cerr << "--devices can't render with --bvh\n";
+        return 1;
+    }
+    // Each of these picks its own renderer, and only one of them runs.
+    int modes = !opt.views.empty() + opt.preview + opt.guide + (opt.radiance_cache != CACHE_OFF) + opt.restir + (opt.light_paths > 0.f)
+        + (opt.devices != 1) + (opt.time_budget > 0.f) + opt.sort_rays;
+    if (modes > 1) {
+        std::cerr << "only one of --views, --preview, --guide, --radiance-cache, --restir, --light-paths, --devices, --time-budget and "
+            "--sort-rays can be given\n";
+        return 1;
+    }
+    if (!opt.tiled.empty() && (!opt.views.empty() || opt.preview || opt.scene == "paged" || opt.guide || opt.radiance_cache != CACHE_OFF
+        || opt.restir || opt.light_paths > 0.f || opt.devices != 1 || opt.time_budget > 0.f || opt.sort_rays)) {
+        std::cerr << "--tiled only renders the plain path tracer\n";
+        return 1;
+    }
+    set_render_seed(opt.seed);
+    if (!opt.daemon.empty()) {
+        render_daemon daemon(opt.daemon, opt.workers, opt.scene_cache);
+        int status = daemon.run();
+        write_trace(opt.trace);
+        return status;
+    }
+    int list_size = scene_list_size(opt.scene);
 
-int main() {
-    int nx = 600;
-    int ny = 600;
-    int tx = 16;
-    int ty = 16;
-    int ns = 100;
+    int nx = opt.nx;
+    int ny = opt.ny;
+    int tx = TILE_SIZE;
+    int ty = TILE_SIZE;
+    int ns = opt.ns;
 
     std::cerr << "Rendering a " << nx << "x" << ny << " image ";
     std::cerr << "in " << tx << "x" << ty << " blocks.\n";
@@ -193,59 +116,203 @@ int main() {
     int num_pixels = nx * ny;
     size_t fb_size = num_pixels * sizeof(vec3);
 
-    curandState* d_rand_state;
-    checkCudaErrors(cudaMallocManaged((void**)&d_rand_state, num_pixels * sizeof(curandState)));
+    TRACE_PHASE("allocate");
+    // allocate FB; --tiled streams tiles out instead.
+    vec3* fb = nullptr;
+    if (opt.tiled.empty()) checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&fb, fb_size, true));
 
+    // Only the wavefront render carries a random state per pixel, from one
+    // bounce launch to the next; the others seed one per sample. One is kept
+    // for building the scene.
+    bool pixel_states = opt.sort_rays;
+    curandState* d_rand_state;
+    checkCudaErrors(tracked_malloc(MEM_RNG, (void**)&d_rand_state, (pixel_states ? num_pixels : 1) * sizeof(curandState), true));
 
+    TRACE_PHASE("rng init");
     dim3 blocks(nx / tx + 1, ny / ty + 1);
     dim3 threads(tx, ty);
-    render_init << <blocks, threads >> > (nx, ny, d_rand_state);
+    if (pixel_states) render_init << <blocks, threads >> > (nx, ny, d_rand_state);
+    else render_init << <1, 1 >> > (1, 1, d_rand_state);
     checkCudaErrors(cudaGetLastError());
     checkCudaErrors(cudaDeviceSynchronize());
-    // allocate FB
-    vec3* fb;
-    checkCudaErrors(cudaMallocManaged((void**)&fb, fb_size));
+    TRACE_PHASE("scene build");
     hittable** d_list;
-    checkCudaErrors(cudaMallocManaged((void**)&d_list, 8 * sizeof(hittable*)));
+    checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&d_list, list_size * sizeof(hittable*), true));
     hittable** d_world;
-    checkCudaErrors(cudaMallocManaged((void**)&d_world, sizeof(hittable*)));
+    checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&d_world, sizeof(hittable*), true));
+    light_bvh** d_lights;
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&d_lights, sizeof(light_bvh*), true));
     camera** d_camera;
-    checkCudaErrors(cudaMallocManaged((void**)&d_camera, sizeof(camera*)));
-    cornell_box << <1, 1 >> > (d_list, d_world, d_camera, nx, ny);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
-    
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&d_camera, sizeof(camera*), true));
+
+    // The paged scene streams its geometry from a file through a fixed
+    // budget of resident pages.
+    geometry_store* store = nullptr;
+    page_cache* cache = nullptr;
+    paged_view view;
+    if (opt.scene == "paged") {
+        if (!std::ifstream(opt.geometry)) {
+            write_sphere_field(opt.geometry, opt.spheres, 1024, 1984);
+        }
+        store = new geometry_store(opt.geometry);
+        cache = new page_cache(*store, size_t(opt.resident_mb) << 20);
+        view = cache->view();
+        std::cerr << store->header().page_count << " geometry pages, " << cache->resident_slots() << " resident.\n";
+    }
+    unsigned features;
+    if (!create_scene(opt.scene, d_list, d_world, d_lights, d_camera, nx, ny, d_rand_state, features, cache ? &view : nullptr,
+        opt.bvh_width)) {
+        cudaDeviceReset();
+        return 2;
+    }
+    TRACE_COLLECT_DEVICE();
+    device_environment* environment = nullptr;
+    if (!opt.environment.empty()) {
+        TRACE_PHASE("environment");
+        environment = new device_environment(opt.environment, opt.environment_scale);
+        if (!environment->loaded()) {
+            std::cerr << "can't read environment map " << opt.environment << "\n";
+            return 1;
+        }
+        set_environment << <1, 1 >> > (d_lights, environment->view);
+        checkCudaErrors(cudaGetLastError());
+        std::cerr << "environment map " << environment->view.width << "x" << environment->view.height << "\n";
+    }
+    if (!check_memory_budget("building the scene")) {
+        cudaDeviceReset();
+        return 2;
+    }
+    std::cerr << "scene features:"
+        << (features == 0 ? " none" : "")
+        << ((features & FEATURE_DEPTH_OF_FIELD) ? " dof" : "")
+        << ((features & FEATURE_MOTION_BLUR) ? " motion_blur" : "")
+        << ((features & FEATURE_DIELECTRIC) ? " dielectric" : "")
+        << ((features & FEATURE_MEDIA) ? " media" : "")
+        << ", max depth " << std::min(opt.max_depth, MAX_DEPTH) << " (kernel depth " << depth_bucket(opt.max_depth) << ")\n";
+    if (opt.light_paths > 0.f && (features & FEATURE_MEDIA)) {
+        std::cerr << "--light-paths doesn't trace light through participating media\n";
+        return 1;
+    }
+
+    std::vector<int> tile_order = make_tile_order(opt.order, nx, ny);
+    int num_tiles = int(tile_order.size());
+    int* d_tiles;
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&d_tiles, num_tiles * sizeof(int), true));
+    std::copy(tile_order.begin(), tile_order.end(), d_tiles);
+
+    TRACE_PHASE("render");
+    TRACE_TILES_BEGIN(nx, ny);
+    // Header comments of the output image.
+    std::vector<std::string> metadata;
+    // Exit status; a render that fails still tears down before returning it.
+    int status = 0;
     clock_t start, stop;
     start = clock();
     // Render our buffer
-    render << <blocks, threads >> > (fb, nx, ny, ns, d_camera, d_world, d_rand_state);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
+    if (!opt.views.empty()) {
+        std::vector<view_spec> views = read_views(opt.views, nx, ny);
+        camera* h_camera;
+        checkCudaErrors(cudaMallocManaged((void**)&h_camera, sizeof(camera)));
+        read_camera << <1, 1 >> > (d_camera, h_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        if (render_views(views, *h_camera, features, opt.max_depth, ns, opt.order, d_world, d_lights) < int(views.size())) status = 1;
+        checkCudaErrors(cudaFree(h_camera));
+    }
+    else if (opt.preview) {
+        int pw = nx / opt.preview_scale > 0 ? nx / opt.preview_scale : 1;
+        int ph = ny / opt.preview_scale > 0 ? ny / opt.preview_scale : 1;
+        progressive_preview preview(pw, ph, opt.frame_ms, features, opt.max_depth, d_camera, d_world, d_lights, cache);
+        shm_framebuffer* shm = opt.preview_shm.empty() ? nullptr : new shm_framebuffer(opt.preview_shm, pw, ph);
+        std::cerr << "preview " << pw << "x" << ph << ", " << opt.frame_ms << " ms per frame; reading commands from stdin.\n";
+        run_preview(preview, std::cin, [&](const preview_frame& f) {
+            if (shm) shm->publish(f.rgba, f.index, int(f.accumulated));
+            std::cerr << "frame " << f.index << ": " << f.spp << " spp in " << f.trace_ms << " ms, "
+                << f.accumulated << " spp accumulated\n";
+        });
+        delete shm;
+        preview.upscale(fb, nx, ny);
+    }
+    else if (cache) {
+        render_paged(fb, nx, ny, ns, features, opt.max_depth, opt.order, d_tiles, num_tiles, d_camera, d_world, d_lights, *cache);
+    }
+    else if (opt.guide) {
+        render_path_guided(fb, nx, ny, ns, features, opt.max_depth, opt.order, d_tiles, num_tiles, d_camera, d_world, d_lights, opt.reference);
+    }
+    else if (opt.radiance_cache != CACHE_OFF) {
+        render_radiance_cached(fb, nx, ny, ns, features, opt.max_depth, opt.order, d_tiles, num_tiles, d_camera, d_world, d_lights,
+            opt.radiance_cache, opt.reference);
+    }
+    else if (opt.restir) {
+        render_restir(fb, nx, ny, ns, features, opt.max_depth, opt.order, d_tiles, num_tiles, d_camera, d_world, d_lights, opt.reference);
+    }
+    else if (opt.light_paths > 0.f) {
+        render_light_traced(fb, nx, ny, ns, opt.light_paths, features, opt.max_depth, opt.order, d_tiles, num_tiles, d_camera, d_world,
+            d_lights, d_list, list_size);
+    }
+    else if (opt.devices != 1) {
+        print_device_stats(std::cerr, render_multi_device(fb, nx, ny, ns, features, opt.max_depth, opt.order, tile_order, opt.scene,
+            d_camera, d_world, d_lights, opt.devices, opt.pin_threads));
+    }
+    else if (opt.time_budget > 0.f) {
+        std::chrono::steady_clock::time_point deadline = job_start
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(opt.time_budget));
+        deadline_result r = render_to_deadline(fb, nx, ny, deadline, features, opt.max_depth, opt.order, d_tiles, num_tiles,
+            d_camera, d_world, d_lights);
+        ns = r.spp;
+        std::cerr << "time budget " << opt.time_budget << " s: " << r.spp << " spp in " << r.passes << " passes, "
+            << r.seconds << " seconds (warm-up " << r.warmup_seconds * 1e3 << " ms), " << r.slack << " s to spare.\n";
+        metadata.push_back("spp " + std::to_string(r.spp));
+        metadata.push_back("time-budget " + std::to_string(opt.time_budget));
+        metadata.push_back("render-seconds " + std::to_string(r.seconds));
+    }
+    else if (!opt.tiled.empty()) {
+        if (!render_tiled(opt.tiled, nx, ny, ns, features, opt.max_depth, opt.order, tile_order, d_tiles, d_camera, d_world, d_lights)) status = 1;
+    }
+    else if (opt.sort_rays) {
+        render_wavefront(fb, nx, ny, ns, features, opt.max_depth, opt.order, d_tiles, num_tiles, true, d_camera, d_world, d_lights, d_rand_state);
+    }
+    else {
+        launch_render(features, opt.max_depth, num_tiles, fb, nx, ny, ns, opt.order, d_tiles, d_camera, d_world, d_lights);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+    TRACE_TILES_END();
+    double render_seconds = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+    if (!opt.preview && opt.views.empty()) std::cerr << "rendered in " << render_seconds << " seconds, "
+        << double(num_pixels) * ns / render_seconds * 1e-6 << " Msamples/s.\n";
+#ifdef RT_STATS
+    render_stats h_stats;
+    checkCudaErrors(cudaMemcpyFromSymbol(&h_stats, d_stats, sizeof(render_stats)));
+    std::cerr << h_stats.rays << " rays (" << h_stats.rays / render_seconds * 1e-6 << " Mrays/s), "
+        << double(h_stats.node_visits) / double(h_stats.rays) << " BVH nodes per ray.\n";
+#endif
 
-    std::ofstream image("image.ppm");
+    TRACE_PHASE("output");
     // Output FB as Image
-    image << "P3\n" << nx << " " << ny << "\n255\n";
-    for (int j = ny - 1; j >= 0; j--) {
-        for (int i = 0; i < nx; i++) {
-            size_t pixel_index = j * nx + i;
-            int ir = int(255.99 * fb[pixel_index].r());
-            int ig = int(255.99 * fb[pixel_index].g());
-            int ib = int(255.99 * fb[pixel_index].b());
-            image << ir << " " << ig << " " << ib << "\n";
-        }
-    }
-    image.close();
+    if (opt.views.empty() && opt.tiled.empty()) write_ppm(opt.output, fb, nx, ny, metadata);
 
     checkCudaErrors(cudaDeviceSynchronize());
-    free_world << <1, 1 >> > (d_list, d_world, d_camera);
+    TRACE_PHASE("free");
+    free_world << <1, 1 >> > (d_list, list_size, d_world, d_lights, d_camera);
     checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaFree(d_list));
-    checkCudaErrors(cudaFree(d_world));
-    checkCudaErrors(cudaFree(d_camera));
-    checkCudaErrors(cudaFree(fb));
+    checkCudaErrors(tracked_free(d_list));
+    checkCudaErrors(tracked_free(d_world));
+    checkCudaErrors(tracked_free(d_lights));
+    checkCudaErrors(tracked_free(d_camera));
+    delete environment;
+    delete cache;
+    delete store;
+    checkCudaErrors(tracked_free(d_tiles));
+    checkCudaErrors(tracked_free(fb));
+    checkCudaErrors(tracked_free(d_rand_state));
+    print_memory_report(std::cerr);
+    TRACE_PHASE_END();
+    write_trace(opt.trace);
     cudaDeviceReset();
 
     stop = clock();
     double timer_seconds = ((double)(stop - start)) / CLOCKS_PER_SEC;
     std::cerr << "took " << timer_seconds << " seconds.\n";
+    return status;
 }
\ No newline at end of file
@@ -6,6 +6,8 @@ struct hit_record;
 #include "ray.h"
 #include "hittable.h"
 #include "onb.h"
+#include "render_features.h"
+#include "memory_budget.h"
 
 #define RANDVEC3 vec3(curand_uniform(local_rand_state),curand_uniform(local_rand_state),curand_uniform(local_rand_state))
 
@@ -27,20 +29,38 @@ __device__ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& re
         return false;
 }
 
+// Sampled directly rather than by rejection so every thread in a warp
+// consumes the same number of random numbers and never diverges.
 __device__ vec3 random_in_unit_sphere(curandState* local_rand_state) {
-    vec3 p;
-    do {
-        p = 2.0f * RANDVEC3 - vec3(1, 1, 1);
-    } while (p.squared_length() >= 1.0f);
-    return p;
+    float z = 1.0f - 2.0f * curand_uniform(local_rand_state);
+    float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+    float phi = 2.0f * float(M_PI) * curand_uniform(local_rand_state);
+    float s = cbrtf(curand_uniform(local_rand_state));
+    return s * vec3(r * cosf(phi), r * sinf(phi), z);
 }
 
 __device__ vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2.0f * dot(v, n) * n;
 }
 
+// Lets the integrator call the built in materials directly instead of
+// through the vtable; anything else is MATERIAL_OTHER and stays virtual.
+enum material_type {
+    MATERIAL_OTHER,
+    MATERIAL_LAMBERTIAN,
+    MATERIAL_METAL,
+    MATERIAL_DIELECTRIC,
+    MATERIAL_DIFFUSE_LIGHT,
+    // Boundary of a participating medium (medium.h), not a surface.
+    MATERIAL_MEDIUM
+};
+
 class material {
 public:
+    DEVICE_MEMORY_CATEGORY(MEM_MATERIALS)
+
+    __device__ material(int t = MATERIAL_OTHER) : type(t) {}
+    __device__ virtual ~material() {}
     __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* local_rand_state, float& pdf) const = 0;
     __device__ virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
         return 0;
@@ -48,11 +68,22 @@ public:
     __device__ virtual vec3 emitted(double u, double v, const vec3& p) const {
         return vec3(0, 0, 0);
     }
+    // Delta distributions can't be light sampled; the integrator follows
+    // their scattered ray as is.
+    __device__ virtual bool is_specular() const {
+        return false;
+    }
+    // Feature flags a scene using this material needs render() to support.
+    __device__ virtual unsigned features() const {
+        return 0;
+    }
+
+    int type;
 };
 
 class lambertian : public material {
 public:
-    __device__ lambertian(const vec3& a) : albedo(a) {}
+    __device__ lambertian(const vec3& a) : material(MATERIAL_LAMBERTIAN), albedo(a) {}
     __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* local_rand_state, float& pdf) const {
         onb uvw;
         uvw.build_from_w(rec.normal);
@@ -72,20 +103,23 @@ public:
 
 class metal : public material {
 public:
-    __device__ metal(const vec3& a, float f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
+    __device__ metal(const vec3& a, float f) : material(MATERIAL_METAL), albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
     __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* local_rand_state, float& pdf) const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(local_rand_state), r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0.0f);
     }
+    __device__ virtual bool is_specular() const override {
+        return true;
+    }
     vec3 albedo;
     float fuzz;
 };
 
 class dielectric : public material {
 public:
-    __device__ dielectric(float ri) : ref_idx(ri) {}
+    __device__ dielectric(float ri) : material(MATERIAL_DIELECTRIC), ref_idx(ri) {}
     __device__ virtual bool scatter(const ray& r_in,
         const hit_record& rec,
         vec3& attenuation,
@@ -119,13 +153,19 @@ public:
             scattered = ray(rec.p, refracted, r_in.time());
         return true;
     }
+    __device__ virtual bool is_specular() const override {
+        return true;
+    }
+    __device__ virtual unsigned features() const override {
+        return FEATURE_DIELECTRIC;
+    }
 
     float ref_idx;
 };
 
 class diffuse_light : public material {
 public:
-    __device__ diffuse_light (const vec3& a) : emit(a) {}
+    __device__ diffuse_light (const vec3& a) : material(MATERIAL_DIFFUSE_LIGHT), emit(a) {}
 
     __device__ virtual bool scatter(
         const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* local_rand_state, float& pdf) const override {
@@ -0,0 +1,327 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include <curand_kernel.h>
+
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "memory_budget.h"
+#include "render_features.h"
+
+// Voxels per majorant cell along each axis.
+#define MAJORANT_CELL 8
+
+// Marks a hit as a medium boundary crossing rather than a surface. The
+// integrator handles these itself; scatter() is never used.
+class medium_interface : public material {
+public:
+    __device__ medium_interface() : material(MATERIAL_MEDIUM) {}
+    __device__ virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, curandState* local_rand_state, float& pdf) const override {
+        return false;
+    }
+};
+
+// Henyey-Greenstein phase function for the angle between the propagation
+// direction d and the new direction wi; g > 0 scatters forward.
+__device__ inline float henyey_greenstein(float cos_theta, float g) {
+    float denom = 1.f + g * g - 2.f * g * cos_theta;
+    return (1.f - g * g) / (4.f * float(M_PI) * denom * sqrtf(fmaxf(denom, 1e-8f)));
+}
+
+/**
+ * A participating medium filling a closed, convex boundary shape. hit()
+ * doesn't sample the medium: it returns where the ray enters it, or leaves
+ * it if the ray starts inside, with rec.normal against the ray when
+ * entering and along it when leaving. The integrator keeps track of the
+ * medium a path is in and samples collisions between crossings with
+ * sample_collision() (delta tracking) and shadow rays with transmittance()
+ * (ratio tracking). Media may not overlap.
+ *
+ * Distances are in units of the ray parameter t, so directions don't need
+ * to be normalized.
+ */
+class medium : public hittable {
+public:
+    __device__ medium(hittable* b, const vec3& a, float phase_g) : boundary(b), albedo(a), g(phase_g) {
+        boundary->bounding_box(0, 1, bounds);
+    }
+    __device__ virtual ~medium() {
+        delete boundary;
+    }
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override {
+        hit_record first, second;
+        if (!boundary->hit(r, -FLT_MAX, FLT_MAX, first)) return false;
+        if (!boundary->hit(r, first.t + 0.0001f, FLT_MAX, second)) return false;
+        vec3 d = unit_vector(r.direction());
+        if (first.t > t_min && first.t < t_max) {
+            rec.t = first.t;
+            rec.normal = -d;
+        }
+        else if (second.t > t_min && second.t < t_max) {
+            rec.t = second.t;
+            rec.normal = d;
+        }
+        else {
+            return false;
+        }
+        rec.p = r.at(rec.t);
+        rec.mat_ptr = const_cast<medium_interface*>(&interface);
+        rec.obj = this;
+        return true;
+    }
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override {
+        box = bounds;
+        return true;
+    }
+    __device__ virtual unsigned features() const override {
+        return FEATURE_MEDIA;
+    }
+
+    // Distance to the first real collision along r before t_max, if any.
+    __device__ virtual bool sample_collision(const ray& r, float t_max, curandState* state, float& t) const = 0;
+    // Fraction of light that crosses r from 0 to t_max.
+    __device__ virtual float transmittance(const ray& r, float t_max, curandState* state) const = 0;
+
+    __device__ float phase(const vec3& d, const vec3& wi) const {
+        return henyey_greenstein(dot(unit_vector(d), unit_vector(wi)), g);
+    }
+    // Samples wi in proportion to phase(d, wi) and returns its density.
+    __device__ float sample_phase(const vec3& d, curandState* state, vec3& wi) const {
+        float u1 = curand_uniform(state);
+        float u2 = curand_uniform(state);
+        float cos_theta;
+        if (fabsf(g) < 1e-3f) {
+            cos_theta = 1.f - 2.f * u1;
+        }
+        else {
+            float s = (1.f - g * g) / (1.f - g + 2.f * g * u1);
+            cos_theta = (1.f + g * g - s * s) / (2.f * g);
+        }
+        float sin_theta = sqrtf(fmaxf(0.f, 1.f - cos_theta * cos_theta));
+        float phi = 2.f * float(M_PI) * u2;
+        onb uvw;
+        uvw.build_from_w(d);
+        wi = uvw.local(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+        return henyey_greenstein(cos_theta, g);
+    }
+
+    hittable* boundary;
+    aabb bounds;
+    vec3 albedo;
+    float g;
+    medium_interface interface;
+};
+
+__device__ inline bool medium_entering(const hit_record& rec, const ray& r) {
+    return dot(rec.normal, r.direction()) < 0.f;
+}
+
+// Constant density: free flights and transmittance in closed form.
+class homogeneous_medium : public medium {
+public:
+    __device__ homogeneous_medium(hittable* b, float density, const vec3& a, float phase_g = 0.f)
+        : medium(b, a, phase_g), sigma_t(density) {}
+
+    __device__ virtual bool sample_collision(const ray& r, float t_max, curandState* state, float& t) const override {
+        float sigma = sigma_t * r.direction().length();
+        t = -logf(1.f - curand_uniform(state)) / sigma;
+        return t < t_max;
+    }
+    __device__ virtual float transmittance(const ray& r, float t_max, curandState* state) const override {
+        return expf(-sigma_t * r.direction().length() * t_max);
+    }
+
+    float sigma_t;
+};
+
+/**
+ * Density on a voxel grid spanning the boundary's bounding box, sampled
+ * trilinearly. A coarse grid stores the maximum density over each
+ * MAJORANT_CELL^3 block of voxels. Tracking walks that grid with a DDA and
+ * draws tentative collisions against each cell's own majorant, so empty
+ * cells cost one step however large they are, and thin regions aren't
+ * sampled at the rate of the densest one.
+ */
+class grid_medium : public medium {
+public:
+    // Takes ownership of density, which must come from
+    // device_new_array<float>(MEM_GEOMETRY, nx * ny * nz).
+    __device__ grid_medium(hittable* b, float* density, int nx, int ny, int nz, float scale, const vec3& a, float phase_g = 0.f);
+    __device__ virtual ~grid_medium() {
+        device_delete_array(MEM_GEOMETRY, density, nx * ny * nz);
+        device_delete_array(MEM_BVH, majorant, mx * my * mz);
+    }
+
+    __device__ virtual bool sample_collision(const ray& r, float t_max, curandState* state, float& t) const override;
+    __device__ virtual float transmittance(const ray& r, float t_max, curandState* state) const override;
+
+    __device__ float density_at(const vec3& p) const;
+
+    float* density;
+    int nx, ny, nz;
+    float* majorant;
+    int mx, my, mz;
+    float scale;
+
+private:
+    // Calls visit(t0, t1, majorant) for each majorant cell r crosses between
+    // 0 and t_max, in order, until visit returns false.
+    template <typename Visit>
+    __device__ void march(const ray& r, float t_max, Visit visit) const;
+};
+
+__device__ grid_medium::grid_medium(hittable* b, float* d, int x, int y, int z, float s, const vec3& a, float phase_g)
+    : medium(b, a, phase_g), density(d), nx(x), ny(y), nz(z), scale(s) {
+    mx = (nx + MAJORANT_CELL - 1) / MAJORANT_CELL;
+    my = (ny + MAJORANT_CELL - 1) / MAJORANT_CELL;
+    mz = (nz + MAJORANT_CELL - 1) / MAJORANT_CELL;
+    majorant = device_new_array<float>(MEM_BVH, mx * my * mz);
+    // Out of device heap; create_scene() reports it.
+    if (majorant == nullptr) return;
+    // march() splits the box into cells of extent / m, which are only
+    // MAJORANT_CELL voxels wide when n is a multiple of it, so each cell's
+    // voxels come from its own extent: cell c of m spans voxels c * n / m
+    // to (c + 1) * n / m. One voxel of overlap on either side, since
+    // trilinear lookups near a cell's edge read the neighbouring voxels too.
+    auto first = [](int c, int n, int m) { return max(c * n / m - 1, 0); };
+    auto last = [](int c, int n, int m) { return min(((c + 1) * n + m - 1) / m, n - 1); };
+    for (int k = 0; k < mz; ++k) {
+        for (int j = 0; j < my; ++j) {
+            for (int i = 0; i < mx; ++i) {
+                float m = 0.f;
+                for (int vz = first(k, nz, mz); vz <= last(k, nz, mz); ++vz)
+                    for (int vy = first(j, ny, my); vy <= last(j, ny, my); ++vy)
+                        for (int vx = first(i, nx, mx); vx <= last(i, nx, mx); ++vx)
+                            m = fmaxf(m, density[(vz * ny + vy) * nx + vx]);
+                majorant[(k * my + j) * mx + i] = m * scale;
+            }
+        }
+    }
+}
+
+__device__ float grid_medium::density_at(const vec3& p) const {
+    vec3 extent = bounds.max() - bounds.min();
+    float gx = (p.x() - bounds.min().x()) / extent.x() * nx - 0.5f;
+    float gy = (p.y() - bounds.min().y()) / extent.y() * ny - 0.5f;
+    float gz = (p.z() - bounds.min().z()) / extent.z() * nz - 0.5f;
+    gx = fminf(fmaxf(gx, 0.f), float(nx - 1));
+    gy = fminf(fmaxf(gy, 0.f), float(ny - 1));
+    gz = fminf(fmaxf(gz, 0.f), float(nz - 1));
+    int x0 = int(gx), y0 = int(gy), z0 = int(gz);
+    int x1 = min(x0 + 1, nx - 1), y1 = min(y0 + 1, ny - 1), z1 = min(z0 + 1, nz - 1);
+    float fx = gx - x0, fy = gy - y0, fz = gz - z0;
+    auto at = [&](int x, int y, int z) { return density[(z * ny + y) * nx + x]; };
+    float c00 = at(x0, y0, z0) * (1.f - fx) + at(x1, y0, z0) * fx;
+    float c10 = at(x0, y1, z0) * (1.f - fx) + at(x1, y1, z0) * fx;
+    float c01 = at(x0, y0, z1) * (1.f - fx) + at(x1, y0, z1) * fx;
+    float c11 = at(x0, y1, z1) * (1.f - fx) + at(x1, y1, z1) * fx;
+    float c0 = c00 * (1.f - fy) + c10 * fy;
+    float c1 = c01 * (1.f - fy) + c11 * fy;
+    return c0 * (1.f - fz) + c1 * fz;
+}
+
+template <typename Visit>
+__device__ void grid_medium::march(const ray& r, float t_max, Visit visit) const {
+    // Clip to the grid's box.
+    float t0 = 0.f, t1 = t_max;
+    vec3 o = r.origin(), d = r.direction();
+    for (int a = 0; a < 3; ++a) {
+        float inv = 1.f / d[a];
+        float near = (bounds.min()[a] - o[a]) * inv;
+        float far = (bounds.max()[a] - o[a]) * inv;
+        if (near > far) { float tmp = near; near = far; far = tmp; }
+        t0 = fmaxf(t0, near);
+        t1 = fminf(t1, far);
+        if (t1 <= t0) return;
+    }
+
+    int res[3] = { mx, my, mz };
+    vec3 extent = bounds.max() - bounds.min();
+    vec3 p = r.at(t0);
+    int cell[3], step[3], last[3];
+    float next[3], delta[3];
+    for (int a = 0; a < 3; ++a) {
+        float cell_size = extent[a] / res[a];
+        float g = (p[a] - bounds.min()[a]) / cell_size;
+        cell[a] = min(max(int(g), 0), res[a] - 1);
+        if (d[a] > 0.f) {
+            step[a] = 1;
+            last[a] = res[a];
+            next[a] = t0 + (bounds.min()[a] + (cell[a] + 1) * cell_size - p[a]) / d[a];
+            delta[a] = cell_size / d[a];
+        }
+        else if (d[a] < 0.f) {
+            step[a] = -1;
+            last[a] = -1;
+            next[a] = t0 + (bounds.min()[a] + cell[a] * cell_size - p[a]) / d[a];
+            delta[a] = -cell_size / d[a];
+        }
+        else {
+            step[a] = 0;
+            last[a] = res[a];
+            next[a] = FLT_MAX;
+            delta[a] = FLT_MAX;
+        }
+    }
+
+    float t = t0;
+    for (;;) {
+        int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        float t_exit = fminf(next[a], t1);
+        float m = majorant[(cell[2] * my + cell[1]) * mx + cell[0]];
+        if (t_exit > t && !visit(t, t_exit, m)) return;
+        if (next[a] >= t1) return;
+        t = next[a];
+        cell[a] += step[a];
+        if (cell[a] == last[a]) return;
+        next[a] += delta[a];
+    }
+}
+
+__device__ bool grid_medium::sample_collision(const ray& r, float t_max, curandState* state, float& t) const {
+    float len = r.direction().length();
+    bool collided = false;
+    march(r, t_max, [&](float t0, float t1, float m) {
+        float sigma_max = m * len;
+        if (sigma_max <= 0.f) return true;
+        float s = t0;
+        for (;;) {
+            s -= logf(1.f - curand_uniform(state)) / sigma_max;
+            if (s >= t1) return true;
+            if (curand_uniform(state) * sigma_max < density_at(r.at(s)) * scale * len) {
+                t = s;
+                collided = true;
+                return false;
+            }
+        }
+    });
+    return collided;
+}
+
+__device__ float grid_medium::transmittance(const ray& r, float t_max, curandState* state) const {
+    float len = r.direction().length();
+    float tr = 1.f;
+    march(r, t_max, [&](float t0, float t1, float m) {
+        float sigma_max = m * len;
+        if (sigma_max <= 0.f) return true;
+        float s = t0;
+        for (;;) {
+            s -= logf(1.f - curand_uniform(state)) / sigma_max;
+            if (s >= t1) return true;
+            tr *= 1.f - density_at(r.at(s)) * scale * len / sigma_max;
+            // Russian roulette once little light is left.
+            if (tr < 0.1f) {
+                if (curand_uniform(state) > 0.5f) {
+                    tr = 0.f;
+                    return false;
+                }
+                tr *= 2.f;
+            }
+        }
+    });
+    return tr;
+}
+
+#endif
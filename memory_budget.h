@@ -0,0 +1,248 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <new>
+#include <cstdint>
+#include <cuda_runtime.h>
+
+enum memory_category {
+    MEM_FRAMEBUFFER,
+    MEM_RNG,
+    MEM_GEOMETRY,
+    MEM_BVH,
+    MEM_MATERIALS,
+    MEM_TEXTURES,
+    MEM_OTHER,
+    MEM_CATEGORIES
+};
+
+static const char* const memory_category_names[MEM_CATEGORIES] = {
+    "framebuffer", "rng", "geometry", "bvh", "materials", "textures", "other"
+};
+
+// What to do when an allocation would go over the budget: stop the run, or
+// shrink to what is left where that is possible. Only the paged scene's
+// resident page cache can (see page_cache, the one caller of
+// memory_degrades()); everything else fails as under MEM_POLICY_FAIL.
+enum memory_policy {
+    MEM_POLICY_FAIL,
+    MEM_POLICY_DEGRADE
+};
+
+struct memory_usage {
+    unsigned long long current[MEM_CATEGORIES];
+    unsigned long long peak[MEM_CATEGORIES];
+    unsigned long long failed;
+};
+
+/**
+ * Scene objects built on the device heap are counted by their class's
+ * operator new and operator delete, which go through device_alloc() and
+ * device_free(). Sized delete keeps the counts exact without a header on
+ * every allocation.
+ */
+__device__ memory_usage d_memory;
+
+// Bytes counted on the device heap across categories, and the most it may
+// hold: the budget less the host's tracked buffers, as of the last
+// memory_snapshot(). A limit of 0 means unlimited.
+__device__ unsigned long long d_memory_heap;
+__device__ unsigned long long d_memory_limit;
+
+// Null when the heap is exhausted or the allocation would take it past
+// d_memory_limit; either way it is counted as failed.
+__device__ void* device_alloc(int category, size_t bytes) {
+    unsigned long long heap = atomicAdd(&d_memory_heap, (unsigned long long)bytes) + bytes;
+    void* p = d_memory_limit > 0 && heap > d_memory_limit ? nullptr : malloc(bytes);
+    if (p == nullptr) {
+        atomicAdd(&d_memory_heap, (unsigned long long)(-(long long)bytes));
+        atomicAdd(&d_memory.failed, 1ull);
+        return nullptr;
+    }
+    unsigned long long now = atomicAdd(&d_memory.current[category], (unsigned long long)bytes) + bytes;
+    atomicMax(&d_memory.peak[category], now);
+    return p;
+}
+
+__device__ void device_free(int category, void* p, size_t bytes) {
+    if (p == nullptr) return;
+    atomicAdd(&d_memory.current[category], (unsigned long long)(-(long long)bytes));
+    atomicAdd(&d_memory_heap, (unsigned long long)(-(long long)bytes));
+    free(p);
+}
+
+// Device allocations that have failed so far. A scene build compares it
+// before and after a step, and stops once it has gone up.
+__device__ unsigned long long device_alloc_failures() {
+    return *(volatile unsigned long long*)&d_memory.failed;
+}
+
+template <typename T>
+__device__ T* device_new_array(int category, int n) {
+    T* p = (T*)device_alloc(category, n * sizeof(T));
+    for (int i = 0; p != nullptr && i < n; ++i) new (p + i) T();
+    return p;
+}
+
+template <typename T>
+__device__ void device_delete_array(int category, T* p, int n) {
+    device_free(category, p, n * sizeof(T));
+}
+
+// Class scope operator new/delete that count a class's objects under one
+// category. operator new doesn't throw, so when device_alloc() returns null
+// the new-expression yields null without running the constructor.
+#define DEVICE_MEMORY_CATEGORY(category) \
+    __device__ static void* operator new(size_t bytes) noexcept { return device_alloc(category, bytes); } \
+    __device__ static void operator delete(void* p, size_t bytes) { device_free(category, p, bytes); }
+
+/**
+ * Host side: device buffers allocated through tracked_malloc(), the budget
+ * and the policy. A budget of 0 means unlimited.
+ */
+struct memory_tracker {
+    memory_usage usage = {};
+    // Device heap counts as of the last memory_snapshot().
+    memory_usage device = {};
+    size_t budget = 0;
+    int policy = MEM_POLICY_FAIL;
+    std::map<void*, std::pair<int, size_t>> blocks;
+    std::mutex mutex;
+};
+
+memory_tracker host_memory;
+
+// Device heap counts, as of the last kernel that finished.
+memory_usage device_memory_usage() {
+    memory_usage usage;
+    cudaDeviceSynchronize();
+    cudaMemcpyFromSymbol(&usage, d_memory, sizeof(memory_usage));
+    return usage;
+}
+
+inline unsigned long long memory_total(const memory_usage& usage) {
+    unsigned long long sum = 0;
+    for (int c = 0; c < MEM_CATEGORIES; ++c) sum += usage.current[c];
+    return sum;
+}
+
+// What the budget leaves the device heap once the host's tracked buffers
+// are paid for; 0 without a budget. Called with host_memory.mutex held.
+unsigned long long device_memory_limit() {
+    if (host_memory.budget == 0) return 0;
+    unsigned long long host = memory_total(host_memory.usage);
+    // 1, not 0, when nothing is left: 0 would lift the limit.
+    return host < host_memory.budget ? host_memory.budget - host : 1;
+}
+
+// Host tracked buffers and the device heap together. Also hands the device
+// heap its share of the budget as it now stands.
+memory_usage memory_snapshot() {
+    memory_usage device = device_memory_usage();
+    std::lock_guard<std::mutex> lock(host_memory.mutex);
+    host_memory.device = device;
+    unsigned long long limit = device_memory_limit();
+    cudaMemcpyToSymbol(d_memory_limit, &limit, sizeof(limit));
+    memory_usage total = host_memory.usage;
+    for (int c = 0; c < MEM_CATEGORIES; ++c) {
+        total.current[c] += device.current[c];
+        total.peak[c] += device.peak[c];
+    }
+    total.failed += device.failed;
+    return total;
+}
+
+void set_memory_budget(size_t bytes, int policy) {
+    std::lock_guard<std::mutex> lock(host_memory.mutex);
+    host_memory.budget = bytes;
+    host_memory.policy = policy;
+}
+
+bool memory_degrades() {
+    std::lock_guard<std::mutex> lock(host_memory.mutex);
+    return host_memory.policy == MEM_POLICY_DEGRADE;
+}
+
+// Budget left for new allocations, and no more than the device has free;
+// SIZE_MAX without a budget. Called on every tracked_malloc(), so it doesn't
+// wait for the device: the device heap is counted as of the last
+// memory_snapshot(), which the scene build is followed by.
+size_t memory_available() {
+    if (host_memory.budget == 0) return SIZE_MAX;
+    unsigned long long used;
+    {
+        std::lock_guard<std::mutex> lock(host_memory.mutex);
+        used = memory_total(host_memory.usage) + memory_total(host_memory.device);
+    }
+    size_t left = used >= host_memory.budget ? 0 : size_t(host_memory.budget - used);
+    size_t free_bytes, total_bytes;
+    if (cudaMemGetInfo(&free_bytes, &total_bytes) == cudaSuccess && free_bytes < left) left = free_bytes;
+    return left;
+}
+
+void print_memory_report(std::ostream& out) {
+    memory_usage usage = memory_snapshot();
+    out << "memory (MB, current / peak):";
+    for (int c = 0; c < MEM_CATEGORIES; ++c) {
+        if (usage.peak[c] == 0) continue;
+        out << " " << memory_category_names[c] << " " << std::fixed << std::setprecision(2)
+            << usage.current[c] / 1048576.0 << " / " << usage.peak[c] / 1048576.0;
+    }
+    out << std::defaultfloat;
+    if (host_memory.budget > 0) out << ", budget " << host_memory.budget / 1048576.0;
+    if (usage.failed > 0) out << ", " << usage.failed << " failed device allocations";
+    out << "\n";
+}
+
+// Whether the scene and buffers built so far fit the budget. Reports what
+// is using it when they don't; the caller decides whether that ends the
+// run or just one job.
+bool check_memory_budget(const char* stage) {
+    if (host_memory.budget == 0) return true;
+    unsigned long long used = memory_total(memory_snapshot());
+    if (used <= host_memory.budget) return true;
+    std::cerr << "memory budget exceeded after " << stage << ": " << used / 1048576.0 << " MB of "
+        << host_memory.budget / 1048576.0 << " MB\n";
+    print_memory_report(std::cerr);
+    return false;
+}
+
+// cudaMalloc/cudaMallocManaged counted under category. Over the budget it
+// returns cudaErrorMemoryAllocation without allocating, so checkCudaErrors
+// stops the run; callers that can degrade check memory_available() first,
+// and the render daemon fails just the job.
+cudaError_t tracked_malloc(int category, void** p, size_t bytes, bool managed = false) {
+    if (host_memory.budget > 0 && bytes > memory_available()) {
+        std::cerr << "memory budget exceeded: " << memory_category_names[category] << " needs "
+            << bytes / 1048576.0 << " MB, " << memory_available() / 1048576.0 << " MB left\n";
+        print_memory_report(std::cerr);
+        return cudaErrorMemoryAllocation;
+    }
+    cudaError_t result = managed ? cudaMallocManaged(p, bytes) : cudaMalloc(p, bytes);
+    if (result != cudaSuccess) return result;
+    std::lock_guard<std::mutex> lock(host_memory.mutex);
+    host_memory.blocks[*p] = std::make_pair(category, bytes);
+    unsigned long long& current = host_memory.usage.current[category];
+    current += bytes;
+    if (current > host_memory.usage.peak[category]) host_memory.usage.peak[category] = current;
+    return result;
+}
+
+cudaError_t tracked_free(void* p) {
+    if (p == nullptr) return cudaSuccess;
+    {
+        std::lock_guard<std::mutex> lock(host_memory.mutex);
+        auto it = host_memory.blocks.find(p);
+        if (it != host_memory.blocks.end()) {
+            host_memory.usage.current[it->second.first] -= it->second.second;
+            host_memory.blocks.erase(it);
+        }
+    }
+    return cudaFree(p);
+}
+
+#endif
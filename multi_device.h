@@ -0,0 +1,295 @@
+#ifndef MULTI_DEVICE_H
+#define MULTI_DEVICE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <curand_kernel.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "render.h"
+#include "trace.h"
+
+// Blocks per streaming multiprocessor in one launch of a device's tiles.
+// Each device keeps two launches queued, so the device never waits on the
+// host thread between them.
+#define DEVICE_BLOCKS_PER_SM 8
+
+// Reads a sysfs attribute of the PCI device behind a CUDA device; empty if
+// there is none (not Linux, or no such file).
+inline std::string device_sysfs(int device, const char* attribute) {
+    char bus_id[32];
+    if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device) != cudaSuccess) return "";
+    std::string path = "/sys/bus/pci/devices/";
+    for (const char* c = bus_id; *c; ++c) path += char(tolower(*c));
+    std::ifstream in(path + "/" + attribute);
+    std::string value;
+    std::getline(in, value);
+    return value;
+}
+
+// NUMA node the device is attached to, or -1 if unknown.
+inline int device_numa_node(int device) {
+    std::string node = device_sysfs(device, "numa_node");
+    return node.empty() ? -1 : atoi(node.c_str());
+}
+
+// CPUs on the device's NUMA node, parsed from a list like "0-15,32-47".
+inline std::vector<int> device_local_cpus(int device) {
+    std::vector<int> cpus;
+    std::istringstream list(device_sysfs(device, "local_cpulist"));
+    for (std::string range; std::getline(list, range, ',');) {
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int c = first; c <= last; ++c) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// Restricts the calling thread to cpus. Returns false where that isn't
+// supported or cpus is empty, and the thread stays where it was.
+inline bool pin_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) {
+        if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Tiles handed out with device affinity. Device d starts with the d-th
+ * contiguous run of the tile order, so with a Morton or Hilbert order each
+ * device renders one compact patch of the image and touches the part of
+ * the scene that patch sees. A device that finishes its run takes chunks
+ * from the end of the longest run left, keeping the others' fronts intact.
+ */
+class affinity_tile_queue {
+public:
+    affinity_tile_queue(int num_tiles, int num_devices) : begin(num_devices), end(num_devices) {
+        for (int d = 0; d < num_devices; ++d) {
+            begin[d] = int((long long)num_tiles * d / num_devices);
+            end[d] = int((long long)num_tiles * (d + 1) / num_devices);
+        }
+    }
+
+    // The next up to chunk tiles for device, as [first, first + count).
+    // False once every tile has been handed out.
+    bool next(int device, int chunk, int& first, int& count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (begin[device] < end[device]) {
+            first = begin[device];
+            count = std::min(chunk, end[device] - first);
+            begin[device] += count;
+            return true;
+        }
+        int victim = -1;
+        for (int d = 0; d < int(begin.size()); ++d) {
+            if (end[d] - begin[d] > 0 && (victim < 0 || end[d] - begin[d] > end[victim] - begin[victim])) victim = d;
+        }
+        if (victim < 0) return false;
+        // Leave the owner at least as much as is taken.
+        count = std::min(chunk, (end[victim] - begin[victim] + 1) / 2);
+        end[victim] -= count;
+        first = end[victim];
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<int> begin, end;
+};
+
+struct device_render_stats {
+    int device;
+    int numa_node;
+    int pinned_cpus;
+    int tiles;
+    double ms;
+};
+
+// Builds its own copy of a scene on the current device, with the RNG state
+// main() would have seeded the build with.
+struct scene_replica {
+    scene_replica(const std::string& name, int nx, int ny, int bvh_width = 2) {
+        list_size = scene_list_size(name);
+        checkCudaErrors(tracked_malloc(MEM_RNG, (void**)&rand_state, sizeof(curandState)));
+        render_init << <1, 1 >> > (1, 1, rand_state);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaMallocManaged((void**)&d_list, list_size * sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_world, sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_lights, sizeof(light_bvh*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_camera, sizeof(camera*)));
+        built = create_scene(name, d_list, d_world, d_lights, d_camera, nx, ny, rand_state, features, nullptr, bvh_width);
+    }
+    ~scene_replica() {
+        free_world << <1, 1 >> > (d_list, list_size, d_world, d_lights, d_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaFree(d_list));
+        checkCudaErrors(cudaFree(d_world));
+        checkCudaErrors(cudaFree(d_lights));
+        checkCudaErrors(cudaFree(d_camera));
+        checkCudaErrors(tracked_free(rand_state));
+    }
+
+    int list_size;
+    // False if the replica didn't fit on its device.
+    bool built;
+    unsigned features;
+    curandState* rand_state;
+    hittable** d_list;
+    hittable** d_world;
+    light_bvh** d_lights;
+    camera** d_camera;
+};
+
+/**
+ * Renders one image across num_devices GPUs. Each device is driven by its
+ * own host thread, pinned (unless pin is false) to the CPUs of the NUMA
+ * node the device hangs off, so launches, copies and the staging buffer
+ * stay on that node. The scene already built on the current device (cam,
+ * world, lights) renders its share there; every other device builds a
+ * replica in its own memory, so no device reads geometry across the
+ * interconnect. Devices render into their own framebuffers and copy them
+ * to host memory allocated by their pinned thread; the tiles each device
+ * rendered are then merged into fb. Samples are seeded by pixel and
+ * sample number (sample_state()), so the image matches a single-device
+ * render.
+ */
+std::vector<device_render_stats> render_multi_device(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order,
+    const std::vector<int>& tile_order, const std::string& scene, camera** cam, hittable** world, light_bvh** lights,
+    int num_devices, bool pin) {
+    int home;
+    checkCudaErrors(cudaGetDevice(&home));
+    std::vector<int> devices = { home };
+    int count;
+    checkCudaErrors(cudaGetDeviceCount(&count));
+    if (num_devices <= 0) num_devices = count;
+    for (int d = 0; d < count && int(devices.size()) < num_devices; ++d) {
+        if (d != home) devices.push_back(d);
+    }
+    int n = int(devices.size());
+    int num_tiles = int(tile_order.size());
+    size_t num_pixels = size_t(nx) * ny;
+
+    affinity_tile_queue queue(num_tiles, n);
+    std::vector<device_render_stats> stats(n);
+    std::vector<vec3*> local_fb(n, nullptr);
+    std::vector<std::vector<std::pair<int, int>>> rendered(n);
+
+    auto worker = [&](int k) {
+        int device = devices[k];
+        device_render_stats& s = stats[k];
+        s.device = device;
+        s.numa_node = device_numa_node(device);
+        std::vector<int> cpus = device_local_cpus(device);
+        s.pinned_cpus = pin && pin_thread(cpus) ? int(cpus.size()) : 0;
+        checkCudaErrors(cudaSetDevice(device));
+        set_render_seed(render_seed);
+        TRACE_THREAD_NAME("device " + std::to_string(device));
+
+        TRACE_PHASE("replica build");
+        scene_replica* replica = k == 0 ? nullptr : new scene_replica(scene, nx, ny);
+        if (replica != nullptr && !replica->built) {
+            // The other devices take its tiles.
+            delete replica;
+            TRACE_PHASE_END();
+            return;
+        }
+        camera** d_cam = replica ? replica->d_camera : cam;
+        hittable** d_world = replica ? replica->d_world : world;
+        light_bvh** d_lights = replica ? replica->d_lights : lights;
+
+        int sms;
+        checkCudaErrors(cudaDeviceGetAttribute(&sms, cudaDevAttrMultiProcessorCount, device));
+        int chunk = sms * DEVICE_BLOCKS_PER_SM;
+        vec3* d_fb;
+        int* d_tiles;
+        checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&d_fb, num_pixels * sizeof(vec3)));
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&d_tiles, num_tiles * sizeof(int)));
+        checkCudaErrors(cudaMemcpy(d_tiles, tile_order.data(), num_tiles * sizeof(int), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaDeviceSynchronize());
+
+        TRACE_PHASE("render");
+        auto start = std::chrono::steady_clock::now();
+        cudaEvent_t in_flight[2];
+        checkCudaErrors(cudaEventCreate(&in_flight[0]));
+        checkCudaErrors(cudaEventCreate(&in_flight[1]));
+        int first, tiles;
+        for (int launch = 0; queue.next(k, chunk, first, tiles); ++launch) {
+            // Wait for the launch before last, so two stay queued.
+            if (launch >= 2) {
+                TRACE_SCOPE("wait");
+                checkCudaErrors(cudaEventSynchronize(in_flight[launch % 2]));
+            }
+            launch_render(features, max_depth, tiles, d_fb, nx, ny, ns, order, d_tiles + first, d_cam, d_world, d_lights);
+            checkCudaErrors(cudaGetLastError());
+            checkCudaErrors(cudaEventRecord(in_flight[launch % 2]));
+            rendered[k].push_back(std::make_pair(first, tiles));
+            s.tiles += tiles;
+        }
+        checkCudaErrors(cudaDeviceSynchronize());
+        s.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        TRACE_PHASE("copy back");
+        // First touched by this thread, so on this node.
+        checkCudaErrors(cudaMallocHost((void**)&local_fb[k], num_pixels * sizeof(vec3)));
+        checkCudaErrors(cudaMemcpy(local_fb[k], d_fb, num_pixels * sizeof(vec3), cudaMemcpyDeviceToHost));
+        checkCudaErrors(cudaEventDestroy(in_flight[0]));
+        checkCudaErrors(cudaEventDestroy(in_flight[1]));
+        checkCudaErrors(tracked_free(d_tiles));
+        checkCudaErrors(tracked_free(d_fb));
+        delete replica;
+        TRACE_PHASE_END();
+    };
+
+    std::vector<std::thread> threads;
+    for (int k = 0; k < n; ++k) threads.emplace_back(worker, k);
+    for (std::thread& t : threads) t.join();
+    checkCudaErrors(cudaSetDevice(home));
+
+    TRACE_SCOPE("merge");
+    for (int k = 0; k < n; ++k) {
+        for (const std::pair<int, int>& run : rendered[k]) {
+            for (int t = run.first; t < run.first + run.second; ++t) {
+                int x0 = (tile_order[t] & 0xffff) * TILE_SIZE;
+                int y0 = (tile_order[t] >> 16) * TILE_SIZE;
+                int width = std::min(TILE_SIZE, nx - x0);
+                for (int y = y0; y < std::min(y0 + TILE_SIZE, ny); ++y) {
+                    std::copy(local_fb[k] + size_t(y) * nx + x0, local_fb[k] + size_t(y) * nx + x0 + width, fb + size_t(y) * nx + x0);
+                }
+            }
+        }
+        checkCudaErrors(cudaFreeHost(local_fb[k]));
+    }
+    return stats;
+}
+
+inline void print_device_stats(std::ostream& out, const std::vector<device_render_stats>& stats) {
+    for (const device_render_stats& s : stats) {
+        out << "device " << s.device << ": node " << s.numa_node << ", "
+            << (s.pinned_cpus > 0 ? std::to_string(s.pinned_cpus) + " cpus pinned" : std::string("not pinned")) << ", "
+            << s.tiles << " tiles in " << s.ms << " ms\n";
+    }
+}
+
+#endif
@@ -5,34 +5,39 @@
 
 class onb {
 public:
-    __device__ onb() {}
+    __host__ __device__ onb() {}
 
-    __device__ inline vec3 operator[](int i) const { return axis[i]; }
+    __host__ __device__ inline vec3 operator[](int i) const { return axis[i]; }
 
-    __device__ vec3 u() const { return axis[0]; }
-    __device__ vec3 v() const { return axis[1]; }
-    __device__ vec3 w() const { return axis[2]; }
+    __host__ __device__ vec3 u() const { return axis[0]; }
+    __host__ __device__ vec3 v() const { return axis[1]; }
+    __host__ __device__ vec3 w() const { return axis[2]; }
 
-    __device__ vec3 local(double a, double b, double c) const {
+    __host__ __device__ vec3 local(double a, double b, double c) const {
         return a * u() + b * v() + c * w();
     }
 
-    __device__ vec3 local(const vec3& a) const {
+    __host__ __device__ vec3 local(const vec3& a) const {
         return a.x() * u() + a.y() * v() + a.z() * w();
     }
 
-    __device__ void build_from_w(const vec3&);
+    __host__ __device__ void build_from_w(const vec3&);
 
 public:
     vec3 axis[3];
 };
 
 
-__device__ void onb::build_from_w(const vec3& n) {
+// Branchless basis from Duff et al., "Building an Orthonormal Basis,
+// Revisited" (JCGT 2017); no cross products or second normalization.
+__host__ __device__ void onb::build_from_w(const vec3& n) {
     axis[2] = unit_vector(n);
-    vec3 a = (fabs(w().x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
-    axis[1] = unit_vector(cross(w(), a));
-    axis[0] = cross(w(), v());
+    float x = axis[2].x(), y = axis[2].y(), z = axis[2].z();
+    float sign = copysignf(1.0f, z);
+    float a = -1.0f / (sign + z);
+    float b = x * y * a;
+    axis[0] = vec3(1.0f + sign * x * x * a, sign * b, -sign * x);
+    axis[1] = vec3(b, sign + y * y * a, -y);
 }
 
 __device__ vec3 random_cosine_direction(curandState* local_rand_state) {
@@ -47,4 +52,17 @@ __device__ vec3 random_cosine_direction(curandState* local_rand_state) {
     return vec3(x, y, z);
 }
 
+// Uniform direction inside the cone subtended by a sphere, around +z.
+__device__ vec3 random_to_sphere(float radius, float distance_squared, curandState* local_rand_state) {
+    auto r1 = curand_uniform(local_rand_state);
+    auto r2 = curand_uniform(local_rand_state);
+    auto z = 1 + r2 * (sqrtf(1 - radius * radius / distance_squared) - 1);
+
+    auto phi = 2 * float(M_PI) * r1;
+    auto x = cosf(phi) * sqrtf(1 - z * z);
+    auto y = sinf(phi) * sqrtf(1 - z * z);
+
+    return vec3(x, y, z);
+}
+
 #endif
\ No newline at end of file
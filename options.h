@@ -0,0 +1,168 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+#include "tile_order.h"
+#include "memory_budget.h"
+#include "radiance_cache.h"
+
+/**
+ * Command line settings for main(). Every flag is optional; the defaults
+ * reproduce the original 600x600, 100 spp Cornell box render.
+ */
+struct render_options {
+    std::string scene = "cornell";
+    std::string output = "image.ppm";
+    int nx = 600;
+    int ny = 600;
+    int ns = 100;
+    int order = ORDER_ROW_MAJOR;
+    bool sort_rays = false;
+    int max_depth = 50;
+    std::string geometry = "field.geom";
+    long long spheres = 1000000;
+    int resident_mb = 32;
+    bool preview = false;
+    int preview_scale = 2;
+    float frame_ms = 33.f;
+    std::string preview_shm;
+    std::string daemon;
+    int workers = 2;
+    int scene_cache = 4;
+    std::string submit;
+    int priority = 0;
+    std::string views;
+    int mem_budget_mb = 0;
+    int mem_policy = MEM_POLICY_FAIL;
+    bool guide = false;
+    std::string reference;
+    int radiance_cache = CACHE_OFF;
+    bool restir = false;
+    int devices = 1;
+    bool pin_threads = true;
+    std::string environment;
+    float environment_scale = 1.f;
+    std::string trace;
+    float time_budget = 0.f;
+    int bvh_width = 2;  // 0 for a lazy BVH
+    float light_paths = 0.f;
+    std::string tiled;
+    unsigned long long seed = 1984;
+};
+
+inline void print_usage(const char* prog) {
+    std::cerr << "usage: " << prog << " [options]\n"
+        << "  --scene NAME      cornell | simple_light | random | many_lights | volumes | paged\n"
+        << "  --width N         image width (600)\n"
+        << "  --height N        image height (600)\n"
+        << "  --spp N           samples per pixel (100)\n"
+        << "  --order ORDER     rowmajor | morton | hilbert tile and pixel order\n"
+        << "  --sort-rays       trace bounce by bounce, sorting rays by origin cell and octant\n"
+        << "  --max-depth N     path depth, at most 50 (50)\n"
+        << "  --geometry FILE   paged scene geometry, written first if missing (field.geom)\n"
+        << "  --spheres N       spheres in a newly written geometry file (1000000)\n"
+        << "  --resident-mb N   device memory for resident geometry pages (32)\n"
+        << "  --preview         progressive preview driven by commands on stdin\n"
+        << "  --preview-scale N preview at 1/N of the image size (2)\n"
+        << "  --frame-ms MS     preview frame time budget (33)\n"
+        << "  --preview-shm NAME  publish preview frames in shared memory\n"
+        << "  --daemon SOCKET   serve render jobs on a Unix socket until shut down\n"
+        << "  --workers N       daemon jobs rendered at once (2)\n"
+        << "  --scene-cache N   built scenes the daemon keeps on the device (4)\n"
+        << "  --submit SOCKET   send this render to a daemon instead, which writes --output\n"
+        << "  --priority N      submitted job priority, higher runs first (0)\n"
+        << "  --views FILE      render every view listed in FILE from one scene build\n"
+        << "  --mem-budget MB   device memory budget for buffers and the scene, 0 for none (0)\n"
+        << "  --mem-policy P    fail | degrade when over the budget (fail)\n"
+        << "  --guide           learn a path guiding distribution in training passes, then compare\n"
+        << "                    against unguided paths traced for the same time\n"
+        << "  --reference FILE  image the --guide, --radiance-cache and --restir comparisons measure error against\n"
+        << "  --radiance-cache M  biased | unbiased: end paths on a world-space radiance cache, or\n"
+        << "                    only use it as a control variate; then time the same render without it\n"
+        << "  --restir          resample direct light at the first diffuse vertex from reservoirs reused\n"
+        << "                    across passes and neighbouring pixels; then time plain light sampling\n"
+        << "  --devices N       GPUs to split the image across, 0 for all (1)\n"
+        << "  --no-pin          don't pin each device's host thread to its NUMA node\n"
+        << "  --env FILE        light the scene with an equirectangular HDR environment map (PFM)\n"
+        << "  --env-scale S     environment map radiance multiplier (1)\n"
+        << "  --bvh WIDTH       2 | 4 | 8 | lazy: binary BVH, collapsed into 4 or 8 wide nodes with 8 bit\n"
+        << "                    child bounds, or binary and split as rays first reach each node (2)\n"
+        << "  --light-paths N   trace N light paths per pixel for dielectric caustics and add them to the\n"
+        << "                    camera paths, which leave those out (0: off)\n"
+        << "  --seed N          seed every sample's random numbers are derived from (1984)\n"
+        << "  --tiled FILE      stream finished tiles into a tiled TIFF instead of --output, without a\n"
+        << "                    frame buffer or per-pixel random states\n"
+        << "  --time-budget S   render as many samples as fit in S seconds of wall time from start up to\n"
+        << "                    the image written, instead of --spp\n"
+        << "  --trace FILE      write a Chrome trace-event timeline (builds with RT_TRACE only)\n"
+        << "  --output FILE     output image (image.ppm)\n";
+}
+
+inline render_options parse_options(int argc, char** argv) {
+    render_options opt;
+    for (int a = 1; a < argc; ++a) {
+        const char* arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (!strcmp(arg, "--scene") && has_value) opt.scene = argv[++a];
+        else if (!strcmp(arg, "--output") && has_value) opt.output = argv[++a];
+        else if (!strcmp(arg, "--width") && has_value) opt.nx = atoi(argv[++a]);
+        else if (!strcmp(arg, "--height") && has_value) opt.ny = atoi(argv[++a]);
+        else if (!strcmp(arg, "--spp") && has_value) opt.ns = atoi(argv[++a]);
+        else if (!strcmp(arg, "--order") && has_value) {
+            std::string order = argv[++a];
+            if (order == "morton") opt.order = ORDER_MORTON;
+            else if (order == "hilbert") opt.order = ORDER_HILBERT;
+            else opt.order = ORDER_ROW_MAJOR;
+        }
+        else if (!strcmp(arg, "--sort-rays")) opt.sort_rays = true;
+        else if (!strcmp(arg, "--max-depth") && has_value) opt.max_depth = atoi(argv[++a]);
+        else if (!strcmp(arg, "--geometry") && has_value) opt.geometry = argv[++a];
+        else if (!strcmp(arg, "--spheres") && has_value) opt.spheres = atoll(argv[++a]);
+        else if (!strcmp(arg, "--resident-mb") && has_value) opt.resident_mb = atoi(argv[++a]);
+        else if (!strcmp(arg, "--preview")) opt.preview = true;
+        else if (!strcmp(arg, "--preview-scale") && has_value) opt.preview_scale = atoi(argv[++a]);
+        else if (!strcmp(arg, "--frame-ms") && has_value) opt.frame_ms = float(atof(argv[++a]));
+        else if (!strcmp(arg, "--preview-shm") && has_value) opt.preview_shm = argv[++a];
+        else if (!strcmp(arg, "--daemon") && has_value) opt.daemon = argv[++a];
+        else if (!strcmp(arg, "--workers") && has_value) opt.workers = atoi(argv[++a]);
+        else if (!strcmp(arg, "--scene-cache") && has_value) opt.scene_cache = atoi(argv[++a]);
+        else if (!strcmp(arg, "--submit") && has_value) opt.submit = argv[++a];
+        else if (!strcmp(arg, "--priority") && has_value) opt.priority = atoi(argv[++a]);
+        else if (!strcmp(arg, "--views") && has_value) opt.views = argv[++a];
+        else if (!strcmp(arg, "--mem-budget") && has_value) opt.mem_budget_mb = atoi(argv[++a]);
+        else if (!strcmp(arg, "--mem-policy") && has_value) {
+            opt.mem_policy = strcmp(argv[++a], "degrade") ? MEM_POLICY_FAIL : MEM_POLICY_DEGRADE;
+        }
+        else if (!strcmp(arg, "--guide")) opt.guide = true;
+        else if (!strcmp(arg, "--restir")) opt.restir = true;
+        else if (!strcmp(arg, "--reference") && has_value) opt.reference = argv[++a];
+        else if (!strcmp(arg, "--radiance-cache") && has_value) {
+            opt.radiance_cache = strcmp(argv[++a], "unbiased") ? CACHE_BIASED : CACHE_UNBIASED;
+        }
+        else if (!strcmp(arg, "--devices") && has_value) opt.devices = atoi(argv[++a]);
+        else if (!strcmp(arg, "--no-pin")) opt.pin_threads = false;
+        else if (!strcmp(arg, "--env") && has_value) opt.environment = argv[++a];
+        else if (!strcmp(arg, "--env-scale") && has_value) opt.environment_scale = float(atof(argv[++a]));
+        else if (!strcmp(arg, "--trace") && has_value) opt.trace = argv[++a];
+        else if (!strcmp(arg, "--time-budget") && has_value) opt.time_budget = float(atof(argv[++a]));
+        else if (!strcmp(arg, "--light-paths") && has_value) opt.light_paths = float(atof(argv[++a]));
+        else if (!strcmp(arg, "--tiled") && has_value) opt.tiled = argv[++a];
+        else if (!strcmp(arg, "--seed") && has_value) opt.seed = strtoull(argv[++a], nullptr, 10);
+        else if (!strcmp(arg, "--bvh") && has_value) {
+            const char* layout = argv[++a];
+            int width = atoi(layout);
+            opt.bvh_width = !strcmp(layout, "lazy") ? 0 : width == 4 || width == 8 ? width : 2;
+        }
+        else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    return opt;
+}
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef PAGED_GEOMETRY_H
+#define PAGED_GEOMETRY_H
+
+#include <vector>
+
+#include "helper_cuda.h"
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+#include "geometry_store.h"
+
+#define PAGED_STACK_SIZE 64
+
+/**
+ * What the device sees of a geometry_store. page_slot maps a page to its
+ * slot in pool, or -1 while it isn't resident. Traversal sets requested[p]
+ * for missing pages and used[p] for pages it walked, and page_cache reads
+ * both between passes.
+ */
+struct paged_view {
+    const flat_node* top;
+    const page_entry* pages;
+    int page_count;
+    const int* page_slot;
+    unsigned* requested;
+    unsigned* used;
+    const char* pool;
+    int page_size;
+    const paged_material* materials;
+    int material_count;
+};
+
+__device__ inline bool flat_box_hit(const float* lo, const float* hi, const ray& r, const vec3& inv_dir, float t_min, float t_max, float& t_entry) {
+    for (int a = 0; a < 3; a++) {
+        float t0 = (lo[a] - r.origin()[a]) * inv_dir[a];
+        float t1 = (hi[a] - r.origin()[a]) * inv_dir[a];
+        t_min = ffmax(ffmin(t0, t1), t_min);
+        t_max = ffmin(ffmax(t0, t1), t_max);
+        if (t_max <= t_min) return false;
+    }
+    t_entry = t_min;
+    return true;
+}
+
+/**
+ * Sphere geometry that lives in a geometry_store and is paged onto the
+ * device one bottom-level subtree at a time. A ray that reaches a page that
+ * isn't resident before any closer hit reports a fault: hit() returns true
+ * at the page's entry distance with a null mat_ptr, and the page is
+ * requested. The integrator drops faulted samples and render_paged()
+ * retries them once page_cache has loaded the page.
+ */
+class paged_geometry : public hittable {
+public:
+    __device__ paged_geometry(const paged_view& v) : view(v) {
+        mats = device_new_array<material*>(MEM_MATERIALS, view.material_count);
+        // Out of device heap; create_scene() reports it.
+        if (mats == nullptr) view.material_count = 0;
+        for (int i = 0; i < view.material_count; ++i) {
+            const paged_material& m = view.materials[i];
+            vec3 albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+            if (m.type == MATERIAL_METAL) mats[i] = new metal(albedo, m.param);
+            else if (m.type == MATERIAL_DIELECTRIC) mats[i] = new dielectric(m.param);
+            else mats[i] = new lambertian(albedo);
+        }
+    }
+    __device__ virtual ~paged_geometry() {
+        for (int i = 0; i < view.material_count; ++i) delete mats[i];
+        device_delete_array(MEM_MATERIALS, mats, view.material_count);
+    }
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override {
+        const flat_node& root = view.top[0];
+        box = aabb(vec3(root.bmin[0], root.bmin[1], root.bmin[2]), vec3(root.bmax[0], root.bmax[1], root.bmax[2]));
+        return true;
+    }
+    __device__ virtual unsigned features() const override {
+        unsigned f = 0;
+        for (int i = 0; i < view.material_count; ++i) f |= mats[i]->features();
+        return f;
+    }
+
+    paged_view view;
+    material** mats;
+
+private:
+    __device__ bool hit_page(int page, int slot, const ray& r, const vec3& inv_dir, float t_min, float& closest, hit_record& rec) const;
+};
+
+__device__ bool paged_geometry::hit_page(int page, int slot, const ray& r, const vec3& inv_dir, float t_min, float& closest, hit_record& rec) const {
+    const flat_node* nodes = (const flat_node*)(view.pool + size_t(slot) * view.page_size);
+    const paged_sphere* prims = (const paged_sphere*)(nodes + view.pages[page].node_count);
+    int stack[PAGED_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    bool hit_anything = false;
+    while (sp > 0) {
+        int index = stack[--sp];
+        const flat_node& node = nodes[index];
+        STATS_ADD(node_visits, 1);
+        float t_entry;
+        if (!flat_box_hit(node.bmin, node.bmax, r, inv_dir, t_min, closest, t_entry)) continue;
+        if (node.count == 0) {
+            stack[sp++] = node.offset;
+            stack[sp++] = index + 1;
+            continue;
+        }
+        for (int i = node.offset; i < node.offset + node.count; ++i) {
+            const paged_sphere& s = prims[i];
+            vec3 center(s.center[0], s.center[1], s.center[2]);
+            vec3 oc = r.origin() - center;
+            float a = dot(r.direction(), r.direction());
+            float b = dot(oc, r.direction());
+            float c = dot(oc, oc) - s.radius * s.radius;
+            float discriminant = b * b - a * c;
+            if (discriminant <= 0) continue;
+            float root = sqrt(discriminant);
+            float sol = (-b - root) / a;
+            if (sol >= closest || sol <= t_min) sol = (-b + root) / a;
+            if (sol >= closest || sol <= t_min) continue;
+            closest = sol;
+            rec.t = sol;
+            rec.p = r.at(sol);
+            rec.normal = (rec.p - center) / s.radius;
+            rec.mat_ptr = mats[s.material];
+            rec.obj = this;
+            hit_anything = true;
+        }
+    }
+    return hit_anything;
+}
+
+__device__ bool paged_geometry::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    vec3 inv_dir(1.f / r.direction().x(), 1.f / r.direction().y(), 1.f / r.direction().z());
+    int stack[PAGED_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    float closest = t_max;
+    bool hit_anything = false;
+    bool fault = false;
+    while (sp > 0) {
+        int index = stack[--sp];
+        const flat_node& node = view.top[index];
+        STATS_ADD(node_visits, 1);
+        float t_entry;
+        if (!flat_box_hit(node.bmin, node.bmax, r, inv_dir, t_min, closest, t_entry)) continue;
+        if (node.count == 0) {
+            stack[sp++] = node.offset;
+            stack[sp++] = index + 1;
+            continue;
+        }
+        int page = node.offset;
+        int slot = view.page_slot[page];
+        if (slot < 0) {
+            // Anything in the page is at least t_entry away, so only hits
+            // closer than that are still certain.
+            if (!view.requested[page]) view.requested[page] = 1;
+            closest = t_entry;
+            fault = true;
+            hit_anything = false;
+            continue;
+        }
+        if (!view.used[page]) view.used[page] = 1;
+        if (hit_page(page, slot, r, inv_dir, t_min, closest, rec)) {
+            hit_anything = true;
+            fault = false;
+        }
+    }
+    if (fault) {
+        rec.t = closest;
+        rec.p = r.at(closest);
+        rec.normal = -unit_vector(r.direction());
+        rec.mat_ptr = nullptr;
+        rec.obj = this;
+        return true;
+    }
+    return hit_anything;
+}
+
+struct page_stats {
+    unsigned long long faults;
+    unsigned long long evictions;
+    unsigned long long bytes_in;
+    int passes;
+};
+
+/**
+ * Host side of a paged_geometry: a device pool of resident_bytes /
+ * page_size slots, filled between render passes with the pages the last
+ * pass asked for. When the pool is full the least recently used page goes.
+ */
+class page_cache {
+public:
+    page_cache(const geometry_store& s, size_t resident_bytes) : store(s) {
+        const geom_header& h = store.header();
+        slots = int(resident_bytes / h.page_size);
+        if (slots < 1) slots = 1;
+        if (slots > h.page_count) slots = h.page_count;
+        last_use.assign(h.page_count, -1);
+        pass = 0;
+        stats = page_stats();
+
+        checkCudaErrors(tracked_malloc(MEM_BVH, (void**)&d_top, h.top_node_count * sizeof(flat_node)));
+        checkCudaErrors(cudaMemcpy(d_top, store.top_nodes(), h.top_node_count * sizeof(flat_node), cudaMemcpyHostToDevice));
+        checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&d_pages, h.page_count * sizeof(page_entry)));
+        checkCudaErrors(cudaMemcpy(d_pages, store.pages(), h.page_count * sizeof(page_entry), cudaMemcpyHostToDevice));
+        checkCudaErrors(tracked_malloc(MEM_MATERIALS, (void**)&d_materials, h.material_count * sizeof(paged_material)));
+        checkCudaErrors(cudaMemcpy(d_materials, store.materials(), h.material_count * sizeof(paged_material), cudaMemcpyHostToDevice));
+        checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&page_slot, h.page_count * sizeof(int), true));
+        checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&requested, h.page_count * sizeof(unsigned), true));
+        checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&used, h.page_count * sizeof(unsigned), true));
+        // Under a degrading budget the pool shrinks to whatever is left.
+        if (memory_degrades() && size_t(slots) * h.page_size > memory_available()) {
+            int fit = int(memory_available() / h.page_size);
+            std::cerr << "memory budget: " << slots << " resident pages reduced to " << (fit > 1 ? fit : 1) << "\n";
+            slots = fit > 1 ? fit : 1;
+        }
+        checkCudaErrors(tracked_malloc(MEM_GEOMETRY, (void**)&pool, size_t(slots) * h.page_size));
+        slot_page.assign(slots, -1);
+        for (int p = 0; p < h.page_count; ++p) {
+            page_slot[p] = -1;
+            requested[p] = 0;
+            used[p] = 0;
+        }
+    }
+    ~page_cache() {
+        checkCudaErrors(tracked_free(d_top));
+        checkCudaErrors(tracked_free(d_pages));
+        checkCudaErrors(tracked_free(d_materials));
+        checkCudaErrors(tracked_free(pool));
+        checkCudaErrors(tracked_free(page_slot));
+        checkCudaErrors(tracked_free(requested));
+        checkCudaErrors(tracked_free(used));
+    }
+
+    paged_view view() const {
+        const geom_header& h = store.header();
+        return { d_top, d_pages, h.page_count, page_slot, requested, used, pool, h.page_size, d_materials, h.material_count };
+    }
+    int resident_slots() const { return slots; }
+
+    // Call with the device idle. Loads the pages requested since the last
+    // call and returns how many were loaded.
+    int service() {
+        const geom_header& h = store.header();
+        ++pass;
+        ++stats.passes;
+        std::vector<int> wanted;
+        for (int p = 0; p < h.page_count; ++p) {
+            if (used[p]) {
+                last_use[p] = pass;
+                used[p] = 0;
+            }
+            if (requested[p]) {
+                requested[p] = 0;
+                if (page_slot[p] < 0) wanted.push_back(p);
+            }
+        }
+        stats.faults += wanted.size();
+
+        int loaded = 0;
+        for (int p : wanted) {
+            int slot = victim();
+            if (slot < 0) break;
+            int old = slot_page[slot];
+            if (old >= 0) {
+                page_slot[old] = -1;
+                ++stats.evictions;
+            }
+            checkCudaErrors(cudaMemcpy(pool + size_t(slot) * h.page_size, store.page(p), h.page_size, cudaMemcpyHostToDevice));
+            stats.bytes_in += h.page_size;
+            slot_page[slot] = p;
+            page_slot[p] = slot;
+            // Loaded this call: not evictable until the next pass has run.
+            last_use[p] = pass + 1;
+            ++loaded;
+        }
+        return loaded;
+    }
+
+    page_stats stats;
+
+private:
+    // A free slot, else the least recently used page the last pass didn't
+    // touch. Only when the last pass touched every resident page does one
+    // of those go, since the faulted samples can't finish otherwise. Pages
+    // loaded by the current service() call are never evicted.
+    int victim() const {
+        int best = -1, needed = -1;
+        for (int s = 0; s < slots; ++s) {
+            int p = slot_page[s];
+            if (p < 0) return s;
+            if (last_use[p] > pass) continue;
+            if (last_use[p] == pass) {
+                if (needed < 0) needed = s;
+                continue;
+            }
+            if (best < 0 || last_use[p] < last_use[slot_page[best]]) best = s;
+        }
+        return best >= 0 ? best : needed;
+    }
+
+    const geometry_store& store;
+    int slots;
+    int pass;
+    std::vector<int> slot_page;
+    std::vector<int> last_use;
+    flat_node* d_top;
+    page_entry* d_pages;
+    paged_material* d_materials;
+    char* pool;
+    int* page_slot;
+    unsigned* requested;
+    unsigned* used;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef PAGED_RENDER_H
+#define PAGED_RENDER_H
+
+#include <iostream>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "paged_geometry.h"
+
+// Give up after this many passes in a row without a finished sample; the
+// resident set is then too small for a single path's pages.
+#define PAGED_MAX_STALLS 8
+
+/**
+ * One pass of the out-of-core renderer. Every pixel keeps tracing samples
+ * until it has ns of them or a path faults on a non-resident page. In that
+ * case the sample is dropped and retried in the next pass, after
+ * page_cache has loaded the page. Each sample is seeded from its pixel and
+ * number as in render(), so a retry replays the path that faulted rather
+ * than drawing one that may avoid the missing page, and samples are added
+ * to accum one at a time in order, so the sum doesn't depend on which
+ * pass finished them.
+ */
+template <unsigned F, int DEPTH>
+__global__ void render_pass(vec3* accum, int* samples, int max_x, int max_y, int ns, int order, const int* tiles,
+    camera** cam, hittable** world, light_bvh** lights, unsigned* faults, unsigned* finished, int max_depth) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    if (samples[pixel_index] >= ns) return;
+    vec3 col = accum[pixel_index];
+    int done = 0;
+    for (int s = samples[pixel_index]; s < ns; s++) {
+        curandState local_rand_state;
+        sample_state(pixel_index, s, &local_rand_state);
+        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+        path_state ps;
+        path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+        while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state)) {}
+        if (ps.faulted) {
+            atomicAdd(faults, 1u);
+            break;
+        }
+        col += ps.radiance;
+        done++;
+    }
+    accum[pixel_index] = col;
+    samples[pixel_index] += done;
+    if (done > 0) atomicAdd(finished, unsigned(done));
+}
+
+__global__ void render_pass_finish(vec3* fb, const int* samples, int num_pixels) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= num_pixels) return;
+    vec3 col = samples[k] > 0 ? fb[k] / float(samples[k]) : vec3(0, 0, 0);
+    col[0] = sqrt(col[0]);
+    col[1] = sqrt(col[1]);
+    col[2] = sqrt(col[2]);
+    fb[k] = col;
+}
+
+struct render_pass_launcher {
+    int num_tiles;
+    vec3* accum;
+    int* samples;
+    int max_x, max_y, ns, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    unsigned* faults;
+    unsigned* finished;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        render_pass<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (accum, samples, max_x, max_y, ns, order, tiles,
+            cam, world, lights, faults, finished, max_depth);
+    }
+};
+
+// Renders a scene containing paged_geometry, servicing page requests
+// between passes until every pixel has ns samples.
+void render_paged(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order, const int* tiles, int num_tiles,
+    camera** cam, hittable** world, light_bvh** lights, page_cache& cache) {
+    int num_pixels = nx * ny;
+    int* samples;
+    unsigned* counters;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&samples, num_pixels * sizeof(int)));
+    checkCudaErrors(cudaMallocManaged((void**)&counters, 2 * sizeof(unsigned)));
+    checkCudaErrors(cudaMemset(samples, 0, num_pixels * sizeof(int)));
+    checkCudaErrors(cudaMemset(fb, 0, num_pixels * sizeof(vec3)));
+
+    render_pass_launcher launcher = { num_tiles, fb, samples, nx, ny, ns, order, tiles, cam, world, lights, counters,
+        counters + 1 };
+    unsigned long long fault_samples = 0;
+    int stalls = 0;
+    for (;;) {
+        checkCudaErrors(cudaMemset(counters, 0, 2 * sizeof(unsigned)));
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        unsigned faults = counters[0];
+        fault_samples += faults;
+        stalls = counters[1] > 0 ? 0 : stalls + 1;
+        cache.service();
+        if (faults == 0) break;
+        if (stalls >= PAGED_MAX_STALLS) {
+            std::cerr << "paged render stalled: " << cache.resident_slots()
+                << " resident pages can't hold the pages one path needs, some pixels are incomplete.\n";
+            break;
+        }
+    }
+    render_pass_finish << <(num_pixels + 255) / 256, 256 >> > (fb, samples, num_pixels);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    std::cerr << cache.stats.passes << " passes, " << fault_samples << " samples retried, "
+        << cache.stats.faults << " page faults, " << cache.stats.evictions << " evictions, "
+        << double(cache.stats.bytes_in) / (1024.0 * 1024.0) << " MB paged in.\n";
+
+    checkCudaErrors(tracked_free(samples));
+    checkCudaErrors(cudaFree(counters));
+}
+
+#endif
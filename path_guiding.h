@@ -0,0 +1,410 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "guide_tree.h"
+#include "image_io.h"
+#include "memory_budget.h"
+
+// Share of diffuse samples drawn from the guide once there is one.
+#define GUIDE_FRACTION 0.5f
+// A spatial leaf splits in two once it has this many records times
+// sqrt(2^iteration), as in Müller et al.
+#define GUIDE_SPLIT_RECORDS 12000
+#define GUIDE_MAX_SPATIAL_DEPTH 24
+// Quadtree cells with more than this share of their leaf's energy are
+// subdivided, the others merged.
+#define GUIDE_SUBDIVIDE_SHARE 0.01f
+#define GUIDE_MAX_QUAD_DEPTH 20
+
+struct host_guide_tree {
+    vec3 lo, hi;
+    std::vector<guide_spatial_node> spatial;
+    std::vector<guide_quad_node> quads;
+    std::vector<unsigned> samples;
+};
+
+// One spatial leaf over the box with a single, empty quadtree node.
+inline host_guide_tree initial_guide(const aabb& box) {
+    host_guide_tree t;
+    t.lo = box.min();
+    t.hi = box.max();
+    t.spatial.push_back({ -1, 0 });
+    t.quads.push_back(guide_quad_node{});
+    t.samples.assign(1, 0u);
+    return t;
+}
+
+// Rebuilds the quadtree at src[root] into out, child indices relative to the
+// start of out. Cells keep the energy learned for them, or a share of their
+// parent's where they are newly split, to decide where to subdivide; the
+// result's energy is cleared for the next pass.
+inline void refine_quadtree(const std::vector<guide_quad_node>& src, int root, std::vector<guide_quad_node>& out) {
+    struct cell {
+        int src;
+        int out;
+        int depth;
+        float energy[4];
+    };
+    float total = guide_node_energy(src[root]);
+    out.push_back(guide_quad_node{});
+    std::vector<cell> stack;
+    stack.push_back({ root, 0, 1, { src[root].energy[0], src[root].energy[1], src[root].energy[2], src[root].energy[3] } });
+    while (!stack.empty()) {
+        cell c = stack.back();
+        stack.pop_back();
+        for (int q = 0; q < 4; ++q) {
+            if (total <= 0.f || c.energy[q] <= total * GUIDE_SUBDIVIDE_SHARE || c.depth >= GUIDE_MAX_QUAD_DEPTH) continue;
+            int index = int(out.size());
+            out.push_back(guide_quad_node{});
+            out[c.out].child[q] = index;
+            int from = c.src >= 0 ? src[c.src].child[q] : 0;
+            cell child = { from != 0 ? from : -1, index, c.depth + 1, {} };
+            for (int k = 0; k < 4; ++k) child.energy[k] = from != 0 ? src[from].energy[k] : 0.25f * c.energy[q];
+            stack.push_back(child);
+        }
+    }
+}
+
+/**
+ * The tree to train in the next pass: spatial leaves that gathered enough
+ * records are split until they wouldn't have (each half inheriting the
+ * quadtree), and every leaf's quadtree is refined on its own host thread.
+ */
+inline host_guide_tree refine_guide(const host_guide_tree& t, int iteration) {
+    struct item {
+        int old_node;
+        int node;
+        int depth;
+        double samples;
+        int quad;
+    };
+    struct leaf {
+        int node;
+        int quad;
+    };
+    double threshold = GUIDE_SPLIT_RECORDS * std::sqrt(std::pow(2.0, iteration));
+    host_guide_tree out;
+    out.lo = t.lo;
+    out.hi = t.hi;
+    out.spatial.push_back({ -1, 0 });
+    std::vector<leaf> leaves;
+    std::vector<item> stack;
+    stack.push_back({ 0, 0, 0, 0.0, 0 });
+    while (!stack.empty()) {
+        item it = stack.back();
+        stack.pop_back();
+        if (it.old_node >= 0 && t.spatial[it.old_node].axis >= 0) {
+            int c = int(out.spatial.size());
+            out.spatial.push_back({ -1, 0 });
+            out.spatial.push_back({ -1, 0 });
+            out.spatial[it.node] = { t.spatial[it.old_node].axis, c };
+            stack.push_back({ t.spatial[it.old_node].child, c, it.depth + 1, 0.0, 0 });
+            stack.push_back({ t.spatial[it.old_node].child + 1, c + 1, it.depth + 1, 0.0, 0 });
+            continue;
+        }
+        double samples = it.old_node >= 0 ? double(t.samples[it.old_node]) : it.samples;
+        int quad = it.old_node >= 0 ? t.spatial[it.old_node].child : it.quad;
+        if (samples > threshold && it.depth < GUIDE_MAX_SPATIAL_DEPTH) {
+            int c = int(out.spatial.size());
+            out.spatial.push_back({ -1, 0 });
+            out.spatial.push_back({ -1, 0 });
+            out.spatial[it.node] = { it.depth % 3, c };
+            stack.push_back({ -1, c, it.depth + 1, samples * 0.5, quad });
+            stack.push_back({ -1, c + 1, it.depth + 1, samples * 0.5, quad });
+            continue;
+        }
+        leaves.push_back({ it.node, quad });
+    }
+
+    std::vector<std::vector<guide_quad_node>> built(leaves.size());
+    std::atomic<size_t> next(0);
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (unsigned k = 0; k < num_threads; ++k) {
+        pool.emplace_back([&] {
+            for (size_t l = next++; l < leaves.size(); l = next++) refine_quadtree(t.quads, leaves[l].quad, built[l]);
+        });
+    }
+    for (std::thread& thread : pool) thread.join();
+
+    for (size_t l = 0; l < leaves.size(); ++l) {
+        int offset = int(out.quads.size());
+        for (guide_quad_node n : built[l]) {
+            for (int q = 0; q < 4; ++q) {
+                if (n.child[q] != 0) n.child[q] += offset;
+            }
+            out.quads.push_back(n);
+        }
+        out.spatial[leaves[l].node].child = offset;
+    }
+    out.samples.assign(out.spatial.size(), 0u);
+    return out;
+}
+
+// A host_guide_tree copied to the device.
+class device_guide_tree {
+public:
+    device_guide_tree() : view{} {}
+    ~device_guide_tree() {
+        release();
+    }
+
+    void upload(const host_guide_tree& t) {
+        release();
+        view.lo = t.lo;
+        view.hi = t.hi;
+        num_spatial = t.spatial.size();
+        num_quads = t.quads.size();
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.spatial, num_spatial * sizeof(guide_spatial_node)));
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.quads, num_quads * sizeof(guide_quad_node)));
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&view.samples, num_spatial * sizeof(unsigned)));
+        checkCudaErrors(cudaMemcpy((void*)view.spatial, t.spatial.data(), num_spatial * sizeof(guide_spatial_node), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpy(view.quads, t.quads.data(), num_quads * sizeof(guide_quad_node), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpy(view.samples, t.samples.data(), num_spatial * sizeof(unsigned), cudaMemcpyHostToDevice));
+    }
+
+    // Reads back the energy and record counts gathered by a training pass.
+    void download(host_guide_tree& t) const {
+        checkCudaErrors(cudaMemcpy(t.quads.data(), view.quads, num_quads * sizeof(guide_quad_node), cudaMemcpyDeviceToHost));
+        checkCudaErrors(cudaMemcpy(t.samples.data(), view.samples, num_spatial * sizeof(unsigned), cudaMemcpyDeviceToHost));
+    }
+
+    guide_tree view;
+
+private:
+    void release() {
+        checkCudaErrors(tracked_free((void*)view.spatial));
+        checkCudaErrors(tracked_free(view.quads));
+        checkCudaErrors(tracked_free(view.samples));
+        view.spatial = nullptr;
+        view.quads = nullptr;
+        view.samples = nullptr;
+    }
+
+    size_t num_spatial = 0;
+    size_t num_quads = 0;
+};
+
+/**
+ * Adds ns samples per pixel to accum, unaveraged and linear. Paths sample
+ * the sampling tree when guided and record into the building tree when
+ * training. Each pass seeds its own random sequences.
+ */
+template <unsigned F, int DEPTH>
+__global__ void guided_trace(vec3* accum, int max_x, int max_y, int ns, int pass, int order, const int* tiles, camera** cam,
+    hittable** world, light_bvh** lights, guide_tree sampling, guide_tree building, bool guided, bool training, int max_depth) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    curandState local_rand_state;
+    curand_init(1984 + pass, pixel_index, 0, &local_rand_state);
+    guide_path guide;
+    guide.sampling = guided ? &sampling : nullptr;
+    guide.building = training ? &building : nullptr;
+    guide.fraction = GUIDE_FRACTION;
+    vec3 col(0, 0, 0);
+    for (int s = 0; s < ns; s++) {
+        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+        path_state ps;
+        path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+        guide.count = 0;
+        while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state, &guide)) {}
+        if (ps.faulted) continue;
+        if (training) guide_train(guide, ps.radiance);
+        col += ps.radiance;
+    }
+    accum[pixel_index] += col;
+}
+
+struct guided_launcher {
+    int num_tiles;
+    vec3* accum;
+    int max_x, max_y, ns, pass, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    guide_tree sampling, building;
+    bool guided, training;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        guided_trace<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (accum, max_x, max_y, ns, pass, order, tiles, cam, world, lights,
+            sampling, building, guided, training, max_depth);
+    }
+};
+
+/**
+ * Two accumulation buffers filled by alternate passes. Their halves of the
+ * estimate differ only by noise, so (a - b)^2 / 4 estimates the variance of
+ * the combined mean, and with it the error, without a reference image.
+ */
+struct split_accumulator {
+    vec3* half[2];
+    int spp[2];
+    int num_pixels;
+
+    explicit split_accumulator(int n) : spp{ 0, 0 }, num_pixels(n) {
+        for (int h = 0; h < 2; ++h) {
+            checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&half[h], num_pixels * sizeof(vec3)));
+            checkCudaErrors(cudaMemset(half[h], 0, num_pixels * sizeof(vec3)));
+        }
+    }
+    ~split_accumulator() {
+        for (int h = 0; h < 2; ++h) checkCudaErrors(tracked_free(half[h]));
+    }
+
+    // Averaged and gamma corrected, like render(); also returns the
+    // estimated mean squared error of the linear image.
+    double resolve(std::vector<vec3>& image) const {
+        std::vector<vec3> a(num_pixels), b(num_pixels);
+        checkCudaErrors(cudaMemcpy(a.data(), half[0], num_pixels * sizeof(vec3), cudaMemcpyDeviceToHost));
+        checkCudaErrors(cudaMemcpy(b.data(), half[1], num_pixels * sizeof(vec3), cudaMemcpyDeviceToHost));
+        image.resize(num_pixels);
+        double error = 0.0;
+        for (int p = 0; p < num_pixels; ++p) {
+            vec3 mean = (a[p] + b[p]) / float(spp[0] + spp[1]);
+            for (int c = 0; c < 3; ++c) {
+                image[p][c] = sqrtf(fmaxf(mean[c], 0.f));
+                if (spp[0] > 0 && spp[1] > 0) {
+                    double d = double(a[p][c]) / spp[0] - double(b[p][c]) / spp[1];
+                    error += d * d / 4.0;
+                }
+            }
+        }
+        return error / (3.0 * num_pixels);
+    }
+};
+
+// Mean squared error against a reference in display space. write_ppm()
+// doesn't clamp, so both sides are clamped to what a viewer shows.
+inline double image_mse(const std::vector<vec3>& image, const std::vector<vec3>& reference) {
+    double error = 0.0;
+    for (size_t p = 0; p < image.size(); ++p) {
+        for (int c = 0; c < 3; ++c) {
+            double d = fminf(image[p][c], 1.f) - fminf(reference[p][c], 1.f);
+            error += d * d;
+        }
+    }
+    return error / (3.0 * image.size());
+}
+
+/**
+ * Renders ns samples per pixel with path guiding into fb. Training passes of
+ * 1, 2, 4 ... spp each learn a new SD tree while guided by the previous
+ * one, for as long as at least as many samples are left; the final pass
+ * spends the rest with the last tree. Only the final pass makes the image,
+ * since earlier passes were guided by worse distributions.
+ *
+ * Then, for the report, plain paths are traced for as long as all of that
+ * took. Both renders print their estimated error, and their error against
+ * reference if it names an image of the same size.
+ */
+void render_path_guided(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order, const int* tiles, int num_tiles,
+    camera** cam, hittable** world, light_bvh** lights, const std::string& reference) {
+    int num_pixels = nx * ny;
+    aabb* bounds;
+    checkCudaErrors(cudaMallocManaged((void**)&bounds, sizeof(aabb)));
+    world_bounds << <1, 1 >> > (world, bounds);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    vec3 margin = 0.001f * (bounds->max() - bounds->min()) + vec3(1e-3f, 1e-3f, 1e-3f);
+    host_guide_tree building = initial_guide(aabb(bounds->min() - margin, bounds->max() + margin));
+    checkCudaErrors(cudaFree(bounds));
+
+    auto start = std::chrono::steady_clock::now();
+    device_guide_tree d_sampling, d_building;
+    guided_launcher launcher = { num_tiles, nullptr, nx, ny, 0, 0, order, tiles, cam, world, lights, {}, {}, false, false };
+    split_accumulator guided(num_pixels);
+    int pass = 0, spent = 0;
+    for (int spp = 1; 2 * spp <= ns - spent; spp *= 2, ++pass) {
+        d_building.upload(building);
+        launcher.accum = guided.half[0];
+        launcher.ns = spp;
+        launcher.pass = pass;
+        launcher.sampling = d_sampling.view;
+        launcher.building = d_building.view;
+        launcher.guided = pass > 0;
+        launcher.training = true;
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        d_building.download(building);
+        d_sampling.upload(building);
+        building = refine_guide(building, pass);
+        spent += spp;
+    }
+    checkCudaErrors(cudaMemset(guided.half[0], 0, num_pixels * sizeof(vec3)));
+    int training_passes = pass;
+    int remaining = ns - spent;
+    launcher.sampling = d_sampling.view;
+    launcher.guided = pass > 0;
+    launcher.training = false;
+    for (int h = 0; h < 2; ++h) {
+        launcher.accum = guided.half[h];
+        launcher.ns = h == 0 ? (remaining + 1) / 2 : remaining / 2;
+        launcher.pass = pass++;
+        if (launcher.ns == 0) continue;
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        guided.spp[h] = launcher.ns;
+    }
+    checkCudaErrors(cudaDeviceSynchronize());
+    double guided_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<vec3> guided_image;
+    double guided_error = guided.resolve(guided_image);
+    std::copy(guided_image.begin(), guided_image.end(), fb);
+    int leaves = 0;
+    for (const guide_spatial_node& n : building.spatial) leaves += n.axis < 0;
+    std::cerr << "guided: " << spent << " spp in " << training_passes << " training passes, " << remaining << " spp final, "
+        << guided_seconds << " seconds; " << leaves << " spatial leaves, " << building.quads.size() << " quadtree nodes.\n";
+
+    // Unguided paths in pairs of passes, one into each half, until the
+    // guided render's time is used up.
+    start = std::chrono::steady_clock::now();
+    split_accumulator plain(num_pixels);
+    launcher.guided = false;
+    launcher.ns = std::max(1, ns / 16);
+    for (double seconds = 0.0; seconds < guided_seconds;) {
+        for (int h = 0; h < 2; ++h) {
+            launcher.accum = plain.half[h];
+            launcher.pass = pass++;
+            dispatch_variant(features, max_depth, launcher);
+            checkCudaErrors(cudaGetLastError());
+            plain.spp[h] += launcher.ns;
+        }
+        checkCudaErrors(cudaDeviceSynchronize());
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::vector<vec3> plain_image;
+    double plain_error = plain.resolve(plain_image);
+    std::cerr << "unguided in equal time: " << plain.spp[0] + plain.spp[1] << " spp.\n";
+    std::cerr << "estimated MSE: guided " << guided_error << ", unguided " << plain_error
+        << " (" << plain_error / std::max(guided_error, 1e-30) << "x).\n";
+
+    std::vector<vec3> reference_image;
+    int rx, ry;
+    if (reference.empty()) return;
+    if (!read_ppm(reference, reference_image, rx, ry) || rx != nx || ry != ny) {
+        std::cerr << "can't compare against " << reference << ": not a " << nx << "x" << ny << " image\n";
+        return;
+    }
+    double guided_mse = image_mse(guided_image, reference_image);
+    double plain_mse = image_mse(plain_image, reference_image);
+    std::cerr << "MSE against " << reference << ": guided " << guided_mse << ", unguided " << plain_mse
+        << " (" << plain_mse / std::max(guided_mse, 1e-30) << "x).\n";
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <functional>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "paged_geometry.h"
+
+// Reprojected history is capped at this many samples, so shading that
+// doesn't follow the surface (reflections, refraction) washes out quickly.
+#define PREVIEW_MAX_HISTORY 16.f
+#define PREVIEW_MAX_SPP 256
+
+struct preview_frame {
+    int width;
+    int height;
+    int index;
+    // Samples per pixel traced this frame, and since the last camera change
+    // (not counting reprojected history).
+    int spp;
+    float accumulated;
+    float trace_ms;
+    // RGBA8, bottom row first.
+    const unsigned char* rgba;
+};
+
+typedef std::function<void(const preview_frame&)> preview_callback;
+
+// Traces samples first_sample to first_sample + spp - 1 of every pixel,
+// each seeded from its pixel and number as in render().
+template <unsigned F, int DEPTH>
+__global__ void preview_trace(vec3* accum, float* count, int w, int h, int first_sample, int spp, camera** cam, hittable** world,
+    light_bvh** lights, int max_depth) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if ((i >= w) || (j >= h)) return;
+    int pixel_index = j * w + i;
+    vec3 col(0, 0, 0);
+    int n = 0;
+    for (int s = 0; s < spp; s++) {
+        curandState local_rand_state;
+        sample_state(pixel_index, first_sample + s, &local_rand_state);
+        float u = float(i + curand_uniform(&local_rand_state)) / float(w);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(h);
+        path_state ps;
+        path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+        while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state)) {}
+        if (ps.faulted) continue;
+        col += ps.radiance;
+        n++;
+    }
+    accum[pixel_index] += col;
+    count[pixel_index] += float(n);
+}
+
+/**
+ * Starts the accumulation for a new camera. Each pixel finds the surface
+ * under its centre and looks it up in the previous view; if that pixel saw
+ * the same point (no disocclusion), its mean carries over as up to
+ * PREVIEW_MAX_HISTORY samples. pos.w is 1 where the centre ray hit.
+ */
+__global__ void preview_reproject(const vec3* old_accum, const float* old_count, const vec4* old_pos, camera old_cam,
+    vec3* accum, float* count, vec4* pos, int w, int h, camera** cam, hittable** world) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if ((i >= w) || (j >= h)) return;
+    int pixel_index = j * w + i;
+    accum[pixel_index] = vec3(0, 0, 0);
+    count[pixel_index] = 0.f;
+    pos[pixel_index] = vec4(0, 0, 0, 0);
+
+    ray r = (*cam)->get_ray<0>((i + 0.5f) / float(w), (j + 0.5f) / float(h), nullptr);
+    hit_record rec;
+    if (!(*world)->hit(r, 0.001f, FLT_MAX, rec) || rec.mat_ptr == nullptr) return;
+    pos[pixel_index] = vec4(rec.p.x(), rec.p.y(), rec.p.z(), 1.f);
+
+    float s, t;
+    if (!old_cam.project(rec.p, s, t)) return;
+    int oi = int(s * w);
+    int oj = int(t * h);
+    if (oi < 0 || oi >= w || oj < 0 || oj >= h) return;
+    int old_index = oj * w + oi;
+    vec4 old = old_pos[old_index];
+    if (old.w() == 0.f || old_count[old_index] <= 0.f) return;
+    float tolerance = 0.01f * rec.t * r.direction().length();
+    if ((vec3(old.x(), old.y(), old.z()) - rec.p).length() > tolerance) return;
+    float n = fminf(old_count[old_index], PREVIEW_MAX_HISTORY);
+    accum[pixel_index] = old_accum[old_index] * (n / old_count[old_index]);
+    count[pixel_index] = n;
+}
+
+__global__ void preview_resolve(const vec3* accum, const float* count, unsigned char* rgba, int num_pixels) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= num_pixels) return;
+    vec3 col = count[k] > 0.f ? accum[k] / count[k] : vec3(0, 0, 0);
+    for (int c = 0; c < 3; ++c) {
+        rgba[4 * k + c] = (unsigned char)(255.99f * fminf(sqrtf(fmaxf(col[c], 0.f)), 1.f));
+    }
+    rgba[4 * k + 3] = 255;
+}
+
+// Nearest-neighbour upscale of the preview into a full size framebuffer.
+__global__ void preview_upscale(const unsigned char* rgba, int w, int h, vec3* fb, int nx, int ny) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if ((i >= nx) || (j >= ny)) return;
+    int k = (j * h / ny) * w + (i * w / nx);
+    fb[j * nx + i] = vec3(rgba[4 * k], rgba[4 * k + 1], rgba[4 * k + 2]) / 255.99f;
+}
+
+struct preview_launcher {
+    dim3 blocks, threads;
+    vec3* accum;
+    float* count;
+    int w, h, first_sample, spp;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        preview_trace<F, DEPTH> << <blocks, threads >> > (accum, count, w, h, first_sample, spp, cam, world, lights, max_depth);
+    }
+};
+
+/**
+ * Progressive low resolution renderer for camera work. Every frame traces
+ * as many samples per pixel as fit in the frame budget, measured on the
+ * previous frame, and adds them to the accumulation. set_camera()
+ * reprojects the accumulation into the new view instead of starting over.
+ */
+class progressive_preview {
+public:
+    progressive_preview(int w, int h, float frame_ms, unsigned features, int max_depth,
+        camera** cam, hittable** world, light_bvh** lights, page_cache* cache)
+        : width(w), height(h), budget_ms(frame_ms), features(features), max_depth(max_depth),
+        cam(cam), world(world), lights(lights), cache(cache), frames(0), spp(1), next_sample(0) {
+        int num_pixels = width * height;
+        threads = dim3(8, 8);
+        blocks = dim3((width + 7) / 8, (height + 7) / 8);
+        for (int b = 0; b < 2; ++b) {
+            checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&accum[b], num_pixels * sizeof(vec3)));
+            checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&count[b], num_pixels * sizeof(float)));
+            checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&pos[b], num_pixels * sizeof(vec4)));
+            checkCudaErrors(cudaMemset(count[b], 0, num_pixels * sizeof(float)));
+            checkCudaErrors(cudaMemset(pos[b], 0, num_pixels * sizeof(vec4)));
+        }
+        checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&rgba, num_pixels * 4, true));
+        checkCudaErrors(cudaMallocManaged((void**)&h_camera, sizeof(camera)));
+        checkCudaErrors(cudaEventCreate(&start));
+        checkCudaErrors(cudaEventCreate(&stop));
+        current = 0;
+        set_camera(get_camera());
+    }
+    ~progressive_preview() {
+        for (int b = 0; b < 2; ++b) {
+            checkCudaErrors(tracked_free(accum[b]));
+            checkCudaErrors(tracked_free(count[b]));
+            checkCudaErrors(tracked_free(pos[b]));
+        }
+        checkCudaErrors(tracked_free(rgba));
+        checkCudaErrors(cudaFree(h_camera));
+        checkCudaErrors(cudaEventDestroy(start));
+        checkCudaErrors(cudaEventDestroy(stop));
+    }
+
+    camera get_camera() {
+        read_camera << <1, 1 >> > (cam, h_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        return *h_camera;
+    }
+
+    void set_camera(const camera& c) {
+        camera old = get_camera();
+        write_camera << <1, 1 >> > (cam, c);
+        checkCudaErrors(cudaGetLastError());
+        int prev = current;
+        current = 1 - current;
+        preview_reproject << <blocks, threads >> > (accum[prev], count[prev], pos[prev], old,
+            accum[current], count[current], pos[current], width, height, cam, world);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        accumulated = 0.f;
+    }
+
+    void frame(const preview_callback& callback) {
+        preview_launcher launcher = { blocks, threads, accum[current], count[current], width, height, next_sample, spp, cam, world, lights };
+        checkCudaErrors(cudaEventRecord(start));
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaEventRecord(stop));
+        checkCudaErrors(cudaEventSynchronize(stop));
+        float ms;
+        checkCudaErrors(cudaEventElapsedTime(&ms, start, stop));
+
+        int num_pixels = width * height;
+        preview_resolve << <(num_pixels + 255) / 256, 256 >> > (accum[current], count[current], rgba, num_pixels);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        accumulated += float(spp);
+        next_sample += spp;
+        if (callback) {
+            preview_frame f = { width, height, frames, spp, accumulated, ms, rgba };
+            callback(f);
+        }
+        frames++;
+
+        // Size the next frame from this one's cost per sample.
+        float per_sample = ms / float(spp);
+        int next = per_sample > 0.f ? int(budget_ms / per_sample) : PREVIEW_MAX_SPP;
+        spp = next < 1 ? 1 : next > PREVIEW_MAX_SPP ? PREVIEW_MAX_SPP : next;
+        if (cache) cache->service();
+    }
+
+    void upscale(vec3* fb, int nx, int ny) {
+        dim3 full_blocks((nx + 7) / 8, (ny + 7) / 8);
+        preview_upscale << <full_blocks, threads >> > (rgba, width, height, fb, nx, ny);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    }
+
+    int width, height;
+
+private:
+    float budget_ms;
+    unsigned features;
+    int max_depth;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    page_cache* cache;
+    int frames;
+    int spp;
+    // Number of the next sample each pixel traces, counted over every
+    // frame so a frame never repeats an earlier one's samples.
+    int next_sample;
+    float accumulated;
+    dim3 blocks, threads;
+    vec3* accum[2];
+    float* count[2];
+    vec4* pos[2];
+    int current;
+    unsigned char* rgba;
+    camera* h_camera;
+    cudaEvent_t start, stop;
+};
+
+/**
+ * Drives a preview from text commands, one per line, until "quit" or end
+ * of input:
+ *   frames N                 render N frames from the current camera
+ *   orbit DEGREES            turn the camera about lookat around the y axis
+ *   move DX DY DZ            translate the camera and lookat
+ *   look FX FY FZ AX AY AZ   place the camera at F looking at A
+ */
+void run_preview(progressive_preview& preview, std::istream& in, const preview_callback& callback) {
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream cmd(line);
+        std::string op;
+        if (!(cmd >> op)) continue;
+        if (op == "quit") break;
+        if (op == "frames") {
+            int n = 1;
+            cmd >> n;
+            for (int f = 0; f < n; ++f) preview.frame(callback);
+            continue;
+        }
+        camera c = preview.get_camera();
+        if (op == "orbit") {
+            float degrees = 0.f;
+            cmd >> degrees;
+            float a = degrees * float(M_PI) / 180.f;
+            vec3 d = c.origin - c.lookat;
+            vec3 from = c.lookat + vec3(cosf(a) * d.x() + sinf(a) * d.z(), d.y(), -sinf(a) * d.x() + cosf(a) * d.z());
+            preview.set_camera(c.moved(from, c.lookat));
+        }
+        else if (op == "move") {
+            float x = 0.f, y = 0.f, z = 0.f;
+            cmd >> x >> y >> z;
+            preview.set_camera(c.moved(c.origin + vec3(x, y, z), c.lookat + vec3(x, y, z)));
+        }
+        else if (op == "look") {
+            float f[6];
+            for (int k = 0; k < 6; ++k) cmd >> f[k];
+            preview.set_camera(c.moved(vec3(f[0], f[1], f[2]), vec3(f[3], f[4], f[5])));
+        }
+        else {
+            std::cerr << "unknown preview command: " << line << "\n";
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef QUAD_H
+#define QUAD_H
+
+#include "hittable.h"
+#include "material.h"
+
+/**
+ * Parallelogram with corner Q and edges u and v, in any orientation. A hit
+ * is the ray's crossing of the plane, accepted if its coordinates along u
+ * and v both lie in [0, 1]; w turns the plane offset into those coordinates
+ * with two cross products, without a matrix inverse.
+ */
+class quad : public hittable {
+public:
+    __device__ quad() {}
+    __device__ quad(const vec3& _Q, const vec3& _u, const vec3& _v, material* mat) : Q(_Q), u(_u), v(_v), mat_ptr(mat) {
+        vec3 n = cross(u, v);
+        normal = unit_vector(n);
+        D = dot(normal, Q);
+        w = n / dot(n, n);
+        area = n.length();
+    }
+    __device__ virtual ~quad() {
+        delete mat_ptr;
+    }
+
+    __device__ virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override;
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const override;
+    __device__ virtual double pdf_value(const vec3& origin, const vec3& v) const override {
+        hit_record rec;
+        if (!this->hit(ray(origin, v), 0.001, FLT_MAX, rec))
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * v.squared_length();
+        auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    __device__ virtual vec3 random(const vec3& origin, curandState* state) const override {
+        auto random_point = Q + curand_uniform(state) * u + curand_uniform(state) * v;
+        return random_point - origin;
+    }
+
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override {
+        rec.t = 0.f;
+        rec.p = Q + curand_uniform(state) * u + curand_uniform(state) * v;
+        rec.normal = curand_uniform(state) < 0.5f ? normal : -normal;
+        rec.mat_ptr = mat_ptr;
+        rec.obj = this;
+        pdf = 0.5f / area;
+        return true;
+    }
+
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override {
+        float power = luminance(mat_ptr->emitted(0, 0, Q)) * area;
+        if (power <= 0.f)
+            return false;
+        bounding_box(0, 0, lb.box);
+        lb.axis = normal;
+        lb.cos_theta_o = 1.f;
+        lb.cos_theta_e = 0.f;
+        lb.power = power;
+        lb.two_sided = true;
+        return true;
+    }
+
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
+
+    vec3 Q, u, v;
+    vec3 normal;
+    float D;
+    vec3 w;
+    float area;
+    material* mat_ptr;
+};
+
+__device__ bool quad::hit(const ray& r, float t0, float t1, hit_record& rec) const {
+    float denom = dot(normal, r.direction());
+    if (fabsf(denom) < 1e-8f) return false;
+
+    float t = (D - dot(normal, r.origin())) / denom;
+    if (t < t0 || t > t1) return false;
+
+    vec3 p = r.at(t);
+    vec3 planar = p - Q;
+    float alpha = dot(w, cross(planar, v));
+    float beta = dot(w, cross(u, planar));
+    if (alpha < 0.f || alpha > 1.f || beta < 0.f || beta > 1.f) return false;
+
+    rec.t = t;
+    rec.mat_ptr = mat_ptr;
+    rec.obj = this;
+    rec.p = p;
+    rec.normal = denom < 0.f ? normal : -normal;
+    return true;
+}
+
+// The corners' box, padded where the quad lies flat along an axis.
+__device__ bool quad::bounding_box(float t0, float t1, aabb& box) const {
+    vec3 lo = Q, hi = Q;
+    vec3 corners[3] = { Q + u, Q + v, Q + u + v };
+    for (int k = 0; k < 3; ++k) {
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = fminf(lo[a], corners[k][a]);
+            hi[a] = fmaxf(hi[a], corners[k][a]);
+        }
+    }
+    for (int a = 0; a < 3; ++a) {
+        lo[a] -= 0.0001f;
+        hi[a] += 0.0001f;
+    }
+    box = aabb(lo, hi);
+    return true;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include <curand_kernel.h>
+
+#include "vec3.h"
+
+// Slots probed from a cell's home slot before the table counts as full.
+#define RADIANCE_CACHE_PROBES 8
+// Samples a cell needs before paths may end on it.
+#define RADIANCE_CACHE_MIN_SAMPLES 16
+// Paths only end on the cache after a segment at least this many cells
+// long, so corners and contact shadows, where a cell spans visibly
+// different lighting, keep tracing.
+#define RADIANCE_CACHE_MIN_DISTANCE 2.f
+// Diffuse vertices per path kept for filling the cache.
+#define RADIANCE_CACHE_MAX_VERTICES 8
+
+// Off, ending paths on the cache, or using it only as a control variate.
+enum radiance_cache_mode {
+    CACHE_OFF = 0,
+    CACHE_BIASED = 1,
+    CACHE_UNBIASED = 2
+};
+
+/**
+ * World-space radiance cache: an open-addressed hash table of grid cells,
+ * each holding the sum and count of the reflected radiance estimates paths
+ * have left at diffuse vertices inside it. A cell is keyed by its integer
+ * coordinates and the dominant axis and sign of the surface normal, so the
+ * two sides of a thin wall don't share a cell. Only ever filled during a
+ * render; the scene is static, so cells just average all they get.
+ */
+struct radiance_cache {
+    vec3 origin;
+    float inv_cell;
+    float cell;
+    unsigned mask;
+    unsigned long long* keys;
+    float* radiance;
+    unsigned* samples;
+};
+
+__device__ inline unsigned long long radiance_cache_key(const radiance_cache& c, const vec3& p, const vec3& n) {
+    unsigned long long key = 0;
+    for (int a = 0; a < 3; ++a) {
+        long long q = (long long)floorf((p[a] - c.origin[a]) * c.inv_cell) + (1 << 18);
+        key |= (unsigned long long)(q & 0x7ffff) << (19 * a);
+    }
+    int axis = fabsf(n.x()) > fabsf(n.y()) ? (fabsf(n.x()) > fabsf(n.z()) ? 0 : 2) : (fabsf(n.y()) > fabsf(n.z()) ? 1 : 2);
+    unsigned long long bucket = 2 * axis + (n[axis] < 0.f);
+    // Zero marks an empty slot.
+    return (key | (bucket << 57)) + 1;
+}
+
+__device__ inline unsigned radiance_cache_hash(unsigned long long key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return unsigned(key);
+}
+
+// Slot holding the cell at p, claimed if the cell is new; -1 if its probe
+// sequence is full.
+__device__ int radiance_cache_slot(const radiance_cache& c, const vec3& p, const vec3& n) {
+    unsigned long long key = radiance_cache_key(c, p, n);
+    unsigned home = radiance_cache_hash(key);
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; ++probe) {
+        unsigned slot = (home + probe) & c.mask;
+        unsigned long long found = c.keys[slot];
+        if (found == 0ull) found = atomicCAS(&c.keys[slot], 0ull, key);
+        if (found == 0ull || found == key) return int(slot);
+    }
+    return -1;
+}
+
+// The cell's mean, if it has enough samples to end a path on.
+__device__ bool radiance_cache_lookup(const radiance_cache& c, int slot, vec3& radiance) {
+    if (slot < 0) return false;
+    unsigned n = c.samples[slot];
+    if (n < RADIANCE_CACHE_MIN_SAMPLES) return false;
+    const float* sum = &c.radiance[3 * slot];
+    radiance = vec3(fmaxf(sum[0], 0.f), fmaxf(sum[1], 0.f), fmaxf(sum[2], 0.f)) / float(n);
+    return true;
+}
+
+// A diffuse vertex of the current path: its cell, and the radiance and
+// throughput the path had on arriving there.
+struct cache_vertex {
+    int slot;
+    vec3 radiance;
+    vec3 throughput;
+};
+
+/**
+ * Per-thread radiance cache state passed to path_bounce(). From the second
+ * diffuse vertex on, a path that reaches a cell with enough samples adds
+ * the cached radiance and ends. With a continue probability q above 0 it
+ * instead goes on with probability q, subtracting the cached value and
+ * weighting what it finds by 1 / q. The cache then only acts as a control
+ * variate and the estimate stays unbiased.
+ */
+struct cache_path {
+    const radiance_cache* cache;
+    float continue_probability;
+    int diffuse_vertices;
+    int count;
+    cache_vertex vertex[RADIANCE_CACHE_MAX_VERTICES];
+};
+
+__device__ void cache_path_begin(cache_path& g) {
+    g.diffuse_vertices = 0;
+    g.count = 0;
+}
+
+// Adds what the finished path found after each of its vertices, divided by
+// the throughput it had there, to that vertex's cell.
+__device__ void cache_train(const cache_path& g, const vec3& radiance) {
+    for (int k = 0; k < g.count; ++k) {
+        const cache_vertex& v = g.vertex[k];
+        if (v.slot < 0) continue;
+        vec3 behind = radiance - v.radiance;
+        vec3 value;
+        for (int c = 0; c < 3; ++c) {
+            value[c] = v.throughput[c] > 0.f ? behind[c] / v.throughput[c] : 0.f;
+        }
+        if (!isfinite(value[0]) || !isfinite(value[1]) || !isfinite(value[2])) continue;
+        float* sum = &g.cache->radiance[3 * v.slot];
+        atomicAdd(&sum[0], value[0]);
+        atomicAdd(&sum[1], value[1]);
+        atomicAdd(&sum[2], value[2]);
+        atomicAdd(&g.cache->samples[v.slot], 1u);
+    }
+}
+
+#endif
@@ -14,13 +14,59 @@ class rectangle_xy : public hittable {
 public:
     __device__ rectangle_xy() {};
     __device__ rectangle_xy(float _x0, float _x1, float _y0, float _y1, float _k, material* mat):
-        x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(mat) {};
+        x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(mat) {}
+    __device__ virtual ~rectangle_xy() {
+        delete mat_ptr;
+    }
 
     __device__ virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const {
         box = aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
         return true;
     }
+    __device__ virtual double pdf_value(const vec3& origin, const vec3& v) const override {
+        hit_record rec;
+        if (!this->hit(ray(origin, v), 0.001, FLT_MAX, rec))
+            return 0;
+
+        auto area = (x1 - x0) * (y1 - y0);
+        auto distance_squared = rec.t * rec.t * v.squared_length();
+        auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    __device__ virtual vec3 random(const vec3& origin, curandState* state) const override {
+        auto random_point = vec3(x0 + curand_uniform(state) * (x1 - x0), y0 + curand_uniform(state) * (y1 - y0), k);
+        return random_point - origin;
+    }
+
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override {
+        rec.t = 0.f;
+        rec.p = vec3(x0 + curand_uniform(state) * (x1 - x0), y0 + curand_uniform(state) * (y1 - y0), k);
+        rec.normal = curand_uniform(state) < 0.5f ? vec3(0, 0, 1) : -vec3(0, 0, 1);
+        rec.mat_ptr = mat_ptr;
+        rec.obj = this;
+        pdf = 0.5f / ((x1 - x0) * (y1 - y0));
+        return true;
+    }
+
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override {
+        float power = luminance(mat_ptr->emitted(0, 0, vec3())) * (x1 - x0) * (y1 - y0);
+        if (power <= 0.f)
+            return false;
+        bounding_box(0, 0, lb.box);
+        lb.axis = vec3(0, 0, 1);
+        lb.cos_theta_o = 1.f;
+        lb.cos_theta_e = 0.f;
+        lb.power = power;
+        lb.two_sided = true;
+        return true;
+    }
+
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
 
     float x0, x1, y0, y1, k;
     material* mat_ptr;
@@ -37,6 +83,7 @@ __device__ bool rectangle_xy::hit(const ray& r, float t0, float t1, hit_record&
 
     rec.t = t;
     rec.mat_ptr = mat_ptr;
+    rec.obj = this;
     rec.p = r.at(t);
     auto outward_normal = vec3(0, 0, 1);
     bool front_face = dot(r.direction(), outward_normal) < 0;
@@ -52,7 +99,10 @@ class rectangle_xz : public hittable
 public:
     __device__ rectangle_xz() {};
     __device__ rectangle_xz(float _x0, float _x1, float _z0, float _z1, float _k, material* mat) :
-        x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {};
+        x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {}
+    __device__ virtual ~rectangle_xz() {
+        delete mat_ptr;
+    }
 
     __device__ virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const {
@@ -72,10 +122,37 @@ public:
     }
 
     __device__ virtual vec3 random(const vec3& origin, curandState* state) const override {
-        auto random_point = vec3(x0 + curand_normal(state) * (x1 - x0), k, z0 + curand_normal(state) * (z1 - z0));
+        auto random_point = vec3(x0 + curand_uniform(state) * (x1 - x0), k, z0 + curand_uniform(state) * (z1 - z0));
         return random_point - origin;
     }
 
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override {
+        rec.t = 0.f;
+        rec.p = vec3(x0 + curand_uniform(state) * (x1 - x0), k, z0 + curand_uniform(state) * (z1 - z0));
+        rec.normal = curand_uniform(state) < 0.5f ? vec3(0, 1, 0) : -vec3(0, 1, 0);
+        rec.mat_ptr = mat_ptr;
+        rec.obj = this;
+        pdf = 0.5f / ((x1 - x0) * (z1 - z0));
+        return true;
+    }
+
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override {
+        float power = luminance(mat_ptr->emitted(0, 0, vec3())) * (x1 - x0) * (z1 - z0);
+        if (power <= 0.f)
+            return false;
+        bounding_box(0, 0, lb.box);
+        lb.axis = vec3(0, 1, 0);
+        lb.cos_theta_o = 1.f;
+        lb.cos_theta_e = 0.f;
+        lb.power = power;
+        lb.two_sided = true;
+        return true;
+    }
+
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
+
     float x0, x1, z0, z1, k;
     material* mat_ptr;
 };
@@ -91,6 +168,7 @@ __device__ bool rectangle_xz::hit(const ray& r, float t0, float t1, hit_record&
 
     rec.t = t;
     rec.mat_ptr = mat_ptr;
+    rec.obj = this;
     rec.p = r.at(t);
     auto outward_normal = vec3(0, 1, 0);
     bool front_face = dot(r.direction(), outward_normal) < 0;
@@ -106,13 +184,59 @@ class rectangle_yz : public hittable {
 public:
     __device__ rectangle_yz() {};
     __device__ rectangle_yz(float _y0, float _y1, float _z0, float _z1, float _k, material* mat) :
-        y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {};
+        y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {}
+    __device__ virtual ~rectangle_yz() {
+        delete mat_ptr;
+    }
 
     __device__ virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
     __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const {
         box = aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
         return true;
     }
+    __device__ virtual double pdf_value(const vec3& origin, const vec3& v) const override {
+        hit_record rec;
+        if (!this->hit(ray(origin, v), 0.001, FLT_MAX, rec))
+            return 0;
+
+        auto area = (y1 - y0) * (z1 - z0);
+        auto distance_squared = rec.t * rec.t * v.squared_length();
+        auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    __device__ virtual vec3 random(const vec3& origin, curandState* state) const override {
+        auto random_point = vec3(k, y0 + curand_uniform(state) * (y1 - y0), z0 + curand_uniform(state) * (z1 - z0));
+        return random_point - origin;
+    }
+
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override {
+        rec.t = 0.f;
+        rec.p = vec3(k, y0 + curand_uniform(state) * (y1 - y0), z0 + curand_uniform(state) * (z1 - z0));
+        rec.normal = curand_uniform(state) < 0.5f ? vec3(1, 0, 0) : -vec3(1, 0, 0);
+        rec.mat_ptr = mat_ptr;
+        rec.obj = this;
+        pdf = 0.5f / ((y1 - y0) * (z1 - z0));
+        return true;
+    }
+
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override {
+        float power = luminance(mat_ptr->emitted(0, 0, vec3())) * (y1 - y0) * (z1 - z0);
+        if (power <= 0.f)
+            return false;
+        bounding_box(0, 0, lb.box);
+        lb.axis = vec3(1, 0, 0);
+        lb.cos_theta_o = 1.f;
+        lb.cos_theta_e = 0.f;
+        lb.power = power;
+        lb.two_sided = true;
+        return true;
+    }
+
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
 
     float y0, y1, z0, z1, k;
     material* mat_ptr;
@@ -129,6 +253,7 @@ __device__ bool rectangle_yz::hit(const ray& r, float t0, float t1, hit_record&
 
     rec.t = t;
     rec.mat_ptr = mat_ptr;
+    rec.obj = this;
     rec.p = r.at(t);
     auto outward_normal = vec3(1, 0, 0);
     bool front_face = dot(r.direction(), outward_normal) < 0;
@@ -136,40 +261,4 @@ __device__ bool rectangle_yz::hit(const ray& r, float t0, float t1, hit_record&
     return true;
 }
 
-class box : public hittable {
-public:
-    __device__ box() {}
-    __device__ box(const vec3& p0, const vec3& p1, material* ptr);
-    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
-    __device__ virtual bool bounding_box(float t0, float t1, aabb& box) const {
-        box = aabb(box_min, box_max);
-        return true;
-    }
-
-    vec3 box_min;
-    vec3 box_max;
-    hittable* sides;
-};
-
-__device__ box::box(const vec3& p0, const vec3& p1, material* ptr) {
-    box_min = p0;
-    box_max = p1;
-
-    hittable** list = new hittable * [6];
-    list[0] = new rectangle_xy(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-    list[1] = new rectangle_xy(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr);
-    list[2] = new rectangle_xz(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-    list[3] = new rectangle_xz(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr);
-    list[4] = new rectangle_yz(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr);
-    list[5] = new rectangle_yz(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-    sides = new hittable_list(list, 6);
-}
-
-__device__ bool box::hit(const ray& r,
-    float t_min,
-    float t_max,
-    hit_record& rec) const {
-    return sides->hit(r, t_min, t_max, rec);
-}
-
 #endif
\ No newline at end of file
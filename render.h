@@ -0,0 +1,192 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "camera.h"
+#include "integrator.h"
+#include "tile_order.h"
+#include "trace.h"
+
+__global__ void render_init(int max_x, int max_y, curandState* rand_state) {
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    int j = threadIdx.y + blockIdx.y * blockDim.y;
+    if ((i >= max_x) || (j >= max_y)) return;
+    int pixel_index = j * max_x + i;
+    //Each thread gets same seed, a different sequence number, no offset
+    curand_init(1984, pixel_index, 0, &rand_state[pixel_index]);
+}
+
+// Seed every sample's random state is derived from; --seed sets it. Each
+// device has its own copy, so set_render_seed() sets the current device's
+// and render_seed is kept for the others.
+__device__ unsigned long long d_render_seed = 1984;
+unsigned long long render_seed = 1984;
+
+void set_render_seed(unsigned long long seed) {
+    render_seed = seed;
+    checkCudaErrors(cudaMemcpyToSymbol(d_render_seed, &seed, sizeof(seed)));
+}
+
+// splitmix64's finalizer.
+__host__ __device__ inline unsigned long long mix_bits(unsigned long long x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Seeds state for sample s of pixel p from d_render_seed, p and s alone,
+ * so a sample draws the same numbers whichever thread, tile, launch, pass
+ * or device traces it, and however many samples came before it. The three
+ * are hashed into curand's seed with the subsequence left at 0, which
+ * skips curand_init()'s jump ahead and makes a state per sample cheap.
+ */
+__device__ inline void sample_state(unsigned long long pixel, int sample, curandState* state) {
+    curand_init(mix_bits(mix_bits(d_render_seed ^ mix_bits(pixel)) + (unsigned)sample), 0, 0, state);
+}
+
+__global__ void read_camera(camera** cam, camera* out) {
+    *out = **cam;
+}
+
+__global__ void write_camera(camera** cam, camera c) {
+    **cam = c;
+}
+
+__global__ void world_bounds(hittable** world, aabb* bounds) {
+    if (!(*world)->bounding_box(0.f, 1.f, *bounds)) {
+        *bounds = aabb(vec3(-1, -1, -1), vec3(1, 1, 1));
+    }
+}
+
+// The pixel this thread shades in a packed tile from make_tile_order().
+__device__ bool tile_pixel_coords(int order, int tile, int max_x, int max_y, int& i, int& j) {
+    unsigned x, y;
+    tile_pixel(order, threadIdx.x, x, y);
+    i = (tile & 0xffff) * TILE_SIZE + x;
+    j = (tile >> 16) * TILE_SIZE + y;
+    return (i < max_x) && (j < max_y);
+}
+
+// Launched with one TILE_SIZE x TILE_SIZE block per entry of tiles.
+__device__ bool tile_pixel_index(int order, const int* tiles, int max_x, int max_y, int& i, int& j) {
+    return tile_pixel_coords(order, tiles[blockIdx.x], max_x, max_y, i, j);
+}
+
+// Samples first_sample to first_sample + ns - 1 of pixel (i, j), summed
+// in that order, averaged and gamma corrected. Paths stop after
+// min(max_depth, DEPTH) bounces.
+template <unsigned F, int DEPTH>
+__device__ vec3 render_pixel(int i, int j, int max_x, int max_y, int first_sample, int ns, const camera& cam, hittable** world, light_bvh** lights,
+    int max_depth) {
+    unsigned long long pixel_index = (unsigned long long)j * max_x + i;
+    vec3 col(0, 0, 0);
+    for (int s = 0; s < ns; s++) {
+        curandState local_rand_state;
+        sample_state(pixel_index, first_sample + s, &local_rand_state);
+        float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+        float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+        ray r = cam.get_ray<F>(u, v, &local_rand_state);
+        col += color<F, DEPTH>(r, world, lights, &local_rand_state, max_depth);
+    }
+    col /= float(ns);
+    col[0] = sqrt(col[0]);
+    col[1] = sqrt(col[1]);
+    col[2] = sqrt(col[2]);
+    return col;
+}
+
+/**
+ * One instantiation per feature mask F and path depth DEPTH, so the lens,
+ * shutter and dielectric code a scene doesn't use is not in its kernel at
+ * all. launch_render() picks the variant. Samples are numbered from
+ * first_sample, so passes that each start where the last one ended draw
+ * new samples; no random state is kept between launches.
+ */
+template <unsigned F, int DEPTH>
+__global__ void render(vec3* fb, int max_x, int max_y, int ns, int order, const int* tiles, camera** cam, hittable** world, light_bvh** lights, int first_sample,
+    int max_depth) {
+    TRACE_TILE_BEGIN(tiles, max_x);
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    fb[pixel_index] = render_pixel<F, DEPTH>(i, j, max_x, max_y, first_sample, ns, **cam, world, lights, max_depth);
+    TRACE_TILE_END(tiles, max_x);
+}
+
+// Adds a pass's averaged, gamma corrected output to accum as a linear sum.
+__global__ void accumulate_pass(vec3* accum, const vec3* fb, int num_pixels, int ns) {
+    int p = threadIdx.x + blockIdx.x * blockDim.x;
+    if (p >= num_pixels) return;
+    accum[p] += fb[p] * fb[p] * float(ns);
+}
+
+// fb as render() would have written it from the spp samples summed in accum.
+__global__ void resolve_passes(vec3* fb, const vec3* accum, int num_pixels, int spp) {
+    int p = threadIdx.x + blockIdx.x * blockDim.x;
+    if (p >= num_pixels) return;
+    vec3 col = accum[p] / float(spp);
+    fb[p] = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+}
+
+template <unsigned F, typename Launcher>
+void dispatch_depth(int max_depth, Launcher& launcher) {
+    switch (depth_bucket(max_depth)) {
+    case 8:
+        launcher.template launch<F, 8>(max_depth);
+        break;
+    case 16:
+        launcher.template launch<F, 16>(max_depth);
+        break;
+    default:
+        launcher.template launch<F, MAX_DEPTH>(max_depth);
+        break;
+    }
+}
+
+// Calls launcher.launch<F, DEPTH>(max_depth) with the kernel variant
+// matching a scene's feature mask and the requested path depth; DEPTH is
+// the bucket max_depth rounds up to, and kernels pass max_depth on so paths
+// stop at it.
+template <typename Launcher>
+void dispatch_variant(unsigned features, int max_depth, Launcher& launcher) {
+    switch (features & FEATURE_ALL) {
+    case 0: dispatch_depth<0>(max_depth, launcher); break;
+    case 1: dispatch_depth<1>(max_depth, launcher); break;
+    case 2: dispatch_depth<2>(max_depth, launcher); break;
+    case 3: dispatch_depth<3>(max_depth, launcher); break;
+    case 4: dispatch_depth<4>(max_depth, launcher); break;
+    case 5: dispatch_depth<5>(max_depth, launcher); break;
+    case 6: dispatch_depth<6>(max_depth, launcher); break;
+    case 7: dispatch_depth<7>(max_depth, launcher); break;
+    // Scenes with media are rare enough to share the full kernel.
+    default: dispatch_depth<FEATURE_ALL>(max_depth, launcher); break;
+    }
+}
+
+struct render_launcher {
+    int num_tiles;
+    vec3* fb;
+    int max_x, max_y, ns, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    int first_sample;
+    cudaStream_t stream;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        render<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE, 0, stream >> > (fb, max_x, max_y, ns, order, tiles, cam, world, lights, first_sample, max_depth);
+    }
+};
+
+void launch_render(unsigned features, int max_depth, int num_tiles, vec3* fb, int max_x, int max_y, int ns, int order, const int* tiles,
+    camera** cam, hittable** world, light_bvh** lights, int first_sample = 0) {
+    render_launcher launcher = { num_tiles, fb, max_x, max_y, ns, order, tiles, cam, world, lights, first_sample, 0 };
+    dispatch_variant(features, max_depth, launcher);
+}
+
+#endif
@@ -0,0 +1,521 @@
+#ifndef RENDER_DAEMON_H
+#define RENDER_DAEMON_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "scenes.h"
+#include "render.h"
+#include "image_io.h"
+#include "memory_budget.h"
+#include "trace.h"
+
+/**
+ * Long running render service. Clients connect to a Unix domain socket and
+ * send one command per line:
+ *
+ *   render scene=NAME width=N height=N spp=N output=FILE [priority=N]
+ *          [max_depth=N] [look=FX,FY,FZ,AX,AY,AZ]
+ *   stats
+ *   shutdown
+ *
+ * A render is answered with "queued ID", then "done ID QUEUE_MS RENDER_MS
+ * FILE" or "error ID MESSAGE" on the same connection. Built scenes (objects,
+ * BVH, light BVH) stay on the device in an LRU cache keyed by a hash of the
+ * scene description, so repeated jobs skip straight to tracing. Jobs run
+ * highest priority first on a pool of workers, each with its own stream
+ * and buffers that are kept between jobs. Samples are seeded from their
+ * pixel and number, so a job's image doesn't depend on which worker
+ * renders it or what ran before.
+ */
+
+struct daemon_client {
+    int fd;
+    std::mutex write_mutex;
+
+    void reply(const std::string& line) {
+#ifndef _WIN32
+        std::lock_guard<std::mutex> lock(write_mutex);
+        std::string msg = line + "\n";
+        // A client that hung up just misses its replies.
+        send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
+#endif
+    }
+    ~daemon_client() {
+#ifndef _WIN32
+        close(fd);
+#endif
+    }
+};
+
+struct render_job {
+    long long id;
+    int priority;
+    std::string scene;
+    int nx = 128;
+    int ny = 128;
+    int ns = 16;
+    int max_depth = MAX_DEPTH;
+    bool has_look = false;
+    float look[6];
+    std::string output;
+    std::shared_ptr<daemon_client> client;
+    std::chrono::steady_clock::time_point queued;
+};
+
+struct job_order {
+    // Highest priority first, then first come first served.
+    bool operator()(const render_job& a, const render_job& b) const {
+        return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+    }
+};
+
+inline bool parse_job(const std::string& line, render_job& job, std::string& error) {
+    std::istringstream in(line);
+    std::string word;
+    in >> word;
+    job.priority = 0;
+    while (in >> word) {
+        size_t eq = word.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + word;
+            return false;
+        }
+        std::string key = word.substr(0, eq);
+        std::string value = word.substr(eq + 1);
+        if (key == "scene") job.scene = value;
+        else if (key == "width") job.nx = atoi(value.c_str());
+        else if (key == "height") job.ny = atoi(value.c_str());
+        else if (key == "spp") job.ns = atoi(value.c_str());
+        else if (key == "max_depth") job.max_depth = atoi(value.c_str());
+        else if (key == "priority") job.priority = atoi(value.c_str());
+        else if (key == "output") job.output = value;
+        else if (key == "look") {
+            job.has_look = sscanf(value.c_str(), "%f,%f,%f,%f,%f,%f",
+                &job.look[0], &job.look[1], &job.look[2], &job.look[3], &job.look[4], &job.look[5]) == 6;
+            if (!job.has_look) {
+                error = "look needs six comma separated numbers";
+                return false;
+            }
+        }
+        else {
+            error = "unknown key " + key;
+            return false;
+        }
+    }
+    if (job.scene == "paged") {
+        error = "the paged scene can't be served by the daemon";
+        return false;
+    }
+    if (job.output.empty() || job.nx <= 0 || job.ny <= 0 || job.ns <= 0) {
+        error = "render needs output, width, height and spp";
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a over the description a scene is built from, printed to tell builds
+// apart in the log. Scenes are generated from their name alone, so that is
+// the whole content; the cache is keyed by the name itself, as two names
+// can share a hash.
+inline unsigned long long scene_hash(const std::string& description) {
+    unsigned long long h = 14695981039346656037ull;
+    for (char c : description) {
+        h ^= (unsigned char)c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// A scene built on the device, freed once the cache has dropped it and the
+// last job using it has finished.
+struct cached_scene {
+    std::string name;
+    int list_size;
+    hittable** d_list;
+    hittable** d_world;
+    light_bvh** d_lights;
+    camera** d_camera;
+    camera base;
+    unsigned features;
+    bool built = false;
+    std::mutex build_mutex;
+
+    // False if the scene doesn't fit the memory budget; what was built of it
+    // is freed, and the next job that asks for it tries again.
+    bool build() {
+        list_size = scene_list_size(name);
+        checkCudaErrors(cudaMallocManaged((void**)&d_list, list_size * sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_world, sizeof(hittable*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_lights, sizeof(light_bvh*)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_camera, sizeof(camera*)));
+        curandState* rand_state;
+        checkCudaErrors(cudaMalloc((void**)&rand_state, sizeof(curandState)));
+        render_init << <1, 1 >> > (1, 1, rand_state);
+        checkCudaErrors(cudaGetLastError());
+        bool fits = create_scene(name, d_list, d_world, d_lights, d_camera, 1, 1, rand_state, features);
+        checkCudaErrors(cudaFree(rand_state));
+        if (!fits) {
+            release();
+            return false;
+        }
+
+        camera* h_camera;
+        checkCudaErrors(cudaMallocManaged((void**)&h_camera, sizeof(camera)));
+        read_camera << <1, 1 >> > (d_camera, h_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        base = *h_camera;
+        checkCudaErrors(cudaFree(h_camera));
+        // Counts the scene's device heap towards the budget the workers'
+        // buffers are checked against.
+        memory_snapshot();
+        built = true;
+        std::cerr << "built scene " << name << " (" << std::hex << scene_hash(name) << std::dec << ")\n";
+        return true;
+    }
+    ~cached_scene() {
+        if (built) release();
+    }
+    void release() {
+        free_world << <1, 1 >> > (d_list, list_size, d_world, d_lights, d_camera);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaFree(d_list));
+        checkCudaErrors(cudaFree(d_world));
+        checkCudaErrors(cudaFree(d_lights));
+        checkCudaErrors(cudaFree(d_camera));
+    }
+};
+
+class scene_cache {
+public:
+    scene_cache(size_t capacity) : hits(0), misses(0), capacity(capacity) {}
+
+    std::shared_ptr<cached_scene> get(const std::string& name) {
+        std::shared_ptr<cached_scene> scene;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(name);
+            if (it != entries.end()) {
+                lru.splice(lru.begin(), lru, it->second.second);
+                scene = it->second.first;
+                hits++;
+            }
+            else {
+                scene = std::make_shared<cached_scene>();
+                scene->name = name;
+                lru.push_front(name);
+                entries[name] = std::make_pair(scene, lru.begin());
+                misses++;
+                while (entries.size() > capacity) {
+                    entries.erase(lru.back());
+                    lru.pop_back();
+                }
+            }
+        }
+        // Built outside the cache lock so other scenes stay available. Null
+        // if the scene doesn't fit the memory budget.
+        std::lock_guard<std::mutex> build(scene->build_mutex);
+        if (!scene->built && !scene->build()) return nullptr;
+        return scene;
+    }
+
+    std::atomic<long long> hits;
+    std::atomic<long long> misses;
+
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::list<std::string> lru;
+    std::map<std::string, std::pair<std::shared_ptr<cached_scene>, std::list<std::string>::iterator>> entries;
+};
+
+// Per worker device state, grown on demand and kept between jobs.
+struct render_worker {
+    cudaStream_t stream;
+    vec3* fb = nullptr;
+    int* tiles = nullptr;
+    camera* cam = nullptr;
+    camera** d_cam = nullptr;
+    int capacity = 0;
+    int tile_capacity = 0;
+    std::vector<vec3> host_fb;
+
+    render_worker() {
+        checkCudaErrors(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+        checkCudaErrors(cudaMalloc((void**)&cam, sizeof(camera)));
+        checkCudaErrors(cudaMallocManaged((void**)&d_cam, sizeof(camera*)));
+        *d_cam = cam;
+    }
+    ~render_worker() {
+        checkCudaErrors(tracked_free(fb));
+        checkCudaErrors(tracked_free(tiles));
+        checkCudaErrors(cudaFree(cam));
+        checkCudaErrors(cudaFree(d_cam));
+        checkCudaErrors(cudaStreamDestroy(stream));
+    }
+
+    // False if the buffers don't fit the memory budget; the worker is left
+    // without them, and the next job allocates again.
+    bool reserve(int nx, int ny, int num_tiles) {
+        if (nx * ny > capacity) {
+            checkCudaErrors(tracked_free(fb));
+            fb = nullptr;
+            capacity = 0;
+            if (tracked_malloc(MEM_FRAMEBUFFER, (void**)&fb, nx * ny * sizeof(vec3)) != cudaSuccess) {
+                fb = nullptr;
+                return false;
+            }
+            capacity = nx * ny;
+            host_fb.resize(capacity);
+        }
+        if (num_tiles > tile_capacity) {
+            checkCudaErrors(tracked_free(tiles));
+            tiles = nullptr;
+            tile_capacity = 0;
+            if (tracked_malloc(MEM_OTHER, (void**)&tiles, num_tiles * sizeof(int)) != cudaSuccess) {
+                tiles = nullptr;
+                return false;
+            }
+            tile_capacity = num_tiles;
+        }
+        return true;
+    }
+
+    // False if the job's buffers don't fit the memory budget.
+    bool render(const render_job& job, const cached_scene& scene) {
+        std::vector<int> order = make_tile_order(ORDER_HILBERT, job.nx, job.ny);
+        int num_tiles = int(order.size());
+        if (!reserve(job.nx, job.ny, num_tiles)) return false;
+        checkCudaErrors(cudaMemcpyAsync(tiles, order.data(), num_tiles * sizeof(int), cudaMemcpyHostToDevice, stream));
+
+        const camera& b = scene.base;
+        vec3 from = job.has_look ? vec3(job.look[0], job.look[1], job.look[2]) : b.origin;
+        vec3 at = job.has_look ? vec3(job.look[3], job.look[4], job.look[5]) : b.lookat;
+        camera c = b.moved(from, at, float(job.nx) / float(job.ny));
+        checkCudaErrors(cudaMemcpyAsync(cam, &c, sizeof(camera), cudaMemcpyHostToDevice, stream));
+
+        render_launcher launcher = { num_tiles, fb, job.nx, job.ny, job.ns, ORDER_HILBERT, tiles,
+            d_cam, scene.d_world, scene.d_lights, 0, stream };
+        dispatch_variant(scene.features, job.max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaMemcpyAsync(host_fb.data(), fb, job.nx * job.ny * sizeof(vec3), cudaMemcpyDeviceToHost, stream));
+        checkCudaErrors(cudaStreamSynchronize(stream));
+        return true;
+    }
+};
+
+class render_daemon {
+public:
+    render_daemon(const std::string& path, int workers, size_t cache_size)
+        : socket_path(path), num_workers(workers), scenes(cache_size), next_id(0), jobs_done(0), stopping(false), listen_fd(-1) {}
+
+    // Serves until a client sends shutdown; queued jobs are finished first.
+    int run() {
+#ifdef _WIN32
+        std::cerr << "the render daemon needs Unix domain sockets\n";
+        return 1;
+#else
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(socket_path.c_str());
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+            std::cerr << "can't listen on " << socket_path << "\n";
+            return 1;
+        }
+        std::cerr << "render daemon listening on " << socket_path << " with " << num_workers << " workers\n";
+
+        std::vector<std::thread> pool;
+        for (int w = 0; w < num_workers; ++w) pool.emplace_back(&render_daemon::work, this);
+        for (;;) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) break;
+            std::shared_ptr<daemon_client> client = std::make_shared<daemon_client>();
+            client->fd = fd;
+            std::thread(&render_daemon::serve, this, client).detach();
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        for (std::thread& t : pool) t.join();
+        unlink(socket_path.c_str());
+        return 0;
+#endif
+    }
+
+private:
+    void serve(std::shared_ptr<daemon_client> client) {
+#ifndef _WIN32
+        std::string pending;
+        char buf[4096];
+        for (;;) {
+            ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
+            if (n <= 0) return;
+            pending.append(buf, n);
+            size_t eol;
+            while ((eol = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, eol);
+                pending.erase(0, eol + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                command(line, client);
+            }
+        }
+#endif
+    }
+
+    void command(const std::string& line, const std::shared_ptr<daemon_client>& client) {
+        std::istringstream in(line);
+        std::string op;
+        in >> op;
+        if (op == "render") {
+            render_job job;
+            std::string error;
+            job.id = next_id++;
+            if (!parse_job(line, job, error)) {
+                client->reply("error " + std::to_string(job.id) + " " + error);
+                return;
+            }
+            job.client = client;
+            job.queued = std::chrono::steady_clock::now();
+            client->reply("queued " + std::to_string(job.id));
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue.push(job);
+            }
+            queue_ready.notify_one();
+        }
+        else if (op == "stats") {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            client->reply("stats jobs_done=" + std::to_string(jobs_done) + " queued=" + std::to_string(queue.size())
+                + " scene_hits=" + std::to_string(scenes.hits) + " scene_misses=" + std::to_string(scenes.misses)
+                + " memory_mb=" + std::to_string(memory_total(memory_snapshot()) >> 20));
+        }
+        else if (op == "shutdown") {
+            client->reply("bye");
+#ifndef _WIN32
+            ::shutdown(listen_fd, SHUT_RDWR);
+            close(listen_fd);
+#endif
+        }
+        else if (!op.empty()) {
+            client->reply("error - unknown command " + op);
+        }
+    }
+
+    void work() {
+        TRACE_THREAD_NAME("daemon worker");
+        render_worker worker;
+        for (;;) {
+            render_job job;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = queue.top();
+                queue.pop();
+            }
+            auto start = std::chrono::steady_clock::now();
+            TRACE_PHASE("scene");
+            std::shared_ptr<cached_scene> scene = scenes.get(job.scene);
+            TRACE_PHASE("render");
+            bool rendered = scene && worker.render(job, *scene);
+            TRACE_PHASE("output");
+            bool written = rendered && write_ppm(job.output, worker.host_fb.data(), job.nx, job.ny);
+            TRACE_PHASE_END();
+            auto end = std::chrono::steady_clock::now();
+            jobs_done++;
+
+            double queue_ms = std::chrono::duration<double, std::milli>(start - job.queued).count();
+            double render_ms = std::chrono::duration<double, std::milli>(end - start).count();
+            std::ostringstream msg;
+            if (written) msg << "done " << job.id << " " << queue_ms << " " << render_ms << " " << job.output;
+            else if (!rendered) msg << "error " << job.id << " memory budget exceeded";
+            else msg << "error " << job.id << " can't write " << job.output;
+            job.client->reply(msg.str());
+        }
+    }
+
+    std::string socket_path;
+    int num_workers;
+    scene_cache scenes;
+    std::atomic<long long> next_id;
+    std::atomic<long long> jobs_done;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::priority_queue<render_job, std::vector<render_job>, job_order> queue;
+    bool stopping;
+    int listen_fd;
+};
+
+// Sends one command to a daemon and prints its replies until the job is
+// done or failed. Returns non-zero on failure.
+inline int submit_job(const std::string& path, const std::string& line) {
+#ifdef _WIN32
+    std::cerr << "the render daemon needs Unix domain sockets\n";
+    return 1;
+#else
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "can't connect to " << path << "\n";
+        return 1;
+    }
+    std::string msg = line + "\n";
+    send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
+    std::string pending;
+    char buf[4096];
+    int status = 1;
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        pending.append(buf, n);
+        size_t eol;
+        bool finished = false;
+        while ((eol = pending.find('\n')) != std::string::npos) {
+            std::string reply = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            std::cout << reply << "\n";
+            if (reply.compare(0, 4, "done") == 0 || reply.compare(0, 5, "stats") == 0 || reply == "bye") {
+                status = 0;
+                finished = true;
+            }
+            else if (reply.compare(0, 5, "error") == 0) {
+                finished = true;
+            }
+        }
+        if (finished) break;
+    }
+    close(fd);
+    return status;
+#endif
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef RENDER_FEATURES_H
+#define RENDER_FEATURES_H
+
+/**
+ * Optional renderer features. render() is instantiated per combination, and
+ * scene_features() reports which ones a scene actually uses, so a scene
+ * without a lens, moving objects, glass or media never runs those paths.
+ */
+enum feature_flags : unsigned {
+    FEATURE_DEPTH_OF_FIELD = 1u << 0,
+    FEATURE_MOTION_BLUR = 1u << 1,
+    FEATURE_DIELECTRIC = 1u << 2,
+    FEATURE_MEDIA = 1u << 3,
+    FEATURE_ALL = FEATURE_DEPTH_OF_FIELD | FEATURE_MOTION_BLUR | FEATURE_DIELECTRIC | FEATURE_MEDIA
+};
+
+#endif
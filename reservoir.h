@@ -0,0 +1,73 @@
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+#include "vec3.h"
+#include "ray.h"
+#include "hittable.h"
+
+/**
+ * A path's first diffuse vertex, as restir_render.h resamples its direct
+ * light: where it is, the ray that reached it, and the throughput its
+ * reflected light is weighted by. A null rec.mat_ptr means the pixel's
+ * path had no such vertex this pass.
+ */
+struct restir_vertex {
+    hit_record rec;
+    ray r_in;
+    vec3 throughput;
+};
+
+/**
+ * A light sample that can be moved between pixels: a point on an emitter
+ * with its normal, or a direction towards the environment. Its density is
+ * per unit area of the emitter, or per solid angle for the environment,
+ * neither of which depends on the shading point, so reservoirs of
+ * neighbouring pixels can be combined without a change of measure.
+ */
+struct restir_light {
+    const hittable* light;
+    bool environment;
+    vec3 p;
+    vec3 normal;
+    vec3 emitted;
+};
+
+/**
+ * Weighted reservoir over light samples, after Bitterli et al. 2020,
+ * "Spatiotemporal reservoir resampling for real-time ray tracing with
+ * dynamic direct lighting". y is the sample kept out of m seen, target
+ * is its unshadowed luminance at the owning vertex, and once finished W
+ * is the weight that makes f(y) * W an estimate of the direct light.
+ * Resampling weights already carry their MIS weight, so W is w_sum over
+ * the target alone.
+ */
+struct reservoir {
+    restir_light y;
+    float w_sum;
+    float m;
+    float target;
+    float W;
+};
+
+__device__ inline void reservoir_clear(reservoir& r) {
+    r.y.light = nullptr;
+    r.y.environment = false;
+    r.w_sum = r.m = r.target = r.W = 0.f;
+}
+
+// Streams y in with resampling weight w on behalf of m samples, keeping it
+// with probability w over the weights seen so far; u is uniform in [0, 1).
+__device__ inline void reservoir_update(reservoir& r, const restir_light& y, float target, float w, float m, float u) {
+    r.w_sum += w;
+    r.m += m;
+    if (w > 0.f && u * r.w_sum < w) {
+        r.y = y;
+        r.target = target;
+    }
+}
+
+__device__ inline void reservoir_finish(reservoir& r) {
+    r.W = r.target > 0.f ? r.w_sum / r.target : 0.f;
+}
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef RESTIR_RENDER_H
+#define RESTIR_RENDER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <float.h>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "reservoir.h"
+#include "image_io.h"
+#include "image_metrics.h"
+#include "memory_budget.h"
+
+// Light samples drawn from the light BVH into each pixel's reservoir per
+// pass; none of them is traced.
+#define RESTIR_CANDIDATES 32
+// A reservoir carried over from the last pass counts for at most this many
+// times the samples drawn in this one. Passes are accumulated into one
+// image, so a longer history mostly correlates them rather than lowering
+// the noise of the sum.
+#define RESTIR_TEMPORAL_CAP 1.f
+// Rounds of spatial reuse, each combining a pixel's reservoir with this many
+// neighbours' within RESTIR_RADIUS pixels.
+#define RESTIR_SPATIAL_PASSES 2
+#define RESTIR_NEIGHBORS 5
+#define RESTIR_RADIUS 10.f
+// Neighbours whose normal is further than about 25 degrees from the pixel's,
+// or whose distance from the camera differs by more than 10%, are skipped.
+#define RESTIR_NORMAL_COS 0.9f
+#define RESTIR_DEPTH_TOLERANCE 0.1f
+
+// Random numbers for one stage of a pass, independent of the others'.
+enum restir_stream {
+    RESTIR_STREAM_CANDIDATES = 1,
+    RESTIR_STREAM_SPATIAL = 2,
+    RESTIR_STREAM_SHADE = 3
+};
+
+__device__ inline void restir_state(int pixel, int num_pixels, int pass, int stream, curandState* state) {
+    sample_state((unsigned long long)stream * num_pixels + pixel, pass, state);
+}
+
+// Unshadowed light y reflects at v, per unit area of the emitter or per
+// solid angle of the environment. wi is the unit direction towards y and
+// distance how far it is; geometry is the factor turning a solid angle
+// density into an area one.
+__device__ vec3 restir_contribution(const restir_vertex& v, const restir_light& y, vec3& wi, float& distance, float& geometry) {
+    if (y.environment) {
+        wi = y.p;
+        distance = FLT_MAX;
+        geometry = 1.f;
+    }
+    else {
+        vec3 d = y.p - v.rec.p;
+        float d2 = d.squared_length();
+        if (d2 <= 0.f) return vec3(0.f, 0.f, 0.f);
+        distance = sqrtf(d2);
+        wi = d / distance;
+        geometry = fabsf(dot(y.normal, wi)) / d2;
+    }
+    float scattering_pdf = material_scattering_pdf(v.rec.mat_ptr, v.r_in, v.rec, ray(v.rec.p, wi, v.r_in.time()));
+    return v.throughput * y.emitted * (scattering_pdf * geometry);
+}
+
+// Luminance of restir_contribution(), the density reservoirs resample
+// towards. Zero where v's candidates can't reach y: a point the emitter
+// itself hides from v, such as the far side of a sphere.
+__device__ float restir_target(const restir_vertex& v, const restir_light& y) {
+    if (y.light == nullptr && !y.environment) return 0.f;
+    hit_record light_rec;
+    if (!y.environment && (!y.light->hit(ray(v.rec.p, y.p - v.rec.p, v.r_in.time()), 0.001f, FLT_MAX, light_rec) || light_rec.t < 1.f - 1e-3f)) {
+        return 0.f;
+    }
+    vec3 wi;
+    float distance, geometry;
+    return luminance(restir_contribution(v, y, wi, distance, geometry));
+}
+
+// Whether b's reservoir is worth reusing at a: close in depth and facing
+// the same way.
+__device__ bool restir_similar(const restir_vertex& a, const restir_vertex& b) {
+    if (a.rec.mat_ptr == nullptr || b.rec.mat_ptr == nullptr) return false;
+    float depth_a = a.rec.t * a.r_in.direction().length();
+    float depth_b = b.rec.t * b.r_in.direction().length();
+    return dot(a.rec.normal, b.rec.normal) >= RESTIR_NORMAL_COS && fabsf(depth_a - depth_b) <= RESTIR_DEPTH_TOLERANCE * depth_a;
+}
+
+/**
+ * Resamples the samples kept by count reservoirs into one for the vertex
+ * at[0]: in[k] belongs to at[k] and speaks for m[k] samples. Each is
+ * weighted with the generalized balance heuristic over the targets of all
+ * count vertices, so a sample only some of them could have drawn, or one
+ * far stronger here than where it was drawn, is not overweighted.
+ */
+__device__ void reservoir_combine(reservoir& r, const reservoir* const* in, const restir_vertex* const* at, const float* m, int count,
+    curandState* state) {
+    reservoir_clear(r);
+    for (int k = 0; k < count; ++k) {
+        const reservoir& q = *in[k];
+        float target = q.W > 0.f ? restir_target(*at[0], q.y) : 0.f;
+        float w = 0.f;
+        if (target > 0.f) {
+            float own = m[k] * q.target;
+            float sum = 0.f;
+            for (int l = 0; l < count; ++l) sum += l == k ? own : m[l] * (l == 0 ? target : restir_target(*at[l], q.y));
+            if (sum > 0.f) w = own / sum * target * q.W;
+        }
+        reservoir_update(r, q.y, target, w, m[k], curand_uniform(state));
+    }
+    reservoir_finish(r);
+}
+
+// Streams RESTIR_CANDIDATES light BVH samples at v into r. Each is turned
+// into a point on the emitter by intersecting that emitter alone.
+__device__ void restir_candidates(const restir_vertex& v, light_bvh** lights, curandState* state, reservoir& r) {
+    const light_bvh& l = **lights;
+    for (int k = 0; k < RESTIR_CANDIDATES; ++k) {
+        vec3 direction;
+        float pdf;
+        restir_light y;
+        const hittable* light = l.sample(v.rec.p, v.rec.normal, state, direction, pdf, y.environment);
+        float target = 0.f, w = 0.f;
+        y.light = light;
+        if (y.environment && pdf > 0.f) {
+            y.p = unit_vector(direction);
+            y.emitted = environment_radiance(l.environment, y.p);
+        }
+        else {
+            hit_record light_rec;
+            y.environment = false;
+            if (light != nullptr && light->hit(ray(v.rec.p, direction, v.r_in.time()), 0.001f, FLT_MAX, light_rec)) {
+                y.p = light_rec.p;
+                y.normal = light_rec.normal;
+                y.emitted = material_emitted(light_rec.mat_ptr, light_rec.p);
+            }
+            else y.light = nullptr;
+        }
+        if (y.light != nullptr || y.environment) {
+            vec3 wi;
+            float distance, geometry;
+            target = luminance(restir_contribution(v, y, wi, distance, geometry));
+            if (pdf * geometry > 0.f) w = target / (RESTIR_CANDIDATES * pdf * geometry);
+        }
+        reservoir_update(r, y, target, w, 1.f, curand_uniform(state));
+    }
+    reservoir_finish(r);
+}
+
+/**
+ * Starts pass s: traces every pixel's path as render() does, its seed and
+ * camera ray included, except that direct light at a diffuse first vertex
+ * is left out and the vertex recorded. The path's radiance is added to
+ * accum. The vertex then gets a reservoir of fresh candidates, merged with
+ * the one its pixel finished the last pass with if that was shading a
+ * similar point, written to out. Media scenes keep next event estimation
+ * and get no reservoirs.
+ */
+template <unsigned F, int DEPTH>
+__global__ void restir_sample(vec3* accum, restir_vertex* vertices, const reservoir* last, reservoir* out, int max_x, int max_y, int s,
+    int order, const int* tiles, camera** cam, hittable** world, light_bvh** lights, int max_depth) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    int num_pixels = max_x * max_y;
+    curandState local_rand_state;
+    sample_state(pixel_index, s, &local_rand_state);
+    float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+    float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+    path_state ps;
+    path_begin(ps, (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+    restir_vertex vertex;
+    vertex.rec.mat_ptr = nullptr;
+    restir_vertex* resample = F & FEATURE_MEDIA ? nullptr : &vertex;
+    while (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state, nullptr, nullptr, resample)) {}
+    accum[pixel_index] += ps.radiance;
+
+    reservoir r;
+    reservoir_clear(r);
+    if (ps.direct_resampled) {
+        restir_state(pixel_index, num_pixels, s, RESTIR_STREAM_CANDIDATES, &local_rand_state);
+        restir_candidates(vertex, lights, &local_rand_state, r);
+        restir_vertex previous_vertex = vertices[pixel_index];
+        if (restir_similar(vertex, previous_vertex)) {
+            reservoir fresh = r;
+            const reservoir* in[2] = { &fresh, &last[pixel_index] };
+            const restir_vertex* at[2] = { &vertex, &previous_vertex };
+            float m[2] = { fresh.m, fminf(last[pixel_index].m, RESTIR_TEMPORAL_CAP * RESTIR_CANDIDATES) };
+            reservoir_combine(r, in, at, m, 2, &local_rand_state);
+        }
+    }
+    vertices[pixel_index] = vertex;
+    out[pixel_index] = r;
+}
+
+// One round of spatial reuse: each pixel's reservoir in in, combined with
+// those of up to RESTIR_NEIGHBORS similar neighbours drawn within
+// RESTIR_RADIUS, to out. Visibility is not retraced for the neighbours'
+// samples; an occluded one is dropped when it is shaded.
+__global__ void restir_spatial(const restir_vertex* vertices, const reservoir* in, reservoir* out, int max_x, int max_y, int s, int round,
+    int order, const int* tiles) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    int num_pixels = max_x * max_y;
+    const restir_vertex& vertex = vertices[pixel_index];
+    reservoir r = in[pixel_index];
+    if (vertex.rec.mat_ptr == nullptr) {
+        out[pixel_index] = r;
+        return;
+    }
+    curandState local_rand_state;
+    restir_state(pixel_index, num_pixels, s * RESTIR_SPATIAL_PASSES + round, RESTIR_STREAM_SPATIAL, &local_rand_state);
+    const reservoir* reused[RESTIR_NEIGHBORS + 1] = { &in[pixel_index] };
+    const restir_vertex* at[RESTIR_NEIGHBORS + 1] = { &vertex };
+    float m[RESTIR_NEIGHBORS + 1] = { in[pixel_index].m };
+    int found = 1;
+    for (int k = 0; k < RESTIR_NEIGHBORS; ++k) {
+        float radius = RESTIR_RADIUS * sqrtf(curand_uniform(&local_rand_state));
+        float angle = 2.f * float(M_PI) * curand_uniform(&local_rand_state);
+        int qi = i + int(roundf(radius * cosf(angle)));
+        int qj = j + int(roundf(radius * sinf(angle)));
+        if (qi < 0 || qi >= max_x || qj < 0 || qj >= max_y || (qi == i && qj == j)) continue;
+        int q = qj * max_x + qi;
+        if (!restir_similar(vertex, vertices[q])) continue;
+        reused[found] = &in[q];
+        at[found] = &vertices[q];
+        m[found++] = in[q].m;
+    }
+    reservoir_combine(r, reused, at, m, found, &local_rand_state);
+    out[pixel_index] = r;
+}
+
+/**
+ * Ends pass s: one shadow ray per pixel, to the sample its reservoir kept,
+ * and the light that arrives weighted by W added to accum. An occluded
+ * sample's W is zeroed, so the next pass doesn't carry it forward.
+ */
+template <unsigned F>
+__global__ void restir_shade(vec3* accum, const restir_vertex* vertices, reservoir* chosen, int max_x, int max_y, int s, int order,
+    const int* tiles, hittable** world) {
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) return;
+    int pixel_index = j * max_x + i;
+    const restir_vertex& vertex = vertices[pixel_index];
+    reservoir& r = chosen[pixel_index];
+    if (vertex.rec.mat_ptr == nullptr || r.W <= 0.f) return;
+    vec3 wi;
+    float distance, geometry;
+    vec3 contribution = restir_contribution(vertex, r.y, wi, distance, geometry);
+    curandState local_rand_state;
+    restir_state(pixel_index, max_x * max_y, s, RESTIR_STREAM_SHADE, &local_rand_state);
+    hit_record light_rec;
+    float transmittance;
+    bool visible = trace_shadow<F>(ray(vertex.rec.p, wi, vertex.r_in.time()), nullptr, world, &local_rand_state, light_rec, transmittance);
+    // The shadow ray must reach the sample's own point, not another part
+    // of the same emitter.
+    bool arrives = r.y.environment ? !visible && transmittance > 0.f
+        : visible && light_rec.obj == r.y.light && light_rec.t >= distance * (1.f - 1e-3f);
+    if (arrives) accum[pixel_index] += contribution * (transmittance * r.W);
+    else r.W = 0.f;
+}
+
+struct restir_sample_launcher {
+    int num_tiles;
+    vec3* accum;
+    restir_vertex* vertices;
+    const reservoir* last;
+    reservoir* out;
+    int max_x, max_y, s, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        restir_sample<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (accum, vertices, last, out, max_x, max_y, s, order, tiles, cam,
+            world, lights, max_depth);
+    }
+};
+
+struct restir_shade_launcher {
+    int num_tiles;
+    vec3* accum;
+    const restir_vertex* vertices;
+    reservoir* chosen;
+    int max_x, max_y, s, order;
+    const int* tiles;
+    hittable** world;
+
+    template <unsigned F, int DEPTH>
+    void launch(int) {
+        restir_shade<F> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (accum, vertices, chosen, max_x, max_y, s, order, tiles, world);
+    }
+};
+
+/**
+ * Renders ns samples per pixel into fb as ns passes of one, the direct
+ * light at each pixel's first diffuse vertex resampled from reservoirs that
+ * are carried from pass to pass and shared between neighbours. Then renders
+ * the same samples with plain next event estimation, which traces as many
+ * rays, and reports both times (and both errors against reference, if it
+ * names an image of the same size).
+ */
+void render_restir(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order, const int* tiles, int num_tiles,
+    camera** cam, hittable** world, light_bvh** lights, const std::string& reference) {
+    if (features & FEATURE_MEDIA) std::cerr << "restir: the scene has participating media; its direct light is sampled as usual\n";
+    int num_pixels = nx * ny;
+    vec3* accum;
+    restir_vertex* vertices;
+    reservoir* reservoirs[2];
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&accum, num_pixels * sizeof(vec3)));
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&vertices, num_pixels * sizeof(restir_vertex)));
+    checkCudaErrors(cudaMemset(accum, 0, num_pixels * sizeof(vec3)));
+    checkCudaErrors(cudaMemset(vertices, 0, num_pixels * sizeof(restir_vertex)));
+    for (int b = 0; b < 2; ++b) {
+        checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&reservoirs[b], num_pixels * sizeof(reservoir)));
+        checkCudaErrors(cudaMemset(reservoirs[b], 0, num_pixels * sizeof(reservoir)));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int last = 0;
+    for (int s = 0; s < ns; ++s) {
+        int current = 1 - last;
+        restir_sample_launcher sample = { num_tiles, accum, vertices, reservoirs[last], reservoirs[current], nx, ny, s, order, tiles, cam,
+            world, lights };
+        dispatch_variant(features, max_depth, sample);
+        checkCudaErrors(cudaGetLastError());
+        for (int round = 0; round < RESTIR_SPATIAL_PASSES; ++round) {
+            restir_spatial << <num_tiles, TILE_SIZE * TILE_SIZE >> > (vertices, reservoirs[current], reservoirs[1 - current], nx, ny, s, round,
+                order, tiles);
+            checkCudaErrors(cudaGetLastError());
+            current = 1 - current;
+        }
+        restir_shade_launcher shade = { num_tiles, accum, vertices, reservoirs[current], nx, ny, s, order, tiles, world };
+        dispatch_variant(features, max_depth, shade);
+        checkCudaErrors(cudaGetLastError());
+        last = current;
+    }
+    resolve_passes << <(num_pixels + 255) / 256, 256 >> > (fb, accum, num_pixels, ns);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    double restir_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<vec3> restir_image = linear_image(fb, num_pixels);
+    for (int b = 0; b < 2; ++b) checkCudaErrors(tracked_free(reservoirs[b]));
+    checkCudaErrors(tracked_free(vertices));
+    checkCudaErrors(tracked_free(accum));
+
+    vec3* plain_fb;
+    checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&plain_fb, num_pixels * sizeof(vec3), true));
+    start = std::chrono::steady_clock::now();
+    launch_render(features, max_depth, num_tiles, plain_fb, nx, ny, ns, order, tiles, cam, world, lights);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    double plain_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<vec3> plain_image = linear_image(plain_fb, num_pixels);
+    checkCudaErrors(tracked_free(plain_fb));
+
+    std::cerr << "restir: " << restir_seconds << " seconds; " << RESTIR_CANDIDATES << " candidates per pixel per pass, "
+        << RESTIR_SPATIAL_PASSES << " rounds of " << RESTIR_NEIGHBORS << " neighbours.\n";
+    std::cerr << "next event estimation, same rays: " << plain_seconds << " seconds.\n";
+    std::vector<vec3> reference_image;
+    int rx, ry;
+    if (reference.empty()) return;
+    if (!read_ppm(reference, reference_image, rx, ry) || rx != nx || ry != ny) {
+        std::cerr << "can't compare against " << reference << ": not a " << nx << "x" << ny << " image\n";
+        return;
+    }
+    for (vec3& p : reference_image) p = p * p;
+    std::cerr << "relMSE against " << reference << ": restir " << image_relmse(restir_image, reference_image)
+        << ", next event estimation " << image_relmse(plain_image, reference_image) << "\n";
+}
+
+#endif
@@ -0,0 +1,313 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include <string>
+#include <iostream>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "memory_budget.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "camera.h"
+#include "material.h"
+#include "rect.h"
+#include "box.h"
+#include "quad.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "lazy_bvh.h"
+#include "light.h"
+#include "medium.h"
+#include "paged_geometry.h"
+#include "trace.h"
+
+#define RND (curand_uniform(&local_rand_state))
+
+// Set by create_scene() for a lazy BVH.
+__device__ bool d_lazy_bvh;
+
+// A scene's top level BVH, marked in the trace.
+__device__ hittable* build_bvh(hittable** l, int n, curandState* state) {
+    TRACE_DEVICE_SCOPE(TRACE_BVH_BUILD);
+    if (d_lazy_bvh) return make_lazy_bvh(l, n);
+    return new bvhNode(l, n, 0.f, 1.f, state);
+}
+
+__global__ void create_world(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_camera, int nx, int ny, curandState* rand_state) {
+    if (threadIdx.x == 0 && blockIdx.x == 0) {
+        unsigned long long failed = device_alloc_failures();
+        curandState local_rand_state = *rand_state;
+        d_list[0] = new sphere(vec3(0, -1000.0, -1), 1000,
+            new lambertian(vec3(0.5, 0.5, 0.5)));
+        int i = 1;
+        for (int a = -11; a < 11; a++) {
+            for (int b = -11; b < 11; b++) {
+                float choose_mat = RND;
+                vec3 center(a + RND, 0.2, b + RND);
+                if (choose_mat < 0.8f) {
+                    auto center2 = center + vec3(0, RND * RND, 0);
+                    d_list[i++] = new moving_sphere(center, center2, 0.f, 1.f, 0.2,
+                        new lambertian(vec3(RND * RND, RND * RND, RND * RND)));
+                }
+                else if (choose_mat < 0.95f) {
+                    d_list[i++] = new sphere(center, 0.2,
+                        new metal(vec3(0.5f * (1.0f + RND), 0.5f * (1.0f + RND), 0.5f * (1.0f + RND)), 0.5f * RND));
+                }
+                else {
+                    d_list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                }
+            }
+        }
+        d_list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
+        d_list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(vec3(0.4, 0.2, 0.1)));
+        d_list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+        if (device_alloc_failures() != failed) return;
+        *d_lights = new light_bvh(d_list, 22 * 22 + 1 + 3);
+        *d_world = build_bvh(d_list, 22 * 22 + 1 + 3, &local_rand_state);
+
+        vec3 lookfrom(13, 2, 3);
+        vec3 lookat(0, 0, 0);
+        *rand_state = local_rand_state;
+        float dist_to_focus = 10.0; (lookfrom - lookat).length();
+        float aperture = 0.1;
+        *d_camera = new camera(lookfrom,
+            lookat,
+            vec3(0, 1, 0),
+            30.0,
+            float(nx) / float(ny),
+            aperture,
+            dist_to_focus,
+            0.f,
+            1.f);
+    }
+}
+
+__global__ void free_world(hittable** d_list, int n, hittable** d_world, light_bvh** d_lights, camera** d_cam) {
+    for (int i = 0; i < n; ++i) {
+        delete* (d_list + i);
+    }
+    delete *(d_world);
+    delete *(d_lights);
+    delete* (d_cam);
+}
+
+__global__ void simple_light(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_cam, int nx, int ny) {
+    unsigned long long failed = device_alloc_failures();
+    d_list[0] = new rectangle_xz(-10, 10, -10, 10, 0, new lambertian(vec3(0.5, 0.5, 0.5)));
+    d_list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(vec3(0.4, 0.2, 0.1)));
+    d_list[2] = new rectangle_xy(3, 5, 1, 3, -2, new diffuse_light(vec3(4, 4, 4)));
+    d_list[3] = new sphere(vec3(0, 7, 0), 2, new diffuse_light(vec3(4, 4, 4)));
+    if (device_alloc_failures() != failed) return;
+    *d_world = new hittable_list(d_list, 4);
+    *d_lights = new light_bvh(d_list, 4);
+    *d_cam = new camera(vec3(26, 3, 6), vec3(0, 2, 0), vec3(0, 1, 0), 30.f, float(nx) / float(ny), 0., 10., 0.f, 0.f);
+}
+
+__global__ void cornell_box(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_cam, int nx, int ny) {
+    unsigned long long failed = device_alloc_failures();
+    d_list[0] = new rectangle_yz(0, 555, 0, 555, 555, new lambertian(vec3(.12, .45, .15)));
+    d_list[1] = new rectangle_yz(0, 555, 0, 555, 0, new lambertian(vec3(.65, .05, .05)));
+    d_list[2] = new rectangle_xz(213, 343, 227, 332, 554, new diffuse_light(vec3(15, 15, 15)));
+    d_list[3] = new rectangle_xz(0, 555, 0, 555, 0, new lambertian(vec3(0.73, 0.73, 0.73)));
+    d_list[4] = new rectangle_xz(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
+    d_list[5] = new rectangle_xy(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
+    hittable* box_1 = new box(vec3(130, 0, 65), vec3(295, 165, 230), new lambertian(vec3(0.73, 0.73, 0.73)));
+    hittable* box_2 = new box(vec3(265, 0, 295), vec3(430, 330, 460), new lambertian(vec3(0.73, 0.73, 0.73)));
+    d_list[6] = box_1;
+    d_list[7] = box_2;
+    if (device_alloc_failures() != failed) return;
+    *d_lights = new light_bvh(d_list, 8);
+    curandState local_rand_state;
+    curand_init(1984, 0, 0, &local_rand_state);
+    *d_world = build_bvh(d_list, 8, &local_rand_state);
+    *d_cam = new camera(vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40.f, float(nx) / float(ny), 0.f, 10.f, 0.f, 0.f);
+
+}
+
+#define VOLUMES_GRID 64
+
+// The Cornell room with a column of smoke on a voxel grid, a milky sphere of
+// constant density and one solid box between them.
+__global__ void volumes(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_cam, int nx, int ny) {
+    unsigned long long failed = device_alloc_failures();
+    d_list[0] = new rectangle_yz(0, 555, 0, 555, 555, new lambertian(vec3(.12, .45, .15)));
+    d_list[1] = new rectangle_yz(0, 555, 0, 555, 0, new lambertian(vec3(.65, .05, .05)));
+    d_list[2] = new rectangle_xz(213, 343, 227, 332, 554, new diffuse_light(vec3(15, 15, 15)));
+    d_list[3] = new rectangle_xz(0, 555, 0, 555, 0, new lambertian(vec3(0.73, 0.73, 0.73)));
+    d_list[4] = new rectangle_xz(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
+    d_list[5] = new rectangle_xy(0, 555, 0, 555, 555, new lambertian(vec3(0.73, 0.73, 0.73)));
+
+    // A plume that widens and twists as it rises, fading out at the top.
+    const int n = VOLUMES_GRID;
+    float* density = device_new_array<float>(MEM_GEOMETRY, n * n * n);
+    if (density == nullptr) return;
+    for (int z = 0; z < n; ++z) {
+        for (int y = 0; y < n; ++y) {
+            for (int x = 0; x < n; ++x) {
+                float u = (x + 0.5f) / n - 0.5f, v = (y + 0.5f) / n, w = (z + 0.5f) / n - 0.5f;
+                float swirl = 6.f * v;
+                float cx = 0.12f * v * cosf(swirl), cz = 0.12f * v * sinf(swirl);
+                float r = sqrtf((u - cx) * (u - cx) + (w - cz) * (w - cz));
+                float radius = 0.08f + 0.25f * v;
+                float d = fmaxf(0.f, 1.f - r / radius) * (1.f - 0.7f * v);
+                d *= 0.6f + 0.4f * sinf(23.f * u + 17.f * v) * cosf(19.f * w - 11.f * v);
+                density[(z * n + y) * n + x] = fmaxf(d, 0.f);
+            }
+        }
+    }
+    d_list[6] = new grid_medium(new box(vec3(40, 1, 200), vec3(300, 420, 460), nullptr), density, n, n, n, 0.08f,
+        vec3(0.55f, 0.65f, 0.9f), 0.2f);
+    d_list[7] = new homogeneous_medium(new sphere(vec3(400, 110, 180), 110, nullptr), 0.015f,
+        vec3(0.95f, 0.9f, 0.8f), 0.6f);
+    d_list[8] = new box(vec3(330, 0, 330), vec3(480, 150, 480), new lambertian(vec3(0.73, 0.73, 0.73)));
+    if (device_alloc_failures() != failed) return;
+    *d_lights = new light_bvh(d_list, 9);
+    curandState local_rand_state;
+    curand_init(1984, 0, 0, &local_rand_state);
+    *d_world = build_bvh(d_list, 9, &local_rand_state);
+    *d_cam = new camera(vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40.f, float(nx) / float(ny), 0.f, 10.f, 0.f, 0.f);
+}
+
+#define MANY_LIGHTS_LEDS 32
+#define MANY_LIGHTS_BULBS 256
+#define MANY_LIGHTS_SIZE (4 + 1 + MANY_LIGHTS_BULBS)
+
+// An LED wall sampled as one emitter_group plus hundreds of small bulbs,
+// each its own leaf in the light BVH.
+__global__ void many_lights(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_cam, int nx, int ny) {
+    unsigned long long failed = device_alloc_failures();
+    curandState local_rand_state;
+    curand_init(1984, 0, 0, &local_rand_state);
+
+    int i = 0;
+    d_list[i++] = new rectangle_xz(-50, 50, -50, 50, 0, new lambertian(vec3(0.5, 0.5, 0.5)));
+    d_list[i++] = new sphere(vec3(0, 2, 0), 2, new lambertian(vec3(0.4, 0.2, 0.1)));
+    d_list[i++] = new sphere(vec3(-5, 1.5, 3), 1.5, new metal(vec3(0.7, 0.6, 0.5), 0.1));
+    d_list[i++] = new sphere(vec3(5, 1.5, -3), 1.5, new dielectric(1.5));
+
+    hittable** wall = device_new_array<hittable*>(MEM_GEOMETRY, MANY_LIGHTS_LEDS * MANY_LIGHTS_LEDS);
+    if (wall == nullptr) return;
+    for (int a = 0; a < MANY_LIGHTS_LEDS; a++) {
+        for (int b = 0; b < MANY_LIGHTS_LEDS; b++) {
+            float x = -16.f + a;
+            float y = 0.5f + 0.5f * b;
+            wall[a * MANY_LIGHTS_LEDS + b] = new rectangle_xy(x, x + 0.8f, y, y + 0.4f, -10,
+                new diffuse_light(4.f * vec3(RND, RND, RND)));
+        }
+    }
+    if (device_alloc_failures() != failed) {
+        for (int k = 0; k < MANY_LIGHTS_LEDS * MANY_LIGHTS_LEDS; ++k) delete wall[k];
+        device_delete_array(MEM_GEOMETRY, wall, MANY_LIGHTS_LEDS * MANY_LIGHTS_LEDS);
+        return;
+    }
+    d_list[i++] = new emitter_group(wall, MANY_LIGHTS_LEDS * MANY_LIGHTS_LEDS);
+
+    for (int b = 0; b < MANY_LIGHTS_BULBS; b++) {
+        vec3 center(-20.f + 40.f * RND, 0.2f, -8.f + 20.f * RND);
+        d_list[i++] = new sphere(center, 0.2, new diffuse_light(10.f * vec3(RND, RND, RND)));
+    }
+    if (device_alloc_failures() != failed) return;
+
+    *d_lights = new light_bvh(d_list, i);
+    // bvhNode sorts d_list in place, which free_world doesn't mind.
+    *d_world = build_bvh(d_list, i, &local_rand_state);
+    *d_cam = new camera(vec3(0, 6, 24), vec3(0, 2, 0), vec3(0, 1, 0), 40.f, float(nx) / float(ny), 0.f, 10.f, 0.f, 0.f);
+}
+
+// A sphere field paged in from a geometry file, lit by one big panel.
+__global__ void paged_field(hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_cam, int nx, int ny, paged_view view) {
+    unsigned long long failed = device_alloc_failures();
+    const flat_node& root = view.top[0];
+    float x0 = root.bmin[0], x1 = root.bmax[0];
+    float z0 = root.bmin[2], z1 = root.bmax[2];
+    float cx = 0.5f * (x0 + x1);
+    float cz = 0.5f * (z0 + z1);
+    float extent = fmaxf(x1 - x0, z1 - z0);
+
+    d_list[0] = new rectangle_xz(x0 - extent, x1 + extent, z0 - extent, z1 + extent, 0, new lambertian(vec3(0.5, 0.5, 0.5)));
+    d_list[1] = new rectangle_xz(x0, x1, z0, z1, 0.25f * extent + 10.f, new diffuse_light(vec3(3, 3, 3)));
+    d_list[2] = new paged_geometry(view);
+    if (device_alloc_failures() != failed) return;
+    *d_lights = new light_bvh(d_list, 3);
+    *d_world = new hittable_list(d_list, 3);
+    *d_cam = new camera(vec3(cx, 4, z0 - 2), vec3(cx, 0, cz), vec3(0, 1, 0), 50.f, float(nx) / float(ny), 0.f, 10.f, 0.f, 0.f);
+}
+
+// Number of d_list slots the named scene fills.
+int scene_list_size(const std::string& scene) {
+    if (scene == "random") return 22 * 22 + 1 + 3;
+    if (scene == "simple_light") return 4;
+    if (scene == "many_lights") return MANY_LIGHTS_SIZE;
+    if (scene == "paged") return 3;
+    if (scene == "volumes") return 9;
+    return 8;
+}
+
+// Features the scene actually uses: a lens, moving objects seen through an
+// open shutter, glass, participating media.
+__global__ void scene_features(hittable** world, camera** cam, unsigned* features) {
+    unsigned world_features = (*world)->features();
+    unsigned cam_features = (*cam)->features();
+    *features = (world_features & (FEATURE_DIELECTRIC | FEATURE_MEDIA))
+        | (cam_features & FEATURE_DEPTH_OF_FIELD)
+        | (world_features & cam_features & FEATURE_MOTION_BLUR);
+}
+
+// Builds the scene and sets features to its feature mask for
+// launch_render(). The paged scene needs the view of an open page_cache.
+// With bvh_width 4 or 8 the scene's binary BVH is collapsed into a wide
+// one; with 0 it is a lazy BVH, split further as rays reach it. False, after
+// reporting it, if device allocations failed on the way, whether over the
+// memory budget or out of device heap; free_world() then frees what was
+// built.
+bool create_scene(const std::string& scene, hittable** d_list, hittable** d_world, light_bvh** d_lights, camera** d_camera, int nx, int ny, curandState* rand_state,
+    unsigned& features, const paged_view* paged = nullptr, int bvh_width = 2) {
+    bool lazy = bvh_width == 0;
+    checkCudaErrors(cudaMemcpyToSymbol(d_lazy_bvh, &lazy, sizeof(bool)));
+    checkCudaErrors(cudaMemset(d_list, 0, scene_list_size(scene) * sizeof(hittable*)));
+    checkCudaErrors(cudaMemset(d_world, 0, sizeof(hittable*)));
+    checkCudaErrors(cudaMemset(d_lights, 0, sizeof(light_bvh*)));
+    checkCudaErrors(cudaMemset(d_camera, 0, sizeof(camera*)));
+    unsigned long long failed = memory_snapshot().failed;
+    if (scene == "random") {
+        create_world << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny, rand_state);
+    }
+    else if (scene == "simple_light") {
+        simple_light << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny);
+    }
+    else if (scene == "many_lights") {
+        many_lights << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny);
+    }
+    else if (scene == "volumes") {
+        volumes << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny);
+    }
+    else if (scene == "paged" && paged != nullptr) {
+        paged_field << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny, *paged);
+    }
+    else {
+        cornell_box << <1, 1 >> > (d_list, d_world, d_lights, d_camera, nx, ny);
+    }
+    checkCudaErrors(cudaGetLastError());
+    if (bvh_width > 2 && memory_snapshot().failed == failed) {
+        collapse_bvh << <1, 1 >> > (d_world, bvh_width);
+        checkCudaErrors(cudaGetLastError());
+    }
+    unsigned long long now = memory_snapshot().failed;
+    if (now != failed) {
+        std::cerr << "can't build scene " << scene << ": " << now - failed << " device allocations failed\n";
+        print_memory_report(std::cerr);
+        return false;
+    }
+
+    unsigned* d_features;
+    checkCudaErrors(cudaMallocManaged((void**)&d_features, sizeof(unsigned)));
+    scene_features << <1, 1 >> > (d_world, d_camera, d_features);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+    features = *d_features;
+    checkCudaErrors(cudaFree(d_features));
+    return true;
+}
+
+#endif
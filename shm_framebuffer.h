@@ -0,0 +1,102 @@
+#ifndef SHM_FRAMEBUFFER_H
+#define SHM_FRAMEBUFFER_H
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define SHM_FRAMEBUFFER_MAGIC 0x52465053u
+
+/**
+ * Header of a preview frame published in named shared memory, followed by
+ * width * height RGBA8 pixels, top row first. seq is odd while a frame is
+ * being written; a reader copies the pixels and accepts them if seq was
+ * even and unchanged before and after.
+ */
+struct shm_frame_header {
+    unsigned magic;
+    int width;
+    int height;
+    int frame;
+    int spp;
+    volatile unsigned seq;
+};
+
+class shm_framebuffer {
+public:
+    shm_framebuffer(const std::string& name, int width, int height) {
+        size = sizeof(shm_frame_header) + size_t(width) * height * 4;
+#ifdef _WIN32
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, DWORD(size), name.c_str());
+        void* p = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+        if (p == NULL) fail(name);
+#else
+        shm_name = name[0] == '/' ? name : "/" + name;
+        int fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) fail(name);
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) fail(name);
+#endif
+        header = (shm_frame_header*)p;
+        pixels = (unsigned char*)(header + 1);
+        header->magic = SHM_FRAMEBUFFER_MAGIC;
+        header->width = width;
+        header->height = height;
+        header->frame = -1;
+        header->spp = 0;
+        header->seq = 0;
+    }
+    ~shm_framebuffer() {
+#ifdef _WIN32
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+#else
+        munmap(header, size);
+        shm_unlink(shm_name.c_str());
+#endif
+    }
+
+    // rgba is bottom row first, as the renderer stores it.
+    void publish(const unsigned char* rgba, int frame, int spp) {
+        header->seq++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int row = header->width * 4;
+        for (int j = 0; j < header->height; ++j) {
+            memcpy(pixels + size_t(j) * row, rgba + size_t(header->height - 1 - j) * row, row);
+        }
+        header->frame = frame;
+        header->spp = spp;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        header->seq++;
+    }
+
+private:
+    void fail(const std::string& name) {
+        std::cerr << "can't create shared framebuffer " << name << "\n";
+        exit(1);
+    }
+
+    shm_frame_header* header;
+    unsigned char* pixels;
+    size_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    std::string shm_name;
+#endif
+};
+
+#endif
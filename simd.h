@@ -0,0 +1,171 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/**
+ * Compile-time selection of the 4-wide float backend used by vec3/vec4.
+ *
+ * Device code (__CUDA_ARCH__) always takes the scalar path, the CUDA
+ * compiler vectorizes the aligned 16-byte loads/stores on its own. Host code
+ * picks AVX, SSE or NEON from the compiler's target flags, or the scalar
+ * fallback when none is available or VEC3_FORCE_SCALAR is defined.
+ *
+ * Lane 3 of a vec3 register is padding; its value is unspecified and no
+ * operation below ever moves it into lanes 0..2.
+ */
+
+#if defined(__CUDA_ARCH__)
+#define VEC3_BACKEND_CUDA
+#define VEC3_BACKEND_NAME "cuda"
+#elif defined(VEC3_FORCE_SCALAR)
+#define VEC3_BACKEND_SCALAR
+#define VEC3_BACKEND_NAME "scalar"
+#elif defined(__AVX__)
+#define VEC3_BACKEND_AVX
+#define VEC3_BACKEND_NAME "avx"
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VEC3_BACKEND_SSE
+#define VEC3_BACKEND_NAME "sse"
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define VEC3_BACKEND_NEON
+#define VEC3_BACKEND_NAME "neon"
+#else
+#define VEC3_BACKEND_SCALAR
+#define VEC3_BACKEND_NAME "scalar"
+#endif
+
+#if defined(VEC3_BACKEND_AVX) || defined(VEC3_BACKEND_SSE)
+#define VEC3_SIMD 1
+#define VEC3_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(VEC3_BACKEND_NEON)
+#define VEC3_SIMD 1
+#include <arm_neon.h>
+#else
+#define VEC3_SIMD 0
+#endif
+
+#include <cmath>
+
+#if defined(VEC3_SIMD_X86)
+
+typedef __m128 simd4;
+
+inline simd4 simd4_load(const float* p) { return _mm_load_ps(p); }
+inline void simd4_store(float* p, simd4 v) { _mm_store_ps(p, v); }
+inline simd4 simd4_splat(float s) { return _mm_set1_ps(s); }
+inline simd4 simd4_add(simd4 a, simd4 b) { return _mm_add_ps(a, b); }
+inline simd4 simd4_sub(simd4 a, simd4 b) { return _mm_sub_ps(a, b); }
+inline simd4 simd4_mul(simd4 a, simd4 b) { return _mm_mul_ps(a, b); }
+inline simd4 simd4_div(simd4 a, simd4 b) { return _mm_div_ps(a, b); }
+inline simd4 simd4_neg(simd4 a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+
+// (x y z w) -> (y z x w)
+inline simd4 simd4_yzx(simd4 v) {
+#if defined(VEC3_BACKEND_AVX)
+    return _mm_permute_ps(v, _MM_SHUFFLE(3, 0, 2, 1));
+#else
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+#endif
+}
+
+inline float simd4_dot3(simd4 a, simd4 b) {
+#if defined(VEC3_BACKEND_AVX)
+    return _mm_cvtss_f32(_mm_dp_ps(a, b, 0x71));
+#else
+    simd4 m = _mm_mul_ps(a, b);
+    simd4 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+    simd4 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+#endif
+}
+
+inline float simd4_dot4(simd4 a, simd4 b) {
+#if defined(VEC3_BACKEND_AVX)
+    return _mm_cvtss_f32(_mm_dp_ps(a, b, 0xF1));
+#else
+    simd4 m = _mm_mul_ps(a, b);
+    simd4 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1))));
+#endif
+}
+
+inline simd4 simd4_cross3(simd4 a, simd4 b) {
+    simd4 c = _mm_sub_ps(_mm_mul_ps(a, simd4_yzx(b)), _mm_mul_ps(simd4_yzx(a), b));
+    return simd4_yzx(c);
+}
+
+// One Newton-Raphson step on top of the 12-bit hardware estimate.
+inline float simd_rsqrt(float x) {
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+}
+
+#elif defined(VEC3_BACKEND_NEON)
+
+typedef float32x4_t simd4;
+
+inline simd4 simd4_load(const float* p) { return vld1q_f32(p); }
+inline void simd4_store(float* p, simd4 v) { vst1q_f32(p, v); }
+inline simd4 simd4_splat(float s) { return vdupq_n_f32(s); }
+inline simd4 simd4_add(simd4 a, simd4 b) { return vaddq_f32(a, b); }
+inline simd4 simd4_sub(simd4 a, simd4 b) { return vsubq_f32(a, b); }
+inline simd4 simd4_mul(simd4 a, simd4 b) { return vmulq_f32(a, b); }
+inline simd4 simd4_neg(simd4 a) { return vnegq_f32(a); }
+
+inline simd4 simd4_div(simd4 a, simd4 b) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+    return vdivq_f32(a, b);
+#else
+    simd4 r = vrecpeq_f32(b);
+    r = vmulq_f32(r, vrecpsq_f32(b, r));
+    r = vmulq_f32(r, vrecpsq_f32(b, r));
+    return vmulq_f32(a, r);
+#endif
+}
+
+// (x y z w) -> (y z x x)
+inline simd4 simd4_yzx(simd4 v) {
+    return vsetq_lane_f32(vgetq_lane_f32(v, 0), vextq_f32(v, v, 1), 2);
+}
+
+inline float simd4_dot3(simd4 a, simd4 b) {
+    simd4 m = vmulq_f32(a, b);
+    return vgetq_lane_f32(m, 0) + vgetq_lane_f32(m, 1) + vgetq_lane_f32(m, 2);
+}
+
+inline float simd4_dot4(simd4 a, simd4 b) {
+    simd4 m = vmulq_f32(a, b);
+    float32x2_t s = vadd_f32(vget_low_f32(m), vget_high_f32(m));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+inline simd4 simd4_cross3(simd4 a, simd4 b) {
+    simd4 c = vsubq_f32(vmulq_f32(a, simd4_yzx(b)), vmulq_f32(simd4_yzx(a), b));
+    return simd4_yzx(c);
+}
+
+// Two Newton-Raphson steps on top of the 8-bit hardware estimate.
+inline float simd_rsqrt(float x) {
+    float32x2_t xv = vdup_n_f32(x);
+    float32x2_t y = vrsqrte_f32(xv);
+    y = vmul_f32(y, vrsqrts_f32(vmul_f32(xv, y), y));
+    y = vmul_f32(y, vrsqrts_f32(vmul_f32(xv, y), y));
+    return vget_lane_f32(y, 0);
+}
+
+#endif
+
+/**
+ * Reciprocal square root, accurate to a couple of ulps on every backend.
+ */
+__host__ __device__ inline float fast_rsqrt(float x) {
+#if defined(VEC3_BACKEND_CUDA)
+    return rsqrtf(x);
+#elif VEC3_SIMD
+    return simd_rsqrt(x);
+#else
+    return 1.0f / sqrtf(x);
+#endif
+}
+
+#endif
@@ -10,10 +10,20 @@ class sphere : public hittable {
 public:
     __device__ sphere() {}
     __device__ sphere(vec3 cen, float r, material* m) : center(cen), radius(r), mat_ptr(m) {};
+    __device__ virtual ~sphere() {
+        delete mat_ptr;
+    }
     __device__ virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
     __device__ virtual bool bounding_box(float t0,
         float t1,
         aabb& box) const;
+    __device__ virtual double pdf_value(const vec3& o, const vec3& v) const override;
+    __device__ virtual vec3 random(const vec3& o, curandState* state) const override;
+    __device__ virtual bool sample_surface(curandState* state, hit_record& rec, float& pdf) const override;
+    __device__ virtual bool emitter_bounds(light_bounds& lb) const override;
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features();
+    }
     vec3 center;
     float radius;
     material* mat_ptr;
@@ -39,6 +49,7 @@ __device__ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record&
             rec.normal = (rec.p - center) / radius;
             //get_sphere_uv(rec.normal, rec.u, rec.v);
             rec.mat_ptr = mat_ptr;
+            rec.obj = this;
             return true;
         }
         temp = (-b + sqrt(discriminant)) / a;
@@ -48,6 +59,7 @@ __device__ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record&
             rec.normal = (rec.p - center) / radius;
             //get_sphere_uv(rec.normal, rec.u, rec.v);
             rec.mat_ptr = mat_ptr;
+            rec.obj = this;
             return true;
         }
     }
@@ -62,11 +74,66 @@ __device__ bool sphere::bounding_box(float t0,
     return true;
 }
 
+__device__ double sphere::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!this->hit(ray(o, v), 0.001f, FLT_MAX, rec))
+        return 0;
+
+    float distance_squared = (center - o).squared_length();
+    if (distance_squared <= radius * radius)
+        return 1 / (4 * M_PI);
+    float cos_theta_max = sqrtf(1 - radius * radius / distance_squared);
+    float solid_angle = 2 * M_PI * (1 - cos_theta_max);
+    return 1 / solid_angle;
+}
+
+__device__ vec3 sphere::random(const vec3& o, curandState* state) const {
+    vec3 direction = center - o;
+    float distance_squared = direction.squared_length();
+    if (distance_squared <= radius * radius)
+        return unit_vector(random_in_unit_sphere(state));
+    onb uvw;
+    uvw.build_from_w(direction);
+    return uvw.local(random_to_sphere(radius, distance_squared, state));
+}
+
+__device__ bool sphere::sample_surface(curandState* state, hit_record& rec, float& pdf) const {
+    float z = 1.f - 2.f * curand_uniform(state);
+    float r = sqrtf(fmaxf(0.f, 1.f - z * z));
+    float phi = 2.f * float(M_PI) * curand_uniform(state);
+    rec.t = 0.f;
+    rec.normal = vec3(r * cosf(phi), r * sinf(phi), z);
+    rec.p = center + radius * rec.normal;
+    rec.mat_ptr = mat_ptr;
+    rec.obj = this;
+    pdf = 1.f / (4.f * float(M_PI) * radius * radius);
+    return true;
+}
+
+__device__ bool sphere::emitter_bounds(light_bounds& lb) const {
+    float power = luminance(mat_ptr->emitted(0, 0, center)) * 4 * float(M_PI) * radius * radius;
+    if (power <= 0.f)
+        return false;
+    bounding_box(0, 0, lb.box);
+    lb.axis = vec3(0, 0, 1);
+    lb.cos_theta_o = -1.f;
+    lb.cos_theta_e = 0.f;
+    lb.power = power;
+    lb.two_sided = false;
+    return true;
+}
+
 
 class moving_sphere : public hittable {
 public:
     __device__ moving_sphere() {}
-    __device__ moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material* m) : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {}
+    __device__ moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material* m) : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {
+        velocity = time1 > time0 ? (center1 - center0) / (time1 - time0) : vec3(0, 0, 0);
+        moving = velocity.squared_length() > 0.f;
+    }
+    __device__ virtual ~moving_sphere() {
+        delete mat_ptr;
+    }
 
     __device__ virtual bool hit(const ray& r,
         float tmin,
@@ -75,18 +142,24 @@ public:
     __device__ virtual bool bounding_box(float t0,
         float t1,
         aabb& box) const;
+    __device__ virtual unsigned features() const override {
+        return mat_ptr->features() | (moving ? FEATURE_MOTION_BLUR : 0u);
+    }
 
     __device__ vec3 center(float time) const;
 public:
     vec3 center0;
     vec3 center1;
+    vec3 velocity;
+    bool moving;
     float time0, time1;
     float radius;
     material* mat_ptr;
 };
 
 __device__ bool moving_sphere::hit(const ray& r, float tmin, float tmax, hit_record& rec) const {
-    vec3 oc = r.origin() - center(r.time());
+    vec3 cen = center(r.time());
+    vec3 oc = r.origin() - cen;
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
     float c = dot(oc, oc) - radius * radius;
@@ -96,16 +169,18 @@ __device__ bool moving_sphere::hit(const ray& r, float tmin, float tmax, hit_rec
         if (sol < tmax && sol > tmin) {
             rec.t = sol;
             rec.p = r.at(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
+            rec.normal = (rec.p - cen) / radius;
             rec.mat_ptr = mat_ptr;
+            rec.obj = this;
             return true;
         }
         sol = (-b + sqrt(discriminant)) / a;
         if (sol < tmax && sol > tmin) {
             rec.t = sol;
             rec.p = r.at(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
+            rec.normal = (rec.p - cen) / radius;
             rec.mat_ptr = mat_ptr;
+            rec.obj = this;
             return true;
         }
     }
@@ -120,7 +195,8 @@ __device__ bool moving_sphere::bounding_box(float t0, float t1, aabb& box) const
 }
 
 __device__ vec3 moving_sphere::center(float time) const {
-    return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
+    if (!moving) return center0;
+    return center0 + (time - time0) * velocity;
 }
 
 #endif
\ No newline at end of file
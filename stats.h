@@ -0,0 +1,20 @@
+#ifndef STATS_H
+#define STATS_H
+
+/**
+ * Device-wide traversal counters. They cost an atomic per event, so they are
+ * only compiled in when RT_STATS is defined.
+ */
+struct render_stats {
+    unsigned long long rays;
+    unsigned long long node_visits;
+};
+
+#ifdef RT_STATS
+__device__ render_stats d_stats;
+#define STATS_ADD(field, n) atomicAdd(&d_stats.field, (unsigned long long)(n))
+#else
+#define STATS_ADD(field, n)
+#endif
+
+#endif
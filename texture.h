@@ -2,10 +2,14 @@
 #define TEXTUREH
 
 #include "vec3.h"
+#include "memory_budget.h"
 
 class texture {
 public:
+    DEVICE_MEMORY_CATEGORY(MEM_TEXTURES)
+
     __device__ texture(){}
+    __device__ virtual ~texture() {}
     __device__ virtual vec3 value(float u, float v, const vec3& p) const = 0;
 };
 
@@ -0,0 +1,111 @@
+#ifndef TILE_ORDER_H
+#define TILE_ORDER_H
+
+#include <vector>
+
+#define TILE_SIZE 16
+
+/**
+ * How render() walks the image. Tiles are handed to thread blocks in curve
+ * order so blocks resident at the same time cover a compact patch of the
+ * image, and pixels inside a tile follow the same curve so each warp traces
+ * an 8x4 patch instead of a 16x2 strip.
+ */
+enum pixel_order {
+    ORDER_ROW_MAJOR = 0,
+    ORDER_MORTON = 1,
+    ORDER_HILBERT = 2
+};
+
+// Every other bit of x, packed into the low half.
+__host__ __device__ inline unsigned morton_compact(unsigned x) {
+    x &= 0x55555555u;
+    x = (x ^ (x >> 1)) & 0x33333333u;
+    x = (x ^ (x >> 2)) & 0x0f0f0f0fu;
+    x = (x ^ (x >> 4)) & 0x00ff00ffu;
+    x = (x ^ (x >> 8)) & 0x0000ffffu;
+    return x;
+}
+
+__host__ __device__ inline void morton_decode(unsigned code, unsigned& x, unsigned& y) {
+    x = morton_compact(code);
+    y = morton_compact(code >> 1);
+}
+
+// Two zero bits after each of the low 10 bits of x.
+__host__ __device__ inline unsigned morton_spread3(unsigned x) {
+    x &= 0x3ffu;
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+__host__ __device__ inline unsigned morton_encode3(unsigned x, unsigned y, unsigned z) {
+    return morton_spread3(x) | (morton_spread3(y) << 1) | (morton_spread3(z) << 2);
+}
+
+// Position of the d-th cell along a Hilbert curve over an n x n grid, n a
+// power of two.
+__host__ __device__ inline void hilbert_decode(unsigned n, unsigned d, unsigned& x, unsigned& y) {
+    x = y = 0;
+    for (unsigned s = 1; s < n; s *= 2) {
+        unsigned rx = 1u & (d / 2);
+        unsigned ry = 1u & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            unsigned t = x;
+            x = y;
+            y = t;
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+}
+
+// Offset of the k-th pixel inside a TILE_SIZE x TILE_SIZE tile.
+__host__ __device__ inline void tile_pixel(int order, unsigned k, unsigned& x, unsigned& y) {
+    if (order == ORDER_MORTON) {
+        morton_decode(k, x, y);
+    }
+    else if (order == ORDER_HILBERT) {
+        hilbert_decode(TILE_SIZE, k, x, y);
+    }
+    else {
+        x = k % TILE_SIZE;
+        y = k / TILE_SIZE;
+    }
+}
+
+// Tiles covering an nx x ny image, packed as (tile_y << 16) | tile_x, in the
+// order they should be dispatched.
+inline std::vector<int> make_tile_order(int order, int nx, int ny) {
+    int tiles_x = (nx + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (ny + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<int> tiles;
+    tiles.reserve(tiles_x * tiles_y);
+    if (order == ORDER_ROW_MAJOR) {
+        for (int y = 0; y < tiles_y; ++y)
+            for (int x = 0; x < tiles_x; ++x)
+                tiles.push_back((y << 16) | x);
+        return tiles;
+    }
+
+    unsigned side = 1;
+    while (side < unsigned(tiles_x) || side < unsigned(tiles_y)) side *= 2;
+    for (unsigned d = 0; d < side * side; ++d) {
+        unsigned x, y;
+        if (order == ORDER_MORTON) morton_decode(d, x, y);
+        else hilbert_decode(side, d, x, y);
+        if (x < unsigned(tiles_x) && y < unsigned(tiles_y))
+            tiles.push_back(int((y << 16) | x));
+    }
+    return tiles;
+}
+
+#endif
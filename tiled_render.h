@@ -0,0 +1,138 @@
+#ifndef TILED_RENDER_H
+#define TILED_RENDER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+#include "image_io.h"
+#include "memory_budget.h"
+#include "trace.h"
+
+// Tiles per streaming multiprocessor in one chunk, enough to keep every
+// SM busy through the chunk.
+#define TILED_BLOCKS_PER_SM 16
+// Chunks in flight: one tracing while the previous one is copied out and
+// written to the file.
+#define TILED_BUFFERS 2
+
+/**
+ * render() for a chunk of tiles, each written to its own TILE_SIZE square
+ * of out, top row first. Tile rows count down from the top of the image,
+ * as TIFF tiles do, so a tile's pixels are whole rows of one file tile.
+ * Samples are seeded as in render(), so the image is the one the
+ * full-frame render makes.
+ */
+template <unsigned F, int DEPTH>
+__global__ void render_tile_chunk(vec3* out, int max_x, int max_y, int ns, int order, const int* tiles, camera** cam, hittable** world,
+    light_bvh** lights, int max_depth) {
+    TRACE_TILE_BEGIN(tiles, max_x);
+    unsigned x, y;
+    tile_pixel(order, threadIdx.x, x, y);
+    int tile = tiles[blockIdx.x];
+    int i = (tile & 0xffff) * TILE_SIZE + x;
+    int row = (tile >> 16) * TILE_SIZE + y;
+    if (i >= max_x || row >= max_y) return;
+    int j = max_y - 1 - row;
+    out[blockIdx.x * TILE_SIZE * TILE_SIZE + y * TILE_SIZE + x] = render_pixel<F, DEPTH>(i, j, max_x, max_y, 0, ns, **cam, world, lights, max_depth);
+    TRACE_TILE_END(tiles, max_x);
+}
+
+struct tile_chunk_launcher {
+    int count;
+    vec3* out;
+    int max_x, max_y, ns, order;
+    const int* tiles;
+    camera** cam;
+    hittable** world;
+    light_bvh** lights;
+    cudaStream_t stream;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        render_tile_chunk<F, DEPTH> << <count, TILE_SIZE * TILE_SIZE, 0, stream >> > (out, max_x, max_y, ns, order, tiles, cam, world, lights, max_depth);
+    }
+};
+
+/**
+ * Renders an nx x ny image without a frame buffer: tiles are traced in
+ * chunks into TILED_BUFFERS rotating device buffers, copied to as many
+ * pinned host buffers, and written to a tiled TIFF at path while the next
+ * chunks trace. Memory is TILED_BUFFERS chunks of tiles, a chunk sized by
+ * the device's SM count, plus the file's tile offset table; nothing is
+ * allocated per pixel. tiles is the device copy of tile_order.
+ */
+bool render_tiled(const std::string& path, int nx, int ny, int ns, unsigned features, int max_depth, int order, const std::vector<int>& tile_order,
+    const int* tiles, camera** cam, hittable** world, light_bvh** lights) {
+    tiff_tile_writer file(path, nx, ny, TILE_SIZE);
+    if (!file.is_open()) {
+        std::cerr << "can't write " << path << "\n";
+        return false;
+    }
+    int device, sms;
+    checkCudaErrors(cudaGetDevice(&device));
+    checkCudaErrors(cudaDeviceGetAttribute(&sms, cudaDevAttrMultiProcessorCount, device));
+    int num_tiles = int(tile_order.size());
+    int chunk = std::min(sms * TILED_BLOCKS_PER_SM, num_tiles);
+    int num_chunks = (num_tiles + chunk - 1) / chunk;
+    size_t chunk_pixels = size_t(chunk) * TILE_SIZE * TILE_SIZE;
+
+    vec3* out[TILED_BUFFERS];
+    vec3* host_out[TILED_BUFFERS];
+    cudaEvent_t done[TILED_BUFFERS];
+    cudaStream_t stream;
+    for (int b = 0; b < TILED_BUFFERS; ++b) {
+        checkCudaErrors(tracked_malloc(MEM_FRAMEBUFFER, (void**)&out[b], chunk_pixels * sizeof(vec3)));
+        checkCudaErrors(cudaMallocHost((void**)&host_out[b], chunk_pixels * sizeof(vec3)));
+        checkCudaErrors(cudaEventCreate(&done[b]));
+    }
+    checkCudaErrors(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+    std::cerr << "streaming " << num_tiles << " tiles to " << path << " in chunks of " << chunk << ", "
+        << TILED_BUFFERS * chunk_pixels * sizeof(vec3) / 1048576.0 << " MB of tile buffers\n";
+
+    // Writes chunk c's tiles, once its copy to the host has finished.
+    bool ok = true;
+    auto write_chunk = [&](int c) {
+        TRACE_SCOPE("write tiles");
+        int b = c % TILED_BUFFERS;
+        checkCudaErrors(cudaEventSynchronize(done[b]));
+        int first = c * chunk;
+        int count = std::min(chunk, num_tiles - first);
+        for (int k = 0; k < count; ++k) {
+            int tile = tile_order[first + k];
+            ok = file.write_tile(tile & 0xffff, tile >> 16, host_out[b] + size_t(k) * TILE_SIZE * TILE_SIZE) && ok;
+        }
+    };
+
+    tile_chunk_launcher launcher = { 0, nullptr, nx, ny, ns, order, nullptr, cam, world, lights, stream };
+    for (int c = 0; c < num_chunks; ++c) {
+        int b = c % TILED_BUFFERS;
+        if (c >= TILED_BUFFERS) write_chunk(c - TILED_BUFFERS);
+        int first = c * chunk;
+        launcher.count = std::min(chunk, num_tiles - first);
+        launcher.out = out[b];
+        launcher.tiles = tiles + first;
+        dispatch_variant(features, max_depth, launcher);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaMemcpyAsync(host_out[b], out[b], size_t(launcher.count) * TILE_SIZE * TILE_SIZE * sizeof(vec3),
+            cudaMemcpyDeviceToHost, stream));
+        checkCudaErrors(cudaEventRecord(done[b], stream));
+    }
+    for (int c = std::max(0, num_chunks - TILED_BUFFERS); c < num_chunks; ++c) write_chunk(c);
+    ok = file.close() && ok;
+    if (!ok) std::cerr << "can't write " << path << "\n";
+
+    checkCudaErrors(cudaStreamDestroy(stream));
+    for (int b = 0; b < TILED_BUFFERS; ++b) {
+        checkCudaErrors(cudaEventDestroy(done[b]));
+        checkCudaErrors(tracked_free(out[b]));
+        checkCudaErrors(cudaFreeHost(host_out[b]));
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Timeline of where a run spends its time, written as Chrome trace-event
+ * JSON for chrome://tracing or ui.perfetto.dev. Host code marks a thread's
+ * consecutive phases with TRACE_PHASE, each lasting until the next, and
+ * nested work with TRACE_SCOPE; single thread device code (the scene
+ * builds) marks its steps with TRACE_DEVICE_SCOPE; the render kernel records
+ * each tile's start, end and SM, so every SM shows up as a track of tiles.
+ * Everything here is compiled in only when RT_TRACE is defined; otherwise
+ * the macros are empty and trace_write() does nothing.
+ */
+
+// Steps of the scene builds marked from device code.
+enum trace_device_mark {
+    TRACE_BVH_BUILD,
+    TRACE_LIGHT_BVH_BUILD,
+    TRACE_BVH_COLLAPSE,
+    TRACE_DEVICE_MARKS
+};
+
+#ifdef RT_TRACE
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <map>
+
+#include "helper_cuda.h"
+#include "tile_order.h"
+
+// Device events kept per collection; later ones are dropped.
+#define TRACE_DEVICE_EVENTS 64
+
+static const char* const trace_device_mark_names[TRACE_DEVICE_MARKS] = {
+    "bvh build",
+    "light bvh build",
+    "bvh collapse"
+};
+
+// Nanoseconds on a clock every SM shares.
+__host__ __device__ inline unsigned long long trace_clock() {
+#ifdef __CUDA_ARCH__
+    unsigned long long t;
+    asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(t));
+    return t;
+#else
+    return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+__device__ inline unsigned trace_sm() {
+#ifdef __CUDA_ARCH__
+    unsigned id;
+    asm volatile("mov.u32 %0, %%smid;" : "=r"(id));
+    return id;
+#else
+    return 0;
+#endif
+}
+
+struct device_trace_event {
+    int mark;
+    unsigned long long begin, end;
+};
+
+struct device_trace_log {
+    device_trace_event events[TRACE_DEVICE_EVENTS];
+    int count;
+};
+
+__device__ device_trace_log d_trace_log;
+
+struct device_trace_scope {
+    __device__ device_trace_scope(int m) : mark(m), begin(trace_clock()) {}
+    __device__ ~device_trace_scope() {
+        int k = d_trace_log.count;
+        if (k >= TRACE_DEVICE_EVENTS) return;
+        d_trace_log.events[k].mark = mark;
+        d_trace_log.events[k].begin = begin;
+        d_trace_log.events[k].end = trace_clock();
+        d_trace_log.count = k + 1;
+    }
+    int mark;
+    unsigned long long begin;
+};
+
+// One tile of the image as render() shaded it; begin is ~0 for tiles that
+// weren't rendered while recording.
+struct tile_trace_record {
+    unsigned long long begin, end;
+    unsigned sm;
+};
+
+// Indexed by the tile's row * tiles per row + column; null unless tiles are
+// being recorded.
+__device__ tile_trace_record* d_tile_trace;
+
+__device__ inline void trace_tile_begin(const int* tiles, int max_x) {
+    if (d_tile_trace == nullptr) return;
+    int tile = tiles[blockIdx.x];
+    tile_trace_record& t = d_tile_trace[(tile >> 16) * ((max_x + TILE_SIZE - 1) / TILE_SIZE) + (tile & 0xffff)];
+    atomicMin(&t.begin, trace_clock());
+    if (threadIdx.x == 0) t.sm = trace_sm();
+}
+
+__device__ inline void trace_tile_end(const int* tiles, int max_x) {
+    if (d_tile_trace == nullptr) return;
+    int tile = tiles[blockIdx.x];
+    atomicMax(&d_tile_trace[(tile >> 16) * ((max_x + TILE_SIZE - 1) / TILE_SIZE) + (tile & 0xffff)].end, trace_clock());
+}
+
+__global__ void trace_clock_sample(unsigned long long* t) {
+    *t = trace_clock();
+}
+
+struct trace_event {
+    std::string name;
+    const char* category;
+    int pid;
+    int tid;
+    double ts;
+    double dur;
+};
+
+/**
+ * Every event of the run, in microseconds since the recorder was created.
+ * Host threads get small track ids in order of their first event. Device
+ * timestamps are moved onto the host clock by an offset measured once per
+ * device, around a one thread launch, so they line up with the host phases
+ * to within a launch latency.
+ */
+class trace_recorder {
+public:
+    static trace_recorder& get() {
+        static trace_recorder recorder;
+        return recorder;
+    }
+
+    double now() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void add(const std::string& name, const char* category, double ts, double dur) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back({ name, category, 0, thread_track(), ts, dur });
+    }
+
+    // Ends the calling thread's open phase, if any, and opens name unless
+    // it is null.
+    void phase(const char* name) {
+        double t = now();
+        std::lock_guard<std::mutex> lock(mutex);
+        int track = thread_track();
+        std::map<int, std::pair<std::string, double>>::iterator open = open_phases.find(track);
+        if (open != open_phases.end()) {
+            events.push_back({ open->second.first, "phase", 0, track, open->second.second, t - open->second.second });
+            open_phases.erase(open);
+        }
+        if (name != nullptr) open_phases[track] = std::make_pair(std::string(name), t);
+    }
+
+    void name_thread(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        thread_names[thread_track()] = name;
+    }
+
+    // Device timestamp t on this recorder's clock, for the current device.
+    double device_time(unsigned long long t) {
+        int device;
+        checkCudaErrors(cudaGetDevice(&device));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!device_offsets.count(device)) {
+            unsigned long long* sample;
+            checkCudaErrors(cudaMallocManaged((void**)&sample, sizeof(unsigned long long)));
+            double before = now();
+            trace_clock_sample << <1, 1 >> > (sample);
+            checkCudaErrors(cudaGetLastError());
+            checkCudaErrors(cudaDeviceSynchronize());
+            double after = now();
+            device_offsets[device] = (before + after) / 2 - *sample * 1e-3;
+            checkCudaErrors(cudaFree(sample));
+        }
+        return t * 1e-3 + device_offsets[device];
+    }
+
+    // Moves the device marks recorded since the last call into the trace.
+    void collect_device_marks() {
+        device_trace_log log;
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaMemcpyFromSymbol(&log, d_trace_log, sizeof(log)));
+        int device;
+        checkCudaErrors(cudaGetDevice(&device));
+        for (int k = 0; k < log.count; ++k) {
+            double ts = device_time(log.events[k].begin);
+            std::lock_guard<std::mutex> lock(mutex);
+            events.push_back({ trace_device_mark_names[log.events[k].mark], "device", 1 + device, 0, ts,
+                (log.events[k].end - log.events[k].begin) * 1e-3 });
+        }
+        log.count = 0;
+        checkCudaErrors(cudaMemcpyToSymbol(d_trace_log, &log, sizeof(log)));
+    }
+
+    // Starts recording the tiles render() shades on the current device.
+    void begin_tiles(int nx, int ny) {
+        tiles_x = (nx + TILE_SIZE - 1) / TILE_SIZE;
+        int count = tiles_x * ((ny + TILE_SIZE - 1) / TILE_SIZE);
+        std::vector<tile_trace_record> empty(count, tile_trace_record{ ~0ull, 0ull, 0u });
+        checkCudaErrors(cudaMalloc((void**)&tile_records, count * sizeof(tile_trace_record)));
+        checkCudaErrors(cudaMemcpy(tile_records, empty.data(), count * sizeof(tile_trace_record), cudaMemcpyHostToDevice));
+        checkCudaErrors(cudaMemcpyToSymbol(d_tile_trace, &tile_records, sizeof(tile_records)));
+        num_tile_records = count;
+    }
+
+    // Adds the recorded tiles to the trace, one track per SM.
+    void end_tiles() {
+        if (tile_records == nullptr) return;
+        checkCudaErrors(cudaDeviceSynchronize());
+        std::vector<tile_trace_record> records(num_tile_records);
+        checkCudaErrors(cudaMemcpy(records.data(), tile_records, records.size() * sizeof(tile_trace_record), cudaMemcpyDeviceToHost));
+        tile_trace_record* none = nullptr;
+        checkCudaErrors(cudaMemcpyToSymbol(d_tile_trace, &none, sizeof(none)));
+        checkCudaErrors(cudaFree(tile_records));
+        tile_records = nullptr;
+        int device;
+        checkCudaErrors(cudaGetDevice(&device));
+        for (int k = 0; k < num_tile_records; ++k) {
+            const tile_trace_record& t = records[k];
+            if (t.begin == ~0ull) continue;
+            double ts = device_time(t.begin);
+            std::lock_guard<std::mutex> lock(mutex);
+            events.push_back({ "tile " + std::to_string(k % tiles_x) + "," + std::to_string(k / tiles_x), "tile",
+                1 + device, 1 + int(t.sm), ts, (t.end - t.begin) * 1e-3 });
+        }
+    }
+
+    bool write(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path);
+        out << "{\"traceEvents\":[\n";
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"host\"}}";
+        // Device tracks: 0 for the scene build, then one per SM.
+        std::map<std::pair<int, int>, bool> device_tracks;
+        for (const trace_event& e : events) {
+            if (e.pid == 0 || device_tracks[std::make_pair(e.pid, e.tid)]) continue;
+            if (!device_tracks[std::make_pair(e.pid, -1)]) {
+                device_tracks[std::make_pair(e.pid, -1)] = true;
+                out << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << e.pid
+                    << ",\"args\":{\"name\":\"device " << e.pid - 1 << "\"}}";
+            }
+            device_tracks[std::make_pair(e.pid, e.tid)] = true;
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << e.pid << ",\"tid\":" << e.tid
+                << ",\"args\":{\"name\":\"" << (e.tid == 0 ? std::string("scene build") : "SM " + std::to_string(e.tid - 1)) << "\"}}";
+        }
+        for (const std::pair<const int, std::string>& t : thread_names) {
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t.first
+                << ",\"args\":{\"name\":\"" << t.second << "\"}}";
+        }
+        for (const trace_event& e : events) {
+            out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":" << e.pid
+                << ",\"tid\":" << e.tid << ",\"ts\":" << std::fixed << e.ts
+                << ",\"dur\":" << e.dur << std::defaultfloat << "}";
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+
+private:
+    trace_recorder() : start(std::chrono::steady_clock::now()), tile_records(nullptr), num_tile_records(0), tiles_x(1) {}
+
+    // Caller holds mutex.
+    int thread_track() {
+        std::thread::id id = std::this_thread::get_id();
+        std::map<std::thread::id, int>::iterator found = threads.find(id);
+        if (found != threads.end()) return found->second;
+        int track = int(threads.size());
+        threads[id] = track;
+        return track;
+    }
+
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::vector<trace_event> events;
+    std::map<std::thread::id, int> threads;
+    std::map<int, std::string> thread_names;
+    std::map<int, std::pair<std::string, double>> open_phases;
+    std::map<int, double> device_offsets;
+    tile_trace_record* tile_records;
+    int num_tile_records;
+    int tiles_x;
+};
+
+class trace_scope {
+public:
+    trace_scope(const std::string& n, const char* c = "host") : name(n), category(c), begin(trace_recorder::get().now()) {}
+    ~trace_scope() {
+        trace_recorder& recorder = trace_recorder::get();
+        recorder.add(name, category, begin, recorder.now() - begin);
+    }
+
+private:
+    std::string name;
+    const char* category;
+    double begin;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_PHASE(name) trace_recorder::get().phase(name)
+#define TRACE_PHASE_END() trace_recorder::get().phase(nullptr)
+#define TRACE_THREAD_NAME(name) trace_recorder::get().name_thread(name)
+#define TRACE_DEVICE_SCOPE(mark) device_trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(mark)
+#define TRACE_COLLECT_DEVICE() trace_recorder::get().collect_device_marks()
+#define TRACE_TILES_BEGIN(nx, ny) trace_recorder::get().begin_tiles(nx, ny)
+#define TRACE_TILES_END() trace_recorder::get().end_tiles()
+#define TRACE_TILE_BEGIN(tiles, max_x) trace_tile_begin(tiles, max_x)
+#define TRACE_TILE_END(tiles, max_x) trace_tile_end(tiles, max_x)
+
+inline bool trace_write(const std::string& path) {
+    return trace_recorder::get().write(path);
+}
+
+#else
+
+#include <string>
+
+#define TRACE_SCOPE(name)
+#define TRACE_PHASE(name)
+#define TRACE_PHASE_END()
+#define TRACE_THREAD_NAME(name)
+#define TRACE_DEVICE_SCOPE(mark)
+#define TRACE_COLLECT_DEVICE()
+#define TRACE_TILES_BEGIN(nx, ny)
+#define TRACE_TILES_END()
+#define TRACE_TILE_BEGIN(tiles, max_x)
+#define TRACE_TILE_END(tiles, max_x)
+
+inline bool trace_write(const std::string& path) {
+    return false;
+}
+
+#endif
+
+#endif
@@ -5,12 +5,16 @@
 #include <cstdlib>
 #include <iostream>
 
+#include "simd.h"
+
 #define M_PI 3.14159265
 
-class vec3 {
+// 16-byte aligned so a vec3 is one SSE/NEON register on the host and one
+// 128-bit load on the device; e[3] is padding.
+class alignas(16) vec3 {
 public:
-	__host__ __device__ vec3() : e{0, 0, 0} {}
-	__host__ __device__ vec3(float e0, float e1, float e2): e{e0, e1, e2}{}
+	__host__ __device__ vec3() : e{0, 0, 0, 0} {}
+	__host__ __device__ vec3(float e0, float e1, float e2): e{e0, e1, e2, 0}{}
     __host__ __device__ inline float x() const { return e[0]; }
     __host__ __device__ inline float y() const { return e[1]; }
     __host__ __device__ inline float z() const { return e[2]; }
@@ -30,13 +34,23 @@ public:
     __host__ __device__ inline vec3& operator*=(const float t);
     __host__ __device__ inline vec3& operator/=(const float t);
 
-    __host__ __device__ inline float length() const { return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]); }
-    __host__ __device__ inline float squared_length() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    __host__ __device__ inline float length() const { return sqrt(squared_length()); }
+    __host__ __device__ inline float squared_length() const;
     __host__ __device__ inline void make_unit_vector();
 public:
-	float e[3];
+	float e[4];
 };
 
+#if VEC3_SIMD
+inline simd4 to_simd(const vec3& v) { return simd4_load(v.e); }
+
+inline vec3 from_simd(simd4 s) {
+    vec3 v;
+    simd4_store(v.e, s);
+    return v;
+}
+#endif
+
 inline std::istream& operator>>(std::istream& is, vec3& t) {
     is >> t.e[0] >> t.e[1] >> t.e[2];
     return is;
@@ -47,83 +61,151 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& t) {
     return os;
 }
 
+__host__ __device__ inline float vec3::squared_length() const {
+#if VEC3_SIMD
+    return simd4_dot3(to_simd(*this), to_simd(*this));
+#else
+    return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+#endif
+}
+
 __host__ __device__ inline void vec3::make_unit_vector() {
-    float k = 1.0f / sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-    e[0] *= k; e[1] *= k; e[2] *= k;
+    *this *= fast_rsqrt(squared_length());
 }
 
 __host__ __device__ inline vec3 operator+(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return from_simd(simd4_add(to_simd(v1), to_simd(v2)));
+#else
     return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator-(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return from_simd(simd4_sub(to_simd(v1), to_simd(v2)));
+#else
     return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator*(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return from_simd(simd4_mul(to_simd(v1), to_simd(v2)));
+#else
     return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator/(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return from_simd(simd4_div(to_simd(v1), to_simd(v2)));
+#else
     return vec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator*(float t, const vec3& v) {
+#if VEC3_SIMD
+    return from_simd(simd4_mul(simd4_splat(t), to_simd(v)));
+#else
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+#endif
 }
 
 __host__ __device__ inline vec3 operator/(vec3 v, float t) {
+#if VEC3_SIMD
+    return from_simd(simd4_mul(to_simd(v), simd4_splat(1.0f / t)));
+#else
     return vec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
+#endif
 }
 
 __host__ __device__ inline vec3 operator*(const vec3& v, float t) {
+#if VEC3_SIMD
+    return from_simd(simd4_mul(to_simd(v), simd4_splat(t)));
+#else
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+#endif
 }
 
 __host__ __device__ inline float dot(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return simd4_dot3(to_simd(v1), to_simd(v2));
+#else
     return v1.e[0] * v2.e[0] + v1.e[1] * v2.e[1] + v1.e[2] * v2.e[2];
+#endif
 }
 
 __host__ __device__ inline vec3 cross(const vec3& v1, const vec3& v2) {
+#if VEC3_SIMD
+    return from_simd(simd4_cross3(to_simd(v1), to_simd(v2)));
+#else
     return vec3((v1.e[1] * v2.e[2] - v1.e[2] * v2.e[1]),
         (-(v1.e[0] * v2.e[2] - v1.e[2] * v2.e[0])),
         (v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]));
+#endif
 }
 
 
 __host__ __device__ inline vec3& vec3::operator+=(const vec3& v) {
+#if VEC3_SIMD
+    *this = *this + v;
+    return *this;
+#else
     e[0] += v.e[0];
     e[1] += v.e[1];
     e[2] += v.e[2];
     return *this;
+#endif
 }
 
 __host__ __device__ inline vec3& vec3::operator*=(const vec3& v) {
+#if VEC3_SIMD
+    *this = *this * v;
+    return *this;
+#else
     e[0] *= v.e[0];
     e[1] *= v.e[1];
     e[2] *= v.e[2];
     return *this;
+#endif
 }
 
 __host__ __device__ inline vec3& vec3::operator/=(const vec3& v) {
+#if VEC3_SIMD
+    *this = *this / v;
+    return *this;
+#else
     e[0] /= v.e[0];
     e[1] /= v.e[1];
     e[2] /= v.e[2];
     return *this;
+#endif
 }
 
 __host__ __device__ inline vec3& vec3::operator-=(const vec3& v) {
+#if VEC3_SIMD
+    *this = *this - v;
+    return *this;
+#else
     e[0] -= v.e[0];
     e[1] -= v.e[1];
     e[2] -= v.e[2];
     return *this;
+#endif
 }
 
 __host__ __device__ inline vec3& vec3::operator*=(const float t) {
+#if VEC3_SIMD
+    *this = *this * t;
+    return *this;
+#else
     e[0] *= t;
     e[1] *= t;
     e[2] *= t;
     return *this;
+#endif
 }
 
 __host__ __device__ inline vec3& vec3::operator/=(const float t) {
@@ -136,7 +218,54 @@ __host__ __device__ inline vec3& vec3::operator/=(const float t) {
 }
 
 __host__ __device__ inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
+    return v * fast_rsqrt(dot(v, v));
+}
+
+__host__ __device__ inline float luminance(const vec3& c) {
+    return 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+}
+
+/**
+ * Homogeneous 4-vector sharing vec3's alignment and backend.
+ */
+class alignas(16) vec4 {
+public:
+    __host__ __device__ vec4() : e{0, 0, 0, 0} {}
+    __host__ __device__ vec4(float e0, float e1, float e2, float e3) : e{e0, e1, e2, e3} {}
+    __host__ __device__ vec4(const vec3& v, float w) : e{v.e[0], v.e[1], v.e[2], w} {}
+    __host__ __device__ inline float x() const { return e[0]; }
+    __host__ __device__ inline float y() const { return e[1]; }
+    __host__ __device__ inline float z() const { return e[2]; }
+    __host__ __device__ inline float w() const { return e[3]; }
+    __host__ __device__ inline vec3 xyz() const { return vec3(e[0], e[1], e[2]); }
+    __host__ __device__ inline float operator[](int i) const { return e[i]; }
+    __host__ __device__ inline float& operator[](int i) { return e[i]; }
+
+    float e[4];
+};
+
+#if VEC3_SIMD
+inline simd4 to_simd(const vec4& v) { return simd4_load(v.e); }
+#endif
+
+__host__ __device__ inline vec4 operator+(const vec4& a, const vec4& b) {
+    return vec4(a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2], a.e[3] + b.e[3]);
+}
+
+__host__ __device__ inline vec4 operator-(const vec4& a, const vec4& b) {
+    return vec4(a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2], a.e[3] - b.e[3]);
+}
+
+__host__ __device__ inline vec4 operator*(float t, const vec4& v) {
+    return vec4(t * v.e[0], t * v.e[1], t * v.e[2], t * v.e[3]);
+}
+
+__host__ __device__ inline float dot(const vec4& a, const vec4& b) {
+#if VEC3_SIMD
+    return simd4_dot4(to_simd(a), to_simd(b));
+#else
+    return a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2] + a.e[3] * b.e[3];
+#endif
 }
 
 #endif
\ No newline at end of file
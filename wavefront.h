@@ -0,0 +1,178 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <thrust/sort.h>
+#include <thrust/execution_policy.h>
+#include <curand_kernel.h>
+
+#include "helper_cuda.h"
+#include "render.h"
+
+/**
+ * Wavefront variant of render(): every pixel's path advances one bounce per
+ * launch, and before each bounce the live rays can be sorted by origin cell
+ * and direction octant so neighbouring threads walk the same BVH nodes.
+ * The kernels are specialised on the scene's features and path depth as
+ * render() is, through the same dispatch_variant().
+ */
+
+// 24-bit Morton code of the origin on a 256^3 grid over the scene bounds,
+// followed by the 3-bit direction octant. Dead paths sort last.
+__device__ unsigned ray_sort_key(const path_state& ps, const aabb& bounds) {
+    if (!ps.alive) return 0xffffffffu;
+    vec3 extent = bounds.max() - bounds.min();
+    vec3 o = ps.r.origin() - bounds.min();
+    unsigned cell[3];
+    for (int a = 0; a < 3; ++a) {
+        float t = o[a] / fmaxf(extent[a], 1e-6f);
+        cell[a] = unsigned(fminf(fmaxf(t, 0.f), 1.f) * 255.f);
+    }
+    vec3 d = ps.r.direction();
+    unsigned octant = (d.x() < 0.f ? 1u : 0u) | (d.y() < 0.f ? 2u : 0u) | (d.z() < 0.f ? 4u : 0u);
+    return (morton_encode3(cell[0], cell[1], cell[2]) << 3) | octant;
+}
+
+// Starts sample s of every pixel, its random state seeded as render() seeds
+// it, so the sorted and unsorted paths draw the numbers render<F, DEPTH>()
+// draws.
+template <unsigned F>
+__global__ void wavefront_generate(path_state* paths, int* indices, int max_x, int max_y, int order, const int* tiles, camera** cam, curandState* rand_state,
+    int s, int max_depth) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    indices[k] = k;
+    int i, j;
+    if (!tile_pixel_index(order, tiles, max_x, max_y, i, j)) {
+        paths[k].alive = false;
+        paths[k].pixel = -1;
+        return;
+    }
+    int pixel_index = j * max_x + i;
+    curandState local_rand_state;
+    sample_state(pixel_index, s, &local_rand_state);
+    float u = float(i + curand_uniform(&local_rand_state)) / float(max_x);
+    float v = float(j + curand_uniform(&local_rand_state)) / float(max_y);
+    path_begin(paths[k], (*cam)->get_ray<F>(u, v, &local_rand_state), pixel_index, max_depth);
+    rand_state[pixel_index] = local_rand_state;
+}
+
+__global__ void wavefront_keys(const path_state* paths, unsigned* keys, int* indices, int n, const aabb* bounds) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= n) return;
+    keys[k] = ray_sort_key(paths[k], *bounds);
+    indices[k] = k;
+}
+
+template <unsigned F, int DEPTH>
+__global__ void wavefront_bounce(path_state* paths, const int* indices, int n, hittable** world, light_bvh** lights, curandState* rand_state, int* alive) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= n) return;
+    path_state& ps = paths[indices[k]];
+    if (!ps.alive) return;
+    curandState local_rand_state = rand_state[ps.pixel];
+    if (path_bounce<F, DEPTH>(ps, world, lights, &local_rand_state)) {
+        atomicAdd(alive, 1);
+    }
+    rand_state[ps.pixel] = local_rand_state;
+}
+
+__global__ void wavefront_accumulate(const path_state* paths, vec3* fb, int n) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= n || paths[k].pixel < 0) return;
+    fb[paths[k].pixel] += paths[k].radiance;
+}
+
+__global__ void wavefront_finish(vec3* fb, int num_pixels, int ns) {
+    int k = threadIdx.x + blockIdx.x * blockDim.x;
+    if (k >= num_pixels) return;
+    vec3 col = fb[k] / float(ns);
+    col[0] = sqrt(col[0]);
+    col[1] = sqrt(col[1]);
+    col[2] = sqrt(col[2]);
+    fb[k] = col;
+}
+
+struct wavefront_generate_launcher {
+    int num_tiles;
+    path_state* paths;
+    int* indices;
+    int max_x, max_y, order;
+    const int* tiles;
+    camera** cam;
+    curandState* rand_state;
+    int s;
+
+    template <unsigned F, int DEPTH>
+    void launch(int max_depth) {
+        wavefront_generate<F> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (paths, indices, max_x, max_y, order, tiles, cam, rand_state, s, max_depth);
+    }
+};
+
+struct wavefront_bounce_launcher {
+    int num_tiles;
+    path_state* paths;
+    const int* indices;
+    int n;
+    hittable** world;
+    light_bvh** lights;
+    curandState* rand_state;
+    int* alive;
+
+    template <unsigned F, int DEPTH>
+    void launch(int) {
+        wavefront_bounce<F, DEPTH> << <num_tiles, TILE_SIZE * TILE_SIZE >> > (paths, indices, n, world, lights, rand_state, alive);
+    }
+};
+
+void render_wavefront(vec3* fb, int nx, int ny, int ns, unsigned features, int max_depth, int order, const int* tiles, int num_tiles,
+    bool sort_rays, camera** cam, hittable** world, light_bvh** lights, curandState* rand_state) {
+    int threads = TILE_SIZE * TILE_SIZE;
+    int n = num_tiles * threads;
+
+    path_state* paths;
+    unsigned* keys;
+    int* indices;
+    aabb* bounds;
+    int* alive;
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&paths, n * sizeof(path_state)));
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&keys, n * sizeof(unsigned)));
+    checkCudaErrors(tracked_malloc(MEM_OTHER, (void**)&indices, n * sizeof(int)));
+    checkCudaErrors(cudaMallocManaged((void**)&bounds, sizeof(aabb)));
+    checkCudaErrors(cudaMallocManaged((void**)&alive, sizeof(int)));
+    checkCudaErrors(cudaMemset(fb, 0, nx * ny * sizeof(vec3)));
+
+    world_bounds << <1, 1 >> > (world, bounds);
+    checkCudaErrors(cudaGetLastError());
+
+    wavefront_generate_launcher generate = { num_tiles, paths, indices, nx, ny, order, tiles, cam, rand_state, 0 };
+    wavefront_bounce_launcher bounce = { num_tiles, paths, indices, n, world, lights, rand_state, alive };
+    for (int s = 0; s < ns; s++) {
+        generate.s = s;
+        dispatch_variant(features, max_depth, generate);
+        checkCudaErrors(cudaGetLastError());
+        for (int depth = 0; depth < std::min(max_depth, depth_bucket(max_depth)); depth++) {
+            if (sort_rays) {
+                wavefront_keys << <num_tiles, threads >> > (paths, keys, indices, n, bounds);
+                checkCudaErrors(cudaGetLastError());
+                thrust::sort_by_key(thrust::device, keys, keys + n, indices);
+            }
+            checkCudaErrors(cudaMemset(alive, 0, sizeof(int)));
+            dispatch_variant(features, max_depth, bounce);
+            checkCudaErrors(cudaGetLastError());
+            checkCudaErrors(cudaDeviceSynchronize());
+            if (*alive == 0) break;
+        }
+        wavefront_accumulate << <num_tiles, threads >> > (paths, fb, n);
+        checkCudaErrors(cudaGetLastError());
+    }
+    wavefront_finish << <(nx * ny + threads - 1) / threads, threads >> > (fb, nx * ny, ns);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaDeviceSynchronize());
+
+    checkCudaErrors(tracked_free(paths));
+    checkCudaErrors(tracked_free(keys));
+    checkCudaErrors(tracked_free(indices));
+    checkCudaErrors(cudaFree(bounds));
+    checkCudaErrors(cudaFree(alive));
+}
+
+#endif
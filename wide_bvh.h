@@ -0,0 +1,304 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <float.h>
+
+#include "hittable.h"
+#include "bvh.h"
+#include "stats.h"
+#include "trace.h"
+
+// Traversal stack entries; a W-wide node pushes at most W - 1 of its
+// children, so this covers trees far deeper than the scenes build.
+#define WIDE_BVH_STACK 128
+
+/**
+ * A node of a W-wide BVH. Child boxes are 8 bit offsets from origin, the
+ * minimum of the node's own box, in steps of a power of two per axis, and
+ * are rounded outwards so they always contain the child. qlo and qhi hold
+ * one axis of every child in a row, so a traversal step reads each axis of
+ * all W children with one W byte load. A child is an inner node when
+ * child >= 0 and primitive ~child of the tree otherwise.
+ */
+template <int W>
+struct wide_node {
+    float origin[3];
+    signed char exponent[3];
+    unsigned char count;
+    unsigned char qlo[3][W];
+    unsigned char qhi[3][W];
+    int child[W];
+};
+
+__device__ inline float box_area(const aabb& b) {
+    vec3 d = b.max() - b.min();
+    return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+}
+
+/**
+ * W-wide BVH collapsed from a binary bvhNode tree: each wide node takes the
+ * binary node's two children and keeps opening whichever inner child has
+ * the largest surface area until it holds W children or only primitives.
+ * A step then tests every child's quantized slabs together in one unrolled
+ * loop, with no dependency between children, pushes the inner children it
+ * hits farthest first and intersects the primitives in place.
+ */
+template <int W>
+class wide_bvh : public hittable {
+public:
+    DEVICE_MEMORY_CATEGORY(MEM_BVH)
+
+    __device__ wide_bvh(const bvhNode* root);
+    __device__ virtual ~wide_bvh() {
+        device_delete_array(MEM_BVH, nodes, num_nodes);
+        device_delete_array(MEM_BVH, prims, num_prims);
+    }
+
+    __device__ virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+    __device__ virtual bool bounding_box(float t0, float t1, aabb& b) const override {
+        b = box;
+        return true;
+    }
+    __device__ virtual unsigned features() const override {
+        return feature_mask;
+    }
+
+    wide_node<W>* nodes;
+    int num_nodes;
+    hittable** prims;
+    int num_prims;
+    aabb box;
+    unsigned feature_mask;
+
+private:
+    __device__ void quantize(wide_node<W>& node, const aabb* boxes, int count) const;
+};
+
+template <int W>
+__device__ wide_bvh<W>::wide_bvh(const bvhNode* root) : box(root->box), feature_mask(root->features()) {
+    // Bounds for the arrays: no more wide nodes than binary inner nodes,
+    // no more primitives than binary leaf slots.
+    int inner = 0;
+    const bvhNode* pending[WIDE_BVH_STACK];
+    int top = 0;
+    pending[top++] = root;
+    while (top > 0) {
+        const bvhNode* b = pending[--top];
+        inner++;
+        if (b->owns_children) {
+            pending[top++] = b->left->as_bvh_node();
+            pending[top++] = b->right->as_bvh_node();
+        }
+    }
+    wide_node<W>* built = device_new_array<wide_node<W>>(MEM_BVH, inner);
+    hittable** leaves = device_new_array<hittable*>(MEM_BVH, 2 * inner);
+    nodes = nullptr;
+    prims = nullptr;
+    num_nodes = 0;
+    num_prims = 0;
+    if (built == nullptr || leaves == nullptr) {
+        // Out of device heap; collapse_bvh() keeps the binary BVH.
+        device_delete_array(MEM_BVH, built, inner);
+        device_delete_array(MEM_BVH, leaves, 2 * inner);
+        return;
+    }
+    num_nodes = 1;
+
+    const bvhNode* source[WIDE_BVH_STACK];
+    int target[WIDE_BVH_STACK];
+    top = 0;
+    source[top] = root;
+    target[top++] = 0;
+    while (top > 0) {
+        --top;
+        const bvhNode* b = source[top];
+        wide_node<W>& node = built[target[top]];
+
+        // Open inner children, largest first, until the node is full.
+        const hittable* item[W];
+        bool is_inner[W];
+        int n = 0;
+        item[n] = b->left;
+        is_inner[n++] = b->owns_children;
+        if (b->right != b->left) {
+            item[n] = b->right;
+            is_inner[n++] = b->owns_children;
+        }
+        while (n < W) {
+            int open = -1;
+            float largest = -1.f;
+            for (int c = 0; c < n; ++c) {
+                if (!is_inner[c]) continue;
+                float area = box_area(item[c]->as_bvh_node()->box);
+                if (area > largest) {
+                    largest = area;
+                    open = c;
+                }
+            }
+            if (open < 0) break;
+            const bvhNode* opened = item[open]->as_bvh_node();
+            item[open] = opened->left;
+            is_inner[open] = opened->owns_children;
+            if (opened->right != opened->left) {
+                item[n] = opened->right;
+                is_inner[n++] = opened->owns_children;
+            }
+        }
+
+        aabb boxes[W];
+        for (int c = 0; c < n; ++c) {
+            item[c]->bounding_box(0.f, 1.f, boxes[c]);
+            if (is_inner[c]) {
+                source[top] = item[c]->as_bvh_node();
+                target[top++] = num_nodes;
+                node.child[c] = num_nodes++;
+            }
+            else {
+                leaves[num_prims] = const_cast<hittable*>(item[c]);
+                node.child[c] = ~num_prims++;
+            }
+        }
+        quantize(node, boxes, n);
+    }
+
+    nodes = device_new_array<wide_node<W>>(MEM_BVH, num_nodes);
+    prims = device_new_array<hittable*>(MEM_BVH, num_prims);
+    if (nodes == nullptr || prims == nullptr) {
+        // Out of device heap; collapse_bvh() keeps the binary BVH.
+        device_delete_array(MEM_BVH, nodes, num_nodes);
+        device_delete_array(MEM_BVH, prims, num_prims);
+        nodes = nullptr;
+        prims = nullptr;
+        num_nodes = 0;
+        num_prims = 0;
+    }
+    for (int k = 0; k < num_nodes; ++k) nodes[k] = built[k];
+    for (int k = 0; k < num_prims; ++k) prims[k] = leaves[k];
+    device_delete_array(MEM_BVH, built, inner);
+    device_delete_array(MEM_BVH, leaves, 2 * inner);
+}
+
+// Fills in the node's origin, steps and the outward rounded child offsets.
+template <int W>
+__device__ void wide_bvh<W>::quantize(wide_node<W>& node, const aabb* boxes, int count) const {
+    node.count = (unsigned char)count;
+    for (int a = 0; a < 3; ++a) {
+        float lo = boxes[0].min()[a], hi = boxes[0].max()[a];
+        for (int c = 1; c < count; ++c) {
+            lo = fminf(lo, boxes[c].min()[a]);
+            hi = fmaxf(hi, boxes[c].max()[a]);
+        }
+        float extent = hi - lo;
+        int e = extent > 0.f ? int(ceilf(log2f(extent / 255.f))) : -100;
+        e = max(-127, min(127, e));
+        while (e < 127 && 255.f * ldexpf(1.f, e) < extent) e++;
+        float step = ldexpf(1.f, e);
+        node.origin[a] = lo;
+        node.exponent[a] = (signed char)e;
+        for (int c = 0; c < W; ++c) {
+            if (c >= count) {
+                node.qlo[a][c] = 255;
+                node.qhi[a][c] = 0;
+                continue;
+            }
+            int qlo = max(0, min(255, int(floorf((boxes[c].min()[a] - lo) / step))));
+            int qhi = max(0, min(255, int(ceilf((boxes[c].max()[a] - lo) / step))));
+            while (qlo > 0 && lo + qlo * step > boxes[c].min()[a]) qlo--;
+            while (qhi < 255 && lo + qhi * step < boxes[c].max()[a]) qhi++;
+            node.qlo[a][c] = (unsigned char)qlo;
+            node.qhi[a][c] = (unsigned char)qhi;
+        }
+    }
+}
+
+template <int W>
+__device__ bool wide_bvh<W>::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    vec3 o = r.origin();
+    // Finite for axis-parallel rays too, so a zero offset below never
+    // multiplies an infinity.
+    vec3 inv_d;
+    for (int a = 0; a < 3; ++a) {
+        float d = r.direction()[a];
+        inv_d[a] = fabsf(d) > 1e-20f ? 1.f / d : copysignf(1e20f, d);
+    }
+    int stack[WIDE_BVH_STACK];
+    float stack_t[WIDE_BVH_STACK];
+    int top = 0;
+    stack[top] = 0;
+    stack_t[top++] = t_min;
+    bool hit_anything = false;
+
+    while (top > 0) {
+        --top;
+        if (stack_t[top] > t_max) continue;
+        const wide_node<W>& node = nodes[stack[top]];
+        STATS_ADD(node_visits, 1);
+
+        // The slab distances are linear in the 8 bit offsets, so each child
+        // costs one multiply-add per plane.
+        float scale[3], offset[3];
+        for (int a = 0; a < 3; ++a) {
+            scale[a] = ldexpf(inv_d[a], node.exponent[a]);
+            offset[a] = (node.origin[a] - o[a]) * inv_d[a];
+        }
+        float near[W];
+#pragma unroll
+        for (int c = 0; c < W; ++c) {
+            float t0 = t_min, t1 = t_max;
+            for (int a = 0; a < 3; ++a) {
+                float ta = offset[a] + node.qlo[a][c] * scale[a];
+                float tb = offset[a] + node.qhi[a][c] * scale[a];
+                t0 = fmaxf(t0, fminf(ta, tb));
+                // Widened by a few ulps of its size, and a little more near
+                // zero, so rounding never loses a grazing hit; scaling alone
+                // would pull a negative far plane in.
+                float far = fmaxf(ta, tb);
+                t1 = fminf(t1, far + fabsf(far) * 4.8e-7f + 1e-6f);
+            }
+            near[c] = t0 <= t1 ? t0 : FLT_MAX;
+        }
+
+        for (int c = 0; c < node.count; ++c) {
+            if (near[c] == FLT_MAX || node.child[c] >= 0) continue;
+            hit_record prim_rec;
+            if (prims[~node.child[c]]->hit(r, t_min, t_max, prim_rec)) {
+                hit_anything = true;
+                t_max = prim_rec.t;
+                rec = prim_rec;
+            }
+        }
+        // Inner children farthest first, so the nearest is popped next.
+        for (;;) {
+            int farthest = -1;
+            for (int c = 0; c < node.count; ++c) {
+                if (near[c] != FLT_MAX && near[c] <= t_max && node.child[c] >= 0 && (farthest < 0 || near[c] > near[farthest])) farthest = c;
+            }
+            if (farthest < 0 || top == WIDE_BVH_STACK) break;
+            stack[top] = node.child[farthest];
+            stack_t[top++] = near[farthest];
+            near[farthest] = FLT_MAX;
+        }
+    }
+    return hit_anything;
+}
+
+// Replaces the scene's world by a width-wide collapse of it, if it is a
+// binary BVH; width is 4 or 8. Out of device heap, the binary BVH stays and
+// create_scene() reports the failure.
+__global__ void collapse_bvh(hittable** world, int width) {
+    const bvhNode* binary = (*world)->as_bvh_node();
+    if (binary == nullptr) return;
+    TRACE_DEVICE_SCOPE(TRACE_BVH_COLLAPSE);
+    unsigned long long failed = device_alloc_failures();
+    hittable* wide;
+    if (width == 8) wide = new wide_bvh<8>(binary);
+    else wide = new wide_bvh<4>(binary);
+    if (device_alloc_failures() != failed) {
+        delete wide;
+        return;
+    }
+    delete *world;
+    *world = wide;
+}
+
+#endif